@@ -434,6 +434,80 @@ calIcalComponent.prototype = {
     }
 };
 
+/**
+ * Removes the events and tasks of comp that cannot occur in the range, with
+ * the rules of calICSService::ParseICSInRange in the libical backend. ical.js
+ * has no way to parse selectively, so this is done after parsing.
+ */
+function removeItemsOutOfRange(comp, rangeStart, rangeEnd) {
+    const kMaxUtcOffset = 14 * 3600;
+    let rangeStartSecs = rangeStart ? rangeStart.nativeTime / 1000000 : -Infinity;
+    let rangeEndSecs = rangeEnd ? rangeEnd.nativeTime / 1000000 : Infinity;
+
+    let floating = false;
+    let wallClock = function(prop) {
+        let time = prop && prop.getFirstValue();
+        if (!time || !(time instanceof ICAL.Time)) {
+            return null;
+        }
+        if (time.zone != ICAL.Timezone.utcTimezone) {
+            floating = true;
+        }
+        return Date.UTC(time.year, time.month - 1, time.day,
+                        time.hour, time.minute, time.second) / 1000;
+    };
+
+    let canSkip = function(item) {
+        floating = false;
+        if (item.hasProperty("rrule") || item.hasProperty("rdate") ||
+            item.hasProperty("recurrence-id")) {
+            return false;
+        }
+        // Tasks which aren't done yet are still of interest however old
+        // they are.
+        if (item.name == "vtodo" && !item.hasProperty("completed") &&
+            item.getFirstPropertyValue("status") != "COMPLETED" &&
+            item.getFirstPropertyValue("percent-complete") != 100) {
+            return false;
+        }
+        let startProp = item.getFirstProperty("dtstart");
+        let start = wallClock(startProp);
+        let end = wallClock(item.getFirstProperty("dtend"));
+        let due = wallClock(item.getFirstProperty("due"));
+        let duration = item.getFirstPropertyValue("duration");
+        if (start === null) {
+            if (due === null) {
+                return false;
+            }
+            start = end = due;
+        } else if (end === null) {
+            if (due !== null) {
+                end = due;
+            } else if (duration) {
+                end = start + duration.toSeconds();
+            } else if (startProp.getFirstValue().isDate) {
+                end = start + 86400;
+            } else {
+                end = start;
+            }
+        }
+        if (end < start) {
+            return false;
+        }
+        if (floating) {
+            start -= kMaxUtcOffset;
+            end += kMaxUtcOffset;
+        }
+        return end < rangeStartSecs || start >= rangeEndSecs;
+    };
+
+    for (let item of comp.getAllSubcomponents().slice()) {
+        if ((item.name == "vevent" || item.name == "vtodo") && canSkip(item)) {
+            comp.removeSubcomponent(item);
+        }
+    }
+}
+
 function calICSService() {
     this.wrappedJSObject = this;
 }
@@ -449,7 +523,13 @@ calICSService.prototype = {
         return new calIcalComponent(new ICAL.Component(comp));
     },
 
-    parseICSAsync: function(serialized, tzProvider, listener) {
+    parseICSInRange: function(serialized, tzProvider, rangeStart, rangeEnd) {
+        let comp = new ICAL.Component(ICAL.parse(serialized));
+        removeItemsOutOfRange(comp, rangeStart, rangeEnd);
+        return new calIcalComponent(comp);
+    },
+
+    parseICSAsync: function(serialized, tzProvider, listener, rangeStart, rangeEnd) {
         // There are way too many error checking messages here, but I had so
         // much pain with this method that I don't want it to break again.
         try {
@@ -459,7 +539,11 @@ calICSService.prototype = {
                 let icalComp = null;
                 try {
                     rc = event.data.rc;
-                    icalComp = new calIcalComponent(new ICAL.Component(event.data.data));
+                    let comp = new ICAL.Component(event.data.data);
+                    if (rangeStart || rangeEnd) {
+                        removeItemsOutOfRange(comp, rangeStart, rangeEnd);
+                    }
+                    icalComp = new calIcalComponent(comp);
                     if (!Components.isSuccessCode(rc)) {
                         cal.ERROR("[calICSService] Error in parser worker: " + data);
                     }
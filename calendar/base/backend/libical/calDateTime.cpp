@@ -7,6 +7,7 @@
 
 #include "nsServiceManagerUtils.h"
 #include "nsIClassInfoImpl.h"
+#include "nsTArray.h"
 
 #include "calIErrors.h"
 #include "calDuration.h"
@@ -39,6 +40,50 @@ calDateTime::calDateTime(icaltimetype const* atimeptr, calITimezone *tz)
     FromIcalTime(atimeptr, tz);
 }
 
+calDateTime::calDateTime(icaltimetype const* atimeptr, calITimezone *tz,
+                         PRTime nativeTime)
+    : mImmutable(false)
+{
+    FromIcalTime(atimeptr, tz, &nativeTime);
+}
+
+void
+calDateTime::FromIcalTimes(icaltimetype const* icalts, uint32_t count,
+                           calITimezone * tz, calIDateTime ** results)
+{
+    // Convert the times to UTC all at once, so libical only has to look up
+    // the timezone once instead of for every time.
+    AutoTArray<icaltimetype, 32> utcTimes;
+    AutoTArray<bool, 32> isNull;
+    utcTimes.AppendElements(icalts, count);
+    for (uint32_t i = 0; i < count; ++i) {
+        NormalizeIcalTime(&utcTimes[i]);
+        utcTimes[i].is_date = 0;
+        isNull.AppendElement(icaltime_is_null_time(utcTimes[i]) != 0);
+    }
+
+    icaltimezone * const utc = icaltimezone_get_utc_timezone();
+    for (uint32_t start = 0; start < count;) {
+        icaltimezone const* zone = utcTimes[start].zone;
+        uint32_t end = start + 1;
+        while (end < count && utcTimes[end].zone == zone) {
+            ++end;
+        }
+        // Floating times are not moved, just represented as UTC.
+        if (zone) {
+            icaltimezone_convert_times(&utcTimes[start], end - start,
+                                       const_cast<icaltimezone *>(zone), utc);
+        }
+        start = end;
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+        PRTime nativeTime = isNull[i] ?
+            0 : IcaltimeToPRTime(&utcTimes[i], nullptr);
+        NS_ADDREF(results[i] = new calDateTime(&icalts[i], tz, nativeTime));
+    }
+}
+
 NS_IMETHODIMP
 calDateTime::GetIsMutable(bool *aResult)
 {
@@ -442,22 +487,31 @@ calDateTime::ToIcalTime(struct icaltimetype * icalt)
 //     }
 }
 
-void calDateTime::FromIcalTime(icaltimetype const* icalt, calITimezone * tz)
+// Clears the time of dates and normalizes valid times. Returns whether the
+// time was valid.
+bool calDateTime::NormalizeIcalTime(icaltimetype * icalt)
 {
-    icaltimetype t = *icalt;
-    mIsValid = (icaltime_is_null_time(t) ||
-                icaltime_is_valid_time(t) ? true : false);
+    bool isValid = (icaltime_is_null_time(*icalt) ||
+                    icaltime_is_valid_time(*icalt) ? true : false);
 
-    mIsDate = t.is_date ? true : false;
-    if (mIsDate) {
-        t.hour = 0;
-        t.minute = 0;
-        t.second = 0;
+    if (icalt->is_date) {
+        icalt->hour = 0;
+        icalt->minute = 0;
+        icalt->second = 0;
     }
 
-    if (mIsValid) {
-        t = icaltime_normalize(t);
+    if (isValid) {
+        *icalt = icaltime_normalize(*icalt);
     }
+    return isValid;
+}
+
+void calDateTime::FromIcalTime(icaltimetype const* icalt, calITimezone * tz,
+                               PRTime const* nativeTime)
+{
+    icaltimetype t = *icalt;
+    mIsValid = NormalizeIcalTime(&t);
+    mIsDate = t.is_date ? true : false;
 
     mYear = static_cast<int16_t>(t.year);
     mMonth = static_cast<int16_t>(t.month - 1);
@@ -497,8 +551,12 @@ void calDateTime::FromIcalTime(icaltimetype const* icalt, calITimezone * tz)
 
     // mNativeTime: not moving the existing date to UTC,
     // but merely representing it a UTC-based way.
-    t.is_date = 0;
-    mNativeTime = IcaltimeToPRTime(&t, icaltimezone_get_utc_timezone());
+    if (nativeTime) {
+        mNativeTime = *nativeTime;
+    } else {
+        t.is_date = 0;
+        mNativeTime = IcaltimeToPRTime(&t, icaltimezone_get_utc_timezone());
+    }
 }
 
 PRTime calDateTime::IcaltimeToPRTime(icaltimetype const* icalt, icaltimezone const* tz)
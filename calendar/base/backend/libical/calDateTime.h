@@ -18,6 +18,11 @@ public:
     calDateTime();
     calDateTime(icaltimetype const* icalt, calITimezone * tz);
 
+    // Creates calDateTime objects for aCount times in the same timezone,
+    // converting them to native time together.
+    static void FromIcalTimes(icaltimetype const* icalts, uint32_t count,
+                              calITimezone * tz, calIDateTime ** results);
+
     NS_DECL_ISUPPORTS
     NS_DECL_CALIDATETIME
     NS_DECL_CALIDATETIMELIBICAL
@@ -41,9 +46,14 @@ protected:
     nsCOMPtr<calITimezone> mTimezone;
 
     void Normalize();
-    void FromIcalTime(icaltimetype const* icalt, calITimezone *tz);
+    calDateTime(icaltimetype const* icalt, calITimezone * tz,
+                PRTime nativeTime);
+
+    void FromIcalTime(icaltimetype const* icalt, calITimezone *tz,
+                      PRTime const* nativeTime = nullptr);
     void ensureTimezone();
 
+    static bool NormalizeIcalTime(icaltimetype * icalt);
     static PRTime IcaltimeToPRTime(icaltimetype const* icalt, icaltimezone const* tz);
     static void PRTimeToIcaltime(PRTime time, bool isdate,
                                  icaltimezone const* tz, icaltimetype *icalt);
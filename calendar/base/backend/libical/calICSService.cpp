@@ -10,6 +10,7 @@
 #include "calDuration.h"
 #include "calIErrors.h"
 #include "calUtils.h"
+#include "prtime.h"
 
 extern "C" {
 #include "ical.h"
@@ -1274,10 +1275,318 @@ calICSService::ParseICS(const nsACString& serialized,
     return NS_OK;
 }
 
+// Wall clock times in a timezone can be up to this many seconds away from
+// the same wall clock time in UTC.
+static const int64_t kMaxUtcOffset = 14 * 3600;
+
+// State for finding the events and tasks of an ICS string which cannot occur
+// in a date range, collected by scanning the string so that they are never
+// parsed. All times are seconds since the epoch, reading wall clock times as
+// if they were UTC.
+struct IcsRangeFilter
+{
+    int64_t mRangeStart;
+    int64_t mRangeEnd;
+    int mDepth;
+
+    // The event or task being scanned.
+    bool mInItem;
+    bool mItemIsTodo;
+    bool mTodoCompleted;
+    size_t mItemOffset;
+    bool mKeep;
+    bool mFloating;
+    bool mHasStart;
+    bool mStartIsDate;
+    bool mHasEnd;
+    bool mHasDue;
+    bool mHasDuration;
+    int64_t mStart;
+    int64_t mEnd;
+    int64_t mDue;
+    int64_t mDuration;
+
+    // Start and end offsets of the items to leave out, in pairs.
+    nsTArray<size_t> mSkipped;
+};
+
+static bool
+scannedNameIs(const char *aName, size_t aLength, const char *aKeyword)
+{
+    return nsDependentCSubstring(aName, aLength).LowerCaseEqualsASCII(aKeyword);
+}
+
+static bool
+parseScannedTime(const char *aValue, size_t aLength, int64_t *aSeconds,
+                 bool *aIsUtc, bool *aIsDate)
+{
+    char buffer[32];
+    if (aLength == 0 || aLength >= sizeof(buffer)) {
+        return false;
+    }
+    memcpy(buffer, aValue, aLength);
+    buffer[aLength] = '\0';
+
+    icaltimetype tt = icaltime_from_string(buffer);
+    if (icaltime_is_null_time(tt) || !icaltime_is_valid_time(tt)) {
+        return false;
+    }
+
+    PRExplodedTime et;
+    memset(&et, 0, sizeof(et));
+    et.tm_sec = tt.second;
+    et.tm_min = tt.minute;
+    et.tm_hour = tt.hour;
+    et.tm_mday = static_cast<int16_t>(tt.day);
+    et.tm_month = static_cast<int16_t>(tt.month - 1);
+    et.tm_year = static_cast<int16_t>(tt.year);
+    *aSeconds = PR_ImplodeTime(&et) / PR_USEC_PER_SEC;
+    *aIsUtc = tt.is_utc != 0;
+    *aIsDate = tt.is_date != 0;
+    return true;
+}
+
+static void
+rangeFilterBegin(const char *aName, size_t aNameLength, size_t aOffset,
+                 void *aData)
+{
+    IcsRangeFilter *filter = static_cast<IcsRangeFilter *>(aData);
+    if (++filter->mDepth != 2) {
+        return;
+    }
+
+    bool isEvent = scannedNameIs(aName, aNameLength, "vevent");
+    bool isTodo = scannedNameIs(aName, aNameLength, "vtodo");
+    filter->mInItem = isEvent || isTodo;
+    if (filter->mInItem) {
+        filter->mItemIsTodo = isTodo;
+        filter->mTodoCompleted = false;
+        filter->mItemOffset = aOffset;
+        filter->mKeep = false;
+        filter->mFloating = false;
+        filter->mHasStart = false;
+        filter->mStartIsDate = false;
+        filter->mHasEnd = false;
+        filter->mHasDue = false;
+        filter->mHasDuration = false;
+    }
+}
+
+static void
+rangeFilterProperty(const char *aName, size_t aNameLength,
+                    const char *aParams, size_t aParamsLength,
+                    const char *aValue, size_t aValueLength, void *aData)
+{
+    IcsRangeFilter *filter = static_cast<IcsRangeFilter *>(aData);
+    if (!filter->mInItem || filter->mDepth != 2 || filter->mKeep) {
+        return;
+    }
+
+    // Recurring items and exceptions are always kept, working out their
+    // occurrences would mean parsing them.
+    if (scannedNameIs(aName, aNameLength, "rrule") ||
+        scannedNameIs(aName, aNameLength, "rdate") ||
+        scannedNameIs(aName, aNameLength, "recurrence-id")) {
+        filter->mKeep = true;
+        return;
+    }
+
+    // Tasks which aren't done yet are still of interest however old they
+    // are.
+    if (scannedNameIs(aName, aNameLength, "completed") ||
+        (scannedNameIs(aName, aNameLength, "status") &&
+         scannedNameIs(aValue, aValueLength, "completed")) ||
+        (scannedNameIs(aName, aNameLength, "percent-complete") &&
+         nsDependentCSubstring(aValue, aValueLength).EqualsLiteral("100"))) {
+        filter->mTodoCompleted = true;
+        return;
+    }
+
+    bool isUtc = true;
+    bool isDate = false;
+    bool parsed = true;
+    if (scannedNameIs(aName, aNameLength, "dtstart")) {
+        parsed = filter->mHasStart =
+            parseScannedTime(aValue, aValueLength, &filter->mStart, &isUtc,
+                             &filter->mStartIsDate);
+    } else if (scannedNameIs(aName, aNameLength, "dtend")) {
+        parsed = filter->mHasEnd =
+            parseScannedTime(aValue, aValueLength, &filter->mEnd, &isUtc, &isDate);
+    } else if (scannedNameIs(aName, aNameLength, "due")) {
+        parsed = filter->mHasDue =
+            parseScannedTime(aValue, aValueLength, &filter->mDue, &isUtc, &isDate);
+    } else if (scannedNameIs(aName, aNameLength, "duration")) {
+        char buffer[64];
+        parsed = aValueLength < sizeof(buffer);
+        if (parsed) {
+            memcpy(buffer, aValue, aValueLength);
+            buffer[aValueLength] = '\0';
+            icaldurationtype duration = icaldurationtype_from_string(buffer);
+            filter->mDuration = icaldurationtype_as_int(duration);
+            parsed = filter->mHasDuration =
+                !icaldurationtype_is_bad_duration(duration) &&
+                filter->mDuration >= 0;
+        }
+    }
+
+    if (!parsed) {
+        filter->mKeep = true;
+    }
+    if (!isUtc) {
+        filter->mFloating = true;
+    }
+}
+
+// Returns whether the item scanned last can be left out.
+static bool
+rangeFilterCanSkip(IcsRangeFilter const& aFilter)
+{
+    if (aFilter.mKeep || (aFilter.mItemIsTodo && !aFilter.mTodoCompleted)) {
+        return false;
+    }
+
+    int64_t start, end;
+    if (aFilter.mHasStart) {
+        start = aFilter.mStart;
+        if (aFilter.mHasEnd) {
+            end = aFilter.mEnd;
+        } else if (aFilter.mHasDue) {
+            end = aFilter.mDue;
+        } else if (aFilter.mHasDuration) {
+            end = start + aFilter.mDuration;
+        } else if (aFilter.mStartIsDate) {
+            end = start + 24 * 3600;
+        } else {
+            end = start;
+        }
+    } else if (aFilter.mHasDue) {
+        start = end = aFilter.mDue;
+    } else {
+        // Tasks without dates show up in every range.
+        return false;
+    }
+
+    if (end < start) {
+        return false;
+    }
+    if (aFilter.mFloating) {
+        start -= kMaxUtcOffset;
+        end += kMaxUtcOffset;
+    }
+    return end < aFilter.mRangeStart || start >= aFilter.mRangeEnd;
+}
+
+static void
+rangeFilterEnd(const char *aName, size_t aNameLength, size_t aOffset,
+               void *aData)
+{
+    IcsRangeFilter *filter = static_cast<IcsRangeFilter *>(aData);
+    if (filter->mDepth == 2 && filter->mInItem) {
+        // Only skip what is between matching BEGIN and END lines.
+        if (scannedNameIs(aName, aNameLength,
+                          filter->mItemIsTodo ? "vtodo" : "vevent") &&
+            rangeFilterCanSkip(*filter)) {
+            filter->mSkipped.AppendElement(filter->mItemOffset);
+            filter->mSkipped.AppendElement(aOffset);
+        }
+        filter->mInItem = false;
+    }
+    if (filter->mDepth > 0) {
+        filter->mDepth--;
+    }
+}
+
+// Gets the range bounds of parseICSInRange() in seconds, so that they can
+// be used off the main thread.
+static nsresult
+getRangeSeconds(calIDateTime *aRangeStart, calIDateTime *aRangeEnd,
+                int64_t *aStart, int64_t *aEnd)
+{
+    *aStart = INT64_MIN;
+    *aEnd = INT64_MAX;
+
+    PRTime nativeTime;
+    if (aRangeStart) {
+        nsresult rv = aRangeStart->GetNativeTime(&nativeTime);
+        NS_ENSURE_SUCCESS(rv, rv);
+        *aStart = nativeTime / PR_USEC_PER_SEC;
+    }
+    if (aRangeEnd) {
+        nsresult rv = aRangeEnd->GetNativeTime(&nativeTime);
+        NS_ENSURE_SUCCESS(rv, rv);
+        *aEnd = nativeTime / PR_USEC_PER_SEC;
+    }
+    return NS_OK;
+}
+
+// Copies aSerialized to aKept without the events and tasks that cannot occur
+// between aRangeStart and aRangeEnd. Returns false, without touching aKept,
+// when nothing is left out.
+static bool
+filterICSRange(nsCString const& aSerialized, int64_t aRangeStart,
+               int64_t aRangeEnd, nsCString& aKept)
+{
+    if (aRangeStart == INT64_MIN && aRangeEnd == INT64_MAX) {
+        return false;
+    }
+
+    IcsRangeFilter filter;
+    filter.mRangeStart = aRangeStart;
+    filter.mRangeEnd = aRangeEnd;
+    filter.mDepth = 0;
+    filter.mInItem = false;
+
+    // Scanning doesn't build any components, so items outside the range
+    // never get parsed or wrapped.
+    static icalparser_scan_callbacks const callbacks = {
+        rangeFilterBegin, rangeFilterEnd, rangeFilterProperty
+    };
+    if (!icalparser_scan_string(aSerialized.get(), &callbacks, &filter) ||
+        filter.mSkipped.IsEmpty()) {
+        return false;
+    }
+
+    aKept.SetCapacity(aSerialized.Length());
+    size_t offset = 0;
+    for (size_t i = 0; i < filter.mSkipped.Length(); i += 2) {
+        aKept.Append(Substring(aSerialized, offset, filter.mSkipped[i] - offset));
+        offset = filter.mSkipped[i + 1];
+    }
+    aKept.Append(Substring(aSerialized, offset));
+    return true;
+}
+
+NS_IMETHODIMP
+calICSService::ParseICSInRange(const nsACString& serialized,
+                               calITimezoneProvider *tzProvider,
+                               calIDateTime *rangeStart,
+                               calIDateTime *rangeEnd,
+                               calIIcalComponent **component)
+{
+    NS_ENSURE_ARG_POINTER(component);
+
+    int64_t start, end;
+    nsresult rv = getRangeSeconds(rangeStart, rangeEnd, &start, &end);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    nsCString const flat(serialized);
+    nsCString kept;
+    if (filterICSRange(flat, start, end, kept)) {
+        return ParseICS(kept, tzProvider, component);
+    }
+    return ParseICS(flat, tzProvider, component);
+}
+
 NS_IMETHODIMP
 calICSService::ParserWorker::Run()
 {
-    icalcomponent *ical = icalparser_parse_string(mString.get());
+    nsCString kept;
+    char const* ics = mString.get();
+    if (filterICSRange(mString, mRangeStart, mRangeEnd, kept)) {
+        ics = kept.get();
+    }
+
+    icalcomponent *ical = icalparser_parse_string(ics);
     nsresult status = NS_OK;
     calIIcalComponent *comp = nullptr;
 
@@ -1315,11 +1624,18 @@ calICSService::ParserWorker::ParserWorkerCompleter::Run()
 NS_IMETHODIMP
 calICSService::ParseICSAsync(const nsACString& serialized,
                              calITimezoneProvider *tzProvider,
-                             calIIcsComponentParsingListener *listener)
+                             calIIcsComponentParsingListener *listener,
+                             calIDateTime *rangeStart,
+                             calIDateTime *rangeEnd)
 {
     nsresult rv;
     NS_ENSURE_ARG_POINTER(listener);
 
+    // calIDateTime can't be used on the worker thread
+    int64_t start, end;
+    rv = getRangeSeconds(rangeStart, rangeEnd, &start, &end);
+    NS_ENSURE_SUCCESS(rv, rv);
+
     nsCOMPtr<nsIThread> workerThread;
     nsCOMPtr<nsIThread> currentThread;
     rv = NS_GetCurrentThread(getter_AddRefs(currentThread));
@@ -1328,7 +1644,8 @@ calICSService::ParseICSAsync(const nsACString& serialized,
     NS_ENSURE_SUCCESS(rv, rv);
 
     nsCOMPtr<nsIRunnable> worker = new ParserWorker(currentThread, workerThread,
-                                                    serialized, tzProvider, listener);
+                                                    serialized, tzProvider, listener,
+                                                    start, end);
     NS_ENSURE_TRUE(worker, NS_ERROR_OUT_OF_MEMORY);
 
     rv = workerThread->Dispatch(worker, NS_DISPATCH_NORMAL);
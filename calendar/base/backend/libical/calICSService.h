@@ -27,10 +27,12 @@ protected:
                    nsIThread *workerThread,
                    const nsACString &icsString,
                    calITimezoneProvider *tzProvider,
-                   calIIcsComponentParsingListener *listener) :
+                   calIIcsComponentParsingListener *listener,
+                   int64_t rangeStart, int64_t rangeEnd) :
         mozilla::Runnable("ParserWorker"),
         mString(icsString), mProvider(tzProvider),
-        mMainThread(mainThread), mWorkerThread(workerThread)
+        mMainThread(mainThread), mWorkerThread(workerThread),
+        mRangeStart(rangeStart), mRangeEnd(rangeEnd)
       {
         mListener = new nsMainThreadPtrHolder<calIIcsComponentParsingListener>("calICSService::mListener", listener);
       }
@@ -43,6 +45,10 @@ protected:
       nsMainThreadPtrHandle<calIIcsComponentParsingListener> mListener;
       nsCOMPtr<nsIThread> mMainThread;
       nsCOMPtr<nsIThread> mWorkerThread;
+      // the range of parseICSInRange() in seconds, INT64_MIN and INT64_MAX
+      // for no bounds
+      int64_t mRangeStart;
+      int64_t mRangeEnd;
 
       class ParserWorkerCompleter : public mozilla::Runnable {
       public:
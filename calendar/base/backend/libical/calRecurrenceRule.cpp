@@ -2,8 +2,6 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
-#include "nsCOMArray.h"
-
 #include "calRecurrenceRule.h"
 
 #include "calDateTime.h"
@@ -19,14 +17,26 @@
 NS_IMPL_CLASSINFO(calRecurrenceRule, NULL, 0, CAL_RECURRENCERULE_CID)
 NS_IMPL_ISUPPORTS_CI(calRecurrenceRule, calIRecurrenceItem, calIRecurrenceRule)
 
+// Rules expanding to more occurrences than this are not cached.
+static const uint32_t kMaxCachedOccurrences = 2000;
+
 calRecurrenceRule::calRecurrenceRule()
-    : mImmutable(false),
+    : mCacheStart(icaltime_null_time()),
+      mCacheNext(icaltime_null_time()),
+      mCacheIter(nullptr),
+      mCacheOverflowed(false),
+      mImmutable(false),
       mIsNegative(false),
       mIsByCount(false)
 {
     icalrecurrencetype_clear(&mIcalRecur);
 }
 
+calRecurrenceRule::~calRecurrenceRule()
+{
+    InvalidateCache();
+}
+
 NS_IMETHODIMP
 calRecurrenceRule::GetIsMutable(bool *aResult)
 {
@@ -130,6 +140,7 @@ calRecurrenceRule::SetType(const nsACString &aType)
     else
         return NS_ERROR_FAILURE;
 
+    InvalidateCache();
     return NS_OK;
 }
 
@@ -169,7 +180,7 @@ calRecurrenceRule::SetCount(int32_t aRecurCount)
 
     mIcalRecur.until = icaltime_null_time();
 
-
+    InvalidateCache();
     return NS_OK;
 }
 
@@ -227,6 +238,7 @@ calRecurrenceRule::SetUntilDate(calIDateTime * aRecurEnd)
 
     mIsByCount = false;
 
+    InvalidateCache();
     return NS_OK;
 }
 
@@ -253,6 +265,7 @@ calRecurrenceRule::SetInterval(int32_t aInterval)
     if (aInterval < 0 || aInterval > SHRT_MAX)
         return NS_ERROR_ILLEGAL_VALUE;
     mIcalRecur.interval = static_cast<short>(aInterval);
+    InvalidateCache();
     return NS_OK;
 }
 
@@ -331,9 +344,167 @@ calRecurrenceRule::SetComponent(const nsACString& aComponentType, uint32_t aCoun
     }
 #undef HANDLE_COMPONENT
 
+    InvalidateCache();
     return NS_OK;
 }
 
+/**
+ * Moves aDtStart, and the count of aRecur, forward to an occurrence close to
+ * but before aTime, for rules whose occurrences repeat the same pattern every
+ * fixed number of days (or seconds, for sub-daily rules).  This lets a rule
+ * that started years ago be expanded from near the range that is asked for
+ * instead of from its very first occurrence.  Returns false if the rule is
+ * not one of those or aTime is not far enough past aDtStart to bother.
+ */
+bool
+calRecurrenceRule::SeekTo(icaltimetype const& aTime, icaltimetype& aDtStart,
+                          icalrecurrencetype& aRecur) const
+{
+    if (mIcalRecur.interval < 1)
+        return false;
+
+    // BYDAY is fine as long as it only names weekdays, anything else breaks
+    // the fixed period, as does counting occurrences when there is more than
+    // one of them per period.
+    bool hasByDay = mIcalRecur.by_day[0] != ICAL_RECURRENCE_ARRAY_MAX;
+    for (int i = 0; i < ICAL_BY_DAY_SIZE &&
+                    mIcalRecur.by_day[i] != ICAL_RECURRENCE_ARRAY_MAX; i++) {
+        if (icalrecurrencetype_day_position(mIcalRecur.by_day[i]) != 0)
+            return false;
+    }
+    if (mIcalRecur.by_second[0] != ICAL_RECURRENCE_ARRAY_MAX ||
+        mIcalRecur.by_minute[0] != ICAL_RECURRENCE_ARRAY_MAX ||
+        mIcalRecur.by_hour[0] != ICAL_RECURRENCE_ARRAY_MAX ||
+        mIcalRecur.by_month_day[0] != ICAL_RECURRENCE_ARRAY_MAX ||
+        mIcalRecur.by_year_day[0] != ICAL_RECURRENCE_ARRAY_MAX ||
+        mIcalRecur.by_week_no[0] != ICAL_RECURRENCE_ARRAY_MAX ||
+        mIcalRecur.by_month[0] != ICAL_RECURRENCE_ARRAY_MAX ||
+        mIcalRecur.by_set_pos[0] != ICAL_RECURRENCE_ARRAY_MAX ||
+        (hasByDay && mIcalRecur.count)) {
+        return false;
+    }
+
+    int64_t periodDays = 0, periodSeconds = 0;
+    switch (mIcalRecur.freq) {
+        case ICAL_SECONDLY_RECURRENCE:
+            periodSeconds = mIcalRecur.interval;
+            break;
+        case ICAL_MINUTELY_RECURRENCE:
+            periodSeconds = mIcalRecur.interval * 60;
+            break;
+        case ICAL_HOURLY_RECURRENCE:
+            periodSeconds = mIcalRecur.interval * 3600;
+            break;
+        case ICAL_DAILY_RECURRENCE:
+            periodDays = hasByDay ? mIcalRecur.interval * 7 : mIcalRecur.interval;
+            break;
+        case ICAL_WEEKLY_RECURRENCE:
+            periodDays = mIcalRecur.interval * 7;
+            break;
+        default:
+            return false;
+    }
+    if (periodSeconds && (hasByDay || aDtStart.is_date))
+        return false;
+    if (periodDays)
+        periodSeconds = periodDays * 86400;
+
+    // Both times are compared as wall clock times, which may be up to a day
+    // apart in absolute terms.  Stopping two days short covers that as well
+    // as any DST shift; the caller skips whatever is still before aTime.
+    int64_t distance = int64_t(icaltime_as_timet(aTime)) -
+                       int64_t(icaltime_as_timet(aDtStart)) - 2 * 86400;
+    int64_t periods = distance > 0 ? distance / periodSeconds : 0;
+    if (periods <= 0)
+        return false;
+
+    aRecur = mIcalRecur;
+    if (aRecur.count) {
+        if (periods >= aRecur.count)
+            periods = aRecur.count - 1;
+        aRecur.count -= static_cast<int>(periods);
+    }
+
+    // Libical adds days, hours, minutes and seconds on the wall clock as well.
+    int64_t seconds = periods * periodSeconds;
+    icaltime_adjust(&aDtStart, static_cast<int>(seconds / 86400), 0, 0,
+                    static_cast<int>(seconds % 86400));
+    return true;
+}
+
+static inline bool sameIcalTime(icaltimetype const& a, icaltimetype const& b)
+{
+    return a.year == b.year && a.month == b.month && a.day == b.day &&
+           a.hour == b.hour && a.minute == b.minute && a.second == b.second &&
+           a.is_date == b.is_date && a.is_utc == b.is_utc && a.zone == b.zone;
+}
+
+/**
+ * Makes the expansion cache hold the occurrences starting at aDtStart,
+ * dropping whatever it held for another start.  Returns false if the rule has
+ * too many occurrences to be cached.
+ */
+bool
+calRecurrenceRule::PrepareCache(icaltimetype const& aDtStart)
+{
+    if (!sameIcalTime(mCacheStart, aDtStart)) {
+        InvalidateCache();
+        mCacheStart = aDtStart;
+        mCacheIter = icalrecur_iterator_new(mIcalRecur, aDtStart);
+        if (!mCacheIter) {
+            mCacheOverflowed = true;
+            return false;
+        }
+        mCacheNext = icalrecur_iterator_next(mCacheIter);
+        if (icaltime_is_null_time(mCacheNext)) {
+            icalrecur_iterator_free(mCacheIter);
+            mCacheIter = nullptr;
+        }
+    }
+    return !mCacheOverflowed;
+}
+
+/**
+ * Adds the occurrences of the next year to the expansion cache.  Returns
+ * false if there are none left, or they would not fit.
+ */
+bool
+calRecurrenceRule::ExpandCache()
+{
+    if (!mCacheIter || mCacheOverflowed)
+        return false;
+
+    int const year = mCacheNext.year;
+    while (mCacheNext.year == year) {
+        if (mCachedDates.Length() >= kMaxCachedOccurrences) {
+            mCacheOverflowed = true;
+            mCachedDates.Clear();
+            return false;
+        }
+        mCachedDates.AppendElement(mCacheNext);
+        mCacheNext = icalrecur_iterator_next(mCacheIter);
+        if (icaltime_is_null_time(mCacheNext)) {
+            icalrecur_iterator_free(mCacheIter);
+            mCacheIter = nullptr;
+            break;
+        }
+    }
+    return true;
+}
+
+void
+calRecurrenceRule::InvalidateCache()
+{
+    if (mCacheIter) {
+        icalrecur_iterator_free(mCacheIter);
+        mCacheIter = nullptr;
+    }
+    mCacheStart = icaltime_null_time();
+    mCacheNext = icaltime_null_time();
+    mCachedDates.Clear();
+    mCacheOverflowed = false;
+}
+
 /* calIDateTime getNextOccurrence (in calIDateTime aStartTime, in calIDateTime aOccurrenceTime); */
 NS_IMETHODIMP
 calRecurrenceRule::GetNextOccurrence(calIDateTime *aStartTime,
@@ -358,8 +529,12 @@ calRecurrenceRule::GetNextOccurrence(calIDateTime *aStartTime,
     struct icaltimetype occurtime;
     icaloccurtime->ToIcalTime(&occurtime);
 
+    icalrecurrencetype recur;
     icalrecur_iterator* recur_iter;
-    recur_iter = icalrecur_iterator_new(mIcalRecur, dtstart);
+    if (SeekTo(occurtime, dtstart, recur))
+        recur_iter = icalrecur_iterator_new(recur, dtstart);
+    else
+        recur_iter = icalrecur_iterator_new(mIcalRecur, dtstart);
     if (!recur_iter)
         return NS_ERROR_OUT_OF_MEMORY;
 
@@ -399,6 +574,87 @@ static inline icaltimetype ensureDateTime(icaltimetype const& icalt) {
     }
 }
 
+nsresult
+calRecurrenceRule::GetOccurrenceTimes(icaltimetype const& aDtStart,
+                                      icaltimetype const& aRangeStart,
+                                      icaltimetype const* aRangeEnd,
+                                      uint32_t aMaxCount,
+                                      nsTArray<icaltimetype>& aDates)
+{
+    icaltimetype dtstart = aDtStart;
+    icalrecurrencetype recur;
+    bool const seeked = SeekTo(aRangeStart, dtstart, recur);
+
+    if (!seeked && PrepareCache(aDtStart)) {
+        // Expand up to the range start, then find the first occurrence in
+        // the range by bisection.
+        while ((mCachedDates.IsEmpty() ||
+                icaltime_compare(ensureDateTime(mCachedDates.LastElement()),
+                                 aRangeStart) < 0) &&
+               ExpandCache()) {
+        }
+        if (!mCacheOverflowed) {
+            size_t low = 0, high = mCachedDates.Length();
+            while (low < high) {
+                size_t const mid = low + (high - low) / 2;
+                if (icaltime_compare(ensureDateTime(mCachedDates[mid]),
+                                     aRangeStart) < 0)
+                    low = mid + 1;
+                else
+                    high = mid;
+            }
+
+            for (size_t i = low; ; i++) {
+                // ExpandCache() also fails when the occurrences don't fit,
+                // which is checked below.
+                if (i == mCachedDates.Length() && !ExpandCache())
+                    break;
+
+                icaltimetype const& next = mCachedDates[i];
+                if (aRangeEnd &&
+                    icaltime_compare(ensureDateTime(next), *aRangeEnd) >= 0)
+                    break;
+
+                aDates.AppendElement(next);
+                if (aMaxCount && aMaxCount <= aDates.Length())
+                    break;
+            }
+            if (!mCacheOverflowed)
+                return NS_OK;
+        }
+    }
+
+    // The rule is cheap to expand from near the range, or has too many
+    // occurrences to cache.
+    aDates.Clear();
+    icalrecur_iterator* recur_iter =
+        icalrecur_iterator_new(seeked ? recur : mIcalRecur, dtstart);
+    if (!recur_iter)
+        return NS_ERROR_OUT_OF_MEMORY;
+
+    for (icaltimetype next = icalrecur_iterator_next(recur_iter);
+         !icaltime_is_null_time(next);
+         next = icalrecur_iterator_next(recur_iter))
+    {
+        icaltimetype const dtNext(ensureDateTime(next));
+
+        // if this thing is before the range start
+        if (icaltime_compare(dtNext, aRangeStart) < 0) {
+            continue;
+        }
+
+        if (aRangeEnd && icaltime_compare(dtNext, *aRangeEnd) >= 0)
+            break;
+
+        aDates.AppendElement(next);
+        if (aMaxCount && aMaxCount <= aDates.Length())
+            break;
+    }
+
+    icalrecur_iterator_free(recur_iter);
+    return NS_OK;
+}
+
 NS_IMETHODIMP
 calRecurrenceRule::GetOccurrences(calIDateTime *aStartTime,
                                   calIDateTime *aRangeStart,
@@ -416,8 +672,6 @@ calRecurrenceRule::GetOccurrences(calIDateTime *aStartTime,
     if (!aMaxCount && !aRangeEnd && mIcalRecur.count == 0 && icaltime_is_null_time(mIcalRecur.until))
         return NS_ERROR_INVALID_ARG;
 
-    nsCOMArray<calIDateTime> dates;
-
 #ifdef DEBUG_dbo
     {
         char const * const ss = icalrecurrencetype_as_string(&mIcalRecur);
@@ -458,55 +712,24 @@ calRecurrenceRule::GetOccurrences(calIDateTime *aStartTime,
         }
     }
 
-    icalrecur_iterator* recur_iter;
-    recur_iter = icalrecur_iterator_new(mIcalRecur, dtstart);
-    if (!recur_iter)
-        return NS_ERROR_OUT_OF_MEMORY;
-
-    uint32_t count = 0;
-
-    for (icaltimetype next = icalrecur_iterator_next(recur_iter);
-         !icaltime_is_null_time(next);
-         next = icalrecur_iterator_next(recur_iter))
-    {
-        icaltimetype const dtNext(ensureDateTime(next));
-
-        // if this thing is before the range start
-        if (icaltime_compare(dtNext, rangestart) < 0) {
-            continue;
-        }
-
-        if (aRangeEnd && icaltime_compare(dtNext, dtend) >= 0)
-            break;
-
-        calIDateTime * const cdt = new calDateTime(&next, tz);
-        if (!cdt) {
-            icalrecur_iterator_free(recur_iter);
-            return NS_ERROR_OUT_OF_MEMORY;
-        }
-
-        dates.AppendObject(cdt);
-#ifdef DEBUG_dbo
-        {
-            nsAutoCString str;
-            cdt->ToString(str);
-            printf("  occ: %s\n", str.get());
-        }
-#endif
-        count++;
-        if (aMaxCount && aMaxCount <= count)
-            break;
-    }
-
-    icalrecur_iterator_free(recur_iter);
+    AutoTArray<icaltimetype, 32> dates;
+    rv = GetOccurrenceTimes(dtstart, rangestart, aRangeEnd ? &dtend : nullptr,
+                            aMaxCount, dates);
+    NS_ENSURE_SUCCESS(rv, rv);
 
+    uint32_t const count = dates.Length();
     if (count) {
         calIDateTime ** const dateArray =
             static_cast<calIDateTime **>(moz_xmalloc(sizeof(calIDateTime*) * count));
         CAL_ENSURE_MEMORY(dateArray);
+        calDateTime::FromIcalTimes(dates.Elements(), count, tz, dateArray);
+#ifdef DEBUG_dbo
         for (uint32_t i = 0; i < count; ++i) {
-            NS_ADDREF(dateArray[i] = dates[i]);
+            nsAutoCString str;
+            dateArray[i]->ToString(str);
+            printf("  occ: %s\n", str.get());
         }
+#endif
         *aDates = dateArray;
     } else {
         *aDates = nullptr;
@@ -580,6 +803,7 @@ calRecurrenceRule::SetIcalProperty(calIIcalProperty *aProp)
 
     mIcalRecur = icalrecur;
 
+    InvalidateCache();
     return NS_OK;
 }
 
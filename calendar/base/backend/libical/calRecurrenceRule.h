@@ -6,6 +6,7 @@
 
 #include "calIRecurrenceRule.h"
 #include "calUtils.h"
+#include "nsTArray.h"
 
 extern "C" {
 #include "ical.h"
@@ -20,11 +21,36 @@ public:
     NS_DECL_ISUPPORTS
     NS_DECL_CALIRECURRENCEITEM
     NS_DECL_CALIRECURRENCERULE
+
+    // Expands the occurrences of this rule starting at aDtStart that fall
+    // between aRangeStart and the optional aRangeEnd into aDates, without
+    // creating a calIDateTime for each of them.  The range limits must be
+    // date-times, not dates.
+    nsresult GetOccurrenceTimes(icaltimetype const& aDtStart,
+                                icaltimetype const& aRangeStart,
+                                icaltimetype const* aRangeEnd,
+                                uint32_t aMaxCount,
+                                nsTArray<icaltimetype>& aDates);
 protected:
-    virtual ~calRecurrenceRule() {}
+    virtual ~calRecurrenceRule();
+
+    bool SeekTo(icaltimetype const& aTime, icaltimetype& aDtStart,
+                icalrecurrencetype& aRecur) const;
+    bool PrepareCache(icaltimetype const& aDtStart);
+    bool ExpandCache();
+    void InvalidateCache();
 
     icalrecurrencetype mIcalRecur;
 
+    // Occurrences of rules SeekTo cannot handle, expanded a year at a time
+    // from mCacheStart and kept until the rule changes.  mCacheIter is null
+    // once the rule has no more occurrences.
+    icaltimetype mCacheStart;
+    icaltimetype mCacheNext;
+    icalrecur_iterator *mCacheIter;
+    nsTArray<icaltimetype> mCachedDates;
+    bool mCacheOverflowed;
+
     bool mImmutable;
     bool mIsNegative;
     bool mIsByCount;
@@ -112,7 +112,7 @@ calIcsParser.prototype = {
         });
     },
 
-    parseString: function(aICSString, aTzProvider, aAsyncParsing) {
+    parseString: function(aICSString, aTzProvider, aAsyncParsing, aRangeStart, aRangeEnd) {
         if (aAsyncParsing) {
             let self = this;
 
@@ -130,10 +130,13 @@ calIcsParser.prototype = {
                         aAsyncParsing.onParsingComplete(rc, self);
                     }
                 }
-            });
+            }, aRangeStart, aRangeEnd);
         } else {
             try {
-                let icalComp = cal.getIcsService().parseICS(aICSString, aTzProvider);
+                let icsService = cal.getIcsService();
+                let icalComp = aRangeStart || aRangeEnd
+                    ? icsService.parseICSInRange(aICSString, aTzProvider, aRangeStart, aRangeEnd)
+                    : icsService.parseICS(aICSString, aTzProvider);
                 // There is no such indicator like X-LIC in icaljs, so there would need to
                 // detect and log such errors already within the parser. However, until
                 // X-LIC or libical will be removed we make use of X-LIC-ERRORS here but
@@ -152,13 +155,13 @@ calIcsParser.prototype = {
         }
     },
 
-    parseFromStream: function(aStream, aTzProvider, aAsyncParsing) {
+    parseFromStream: function(aStream, aTzProvider, aAsyncParsing, aRangeStart, aRangeEnd) {
         // Read in the string. Note that it isn't a real string at this point,
         // because likely, the file is utf8. The multibyte chars show up as multiple
         // 'chars' in this string. So call it an array of octets for now.
 
         let stringData = NetUtil.readInputStreamToString(aStream, aStream.available(), { charset: "utf-8" });
-        this.parseString(stringData, aTzProvider, aAsyncParsing);
+        this.parseString(stringData, aTzProvider, aAsyncParsing, aRangeStart, aRangeEnd);
     },
 
     getItems: function(aCount) {
@@ -3,6 +3,7 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
 var { cal } = ChromeUtils.import("resource://calendar/modules/calUtils.jsm");
+var { Preferences } = ChromeUtils.import("resource://gre/modules/Preferences.jsm");
 
 /**
  * ICS Import and Export Plugin
@@ -33,7 +34,15 @@ calIcsImporter.prototype = {
     importFromStream: function(aStream, aCount) {
         let parser = Cc["@mozilla.org/calendar/ics-parser;1"]
                        .createInstance(Ci.calIIcsParser);
-        parser.parseFromStream(aStream, null);
+
+        // Items that ended too long ago are left out without parsing them.
+        let rangeStart = null;
+        let pastDays = Preferences.get("calendar.import.ics.pastDays", -1);
+        if (pastDays >= 0) {
+            rangeStart = cal.dtz.now();
+            rangeStart.day -= pastDays;
+        }
+        parser.parseFromStream(aStream, null, null, rangeStart, null);
         return parser.getItems(aCount);
     }
 };
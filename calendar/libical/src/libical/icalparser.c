@@ -602,6 +602,35 @@ static int line_is_blank(char* line){
     return 1;
 }
 
+/** Adds a component returned by icalparser_add_line() to the components
+    parsed so far and returns the new root. Once there is more than one
+    component they are put under an XROOT component. */
+static icalcomponent* icalparser_add_root(icalcomponent *root,
+					  icalcomponent *c)
+{
+    if (root == 0){
+	/* Just one component */
+	root = c;
+    } else if(icalcomponent_isa(root) != ICAL_XROOT_COMPONENT) {
+	/*Got a second component, so move the two components under
+	  an XROOT container */
+	icalcomponent *tempc = icalcomponent_new(ICAL_XROOT_COMPONENT);
+	icalcomponent_add_component(tempc, root);
+	icalcomponent_add_component(tempc, c);
+	root = tempc;
+    } else if(icalcomponent_isa(root) == ICAL_XROOT_COMPONENT) {
+	/* Already have an XROOT container, so add the component
+	   to it*/
+	icalcomponent_add_component(root, c);
+	
+    } else {
+	/* Badness */
+	assert(0);
+    }
+
+    return root;
+}
+
 icalcomponent* icalparser_parse(icalparser *parser,
 				char* (*line_gen_func)(char *s, size_t size, 
 						       void* d))
@@ -629,26 +658,7 @@ icalcomponent* icalparser_parse(icalparser *parser,
 	    assert(parser->root_component == 0);
 	    assert(pvl_count(parser->components) ==0);
 
-	    if (root == 0){
-		/* Just one component */
-		root = c;
-	    } else if(icalcomponent_isa(root) != ICAL_XROOT_COMPONENT) {
-		/*Got a second component, so move the two components under
-		  an XROOT container */
-		icalcomponent *tempc = icalcomponent_new(ICAL_XROOT_COMPONENT);
-		icalcomponent_add_component(tempc, root);
-		icalcomponent_add_component(tempc, c);
-		root = tempc;
-	    } else if(icalcomponent_isa(root) == ICAL_XROOT_COMPONENT) {
-		/* Already have an XROOT container, so add the component
-		   to it*/
-		icalcomponent_add_component(root, c);
-		
-	    } else {
-		/* Badness */
-		assert(0);
-	    }
-
+	    root = icalparser_add_root(root, c);
 	    c = 0;
 
         }
@@ -1217,28 +1227,244 @@ char* icalparser_string_line_generator(char *out, size_t buf_size, void *d)
     return out;    
 }
 
+/*
+ * Reading content lines straight from a string.
+ *
+ * This unfolds lines exactly like icalparser_get_line() does with
+ * icalparser_string_line_generator(), but without copying every line into a
+ * newly allocated buffer in 80 byte pieces. Lines which aren't folded can
+ * be used in place; folded lines, or all lines if the caller needs them
+ * NUL-terminated, go into one buffer which is reused for the whole string.
+ */
+
+struct icalparser_line_reader {
+    const char *str;
+    const char *pos;
+    char *buf;
+    size_t buf_size;
+};
+
+static void icalparser_init_line_reader(struct icalparser_line_reader *reader,
+					const char *str)
+{
+    reader->str = str;
+    reader->pos = str;
+    reader->buf = 0;
+    reader->buf_size = 0;
+}
+
+/* Makes room for size bytes in the reader's buffer. */
+static int icalparser_reserve_line(struct icalparser_line_reader *reader,
+				   size_t size)
+{
+    char *buf;
+    size_t buf_size;
+
+    if (size <= reader->buf_size)
+	return 1;
+
+    buf_size = reader->buf_size ? reader->buf_size : 256;
+    while (buf_size < size)
+	buf_size *= 2;
+
+    buf = (char*)realloc(reader->buf, buf_size);
+    if (buf == 0) {
+	icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+	return 0;
+    }
+
+    reader->buf = buf;
+    reader->buf_size = buf_size;
+    return 1;
+}
+
+/* Returns the start of the physical line following the one at pos. */
+static const char* icalparser_next_physical_line(const char *pos)
+{
+    const char *nl = strchr(pos, '\n');
+    return nl ? nl + 1 : pos + strlen(pos);
+}
+
+/* Reads the next content line. Returns 0 at the end of the string, or if
+   the buffer can't be grown. If copy is set the line is NUL-terminated in
+   the reader's buffer, otherwise it may point into the string. */
+static int icalparser_read_line(struct icalparser_line_reader *reader,
+				int copy, const char **line, size_t *len)
+{
+    const char *pos = reader->pos;
+    const char *next;
+    const char *out;
+    size_t n;
+
+    if (*pos == '\0')
+	return 0;
+
+    next = icalparser_next_physical_line(pos);
+    n = (size_t)(next - pos);
+
+    if (n > 1 && pos[n-1] == '\n' && (*next == ' ' || *next == '\t')) {
+	/* A folded line. Join the continuation lines, dropping the line
+	   break and the first character of each of them. */
+	if (!icalparser_reserve_line(reader, n + 1))
+	    return 0;
+	memcpy(reader->buf, pos, n);
+	pos = next;
+
+	while (n > 1 && reader->buf[n-1] == '\n'
+	       && (*pos == ' ' || *pos == '\t')) {
+	    size_t piece;
+
+	    n--;
+	    if (reader->buf[n-1] == '\r')
+		n--;
+
+	    next = icalparser_next_physical_line(pos);
+	    piece = (size_t)(next - pos) - 1;
+	    if (!icalparser_reserve_line(reader, n + piece + 1))
+		return 0;
+	    memcpy(reader->buf + n, pos + 1, piece);
+	    n += piece;
+	    pos = next;
+	}
+
+	out = reader->buf;
+    } else {
+	pos = next;
+	if (copy) {
+	    if (!icalparser_reserve_line(reader, n + 1))
+		return 0;
+	    memcpy(reader->buf, reader->pos, n);
+	    out = reader->buf;
+	} else {
+	    out = reader->pos;
+	}
+    }
+
+    reader->pos = pos;
+
+    /* Erase the final newline and/or carriage return, and any trailing
+       white space except for the first character. */
+    if (n > 1 && out[n-1] == '\n') {
+	n--;
+	if (out[n-1] == '\r')
+	    n--;
+    }
+    while (n > 1 && iswspace(out[n-1]))
+	n--;
+
+    if (out == reader->buf)
+	reader->buf[n] = '\0';
+
+    *line = out;
+    *len = n;
+    return 1;
+}
+
 icalcomponent* icalparser_parse_string(const char* str)
 {
     icalcomponent *c;
-    struct slg_data d;
+    icalcomponent *root = 0;
+    struct icalparser_line_reader reader;
+    const char *line;
+    size_t len;
     icalparser *p;
 
     icalerrorstate es = icalerror_get_error_state(ICAL_MALFORMEDDATA_ERROR);
 
-    d.pos = 0;
-    d.str = str;
+    icalparser_init_line_reader(&reader, str);
 
     p = icalparser_new();
-    icalparser_set_gen_data(p,&d);
 
     icalerror_set_error_state(ICAL_MALFORMEDDATA_ERROR,ICAL_ERROR_NONFATAL);
 
-    c = icalparser_parse(p,icalparser_string_line_generator);
+    while (icalparser_read_line(&reader, 1, &line, &len)) {
+	if ((c = icalparser_add_line(p, (char*)line)) != 0)
+	    root = icalparser_add_root(root, c);
+    }
 
     icalerror_set_error_state(ICAL_MALFORMEDDATA_ERROR,es);
 
+    free(reader.buf);
     icalparser_free(p);
 
-    return c;
+    return root;
+
+}
+
+/* Compares a name which isn't NUL-terminated with a keyword, ignoring
+   case. */
+static int icalparser_name_is(const char *name, size_t len,
+			      const char *keyword)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+	if (keyword[i] == '\0'
+	    || toupper((unsigned char)name[i]) != keyword[i])
+	    return 0;
+    }
+    return keyword[len] == '\0';
+}
+
+int icalparser_scan_string(const char *str,
+			   const icalparser_scan_callbacks *callbacks,
+			   void *data)
+{
+    struct icalparser_line_reader reader;
+    const char *line, *params, *value;
+    size_t len, name_len, params_len, offset;
+    int in_quotes;
+
+    icalerror_check_arg_rz((str != 0), "str");
+    icalerror_check_arg_rz((callbacks != 0), "callbacks");
+
+    icalparser_init_line_reader(&reader, str);
+
+    for (;;) {
+	offset = (size_t)(reader.pos - str);
+	if (!icalparser_read_line(&reader, 0, &line, &len))
+	    break;
+
+	/* The name ends at the first ';' or ':', the parameters at the
+	   first ':' which isn't quoted. Lines without a value are skipped,
+	   as the parser can't do anything with them either. */
+	for (name_len = 0; name_len < len; name_len++) {
+	    if (line[name_len] == ';' || line[name_len] == ':')
+		break;
+	}
+	if (name_len == 0 || name_len == len)
+	    continue;
+
+	params = line + name_len;
+	in_quotes = 0;
+	for (value = params; value < line + len; value++) {
+	    if (*value == '"')
+		in_quotes = !in_quotes;
+	    else if (*value == ':' && !in_quotes)
+		break;
+	}
+	if (value == line + len)
+	    continue;
+	params_len = (size_t)(value - params);
+	value++;
+
+	if (icalparser_name_is(line, name_len, "BEGIN")) {
+	    if (callbacks->begin_component)
+		callbacks->begin_component(value, (size_t)(line + len - value),
+					   offset, data);
+	} else if (icalparser_name_is(line, name_len, "END")) {
+	    if (callbacks->end_component)
+		callbacks->end_component(value, (size_t)(line + len - value),
+					 (size_t)(reader.pos - str), data);
+	} else if (callbacks->property) {
+	    callbacks->property(line, name_len, params, params_len,
+				value, (size_t)(line + len - value), data);
+	}
+    }
+
+    free(reader.buf);
 
+    /* Stopping before the end of the string means the buffer for a folded
+       line couldn't be allocated. */
+    return *reader.pos == '\0';
 }
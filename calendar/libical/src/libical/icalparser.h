@@ -81,6 +81,37 @@ void icalparser_set_gen_data(icalparser* parser, void* data);
 icalcomponent* icalparser_parse_string(const char* str);
 
 
+/**
+ * Event driven scanning. icalparser_scan_string walks through the content
+ * lines of the string and calls back for the start and end of every
+ * component and for every property, without creating any components,
+ * properties, parameters or values. Names, parameters and values are not
+ * NUL-terminated and values are not unescaped; they point into the string
+ * unless the line was folded, in which case they are only valid during the
+ * callback. Callbacks may be NULL.
+ */
+
+typedef struct icalparser_scan_callbacks {
+    /** Called for BEGIN lines; offset is where the line starts in str. */
+    void (*begin_component)(const char *name, size_t name_len,
+			    size_t offset, void *data);
+    /** Called for END lines; offset is just past the end of the line. */
+    void (*end_component)(const char *name, size_t name_len,
+			  size_t offset, void *data);
+    /** Called for all other lines. params runs from the first ';' after
+	the name up to the ':' before the value, and is empty if there are
+	no parameters. */
+    void (*property)(const char *name, size_t name_len,
+		     const char *params, size_t params_len,
+		     const char *value, size_t value_len, void *data);
+} icalparser_scan_callbacks;
+
+/** Returns 1 if the whole string was scanned, 0 if memory ran out. */
+int icalparser_scan_string(const char *str,
+			   const icalparser_scan_callbacks *callbacks,
+			   void *data);
+
+
 /***********************************************************************
  * Parser support functions
  ***********************************************************************/
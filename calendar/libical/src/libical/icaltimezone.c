@@ -46,6 +46,7 @@
 #endif
 
 #include <sys/stat.h>
+#include <stdint.h>
 
 #ifdef WIN32
 #include <mbstring.h>
@@ -112,6 +113,29 @@ struct _icaltimezonechange {
 };
 
 
+/** The changes of a timezone in the form used to look up UTC offsets. Each
+    change is reduced to keys which compare the same way as the fields of an
+    icaltimezonechange do, so a lookup is a single binary search over one of
+    the key arrays:
+
+    utc_keys		When the change came into effect, in UTC.
+    local_keys		The first local time the change applies to. If the
+			clock goes back this is the first repeated local
+			time, otherwise the time the clock is set forward at.
+    overlap_end_keys	For changes setting the clock back, the end of the
+			repeated local times, when the previous change may
+			apply instead. For other changes it is local_keys.
+*/
+struct _icaltimezonetransitions {
+    int		 num_transitions;
+    int64_t	*utc_keys;
+    int64_t	*local_keys;
+    int64_t	*overlap_end_keys;
+    int		*utc_offsets;
+    int		*is_daylight;
+};
+
+
 /** An array of icaltimezones for the builtin timezones. */
 static icalarray *s_builtin_timezones = NULL;
 
@@ -131,8 +155,14 @@ static void  icaltimezone_expand_vtimezone	(icalcomponent	*comp,
 static int   icaltimezone_compare_change_fn	(const void	*elem1,
 						 const void	*elem2);
 
-static int   icaltimezone_find_nearby_change	(icaltimezone *zone,
-						 icaltimezonechange *change);
+static icaltimezonetransitions* icaltimezone_get_transitions (icaltimezone *zone);
+static void  icaltimezone_free_transitions	(icaltimezonetransitions *transitions);
+static int   icaltimezone_lookup_utc_offset	(const icaltimezonetransitions *transitions,
+						 const struct icaltimetype *tt,
+						 int		*is_daylight);
+static int   icaltimezone_lookup_utc_offset_of_utc_time (const icaltimezonetransitions *transitions,
+						 const struct icaltimetype *tt,
+						 int		*is_daylight);
 
 static void  icaltimezone_adjust_change		(icaltimezonechange *tt,
 						 int		 days,
@@ -204,6 +234,8 @@ icaltimezone_copy			(icaltimezone *originalzone)
 	zone->tznames = strdup (zone->tznames);
     if (zone->changes != NULL)
         zone->changes = icalarray_copy(zone->changes);
+    /* The copy builds its own transitions when it is first used. */
+    zone->transitions = NULL;
     
     /* Let the caller set the component because then they will
        know to be careful not to free this reference twice. */
@@ -237,6 +269,8 @@ icaltimezone_reset			(icaltimezone *zone)
 		icalcomponent_free (zone->component);
     if (zone->changes)
 		icalarray_free (zone->changes);
+    if (zone->transitions)
+		icaltimezone_free_transitions (zone->transitions);
 	
     icaltimezone_init (zone);
 }
@@ -255,6 +289,7 @@ icaltimezone_init			(icaltimezone	*zone)
     zone->builtin_timezone = NULL;
     zone->end_year = 0;
     zone->changes = NULL;
+    zone->transitions = NULL;
 }
 
 
@@ -469,7 +504,11 @@ icaltimezone_ensure_coverage		(icaltimezone *zone,
     if (changes_end_year > ICALTIMEZONE_MAX_YEAR)
 	changes_end_year = ICALTIMEZONE_MAX_YEAR;
 
-    if (!zone->changes || zone->end_year < end_year)
+    /* Nothing is expanded past ICALTIMEZONE_MAX_YEAR, so there is no point
+       in expanding again for times after it. */
+    if (!zone->changes
+	|| (zone->end_year < end_year
+	    && zone->end_year < ICALTIMEZONE_MAX_YEAR))
 	icaltimezone_expand_changes (zone, changes_end_year);
 }
 
@@ -781,11 +820,6 @@ icaltimezone_get_utc_offset		(icaltimezone	*zone,
 					 struct icaltimetype	*tt,
 					 int		*is_daylight)
 {
-    icaltimezonechange *zone_change, *prev_zone_change, tt_change, tmp_change;
-    int change_num, step, utc_offset_change, cmp;
-    int change_num_to_use;
-    int want_daylight;
-
     if (tt == NULL)
 	return 0;
 
@@ -796,264 +830,274 @@ icaltimezone_get_utc_offset		(icaltimezone	*zone,
     if (zone == NULL || zone == &utc_timezone)
 	return 0;
 
-    /* Use the builtin icaltimezone if possible. */
-    if (zone->builtin_timezone)
-	zone = zone->builtin_timezone;
+    return icaltimezone_lookup_utc_offset (icaltimezone_get_transitions (zone),
+					   tt, is_daylight);
+}
 
-    /* Make sure the changes array is expanded up to the given time. */
-    icaltimezone_ensure_coverage (zone, tt->year);
 
-    if (!zone->changes || zone->changes->num_elements == 0)
+/** @deprecated This API wasn't updated when we changed icaltimetype to contain its own
+    timezone. Also, this takes a pointer instead of the struct. */
+/** Calculates the UTC offset of a given UTC time in the given
+   timezone.  It is the number of seconds to add to UTC to get local
+   time.  The is_daylight flag is set to 1 if the time is in
+   daylight-savings time. */
+int
+icaltimezone_get_utc_offset_of_utc_time	(icaltimezone	*zone,
+					 struct icaltimetype	*tt,
+					 int		*is_daylight)
+{
+    if (is_daylight)
+	*is_daylight = 0;
+
+    /* For local times and UTC return 0. */
+    if (zone == NULL || zone == &utc_timezone)
 	return 0;
 
-    /* Copy the time parts of the icaltimetype to an icaltimezonechange so we
-       can use our comparison function on it. */
-    tt_change.year   = tt->year;
-    tt_change.month  = tt->month;
-    tt_change.day    = tt->day;
-    tt_change.hour   = tt->hour;
-    tt_change.minute = tt->minute;
-    tt_change.second = tt->second;
-
-    /* This should find a change close to the time, either the change before
-       it or the change after it. */
-    change_num = icaltimezone_find_nearby_change (zone, &tt_change);
-
-    /* Sanity check. */
-    icalerror_assert (change_num >= 0,
-		      "Negative timezone change index");
-    icalerror_assert (change_num < zone->changes->num_elements,
-		      "Timezone change index out of bounds");
-
-    /* Now move backwards or forwards to find the timezone change that applies
-       to tt. It should only have to do 1 or 2 steps. */
-    zone_change = icalarray_element_at (zone->changes, change_num);
-    step = 1;
-    change_num_to_use = -1;
-    for (;;) {
-	/* Copy the change, so we can adjust it. */
-	tmp_change = *zone_change;
-
-	/* If the clock is going backward, check if it is in the region of time
-	   that is used twice. If it is, use the change with the daylight
-	   setting which matches tt, or use standard if we don't know. */
-	if (tmp_change.utc_offset < tmp_change.prev_utc_offset) {
-	    /* If the time change is at 2:00AM local time and the clock is
-	       going back to 1:00AM we adjust the change to 1:00AM. We may
-	       have the wrong change but we'll figure that out later. */
-	    icaltimezone_adjust_change (&tmp_change, 0, 0, 0,
-					tmp_change.utc_offset);
-	} else {
-	    icaltimezone_adjust_change (&tmp_change, 0, 0, 0,
-					tmp_change.prev_utc_offset);
-	}
+    return icaltimezone_lookup_utc_offset_of_utc_time (
+	icaltimezone_get_transitions (zone), tt, is_daylight);
+}
 
-	cmp = icaltimezone_compare_change_fn (&tt_change, &tmp_change);
 
-	/* If the given time is on or after this change, then this change may
-	   apply, but we continue as a later change may be the right one.
-	   If the given time is before this change, then if we have already
-	   found a change which applies we can use that, else we need to step
-	   backwards. */
-	if (cmp >= 0)
-	    change_num_to_use = change_num;
-	else
-	    step = -1;
+/** Converts count times from from_zone to to_zone, in place. This gives the
+   same results as calling icaltimezone_convert_time() on each of them, but
+   only looks up the timezones' transitions once. */
+void
+icaltimezone_convert_times		(struct icaltimetype *tts,
+					 size_t		 count,
+					 icaltimezone *from_zone,
+					 icaltimezone *to_zone)
+{
+    const icaltimezonetransitions *from_transitions = NULL;
+    const icaltimezonetransitions *to_transitions = NULL;
+    int utc_offset, is_daylight;
+    size_t i;
 
-	/* If we are stepping backwards through the changes and we have found
-	   a change that applies, then we know this is the change to use so
-	   we exit the loop. */
-	if (step == -1 && change_num_to_use != -1)
-	    break;
+    if (from_zone == to_zone || from_zone == NULL)
+	return;
 
-	change_num += step;
+    if (from_zone != &utc_timezone)
+	from_transitions = icaltimezone_get_transitions (from_zone);
+    if (to_zone != NULL && to_zone != &utc_timezone)
+	to_transitions = icaltimezone_get_transitions (to_zone);
 
-	/* If we go past the start of the changes array, then we have no data
-	   for this time so we return a UTC offset of 0. */
-	if (change_num < 0)
-	    return 0;
+    for (i = 0; i < count; i++) {
+	struct icaltimetype *tt = &tts[i];
 
-	if ((unsigned int)change_num >= zone->changes->num_elements)
-	    break;
+	if (icaltime_is_date(*tt))
+	    continue;
 
-	zone_change = icalarray_element_at (zone->changes, change_num);
+	utc_offset = from_transitions
+	    ? icaltimezone_lookup_utc_offset (from_transitions, tt, NULL)
+	    : 0;
+	icaltime_adjust (tt, 0, 0, 0, -utc_offset);
+
+	is_daylight = 0;
+	utc_offset = to_transitions
+	    ? icaltimezone_lookup_utc_offset_of_utc_time (to_transitions, tt,
+							  &is_daylight)
+	    : 0;
+	tt->is_daylight = is_daylight;
+	icaltime_adjust (tt, 0, 0, 0, utc_offset);
     }
+}
 
-    /* If we didn't find a change to use, then we have a bug! */
-    icalerror_assert (change_num_to_use != -1,
-		      "No applicable timezone change found");
-
-    /* Now we just need to check if the time is in the overlapped region of
-       time when clocks go back. */
-    zone_change = icalarray_element_at (zone->changes, change_num_to_use);
-
-    utc_offset_change = zone_change->utc_offset - zone_change->prev_utc_offset;
-    if (utc_offset_change < 0 && change_num_to_use > 0) {
-	tmp_change = *zone_change;
-	icaltimezone_adjust_change (&tmp_change, 0, 0, 0,
-				    tmp_change.prev_utc_offset);
-
-	if (icaltimezone_compare_change_fn (&tt_change, &tmp_change) < 0) {
-	    /* The time is in the overlapped region, so we may need to use
-	       either the current zone_change or the previous one. If the
-	       time has the is_daylight field set we use the matching change,
-	       else we use the change with standard time. */
-	    prev_zone_change = icalarray_element_at (zone->changes,
-						     change_num_to_use - 1);
-
-	    /* I was going to add an is_daylight flag to struct icaltimetype,
-	       but iCalendar doesn't let us distinguish between standard and
-	       daylight time anyway, so there's no point. So we just use the
-	       standard time instead. */
-	    want_daylight = (tt->is_daylight == 1) ? 1 : 0;
 
-#if 0
-	    if (zone_change->is_daylight == prev_zone_change->is_daylight)
-		printf (" **** Same is_daylight setting\n");
-#endif
+/** Returns a key for the time in tt which orders times the same way as
+   icaltimezone_compare_change_fn() does. */
+static int64_t
+icaltimezone_time_key			(int		 year,
+					 int		 month,
+					 int		 day,
+					 int		 hour,
+					 int		 minute,
+					 int		 second)
+{
+    return (((((int64_t) year * 16 + month) * 32 + day) * 32 + hour) * 64
+	    + minute) * 64 + second;
+}
 
-	    if (zone_change->is_daylight != want_daylight
-		&& prev_zone_change->is_daylight == want_daylight)
-		zone_change = prev_zone_change;
-	}
-    }
 
-    /* Now we know exactly which timezone change applies to the time, so
-       we can return the UTC offset and whether it is a daylight time. */
-    if (is_daylight)
-	*is_daylight = zone_change->is_daylight;
-    return zone_change->utc_offset;
+static int64_t
+icaltimezone_change_key			(const icaltimezonechange *change)
+{
+    return icaltimezone_time_key (change->year, change->month, change->day,
+				  change->hour, change->minute,
+				  change->second);
 }
 
 
-/** @deprecated This API wasn't updated when we changed icaltimetype to contain its own
-    timezone. Also, this takes a pointer instead of the struct. */
-/** Calculates the UTC offset of a given UTC time in the given
-   timezone.  It is the number of seconds to add to UTC to get local
-   time.  The is_daylight flag is set to 1 if the time is in
-   daylight-savings time. */
-int
-icaltimezone_get_utc_offset_of_utc_time	(icaltimezone	*zone,
-					 struct icaltimetype	*tt,
-					 int		*is_daylight)
+/** Returns the index of the last of the num sorted keys which is less than
+   or equal to key, or -1 if they are all greater. */
+static int
+icaltimezone_find_last_key		(const int64_t	*keys,
+					 int		 num,
+					 int64_t	 key)
 {
-    icaltimezonechange *zone_change, tt_change, tmp_change;
-    int change_num, step, change_num_to_use;
+    int lower, upper, middle;
 
-    if (is_daylight)
-	*is_daylight = 0;
+    lower = 0;
+    upper = num;
+    while (lower < upper) {
+	middle = lower + (upper - lower) / 2;
+	if (keys[middle] <= key)
+	    lower = middle + 1;
+	else
+	    upper = middle;
+    }
+
+    return lower - 1;
+}
 
-    /* For local times and UTC return 0. */
-    if (zone == NULL || zone == &utc_timezone)
-	return 0;
+
+/** Returns the transitions of the zone, building them the first time. All
+   the changes up to ICALTIMEZONE_MAX_YEAR are expanded before building them,
+   so they never need to be rebuilt for a later time and can be read without
+   any further checks. Returns NULL if the changes couldn't be expanded. */
+static icaltimezonetransitions*
+icaltimezone_get_transitions		(icaltimezone	*zone)
+{
+    icaltimezonetransitions *transitions;
+    icaltimezonechange *change, tmp_change;
+    int num, i;
 
     /* Use the builtin icaltimezone if possible. */
     if (zone->builtin_timezone)
 	zone = zone->builtin_timezone;
 
-    /* Make sure the changes array is expanded up to the given time. */
-    icaltimezone_ensure_coverage (zone, tt->year);
+    if (zone->transitions)
+	return zone->transitions;
 
-    if (!zone->changes || zone->changes->num_elements == 0)
-	return 0;
+    icaltimezone_ensure_coverage (zone, ICALTIMEZONE_MAX_YEAR);
+    if (!zone->changes)
+	return NULL;
 
-    /* Copy the time parts of the icaltimetype to an icaltimezonechange so we
-       can use our comparison function on it. */
-    tt_change.year   = tt->year;
-    tt_change.month  = tt->month;
-    tt_change.day    = tt->day;
-    tt_change.hour   = tt->hour;
-    tt_change.minute = tt->minute;
-    tt_change.second = tt->second;
-
-    /* This should find a change close to the time, either the change before
-       it or the change after it. */
-    change_num = icaltimezone_find_nearby_change (zone, &tt_change);
-
-    /* Sanity check. */
-    icalerror_assert (change_num >= 0,
-		      "Negative timezone change index");
-    icalerror_assert (change_num < zone->changes->num_elements,
-		      "Timezone change index out of bounds");
-
-    /* Now move backwards or forwards to find the timezone change that applies
-       to tt. It should only have to do 1 or 2 steps. */
-    zone_change = icalarray_element_at (zone->changes, change_num);
-    step = 1;
-    change_num_to_use = -1;
-    for (;;) {
-	/* Copy the change and adjust it to UTC. */
-	tmp_change = *zone_change;
-
-	/* If the given time is on or after this change, then this change may
-	   apply, but we continue as a later change may be the right one.
-	   If the given time is before this change, then if we have already
-	   found a change which applies we can use that, else we need to step
-	   backwards. */
-	if (icaltimezone_compare_change_fn (&tt_change, &tmp_change) >= 0)
-	    change_num_to_use = change_num;
-	else
-	    step = -1;
+    num = zone->changes->num_elements;
+    transitions = (icaltimezonetransitions*) malloc (sizeof (icaltimezonetransitions));
+    if (!transitions) {
+	icalerror_set_errno (ICAL_NEWFAILED_ERROR);
+	return NULL;
+    }
+    transitions->num_transitions = num;
+    transitions->utc_keys = (int64_t*) malloc ((num ? num : 1) * 3 * sizeof (int64_t));
+    transitions->utc_offsets = (int*) malloc ((num ? num : 1) * 2 * sizeof (int));
+    if (!transitions->utc_keys || !transitions->utc_offsets) {
+	icaltimezone_free_transitions (transitions);
+	icalerror_set_errno (ICAL_NEWFAILED_ERROR);
+	return NULL;
+    }
+    transitions->local_keys = transitions->utc_keys + num;
+    transitions->overlap_end_keys = transitions->local_keys + num;
+    transitions->is_daylight = transitions->utc_offsets + num;
+
+    for (i = 0; i < num; i++) {
+	change = icalarray_element_at (zone->changes, i);
+	transitions->utc_keys[i] = icaltimezone_change_key (change);
+	transitions->utc_offsets[i] = change->utc_offset;
+	transitions->is_daylight[i] = change->is_daylight;
+
+	/* If the time change is at 2:00AM local time and the clock is going
+	   back to 1:00AM, the change applies from 1:00AM, and times up to
+	   2:00AM may be in either the previous change or this one. */
+	tmp_change = *change;
+	if (change->utc_offset < change->prev_utc_offset) {
+	    icaltimezone_adjust_change (&tmp_change, 0, 0, 0,
+					change->utc_offset);
+	    transitions->local_keys[i] = icaltimezone_change_key (&tmp_change);
 
-	/* If we are stepping backwards through the changes and we have found
-	   a change that applies, then we know this is the change to use so
-	   we exit the loop. */
-	if (step == -1 && change_num_to_use != -1)
-	    break;
+	    tmp_change = *change;
+	    icaltimezone_adjust_change (&tmp_change, 0, 0, 0,
+					change->prev_utc_offset);
+	    transitions->overlap_end_keys[i] =
+		icaltimezone_change_key (&tmp_change);
+	} else {
+	    icaltimezone_adjust_change (&tmp_change, 0, 0, 0,
+					change->prev_utc_offset);
+	    transitions->local_keys[i] = icaltimezone_change_key (&tmp_change);
+	    transitions->overlap_end_keys[i] = transitions->local_keys[i];
+	}
+    }
 
-	change_num += step;
+    zone->transitions = transitions;
+    return transitions;
+}
 
-	/* If we go past the start of the changes array, then we have no data
-	   for this time so we return a UTC offset of 0. */
-	if (change_num < 0)
-	    return 0;
 
-	if ((unsigned int)change_num >= zone->changes->num_elements)
-	    break;
+static void
+icaltimezone_free_transitions		(icaltimezonetransitions *transitions)
+{
+    if (transitions->utc_keys)
+	free (transitions->utc_keys);
+    if (transitions->utc_offsets)
+	free (transitions->utc_offsets);
+    free (transitions);
+}
 
-	zone_change = icalarray_element_at (zone->changes, change_num);
-    }
 
-    /* If we didn't find a change to use, then we have a bug! */
-    icalerror_assert (change_num_to_use != -1,
-		      "No applicable timezone change found");
+/** Calculates the UTC offset of the local time in tt from the transitions
+   of a timezone. */
+static int
+icaltimezone_lookup_utc_offset		(const icaltimezonetransitions *transitions,
+					 const struct icaltimetype *tt,
+					 int		*is_daylight)
+{
+    int64_t tt_key;
+    int change_num;
+    int want_daylight;
 
-    /* Now we know exactly which timezone change applies to the time, so
-       we can return the UTC offset and whether it is a daylight time. */
-    zone_change = icalarray_element_at (zone->changes, change_num_to_use);
-    if (is_daylight)
-	*is_daylight = zone_change->is_daylight;
+    if (!transitions || transitions->num_transitions == 0)
+	return 0;
 
-    return zone_change->utc_offset;
+    tt_key = icaltimezone_time_key (tt->year, tt->month, tt->day,
+				    tt->hour, tt->minute, tt->second);
+
+    /* Find the last change which applies to the time. If there is none we
+       have no data for this time so we return a UTC offset of 0. */
+    change_num = icaltimezone_find_last_key (transitions->local_keys,
+					     transitions->num_transitions,
+					     tt_key);
+    if (change_num < 0)
+	return 0;
+
+    /* Now we just need to check if the time is in the overlapped region of
+       time when clocks go back. If it is, we use the change with the
+       daylight setting which matches tt, or standard if we don't know;
+       iCalendar doesn't let us distinguish between standard and daylight
+       time anyway. */
+    if (change_num > 0 && tt_key < transitions->overlap_end_keys[change_num]) {
+	want_daylight = (tt->is_daylight == 1) ? 1 : 0;
+	if (transitions->is_daylight[change_num] != want_daylight
+	    && transitions->is_daylight[change_num - 1] == want_daylight)
+	    change_num--;
+    }
+
+    if (is_daylight)
+	*is_daylight = transitions->is_daylight[change_num];
+    return transitions->utc_offsets[change_num];
 }
 
 
-/** Returns the index of a timezone change which is close to the time
-   given in change. */
+/** Calculates the UTC offset of the UTC time in tt from the transitions of
+   a timezone. */
 static int
-icaltimezone_find_nearby_change		(icaltimezone	*zone,
-					 icaltimezonechange	*change)
+icaltimezone_lookup_utc_offset_of_utc_time (const icaltimezonetransitions *transitions,
+					    const struct icaltimetype *tt,
+					    int		*is_daylight)
 {
-    icaltimezonechange *zone_change;
-    int lower, upper, middle, cmp;
-					 
-    /* Do a simple binary search. */
-    lower = middle = 0;
-    upper = zone->changes->num_elements;
+    int change_num;
 
-    while (lower < upper) {
-	middle = (lower + upper) / 2;
-	zone_change = icalarray_element_at (zone->changes, middle);
-	cmp = icaltimezone_compare_change_fn (change, zone_change);
-	if (cmp == 0)
-	    break;
-	else if (cmp < 0)
-	    upper = middle;
-	else
-	    lower = middle + 1;
-    }
+    if (!transitions || transitions->num_transitions == 0)
+	return 0;
+
+    change_num = icaltimezone_find_last_key (
+	transitions->utc_keys, transitions->num_transitions,
+	icaltimezone_time_key (tt->year, tt->month, tt->day,
+			       tt->hour, tt->minute, tt->second));
+    if (change_num < 0)
+	return 0;
 
-    return middle;
+    if (is_daylight)
+	*is_daylight = transitions->is_daylight[change_num];
+    return transitions->utc_offsets[change_num];
 }
 
 
@@ -123,6 +123,13 @@ void	icaltimezone_convert_time		(struct icaltimetype *tt,
 						 icaltimezone *from_zone,
 						 icaltimezone *to_zone);
 
+/** Converts count times from from_zone to to_zone, in place, looking up
+   the timezone data only once for all of them. */
+void	icaltimezone_convert_times		(struct icaltimetype *tts,
+						 size_t		 count,
+						 icaltimezone *from_zone,
+						 icaltimezone *to_zone);
+
 
 /**
  * @par Getting offsets from UTC.
@@ -35,6 +35,8 @@
 #include "icalcomponent.h"
 #include "icalarray.h"
 
+typedef struct _icaltimezonetransitions icaltimezonetransitions;
+
 struct _icaltimezone {
     char		*tzid;
     /**< The unique ID of this timezone,
@@ -81,6 +83,12 @@ struct _icaltimezone {
     /**< A dynamically-allocated array of time zone changes, sorted by the
        time of the change in local time. So we can do fast binary-searches
        to convert from local time to UTC. */
+
+    icaltimezonetransitions *transitions;
+    /**< The changes above flattened into sorted arrays of keys, built once
+       the changes have been expanded up to ICALTIMEZONE_MAX_YEAR. It is
+       never modified after that, so converting times only has to
+       binary-search it. */
 };
 
 
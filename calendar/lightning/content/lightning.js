@@ -159,6 +159,14 @@ pref("calendar.item.useNewItemUI", false);
 // Always use the currently selected calendar as target for paste operations
 pref("calendar.paste.intoSelectedCalendar", false);
 
+// Events and completed tasks of read-only ICS calendars that ended more than
+// this many days ago are left out when the calendar is loaded, without being
+// parsed. Recurring items are always kept. -1 loads everything.
+pref("calendar.ics.readOnly.pastDays", -1);
+
+// The same for importing ICS files. By default everything is imported.
+pref("calendar.import.ics.pastDays", -1);
+
 // Backend to use. false: libical, true: ical.js
 #ifdef NIGHTLY_BUILD
 pref("calendar.icaljs", true);
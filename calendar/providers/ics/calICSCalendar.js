@@ -37,6 +37,8 @@ function calICSCalendar() {
     this.unmappedProperties = [];
     this.queue = [];
     this.mModificationActions = [];
+    this.mLoadedInRange = false;
+    this.mFullLoadPending = false;
 }
 var calICSCalendarClassID = Components.ID("{f8438bff-a3c9-4ed5-b23f-2663b5469abf}");
 var calICSCalendarInterfaces = [
@@ -256,6 +258,18 @@ calICSCalendar.prototype = {
         let parser = Cc["@mozilla.org/calendar/ics-parser;1"]
                        .createInstance(Ci.calIIcsParser);
         let self = this;
+
+        // Read-only calendars are not written back, so they can leave out
+        // the items that are long past. Those are not even parsed. If the
+        // calendar is changed later, all of it is loaded first.
+        let rangeStart = null;
+        let pastDays = Preferences.get("calendar.ics.readOnly.pastDays", -1);
+        if (this.readOnly && pastDays >= 0) {
+            rangeStart = cal.dtz.now();
+            rangeStart.day -= pastDays;
+        }
+        this.mLoadedInRange = !!rangeStart;
+
         let listener = { // calIIcsParsingListener
             onParsingComplete: function(rc, parser_) {
                 try {
@@ -281,7 +295,7 @@ calICSCalendar.prototype = {
                 self.unlock();
             }
         };
-        parser.parseString(str, null, listener);
+        parser.parseString(str, null, listener, rangeStart, null);
     },
 
     writeICS: function() {
@@ -518,7 +532,26 @@ calICSCalendar.prototype = {
         let a;
         let writeICS = false;
         let refreshAction = null;
+        // If a full load was asked for and the calendar is still partially
+        // loaded, that load failed.
+        let fullLoadFailed = this.mFullLoadPending;
+        this.mFullLoadPending = false;
         while ((a = this.queue.shift())) {
+            if (this.mLoadedInRange &&
+                (a.action == "add" || a.action == "modify" || a.action == "delete")) {
+                if (fullLoadFailed) {
+                    this.failModification(a);
+                    continue;
+                }
+                // The calendar was loaded while read-only, without its past
+                // items. Load all of it before changing it, so that writing
+                // it back doesn't lose them.
+                cal.LOG("[calICSCalendar] Loading all of " + this.name + " before changing it");
+                this.queue.unshift(a);
+                refreshAction = { action: "refresh", forceRefresh: true };
+                this.mFullLoadPending = true;
+                break;
+            }
             switch (a.action) {
                 case "add":
                     this.mMemoryCalendar.addItem(a.item, new modListener(a));
@@ -568,6 +601,31 @@ calICSCalendar.prototype = {
         }
     },
 
+    failModification: function(aAction) {
+        let item, operation;
+        switch (aAction.action) {
+            case "add":
+                item = aAction.item;
+                operation = Ci.calIOperationListener.ADD;
+                break;
+            case "modify":
+                item = aAction.newItem;
+                operation = Ci.calIOperationListener.MODIFY;
+                break;
+            case "delete":
+                item = aAction.item;
+                operation = Ci.calIOperationListener.DELETE;
+                break;
+        }
+        let message = "The calendar could not be loaded completely before changing it.";
+        this.mObserver.onError(this.superCalendar, calIErrors.MODIFICATION_FAILED, message);
+        if (aAction.listener) {
+            aAction.listener.onOperationComplete(this.superCalendar,
+                                                 calIErrors.MODIFICATION_FAILED,
+                                                 operation, item.id, message);
+        }
+    },
+
     lock: function() {
         this.locked = true;
     },
@@ -0,0 +1,192 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+ * Parsing only the items of an ICS string that can occur in a range, also
+ * through calIIcsParser as the ICS provider and the importer do. Also
+ * measures parsing throughput and memory use for a large calendar, with and
+ * without a range.
+ */
+
+function run_test() {
+    do_calendar_startup(really_run_test);
+}
+
+function really_run_test() {
+    test_range();
+    test_throughput();
+    test_parser_range();
+}
+
+function uids(aComponent) {
+    let result = [];
+    for (let kind of ["VEVENT", "VTODO"]) {
+        let item = aComponent.getFirstSubcomponent(kind);
+        for (; item; item = aComponent.getNextSubcomponent(kind)) {
+            result.push(item.getFirstProperty("UID").value);
+        }
+    }
+    return result.sort();
+}
+
+var gRangeIcs = [
+    "BEGIN:VCALENDAR",
+    "PRODID:-//Test//EN",
+    "VERSION:2.0",
+    "BEGIN:VTIMEZONE",
+    "TZID:Europe/Berlin",
+    "BEGIN:STANDARD",
+    "DTSTART:19701025T030000",
+    "TZOFFSETFROM:+0200",
+    "TZOFFSETTO:+0100",
+    "RRULE:FREQ=YEARLY;BYDAY=-1SU;BYMONTH=10",
+    "END:STANDARD",
+    "END:VTIMEZONE",
+    // Before, in and after the range.
+    "BEGIN:VEVENT", "UID:before", "DTSTART:20190501T100000Z",
+    "DTEND:20190501T110000Z", "END:VEVENT",
+    "BEGIN:VEVENT", "UID:inside", "DTSTART:20190610T100000Z",
+    "DTEND:20190610T110000Z", "END:VEVENT",
+    "BEGIN:VEVENT", "UID:after", "DTSTART:20190801T100000Z",
+    "DURATION:PT1H", "END:VEVENT",
+    // Starting before the range and ending in it.
+    "BEGIN:VEVENT", "UID:overlapping", "DTSTART:20190520T100000Z",
+    "DTEND:20190602T000000Z", "END:VEVENT",
+    // An all day event shortly before the range, with a long summary
+    // folded over two lines.
+    "BEGIN:VEVENT", "UID:allday", "DTSTART;VALUE=DATE:20190530",
+    "SUMMARY:a summary that goes on and on and on and on and on and on and",
+    "  on and on", "END:VEVENT",
+    // A local time near the start of the range is kept, one far from it
+    // isn't.
+    "BEGIN:VEVENT", "UID:local-near",
+    "DTSTART;TZID=Europe/Berlin:20190601T010000", "END:VEVENT",
+    "BEGIN:VEVENT", "UID:local-far",
+    "DTSTART;TZID=Europe/Berlin:20190520T010000", "END:VEVENT",
+    // Recurring items and exceptions are always kept.
+    "BEGIN:VEVENT", "UID:recurring", "DTSTART:20100101T100000Z",
+    "RRULE:FREQ=YEARLY", "END:VEVENT",
+    "BEGIN:VEVENT", "UID:exception", "DTSTART:20100102T100000Z",
+    "RECURRENCE-ID:20100101T100000Z", "END:VEVENT",
+    // Completed tasks are placed by their due date, open and undated ones
+    // are always kept.
+    "BEGIN:VTODO", "UID:task-due-before", "DUE:20190101T000000Z",
+    "STATUS:COMPLETED", "END:VTODO",
+    "BEGIN:VTODO", "UID:task-open-before", "DTSTART:20180101T000000Z",
+    "END:VTODO",
+    "BEGIN:VTODO", "UID:task-due-inside", "DUE:20190615T000000Z",
+    "END:VTODO",
+    "BEGIN:VTODO", "UID:task-undated", "END:VTODO",
+    "END:VCALENDAR", ""
+].join("\r\n");
+
+var gInRangeUids = ["exception", "inside", "local-near", "overlapping",
+                    "recurring", "task-due-inside", "task-open-before",
+                    "task-undated"];
+
+function test_range() {
+    let ics = gRangeIcs;
+    let svc = cal.getIcsService();
+    let june = createDate(2019, 5, 1);
+    let july = createDate(2019, 6, 1);
+
+    let all = svc.parseICS(ics, null);
+    equal(uids(all).length, 13);
+    deepEqual(uids(svc.parseICSInRange(ics, null, null, null)), uids(all));
+
+    let inRange = svc.parseICSInRange(ics, null, june, july);
+    deepEqual(uids(inRange), gInRangeUids);
+    equal(inRange.getFirstSubcomponent("VTIMEZONE").getFirstProperty("TZID").value,
+          "Europe/Berlin");
+    equal(inRange.getFirstProperty("PRODID").value, "-//Test//EN");
+
+    // Open ranges only bound one side.
+    deepEqual(uids(svc.parseICSInRange(ics, null, null, june)),
+              ["allday", "before", "exception", "local-far", "local-near",
+               "overlapping", "recurring", "task-due-before", "task-open-before",
+               "task-undated"]);
+    ok(uids(svc.parseICSInRange(ics, null, july, null)).includes("after"));
+    ok(!uids(svc.parseICSInRange(ics, null, july, null)).includes("inside"));
+}
+
+function memoryUsage() {
+    try {
+        let manager = Components.classes["@mozilla.org/memory-reporter-manager;1"]
+                                .getService(Components.interfaces.nsIMemoryReporterManager);
+        return "resident " + Math.round(manager.resident / 1048576) + "MB, " +
+               "peak " + Math.round(manager.residentPeak / 1048576) + "MB";
+    } catch (e) {
+        return "memory use not available";
+    }
+}
+
+function test_throughput() {
+    const kEvents = 50000;
+    let lines = ["BEGIN:VCALENDAR", "PRODID:-//Test//EN", "VERSION:2.0"];
+    let base = cal.createDateTime("20100101T090000Z");
+    for (let i = 0; i < kEvents; i++) {
+        let start = base.clone();
+        start.nativeTime = base.nativeTime + (i * 3600 * 7) * 1000000;
+        lines.push("BEGIN:VEVENT", "UID:event-" + i,
+                   "SUMMARY:Event number " + i,
+                   "DESCRIPTION:A description that is long enough to be folded",
+                   " over more than one line when it is written",
+                   "DTSTART:" + start.icalString, "DURATION:PT1H",
+                   "END:VEVENT");
+    }
+    lines.push("END:VCALENDAR", "");
+    let ics = lines.join("\r\n");
+    let megabytes = ics.length / 1048576;
+
+    let svc = cal.getIcsService();
+    let rangeStart = createDate(2012, 0, 1);
+    let rangeEnd = createDate(2012, 1, 1);
+    let expected = null;
+    for (let round = 0; round < 3; round++) {
+        let start = Date.now();
+        let all = svc.parseICS(ics, null);
+        let elapsed = Math.max(Date.now() - start, 1);
+        equal(uids(all).length, kEvents);
+        info("Parsed " + megabytes.toFixed(1) + "MB in " + elapsed + "ms (" +
+             (megabytes * 1000 / elapsed).toFixed(1) + "MB/s), " + memoryUsage());
+        all = null;
+
+        start = Date.now();
+        let month = svc.parseICSInRange(ics, null, rangeStart, rangeEnd);
+        elapsed = Math.max(Date.now() - start, 1);
+        let count = uids(month).length;
+        info("Parsed one month out of " + megabytes.toFixed(1) + "MB in " +
+             elapsed + "ms (" + (megabytes * 1000 / elapsed).toFixed(1) +
+             "MB/s, " + count + " events), " + memoryUsage());
+        if (expected === null) {
+            expected = count;
+        }
+        equal(count, expected);
+    }
+    // Events start every seven hours, 31 days of them fall in January, plus
+    // the one ending just after the range starts.
+    ok(expected >= Math.floor(31 * 24 / 7) && expected <= Math.ceil(31 * 24 / 7) + 1);
+}
+
+function test_parser_range() {
+    let june = createDate(2019, 5, 1);
+    let july = createDate(2019, 6, 1);
+    let itemIds = parser => parser.getItems({}).map(item => item.id).sort();
+
+    let parser = Cc["@mozilla.org/calendar/ics-parser;1"]
+                   .createInstance(Ci.calIIcsParser);
+    parser.parseString(gRangeIcs, null, null, june, july);
+    deepEqual(itemIds(parser), gInRangeUids);
+
+    do_test_pending();
+    let asyncParser = Cc["@mozilla.org/calendar/ics-parser;1"]
+                        .createInstance(Ci.calIIcsParser);
+    asyncParser.parseString(gRangeIcs, null, {
+        onParsingComplete: function(rc, aParser) {
+            equal(rc, Cr.NS_OK);
+            deepEqual(itemIds(aParser), gInRangeUids);
+            do_test_finished();
+        }
+    }, june, july);
+}
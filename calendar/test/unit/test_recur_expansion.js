@@ -0,0 +1,114 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+ * Expanding rules that started long before the range that is asked for must
+ * give the same occurrences as expanding from the start, also after the rule
+ * changed, and when the occurrences stop fitting into the cache in the middle
+ * of the range. Also measures how long it takes to fill a month view with 5,000
+ * recurring events.
+ */
+
+// Rules and how many times they occur in June 2019.
+var kRules = [
+    ["RRULE:FREQ=DAILY\nDTSTART:20050103T100000Z\n", 30],
+    ["RRULE:FREQ=WEEKLY;BYDAY=MO,WE,FR\nDTSTART:20080107T083000Z\n", 12],
+    ["RRULE:FREQ=DAILY;INTERVAL=2;BYDAY=TU,TH\nDTSTART:20090106T140000Z\n", 4],
+    ["RRULE:FREQ=DAILY;COUNT=5000\nDTSTART:20100101T120000Z\n", 30],
+    ["RRULE:FREQ=WEEKLY;INTERVAL=2;UNTIL=20301231T000000Z\nDTSTART:20110103T090000Z\n", 2],
+    ["RRULE:FREQ=MONTHLY;BYDAY=2TU\nDTSTART:20100112T160000Z\n", 1],
+    ["RRULE:FREQ=YEARLY\nDTSTART;VALUE=DATE:20000615\n", 1],
+];
+
+function run_test() {
+    do_calendar_startup(really_run_test);
+}
+
+function really_run_test() {
+    test_rule_changes();
+    test_cache_overflow();
+    test_month_view();
+}
+
+function countOccurrences(aRule, aStart, aRangeStart, aRangeEnd) {
+    return aRule.getOccurrences(aStart, aRangeStart, aRangeEnd, 0, {}).length;
+}
+
+function test_rule_changes() {
+    let start = cal.createDateTime("20100112T160000Z");
+    let june = createDate(2019, 5, 1);
+    let july = createDate(2019, 6, 1);
+    let august = createDate(2019, 7, 1);
+
+    let rule = cal.createRecurrenceRule("RRULE:FREQ=MONTHLY;BYDAY=2TU");
+    equal(countOccurrences(rule, start, june, july), 1);
+    // Going back to an earlier range gives the same answer.
+    equal(countOccurrences(rule, start, start, june), 113);
+    equal(countOccurrences(rule, start, june, july), 1);
+
+    // Every other month starting in January 2010 skips June.
+    rule.interval = 2;
+    equal(countOccurrences(rule, start, june, july), 0);
+    equal(countOccurrences(rule, start, july, august), 1);
+
+    // A different start date is expanded from that date.
+    let later = cal.createDateTime("20190709T160000Z");
+    equal(countOccurrences(rule, later, june, august), 1);
+    equal(countOccurrences(rule, start, june, august), 1);
+
+    rule.count = 5;
+    equal(countOccurrences(rule, start, june, august), 0);
+
+    // Daily rules seek to the range, including when counting occurrences.
+    start = cal.createDateTime("20100101T120000Z");
+    rule = cal.createRecurrenceRule("RRULE:FREQ=DAILY;COUNT=3468");
+    let dates = rule.getOccurrences(start, june, august, 0, {});
+    equal(dates.length, 30);
+    equal(dates[29].icalString, "20190630T120000Z");
+    equal(rule.getNextOccurrence(start, cal.createDateTime("20190615T120000Z"))
+              .icalString, "20190616T120000Z");
+}
+
+function test_cache_overflow() {
+    // Counting occurrences by day can't be sought into, so the rule is
+    // expanded into the cache from its start. The years up to the range
+    // start fit, but the cache overflows in 2017.
+    let start = cal.createDateTime("20100101T120000Z");
+    let rule = cal.createRecurrenceRule(
+        "RRULE:FREQ=DAILY;BYDAY=MO,TU,WE,TH,FR;COUNT=5000");
+    let dates = rule.getOccurrences(start, createDate(2015, 5, 1),
+                                    createDate(2018, 0, 1), 0, {});
+    equal(dates.length, 675);
+    equal(dates[0].icalString, "20150601T120000Z");
+    equal(dates[674].icalString, "20171229T120000Z");
+}
+
+function test_month_view() {
+    const kEvents = 5000;
+    let events = [];
+    for (let i = 0; i < kEvents; i++) {
+        let [rule] = kRules[i % kRules.length];
+        events.push(createEventFromIcalString("BEGIN:VEVENT\nUID:" + i + "\n" +
+                                              rule + "END:VEVENT"));
+    }
+
+    let expected = 0;
+    for (let i = 0; i < kEvents; i++) {
+        expected += kRules[i % kRules.length][1];
+    }
+
+    let rangeStart = createDate(2019, 5, 1);
+    let rangeEnd = createDate(2019, 6, 1);
+    for (let round = 0; round < 3; round++) {
+        let start = Date.now();
+        let total = 0;
+        for (let event of events) {
+            total += event.recurrenceInfo.getOccurrences(rangeStart, rangeEnd,
+                                                         0, {}).length;
+        }
+        info("Expanded " + total + " occurrences of " + kEvents +
+             " events for a month view in " + (Date.now() - start) + "ms");
+        equal(total, expected);
+    }
+}
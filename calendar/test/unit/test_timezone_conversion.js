@@ -0,0 +1,116 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+ * Converting times around daylight saving changes, for single dates and for
+ * the occurrences of recurring events. Also measures how many conversions per
+ * second we manage across a few dozen timezones.
+ */
+
+var kZones = [
+    "America/New_York", "America/Chicago", "America/Denver",
+    "America/Los_Angeles", "America/Anchorage", "America/Sao_Paulo",
+    "America/Mexico_City", "America/Toronto", "America/Halifax",
+    "America/St_Johns", "America/Argentina/Buenos_Aires", "America/Santiago",
+    "Europe/London", "Europe/Berlin", "Europe/Paris", "Europe/Moscow",
+    "Europe/Istanbul", "Europe/Lisbon", "Europe/Helsinki", "Africa/Cairo",
+    "Africa/Johannesburg", "Asia/Kolkata", "Asia/Kathmandu", "Asia/Shanghai",
+    "Asia/Tokyo", "Asia/Tehran", "Asia/Jerusalem", "Australia/Sydney",
+    "Australia/Adelaide", "Australia/Perth", "Pacific/Auckland",
+    "Pacific/Chatham", "Pacific/Honolulu",
+];
+
+function run_test() {
+    do_calendar_startup(really_run_test);
+}
+
+function really_run_test() {
+    test_dst_changes();
+    test_recurrence();
+    test_throughput();
+}
+
+function inZone(aUtcString, aTzid) {
+    let tz = cal.getTimezoneService().getTimezone(aTzid);
+    return cal.createDateTime(aUtcString).getInTimezone(tz);
+}
+
+function test_dst_changes() {
+    // New York sets the clock forward at 2am EST on 10 March 2019 ...
+    equal(inZone("20190310T065959Z", "America/New_York").icalString, "20190310T015959");
+    equal(inZone("20190310T070000Z", "America/New_York").icalString, "20190310T030000");
+    // ... and back at 2am EDT on 3 November 2019, so 1:30am happens twice.
+    equal(inZone("20191103T053000Z", "America/New_York").icalString, "20191103T013000");
+    equal(inZone("20191103T063000Z", "America/New_York").icalString, "20191103T013000");
+    equal(inZone("20191103T073000Z", "America/New_York").icalString, "20191103T023000");
+
+    // Sydney goes back from AEDT to AEST on 7 April 2019.
+    equal(inZone("20190406T155959Z", "Australia/Sydney").icalString, "20190407T025959");
+    equal(inZone("20190406T160000Z", "Australia/Sydney").icalString, "20190407T020000");
+
+    // Zones without daylight saving and with odd offsets.
+    equal(inZone("20190701T000000Z", "Asia/Kolkata").icalString, "20190701T053000");
+    equal(inZone("20190101T000000Z", "Asia/Kathmandu").icalString, "20190101T054500");
+
+    // And back again from local time to UTC, outside of the repeated hour.
+    for (let [utc, tzid] of [["20190310T070000Z", "America/New_York"],
+                             ["20191103T073000Z", "America/New_York"],
+                             ["20190406T160000Z", "Australia/Sydney"],
+                             ["20301027T120000Z", "Europe/Berlin"],
+                             ["20400101T120000Z", "Europe/Berlin"]]) {
+        let local = inZone(utc, tzid);
+        equal(local.getInTimezone(cal.UTC()).icalString, utc);
+        equal(local.nativeTime, cal.createDateTime(utc).nativeTime);
+    }
+}
+
+function test_recurrence() {
+    // A daily meeting at 9am New York time keeps that time when the clocks
+    // change, so its occurrences are 23 hours apart across the change.
+    let item = createEventFromIcalString(
+        "BEGIN:VEVENT\nUID:dst\n" +
+        "DTSTART;TZID=America/New_York:20190308T090000\n" +
+        "RRULE:FREQ=DAILY;COUNT=4\nEND:VEVENT");
+    let dates = item.recurrenceInfo.getOccurrenceDates(createDate(2019, 2, 1),
+                                                       createDate(2019, 3, 1),
+                                                       0, {});
+    equal(dates.length, 4);
+    deepEqual(dates.map(date => date.getInTimezone(cal.UTC()).icalString),
+              ["20190308T140000Z", "20190309T140000Z",
+               "20190310T130000Z", "20190311T130000Z"]);
+    deepEqual(dates.map(date => date.hour), [9, 9, 9, 9]);
+    equal(dates[2].nativeTime - dates[1].nativeTime, 23 * 3600 * 1000000);
+}
+
+function test_throughput() {
+    const kConversions = 100000;
+    let tzs = kZones.map(tzid => cal.getTimezoneService().getTimezone(tzid));
+    tzs.forEach((tz, index) => ok(tz, kZones[index]));
+
+    // Times spread over twenty years, so they fall on both sides of many
+    // daylight saving changes.
+    let times = [];
+    let base = cal.createDateTime("20100101T000000Z");
+    for (let i = 0; i < kConversions; i++) {
+        let date = base.clone();
+        date.nativeTime = base.nativeTime + (i * 7919) % (20 * 365 * 86400) * 1000000;
+        times.push(date);
+    }
+
+    for (let round = 0; round < 3; round++) {
+        let start = Date.now();
+        let checksum = 0;
+        for (let i = 0; i < kConversions; i++) {
+            let local = times[i].getInTimezone(tzs[i % tzs.length]);
+            checksum += local.getInTimezone(cal.UTC()).nativeTime == times[i].nativeTime;
+        }
+        let elapsed = Math.max(Date.now() - start, 1);
+        info("Converted " + kConversions + " times to " + tzs.length +
+             " timezones and back in " + elapsed + "ms (" +
+             Math.round(kConversions * 1000 / elapsed) + " conversions/s)");
+        // Times in a repeated hour come back as the standard time, which is an
+        // hour off; everything else has to round trip exactly.
+        ok(checksum > kConversions * 0.99);
+    }
+}
@@ -148,6 +148,14 @@ LDAP_API(void) LDAP_CALL ldap_ber_free( BerElement *ber, int freebuf );
 LDAP_API(LDAPControl *) LDAP_CALL ldap_find_control( const char *oid,
     LDAPControl **ctrls );
 
+/*
+ * Get the values of an attribute without copying them (an API extension).
+ * The returned array must be freed with ldap_memfree(), and its values are
+ * only valid as long as the entry is.
+ */
+LDAP_API(struct berval **) LDAP_CALL ldap_get_values_len_ref( LDAP *ld,
+    LDAPMessage *entry, const char *target );
+
 /*
  * Server side sorting of search results (an LDAPv3 extension --
  * LDAP_API_FEATURE_SERVER_SIDE_SORT)
@@ -870,7 +870,8 @@ ber_get_next( Sockbuf *sb, ber_len_t *len, BerElement *ber )
 			if ( ber->ber_buf && !(ber->ber_flags & LBER_FLAG_NO_FREE_BUFFER)) {
 				NSLBERI_FREE(ber->ber_buf);
 			}
-			if ( (ber->ber_buf = (char *)NSLBERI_CALLOC( 1,(size_t)newlen ))
+			/* every byte is read from the socket below; don't zero it */
+			if ( (ber->ber_buf = (char *)NSLBERI_MALLOC( (size_t)newlen ))
 				 == NULL ) {
 				return( LBER_DEFAULT );
 			}
@@ -51,12 +51,53 @@ static char copyright[] = "@(#) Copyright (c) 1990 Regents of the University of
 #include "ldap-int.h"
 
 
+/*
+ * Position ber just before the set of values of attribute target in entry.
+ * The attribute types are compared in place, without copying them out of
+ * the message.  Returns LDAP_SUCCESS or LDAP_DECODING_ERROR.
+ */
+static int
+nsldapi_skip_to_values( BerElement *ber, const char *target )
+{
+	ber_len_t	len;
+	size_t		targetlen;
+	int			match;
+
+	targetlen = strlen( target );
+
+	/* skip sequence, dn, and sequence of */
+	if ( ber_scanf( ber, "{x{" ) == LBER_ERROR ) {
+		return( LDAP_DECODING_ERROR );
+	}
+
+	while ( 1 ) {
+		/* snag the next attribute type */
+		if ( ber_scanf( ber, "{" ) == LBER_ERROR ||
+		    ber_skip_tag( ber, &len ) == LBER_DEFAULT ||
+		    len > (ber_len_t)( ber->ber_end - ber->ber_ptr )) {
+			return( LDAP_DECODING_ERROR );
+		}
+
+		match = ( len == targetlen &&
+		    strncasecmp( target, ber->ber_ptr, len ) == 0 );
+		ber->ber_ptr += len;
+		if ( match ) {
+			return( LDAP_SUCCESS );
+		}
+
+		/* skip its values */
+		if ( ber_scanf( ber, "x}" ) == LBER_ERROR ) {
+			return( LDAP_DECODING_ERROR );
+		}
+	}
+}
+
+
 static void **
 internal_ldap_get_values( LDAP *ld, LDAPMessage *entry, const char *target,
 	int lencall )
 {
 	struct berelement	ber;
-	char		        *attr;
 	int			        rc;
 	void			    **vals;
 
@@ -73,31 +114,11 @@ internal_ldap_get_values( LDAP *ld, LDAPMessage *entry, const char *target,
 
 	ber = *entry->lm_ber;
 
-	/* skip sequence, dn, sequence of, and snag the first attr */
-	if ( ber_scanf( &ber, "{x{{a", &attr ) == LBER_ERROR ) {
+	if ( nsldapi_skip_to_values( &ber, target ) != LDAP_SUCCESS ) {
 		LDAP_SET_LDERRNO( ld, LDAP_DECODING_ERROR, NULL, NULL );
 		return( NULL );
 	}
 
-	rc = strcasecmp( (char *)target, attr );
-	NSLDAPI_FREE( attr );
-	if ( rc != 0 ) {
-		while ( 1 ) {
-			if ( ber_scanf( &ber, "x}{a", &attr ) == LBER_ERROR ) {
-				LDAP_SET_LDERRNO( ld, LDAP_DECODING_ERROR,
-				    NULL, NULL );
-				return( NULL );
-			}
-
-			rc = strcasecmp( (char *)target, attr );
-			if ( rc == 0 ) {
-				NSLDAPI_FREE( attr );
-				break;
-			}
-			NSLDAPI_FREE( attr );
-		}
-	}
-
 	/* 
 	 * if we get this far, we've found the attribute and are sitting
 	 * just before the set of values.
@@ -460,6 +481,100 @@ ldap_get_values_len( LDAP *ld, LDAPMessage *entry, const char *target )
 	    1 ) );
 }
 
+/*
+ * Like ldap_get_values_len(), but the returned bervals point straight into
+ * the encoded entry instead of being copied out of it one by one.  The
+ * array, the berval structures and nothing else are allocated, in a single
+ * block that the caller releases with ldap_memfree().  The values are not
+ * NUL terminated, are not passed through any string translation, and stay
+ * valid only as long as entry does.
+ */
+struct berval **
+LDAP_CALL
+ldap_get_values_len_ref( LDAP *ld, LDAPMessage *entry, const char *target )
+{
+	struct berelement	ber;
+	struct berval		**vals, *bvs;
+	ber_len_t			len;
+	ber_tag_t			tag;
+	char				*last, *start;
+	int					i, count;
+
+	LDAPDebug( LDAP_DEBUG_TRACE, "ldap_get_values_len_ref\n", 0, 0, 0 );
+
+	if ( !NSLDAPI_VALID_LDAP_POINTER( ld )) {
+		return( NULL );	/* punt */
+	}
+	if ( target == NULL ||
+	    !NSLDAPI_VALID_LDAPMESSAGE_ENTRY_POINTER( entry )) {
+		LDAP_SET_LDERRNO( ld, LDAP_PARAM_ERROR, NULL, NULL );
+		return( NULL );
+	}
+
+	ber = *entry->lm_ber;
+
+	if ( nsldapi_skip_to_values( &ber, target ) != LDAP_SUCCESS ) {
+		LDAP_SET_LDERRNO( ld, LDAP_DECODING_ERROR, NULL, NULL );
+		return( NULL );
+	}
+
+	/* first pass: count the values so we only allocate once */
+	start = ber.ber_ptr;
+	count = 0;
+	for ( tag = ber_first_element( &ber, &len, &last );
+	    tag != LBER_DEFAULT && tag != LBER_END_OF_SEQORSET;
+	    tag = ber_next_element( &ber, &len, last ) ) {
+		if ( ber_scanf( &ber, "x" ) == LBER_ERROR ) {
+			tag = LBER_DEFAULT;
+			break;
+		}
+		++count;
+	}
+	if ( tag != LBER_END_OF_SEQORSET ) {
+		LDAP_SET_LDERRNO( ld, LDAP_DECODING_ERROR, NULL, NULL );
+		return( NULL );
+	}
+	if ( count == 0 ) {
+		/* ldap_get_values_len() doesn't return empty arrays either */
+		LDAP_SET_LDERRNO( ld, LDAP_SUCCESS, NULL, NULL );
+		return( NULL );
+	}
+
+	if (( vals = (struct berval **)NSLDAPI_MALLOC(( count + 1 ) *
+	    sizeof( struct berval * ) + count * sizeof( struct berval )))
+	    == NULL ) {
+		LDAP_SET_LDERRNO( ld, LDAP_NO_MEMORY, NULL, NULL );
+		return( NULL );
+	}
+	bvs = (struct berval *)( vals + count + 1 );
+
+	/* second pass: point the bervals at the values in the message */
+	ber.ber_ptr = start;
+	i = 0;
+	for ( tag = ber_first_element( &ber, &len, &last );
+	    tag != LBER_DEFAULT && tag != LBER_END_OF_SEQORSET && i < count;
+	    tag = ber_next_element( &ber, &len, last ) ) {
+		if ( ber_skip_tag( &ber, &len ) == LBER_DEFAULT ||
+		    len > (ber_len_t)( ber.ber_end - ber.ber_ptr )) {
+			break;
+		}
+		bvs[i].bv_val = ber.ber_ptr;
+		bvs[i].bv_len = len;
+		vals[i] = &bvs[i];
+		ber.ber_ptr += len;
+		++i;
+	}
+	if ( i != count ) {
+		NSLDAPI_FREE( vals );
+		LDAP_SET_LDERRNO( ld, LDAP_DECODING_ERROR, NULL, NULL );
+		return( NULL );
+	}
+	vals[count] = NULL;
+
+	LDAP_SET_LDERRNO( ld, LDAP_SUCCESS, NULL, NULL );
+	return( vals );
+}
+
 char **
 LDAP_CALL
 ldap_get_lang_values( LDAP *ld, LDAPMessage *entry, const char *target,
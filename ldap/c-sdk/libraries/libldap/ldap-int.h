@@ -170,6 +170,7 @@ struct ldapmsg {
   struct ldapmsg *lm_chain;  /* for search - next msg in the resp */
   struct ldapmsg *lm_next;  /* next response */
   int lm_fromcache;  /* memcache: origin of message */
+  struct ldapmemcacheBuf *lm_sharedbuf;  /* memcache: shared ber buffer */
 };
 
 /*
@@ -879,6 +880,9 @@ int ldap_memcache_new( LDAP *ld, int msgid, unsigned long key,
   const char *basedn );
 int ldap_memcache_append( LDAP *ld, int msgid, int bLast, LDAPMessage *result );
 int ldap_memcache_abandon( LDAP *ld, int msgid );
+void nsldapi_memcache_release_buf( struct ldapmemcacheBuf *buf );
+void nsldapi_memcache_get_stats( LDAPMemCache *cache, unsigned long *tries,
+  unsigned long *hits, unsigned long *evictions );
 
 /*
  * in sbind.c
@@ -112,6 +112,17 @@
 #define NSLDAPI_IS_SEPARATER( c ) \
 	((c) == ',')
 
+/* Macros for the reference count of shared ber buffers, which may be
+   released from any thread without holding the cache lock. */
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define MEMCACHE_ATOMIC_INCREMENT( p )	_InterlockedIncrement( (p) )
+#define MEMCACHE_ATOMIC_DECREMENT( p )	_InterlockedDecrement( (p) )
+#else
+#define MEMCACHE_ATOMIC_INCREMENT( p )	__sync_add_and_fetch( (p), 1 )
+#define MEMCACHE_ATOMIC_DECREMENT( p )	__sync_sub_and_fetch( (p), 1 )
+#endif
+
 /* Hash table callback function pointer definition */
 typedef int (*HashFuncPtr)(int table_size, void *key);
 typedef int (*PutDataPtr)(void **ppTableData, void *key, void *pData);
@@ -167,8 +178,19 @@ typedef struct ldapmemcacheRes_struct {
 typedef struct ldapmemcacheStats_struct {
     unsigned long			ldmemcstat_tries;
     unsigned long			ldmemcstat_hits;
+    unsigned long			ldmemcstat_evictions;
 } ldapmemcacheStats;
 
+/* Immutable copy of a cached ber buffer.  The message stored in the cache
+   and every copy handed out on a cache hit point their BerElement at
+   ldmemcb_data and hold a reference, so hits don't copy the encoded
+   entries and an evicted result stays valid until its last copy is
+   freed by ldap_msgfree(). */
+struct ldapmemcacheBuf {
+    long				ldmemcb_refcnt;
+    char				ldmemcb_data[1];
+};
+
 /* Structure of a memcache object */
 struct ldapmemcache {
     unsigned long			ldmemc_ttl;
@@ -192,7 +214,8 @@ static int memcache_add_to_ld(LDAP *ld, int msgid, LDAPMessage *pMsg);
 static int memcache_compare_dn(const char *main_dn, const char *dn, int scope);
 static int memcache_dup_message(LDAPMessage *res, int msgid, int fromcache, 
 				LDAPMessage **ppResCopy, unsigned long *pSize);
-static BerElement* memcache_ber_dup(BerElement* pBer, unsigned long *pSize);
+static BerElement* memcache_ber_share(BerElement* pBer,
+			struct ldapmemcacheBuf **ppBuf, unsigned long *pSize);
 
 static void memcache_trim_basedn_spaces(char *basedn);
 static int memcache_validate_basedn(LDAPMemCache *cache, const char *basedn);
@@ -254,7 +277,7 @@ static int attrkey_getdata(void *pTableData, void *key, void **ppData);
 static int attrkey_removedata(void **ppTableData, void *key, void **ppData);
 static void attrkey_clearnode(void **ppTableData, void *pData);
 
-static unsigned long crc32_convert(char *buf, int len);
+static unsigned long memcache_hash_key(const char *buf, int len);
 
 /* Create a memcache object. */
 int
@@ -579,11 +602,11 @@ ldap_memcache_destroy( LDAPMemCache *cache )
 
 /************************* Internal API Functions ****************************/
 
-/* Creates an integer key by applying the Cyclic Reduntency Check algorithm on
-   a long string formed by concatenating all the search parameters plus the
-   current bind DN.  The key is used in the cache for looking up cached
-   entries.  It is assumed that the CRC algorithm will generate
-   different integers from different byte strings. */
+/* Creates an integer key by hashing a long string formed by concatenating
+   all the search parameters plus the current bind DN.  The key is used in
+   the cache for looking up cached entries.  Only the key is compared on
+   lookup, so it is assumed that different byte strings hash to different
+   integers; see memcache_hash_key(). */
 int
 ldap_memcache_createkey(LDAP *ld, const char *base, int scope, 
 			const char *filter, char **attrs, 
@@ -674,8 +697,7 @@ ldap_memcache_createkey(LDAP *ld, const char *base, int scope,
 
     memcache_append_ctrls(keystr, serverctrls, clientctrls);
 
-    /* CRC algorithm */
-    *keyp = crc32_convert(keystr, len);
+    *keyp = memcache_hash_key(keystr, len);
 
     NSLDAPI_FREE(keystr);
     NSLDAPI_FREE(tmpbase);
@@ -1195,43 +1217,74 @@ memcache_compare_dn(const char *main_dn, const char *dn, int scope)
     return nRes;
 }
 
-/* Dup a complete separate copy of a berelement, including the buffers
-   the berelement points to. */
+/* Returns a new BerElement reading the same encoded data as pBer, backed by
+   a shared, reference counted buffer.  If *ppBuf is NULL, the data of pBer
+   is copied into a new shared buffer, which is returned in *ppBuf with one
+   reference for the returned BerElement.  Otherwise pBer must already read
+   from *ppBuf and only a new reference is taken; no data is copied. */
 static BerElement*
-memcache_ber_dup(BerElement* pBer, unsigned long *pSize)
+memcache_ber_share(BerElement* pBer, struct ldapmemcacheBuf **ppBuf,
+                   unsigned long *pSize)
 {
-    BerElement *p = ber_dup(pBer);
+    BerElement *p;
+    struct ldapmemcacheBuf *pBuf = *ppBuf;
 
     *pSize = 0;
 
-    if (p) {
-
-	*pSize += sizeof(BerElement) + EXTRA_SIZE;
+    if ((p = (BerElement*)NSLDAPI_MALLOC(sizeof(BerElement))) == NULL)
+	return NULL;
 
-	if (p->ber_len <= EXTRA_SIZE) {
-	    p->ber_flags |= LBER_FLAG_NO_FREE_BUFFER;
-	    p->ber_buf = (char*)p + sizeof(BerElement);
-	} else {
-	    p->ber_flags &= ~LBER_FLAG_NO_FREE_BUFFER;
-	    p->ber_buf = (char*)NSLDAPI_CALLOC(1, p->ber_len);
-	    *pSize += (p->ber_buf ? p->ber_len : 0);
-	}
+    *p = *pBer;
+    *pSize += sizeof(BerElement);
 
-	if (p->ber_buf) {
-	    p->ber_ptr = p->ber_buf + (pBer->ber_ptr - pBer->ber_buf);
-	    p->ber_end = p->ber_buf + p->ber_len;
-	    memcpy(p->ber_buf, pBer->ber_buf, p->ber_len);
-	} else {
-	    ber_free(p, 0);
-	    p = NULL;
+    if (pBuf == NULL) {
+	pBuf = (struct ldapmemcacheBuf*)NSLDAPI_MALLOC(
+	                    sizeof(struct ldapmemcacheBuf) + pBer->ber_len);
+	if (pBuf == NULL) {
+	    NSLDAPI_FREE(p);
 	    *pSize = 0;
+	    return NULL;
 	}
+	pBuf->ldmemcb_refcnt = 1;
+	memcpy(pBuf->ldmemcb_data, pBer->ber_buf, pBer->ber_len);
+	*pSize += sizeof(struct ldapmemcacheBuf) + pBer->ber_len;
+	*ppBuf = pBuf;
+    } else {
+	MEMCACHE_ATOMIC_INCREMENT(&pBuf->ldmemcb_refcnt);
     }
 
+    p->ber_flags |= LBER_FLAG_NO_FREE_BUFFER;
+    p->ber_buf = pBuf->ldmemcb_data;
+    p->ber_ptr = p->ber_buf + (pBer->ber_ptr - pBer->ber_buf);
+    p->ber_end = p->ber_buf + p->ber_len;
+
     return p;
 }
 
-/* Dup a entry or a chain of entries. */
+/* Drops a reference to a shared ber buffer, freeing it with the last one. */
+void
+nsldapi_memcache_release_buf(struct ldapmemcacheBuf *buf)
+{
+    if (MEMCACHE_ATOMIC_DECREMENT(&buf->ldmemcb_refcnt) == 0)
+	NSLDAPI_FREE(buf);
+}
+
+/* Reads the lookup and eviction counters of a cache; misses are the
+   tries that weren't hits. */
+void
+nsldapi_memcache_get_stats(LDAPMemCache *cache, unsigned long *tries,
+                           unsigned long *hits, unsigned long *evictions)
+{
+    LDAP_MEMCACHE_MUTEX_LOCK( cache );
+    *tries = cache->ldmemc_stats.ldmemcstat_tries;
+    *hits = cache->ldmemc_stats.ldmemcstat_hits;
+    *evictions = cache->ldmemc_stats.ldmemcstat_evictions;
+    LDAP_MEMCACHE_MUTEX_UNLOCK( cache );
+}
+
+/* Dup a entry or a chain of entries.  When caching a result (fromcache is
+   0) the encoded data is copied once into shared buffers; when handing out
+   cached results the copies share those buffers. */
 static int
 memcache_dup_message(LDAPMessage *res, int msgid, int fromcache,
 				LDAPMessage **ppResCopy, unsigned long *pSize)
@@ -1258,10 +1311,20 @@ memcache_dup_message(LDAPMessage *res, int msgid, int fromcache,
 
 	memcpy(*ppCurNew, pCur, sizeof(LDAPMessage));
 	(*ppCurNew)->lm_next = NULL;
-	(*ppCurNew)->lm_ber = memcache_ber_dup(pCur->lm_ber, &ber_size);
+	(*ppCurNew)->lm_chain = NULL;
+	(*ppCurNew)->lm_sharedbuf = (fromcache ? pCur->lm_sharedbuf : NULL);
+	(*ppCurNew)->lm_ber = memcache_ber_share(pCur->lm_ber,
+	                             &((*ppCurNew)->lm_sharedbuf), &ber_size);
 	(*ppCurNew)->lm_msgid = msgid;
 	(*ppCurNew)->lm_fromcache = (fromcache != 0);
 
+	if ((*ppCurNew)->lm_ber == NULL) {
+	    /* don't release a buffer we didn't take a reference to */
+	    (*ppCurNew)->lm_sharedbuf = NULL;
+	    nRes = LDAP_NO_MEMORY;
+	    break;
+	}
+
 	if (pSize)
 	    *pSize += sizeof(LDAPMessage) + ber_size;
     }
@@ -1677,6 +1740,7 @@ memcache_access(LDAPMemCache *cache, int mode,
 	LDAPDebug( LDAP_DEBUG_TRACE,
 		"memcache_access FLUSH_LRU: removing key 0x%8.8lx\n",
 		pRes->ldmemcr_crc_key, 0, 0 );
+	++cache->ldmemc_stats.ldmemcstat_evictions;
 	nRes = htable_remove(cache->ldmemc_resLookup,
 	              (void*)&(pRes->ldmemcr_crc_key), NULL);
 	assert(nRes == LDAP_SUCCESS);
@@ -1733,6 +1797,10 @@ memcache_report_statistics( LDAPMemCache *cache )
     LDAPDebug( LDAP_DEBUG_STATS, "    tries: %ld  hits: %ld  hitrate: %ld%%\n",
 	    cache->ldmemc_stats.ldmemcstat_tries,
 	    cache->ldmemc_stats.ldmemcstat_hits, hitrate );
+    LDAPDebug( LDAP_DEBUG_STATS, "    misses: %ld  evictions: %ld\n",
+	    cache->ldmemc_stats.ldmemcstat_tries -
+	    cache->ldmemc_stats.ldmemcstat_hits,
+	    cache->ldmemc_stats.ldmemcstat_evictions, 0 );
     if ( cache->ldmemc_size <= 0 ) {	/* no size limit */
 	LDAPDebug( LDAP_DEBUG_STATS, "    memory bytes used: %ld\n",
 		cache->ldmemc_size_used, 0, 0 );
@@ -2172,73 +2240,28 @@ attrkey_clearnode(void **ppTableData, void *pData)
     }
 }
 
-/***************************** CRC algorithm ********************************/
+/***************************** Key hashing ********************************/
 
-/* From http://www.faqs.org/faqs/compression-faq/part1/section-25.html */
-
-/*
- * Build auxiliary table for parallel byte-at-a-time CRC-32.
- */
-#define NSLDAPI_CRC32_POLY 0x04c11db7     /* AUTODIN II, Ethernet, & FDDI */
-
-static nsldapi_uint_32 crc32_table[256] = { 
-    0x00000000, 0x04c11db7, 0x09823b6e, 0x0d4326d9, 0x130476dc, 0x17c56b6b, 
-    0x1a864db2, 0x1e475005, 0x2608edb8, 0x22c9f00f, 0x2f8ad6d6, 0x2b4bcb61, 
-    0x350c9b64, 0x31cd86d3, 0x3c8ea00a, 0x384fbdbd, 0x4c11db70, 0x48d0c6c7, 
-    0x4593e01e, 0x4152fda9, 0x5f15adac, 0x5bd4b01b, 0x569796c2, 0x52568b75, 
-    0x6a1936c8, 0x6ed82b7f, 0x639b0da6, 0x675a1011, 0x791d4014, 0x7ddc5da3, 
-    0x709f7b7a, 0x745e66cd, 0x9823b6e0, 0x9ce2ab57, 0x91a18d8e, 0x95609039, 
-    0x8b27c03c, 0x8fe6dd8b, 0x82a5fb52, 0x8664e6e5, 0xbe2b5b58, 0xbaea46ef, 
-    0xb7a96036, 0xb3687d81, 0xad2f2d84, 0xa9ee3033, 0xa4ad16ea, 0xa06c0b5d, 
-    0xd4326d90, 0xd0f37027, 0xddb056fe, 0xd9714b49, 0xc7361b4c, 0xc3f706fb, 
-    0xceb42022, 0xca753d95, 0xf23a8028, 0xf6fb9d9f, 0xfbb8bb46, 0xff79a6f1, 
-    0xe13ef6f4, 0xe5ffeb43, 0xe8bccd9a, 0xec7dd02d, 0x34867077, 0x30476dc0, 
-    0x3d044b19, 0x39c556ae, 0x278206ab, 0x23431b1c, 0x2e003dc5, 0x2ac12072, 
-    0x128e9dcf, 0x164f8078, 0x1b0ca6a1, 0x1fcdbb16, 0x018aeb13, 0x054bf6a4, 
-    0x0808d07d, 0x0cc9cdca, 0x7897ab07, 0x7c56b6b0, 0x71159069, 0x75d48dde, 
-    0x6b93dddb, 0x6f52c06c, 0x6211e6b5, 0x66d0fb02, 0x5e9f46bf, 0x5a5e5b08, 
-    0x571d7dd1, 0x53dc6066, 0x4d9b3063, 0x495a2dd4, 0x44190b0d, 0x40d816ba, 
-    0xaca5c697, 0xa864db20, 0xa527fdf9, 0xa1e6e04e, 0xbfa1b04b, 0xbb60adfc, 
-    0xb6238b25, 0xb2e29692, 0x8aad2b2f, 0x8e6c3698, 0x832f1041, 0x87ee0df6, 
-    0x99a95df3, 0x9d684044, 0x902b669d, 0x94ea7b2a, 0xe0b41de7, 0xe4750050, 
-    0xe9362689, 0xedf73b3e, 0xf3b06b3b, 0xf771768c, 0xfa325055, 0xfef34de2, 
-    0xc6bcf05f, 0xc27dede8, 0xcf3ecb31, 0xcbffd686, 0xd5b88683, 0xd1799b34, 
-    0xdc3abded, 0xd8fba05a, 0x690ce0ee, 0x6dcdfd59, 0x608edb80, 0x644fc637, 
-    0x7a089632, 0x7ec98b85, 0x738aad5c, 0x774bb0eb, 0x4f040d56, 0x4bc510e1, 
-    0x46863638, 0x42472b8f, 0x5c007b8a, 0x58c1663d, 0x558240e4, 0x51435d53, 
-    0x251d3b9e, 0x21dc2629, 0x2c9f00f0, 0x285e1d47, 0x36194d42, 0x32d850f5, 
-    0x3f9b762c, 0x3b5a6b9b, 0x0315d626, 0x07d4cb91, 0x0a97ed48, 0x0e56f0ff, 
-    0x1011a0fa, 0x14d0bd4d, 0x19939b94, 0x1d528623, 0xf12f560e, 0xf5ee4bb9, 
-    0xf8ad6d60, 0xfc6c70d7, 0xe22b20d2, 0xe6ea3d65, 0xeba91bbc, 0xef68060b, 
-    0xd727bbb6, 0xd3e6a601, 0xdea580d8, 0xda649d6f, 0xc423cd6a, 0xc0e2d0dd, 
-    0xcda1f604, 0xc960ebb3, 0xbd3e8d7e, 0xb9ff90c9, 0xb4bcb610, 0xb07daba7, 
-    0xae3afba2, 0xaafbe615, 0xa7b8c0cc, 0xa379dd7b, 0x9b3660c6, 0x9ff77d71, 
-    0x92b45ba8, 0x9675461f, 0x8832161a, 0x8cf30bad, 0x81b02d74, 0x857130c3, 
-    0x5d8a9099, 0x594b8d2e, 0x5408abf7, 0x50c9b640, 0x4e8ee645, 0x4a4ffbf2, 
-    0x470cdd2b, 0x43cdc09c, 0x7b827d21, 0x7f436096, 0x7200464f, 0x76c15bf8, 
-    0x68860bfd, 0x6c47164a, 0x61043093, 0x65c52d24, 0x119b4be9, 0x155a565e, 
-    0x18197087, 0x1cd86d30, 0x029f3d35, 0x065e2082, 0x0b1d065b, 0x0fdc1bec, 
-    0x3793a651, 0x3352bbe6, 0x3e119d3f, 0x3ad08088, 0x2497d08d, 0x2056cd3a, 
-    0x2d15ebe3, 0x29d4f654, 0xc5a92679, 0xc1683bce, 0xcc2b1d17, 0xc8ea00a0, 
-    0xd6ad50a5, 0xd26c4d12, 0xdf2f6bcb, 0xdbee767c, 0xe3a1cbc1, 0xe760d676, 
-    0xea23f0af, 0xeee2ed18, 0xf0a5bd1d, 0xf464a0aa, 0xf9278673, 0xfde69bc4, 
-    0x89b8fd09, 0x8d79e0be, 0x803ac667, 0x84fbdbd0, 0x9abc8bd5, 0x9e7d9662, 
-    0x933eb0bb, 0x97ffad0c, 0xafb010b1, 0xab710d06, 0xa6322bdf, 0xa2f33668, 
-    0xbcb4666d, 0xb8757bda, 0xb5365d03, 0xb1f740b4 };
-
-/* Initialized first time "crc32()" is called. If you prefer, you can
- * statically initialize it at compile time. [Another exercise.]
- */
+/* 64-bit FNV-1a hash of the key string, folded to the width of unsigned
+   long on platforms where that is narrower.  Cached results are looked up
+   by this value alone, so it replaces the CRC-32 that was used before,
+   which made key collisions - and thus wrong cache hits - far likelier. */
+#define MEMCACHE_FNV_OFFSET_BASIS	0xcbf29ce484222325ULL
+#define MEMCACHE_FNV_PRIME		0x100000001b3ULL
 
 static unsigned long
-crc32_convert(char *buf, int len)
+memcache_hash_key(const char *buf, int len)
 {
-    unsigned char *p;
-	nsldapi_uint_32	crc;
+    const unsigned char *p;
+    unsigned long long hash = MEMCACHE_FNV_OFFSET_BASIS;
+
+    for (p = (const unsigned char *)buf; len > 0; ++p, --len) {
+	hash ^= *p;
+	hash *= MEMCACHE_FNV_PRIME;
+    }
 
-    crc = 0xffffffff;       /* preload shift register, per CRC-32 spec */
-    for (p = (unsigned char *)buf; len > 0; ++p, --len)
-	crc = ((crc << 8) ^ crc32_table[(crc >> 24) ^ *p]) & 0xffffffff;
+    if (sizeof(unsigned long) < sizeof(hash))
+	hash ^= hash >> 32;
 
-    return (unsigned long) ~crc;    /* transmit complement, per CRC-32 spec */
+    return (unsigned long)hash;
 }
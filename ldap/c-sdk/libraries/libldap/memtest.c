@@ -0,0 +1,339 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ * 
+ * The contents of this file are subject to the Mozilla Public License Version 
+ * 1.1 (the "License"); you may not use this file except in compliance with 
+ * the License. You may obtain a copy of the License at 
+ * http://www.mozilla.org/MPL/
+ * 
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ * 
+ * The Original Code is Mozilla Communicator client code, released
+ * March 31, 1998.
+ * 
+ * The Initial Developer of the Original Code is
+ * Netscape Communications Corporation.
+ * Portions created by the Initial Developer are Copyright (C) 1998-1999
+ * the Initial Developer. All Rights Reserved.
+ * 
+ * Contributor(s):
+ * 
+ * Alternatively, the contents of this file may be used under the terms of
+ * either of the GNU General Public License Version 2 or later (the "GPL"),
+ * or the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ * 
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * memtest.c - drives the in-memory search result cache without a
+ * directory server: fills it with search results, repeats lookups on a
+ * skewed mix of searches, caching a result again on each miss, and
+ * reports the hit, miss and eviction counts and the allocations per
+ * lookup.  It also checks that a result handed out by the cache stays
+ * readable after the cache evicts it, and that freeing it releases the
+ * shared buffer.
+ *
+ * usage: memtest [ searches [ cachesize [ valuesize [ lookups ] ] ] ]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ldap-int.h"
+
+#define MEMTEST_BASE	"o=Example"
+
+static unsigned long	allocs, allocbytes, blocks;
+
+static void *
+count_malloc( size_t size )
+{
+	++allocs;
+	++blocks;
+	allocbytes += size;
+	return( malloc( size ));
+}
+
+static void *
+count_calloc( size_t nelem, size_t elsize )
+{
+	++allocs;
+	++blocks;
+	allocbytes += nelem * elsize;
+	return( calloc( nelem, elsize ));
+}
+
+static void *
+count_realloc( void *ptr, size_t size )
+{
+	++allocs;
+	if ( ptr == NULL ) {
+		++blocks;
+	}
+	allocbytes += size;
+	return( realloc( ptr, size ));
+}
+
+static void
+count_free( void *ptr )
+{
+	if ( ptr != NULL ) {
+		--blocks;
+	}
+	free( ptr );
+}
+
+/*
+ * Encode a message the way read1msg() leaves it.  Search entries hold a
+ * cn and a jpegPhoto value of valsize bytes filled with fill.
+ */
+static BerElement *
+make_message( int msgtype, int valsize, int fill )
+{
+	BerElement		*ber;
+	struct berval	val, *vals[2], *flatp;
+	int				rc;
+
+	if (( ber = ber_alloc_t( 0 )) == NULL ) {
+		return( NULL );
+	}
+	if ( msgtype == LDAP_RES_SEARCH_ENTRY ) {
+		val.bv_len = valsize;
+		val.bv_val = (char *)malloc( valsize );
+		memset( val.bv_val, fill, valsize );
+		vals[0] = &val;
+		vals[1] = NULL;
+		rc = ber_printf( ber, "t{s{{s[s]}{s[V]}}}", msgtype,
+		    "cn=Test," MEMTEST_BASE, "cn", "Test", "jpegPhoto", vals );
+		free( val.bv_val );
+	} else {
+		rc = ber_printf( ber, "t{ess}", msgtype, LDAP_SUCCESS, "", "" );
+	}
+	if ( rc == -1 || ber_flatten( ber, &flatp ) != 0 ) {
+		fprintf( stderr, "cannot encode a test message\n" );
+		exit( 1 );
+	}
+	ber_free( ber, 1 );
+
+	ber = ber_init( flatp );
+	ber_bvfree( flatp );
+	/* the cache copies ber_len bytes, which ber_get_next() sets */
+	if ( ber != NULL ) {
+		ber->ber_len = ber->ber_end - ber->ber_buf;
+	}
+	return( ber );
+}
+
+static unsigned long
+search_key( LDAP *ld, int search )
+{
+	char			filter[32];
+	unsigned long	key;
+
+	sprintf( filter, "(cn=Test %d)", search );
+	if ( ldap_memcache_createkey( ld, MEMTEST_BASE, LDAP_SCOPE_SUBTREE,
+	    filter, NULL, 0, NULL, NULL, &key ) != LDAP_SUCCESS ) {
+		fprintf( stderr, "cannot create the key of search %d\n", search );
+		exit( 1 );
+	}
+	return( key );
+}
+
+/*
+ * Cache the result of a search, one entry and the search result, as
+ * nsldapi_result() does when they arrive from the server.
+ */
+static void
+cache_search( LDAP *ld, int msgid, unsigned long key, int search,
+    int valsize )
+{
+	LDAPMessage		entry, done;
+
+	memset( &entry, 0, sizeof( entry ));
+	entry.lm_msgid = msgid;
+	entry.lm_msgtype = LDAP_RES_SEARCH_ENTRY;
+	entry.lm_ber = make_message( LDAP_RES_SEARCH_ENTRY, valsize,
+	    'a' + search % 26 );
+	memset( &done, 0, sizeof( done ));
+	done.lm_msgid = msgid;
+	done.lm_msgtype = LDAP_RES_SEARCH_RESULT;
+	done.lm_ber = make_message( LDAP_RES_SEARCH_RESULT, 0, 0 );
+	if ( entry.lm_ber == NULL || done.lm_ber == NULL ||
+	    ldap_memcache_new( ld, msgid, key, MEMTEST_BASE ) != LDAP_SUCCESS ||
+	    ldap_memcache_append( ld, msgid, 0, &entry ) != LDAP_SUCCESS ||
+	    ldap_memcache_append( ld, msgid, 1, &done ) != LDAP_SUCCESS ) {
+		fprintf( stderr, "cannot cache search %d\n", search );
+		exit( 1 );
+	}
+	ber_free( entry.lm_ber, 1 );
+	ber_free( done.lm_ber, 1 );
+}
+
+/*
+ * Look a search up in the cache.  A hit is attached to ld like a result
+ * from the server; take it off again and hand it to the caller.
+ */
+static LDAPMessage *
+lookup_search( LDAP *ld, int msgid, unsigned long key )
+{
+	LDAPMessage		*res;
+
+	if ( ldap_memcache_result( ld, msgid, key ) != LDAP_SUCCESS ) {
+		return( NULL );
+	}
+	res = ld->ld_responses;
+	ld->ld_responses = NULL;
+	return( res );
+}
+
+/* Check that res holds the entry cached for search. */
+static int
+check_result( LDAP *ld, LDAPMessage *res, int search, int valsize )
+{
+	LDAPMessage		*e;
+	struct berval	**vals;
+	int				i, ok;
+
+	if (( e = ldap_first_entry( ld, res )) == NULL ||
+	    ( vals = ldap_get_values_len( ld, e, "jpegPhoto" )) == NULL ) {
+		return( 0 );
+	}
+	ok = vals[0] != NULL && vals[1] == NULL &&
+	    vals[0]->bv_len == (ber_len_t)valsize;
+	for ( i = 0; ok && i < valsize; ++i ) {
+		ok = vals[0]->bv_val[i] == 'a' + search % 26;
+	}
+	ldap_value_free_len( vals );
+	return( ok );
+}
+
+int
+main( int argc, char **argv )
+{
+	struct ldap_memalloc_fns	memfns;
+	LDAP			*ld;
+	LDAPMemCache	*cache;
+	LDAPMessage		*res, *held;
+	unsigned long	*keys, seed, before, beforebytes, beforeblocks;
+	unsigned long	tries, hits, evictions, tries0, hits0, evictions0;
+	clock_t			start;
+	int				searches, cachesize, valsize, lookups;
+	int				msgid, search, i;
+
+	searches = argc > 1 ? atoi( argv[1] ) : 1000;
+	cachesize = argc > 2 ? atoi( argv[2] ) : 1024 * 1024;
+	valsize = argc > 3 ? atoi( argv[3] ) : 4 * 1024;
+	lookups = argc > 4 ? atoi( argv[4] ) : 100000;
+	if ( searches < 1 ) {
+		searches = 1;
+	}
+	if ( cachesize <= 0 ) {
+		fprintf( stderr, "the cache needs a size limit to evict\n" );
+		return( 1 );
+	}
+
+	memfns.ldapmem_malloc = count_malloc;
+	memfns.ldapmem_calloc = count_calloc;
+	memfns.ldapmem_realloc = count_realloc;
+	memfns.ldapmem_free = count_free;
+	if ( ldap_set_option( NULL, LDAP_OPT_MEMALLOC_FN_PTRS, &memfns ) != 0 ) {
+		fprintf( stderr, "cannot set the allocation functions\n" );
+		return( 1 );
+	}
+
+	if (( ld = ldap_init( "localhost", LDAP_PORT )) == NULL ) {
+		perror( "ldap_init" );
+		return( 1 );
+	}
+	if ( ldap_memcache_init( 0, cachesize, NULL, NULL, &cache )
+	    != LDAP_SUCCESS || ldap_memcache_set( ld, cache ) != LDAP_SUCCESS ) {
+		fprintf( stderr, "cannot set up the cache\n" );
+		return( 1 );
+	}
+
+	keys = (unsigned long *)malloc( searches * sizeof( *keys ));
+	for ( search = 0; search < searches; ++search ) {
+		keys[search] = search_key( ld, search );
+	}
+	msgid = 1;
+	for ( search = 0; search < searches; ++search ) {
+		cache_search( ld, msgid++, keys[search], search, valsize );
+	}
+
+	/*
+	 * Hold on to a copy of the most recent search, then cache new
+	 * searches until everything cached before is evicted.
+	 */
+	if (( held = lookup_search( ld, msgid++, keys[searches - 1] ))
+	    == NULL ) {
+		fprintf( stderr, "the last search is not in the cache\n" );
+		return( 1 );
+	}
+	nsldapi_memcache_get_stats( cache, &tries0, &hits0, &evictions0 );
+	evictions = evictions0;
+	for ( i = 0; evictions - evictions0 <= (unsigned long)searches; ++i ) {
+		cache_search( ld, msgid++, search_key( ld, searches + i ),
+		    searches + i, valsize );
+		nsldapi_memcache_get_stats( cache, &tries, &hits, &evictions );
+	}
+	if ( lookup_search( ld, msgid++, keys[searches - 1] ) != NULL ) {
+		fprintf( stderr, "the last search was not evicted\n" );
+		return( 1 );
+	}
+	if ( !check_result( ld, held, searches - 1, valsize )) {
+		fprintf( stderr, "the evicted result is damaged\n" );
+		return( 1 );
+	}
+	beforeblocks = blocks;
+	ldap_msgfree( held );
+	printf( "evicted result still readable, freeing it released %lu "
+	    "blocks\n", beforeblocks - blocks );
+
+	/*
+	 * Half of the lookups go to the first tenth of the searches.  A miss
+	 * caches the search again, as a client fetching it from the server
+	 * would.
+	 */
+	nsldapi_memcache_get_stats( cache, &tries0, &hits0, &evictions0 );
+	printf( "%d lookups of %d searches of %d bytes in a %d byte cache\n",
+	    lookups, searches, valsize, cachesize );
+	before = allocs;
+	beforebytes = allocbytes;
+	seed = 1;
+	start = clock();
+	for ( i = 0; i < lookups; ++i ) {
+		seed = seed * 1103515245 + 12345;
+		search = (int)(( seed >> 16 ) % (unsigned long)searches );
+		if ( seed & 0x10000000 ) {
+			search /= 10;
+		}
+		if (( res = lookup_search( ld, msgid++, keys[search] )) != NULL ) {
+			ldap_msgfree( res );
+		} else {
+			cache_search( ld, msgid++, keys[search], search, valsize );
+		}
+	}
+	printf( "%.3f us and %lu allocations (%lu bytes) per lookup\n",
+	    ( clock() - start ) * 1000000.0 / CLOCKS_PER_SEC / lookups,
+	    ( allocs - before ) / lookups, ( allocbytes - beforebytes ) / lookups );
+	nsldapi_memcache_get_stats( cache, &tries, &hits, &evictions );
+	printf( "hits: %lu  misses: %lu  evictions: %lu\n", hits - hits0,
+	    ( tries - tries0 ) - ( hits - hits0 ), evictions - evictions0 );
+
+	free( keys );
+	ldap_unbind( ld );
+	ldap_memcache_destroy( cache );
+	return( 0 );
+}
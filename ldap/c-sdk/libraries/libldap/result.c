@@ -1248,6 +1248,9 @@ ldap_msgfree( LDAPMessage *lm )
 		next = lm->lm_chain;
 		type = lm->lm_msgtype;
 		ber_free( lm->lm_ber, 1 );
+		if ( lm->lm_sharedbuf != NULL ) {
+			nsldapi_memcache_release_buf( lm->lm_sharedbuf );
+		}
 		NSLDAPI_FREE( (char *) lm );
 	}
 
@@ -0,0 +1,211 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ * 
+ * The contents of this file are subject to the Mozilla Public License Version 
+ * 1.1 (the "License"); you may not use this file except in compliance with 
+ * the License. You may obtain a copy of the License at 
+ * http://www.mozilla.org/MPL/
+ * 
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ * 
+ * The Original Code is Mozilla Communicator client code, released
+ * March 31, 1998.
+ * 
+ * The Initial Developer of the Original Code is
+ * Netscape Communications Corporation.
+ * Portions created by the Initial Developer are Copyright (C) 1998-1999
+ * the Initial Developer. All Rights Reserved.
+ * 
+ * Contributor(s):
+ * 
+ * Alternatively, the contents of this file may be used under the terms of
+ * either of the GNU General Public License Version 2 or later (the "GPL"),
+ * or the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ * 
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * valtest.c - counts the allocations made while fetching large binary
+ * attribute values from a search entry, with ldap_get_values_len() and
+ * with ldap_get_values_len_ref().
+ *
+ * usage: valtest [ values [ valuesize [ rounds ] ] ]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ldap-int.h"
+
+static unsigned long	allocs, allocbytes;
+
+static void *
+count_malloc( size_t size )
+{
+	++allocs;
+	allocbytes += size;
+	return( malloc( size ));
+}
+
+static void *
+count_calloc( size_t nelem, size_t elsize )
+{
+	++allocs;
+	allocbytes += nelem * elsize;
+	return( calloc( nelem, elsize ));
+}
+
+static void *
+count_realloc( void *ptr, size_t size )
+{
+	++allocs;
+	allocbytes += size;
+	return( realloc( ptr, size ));
+}
+
+static void
+count_free( void *ptr )
+{
+	free( ptr );
+}
+
+/*
+ * Build a search entry holding a cn and nvals jpegPhoto values of
+ * valsize bytes each, positioned the way read1msg() leaves it.
+ */
+static BerElement *
+make_entry( int nvals, int valsize )
+{
+	BerElement		*ber;
+	struct berval	**vals, *flatp;
+	int				i;
+
+	if (( ber = ber_alloc_t( 0 )) == NULL ) {
+		return( NULL );
+	}
+	vals = (struct berval **)malloc(( nvals + 1 ) * sizeof( *vals ));
+	for ( i = 0; i < nvals; ++i ) {
+		vals[i] = (struct berval *)malloc( sizeof( struct berval ));
+		vals[i]->bv_len = valsize;
+		vals[i]->bv_val = (char *)malloc( valsize );
+		memset( vals[i]->bv_val, 'a' + i % 26, valsize );
+	}
+	vals[nvals] = NULL;
+
+	if ( ber_printf( ber, "t{s{{s[s]}{s[V]}}}", LDAP_RES_SEARCH_ENTRY,
+	    "cn=Test,o=Example", "cn", "Test", "jpegPhoto", vals ) == -1 ||
+	    ber_flatten( ber, &flatp ) != 0 ) {
+		fprintf( stderr, "cannot encode the test entry\n" );
+		exit( 1 );
+	}
+	ber_free( ber, 1 );
+	ber_bvecfree( vals );
+
+	ber = ber_init( flatp );
+	ber_bvfree( flatp );
+	return( ber );
+}
+
+int
+main( int argc, char **argv )
+{
+	struct ldap_memalloc_fns	memfns;
+	LDAP			*ld;
+	LDAPMessage		entry;
+	struct berval	**vals;
+	unsigned long	before;
+	clock_t			start;
+	int				nvals, valsize, rounds, i, n;
+
+	nvals = argc > 1 ? atoi( argv[1] ) : 16;
+	valsize = argc > 2 ? atoi( argv[2] ) : 64 * 1024;
+	rounds = argc > 3 ? atoi( argv[3] ) : 1000;
+
+	memfns.ldapmem_malloc = count_malloc;
+	memfns.ldapmem_calloc = count_calloc;
+	memfns.ldapmem_realloc = count_realloc;
+	memfns.ldapmem_free = count_free;
+	if ( ldap_set_option( NULL, LDAP_OPT_MEMALLOC_FN_PTRS, &memfns ) != 0 ) {
+		fprintf( stderr, "cannot set the allocation functions\n" );
+		return( 1 );
+	}
+
+	if (( ld = ldap_init( "localhost", LDAP_PORT )) == NULL ) {
+		perror( "ldap_init" );
+		return( 1 );
+	}
+
+	memset( &entry, 0, sizeof( entry ));
+	entry.lm_msgtype = LDAP_RES_SEARCH_ENTRY;
+	if (( entry.lm_ber = make_entry( nvals, valsize )) == NULL ) {
+		fprintf( stderr, "cannot allocate the test entry\n" );
+		return( 1 );
+	}
+
+	/* both calls must see the same values */
+	{
+		struct berval	**copies;
+
+		copies = ldap_get_values_len( ld, &entry, "jpegPhoto" );
+		vals = ldap_get_values_len_ref( ld, &entry, "jpegPhoto" );
+		for ( i = 0; copies != NULL && copies[i] != NULL; ++i ) {
+			if ( vals == NULL || vals[i] == NULL ||
+			    vals[i]->bv_len != copies[i]->bv_len ||
+			    memcmp( vals[i]->bv_val, copies[i]->bv_val,
+			    vals[i]->bv_len ) != 0 ) {
+				fprintf( stderr, "value %d differs\n", i );
+				return( 1 );
+			}
+		}
+		if ( i != nvals || vals[i] != NULL ) {
+			fprintf( stderr, "got %d values, expected %d\n", i, nvals );
+			return( 1 );
+		}
+		ldap_value_free_len( copies );
+		ldap_memfree( vals );
+	}
+
+	printf( "%d rounds of %d values of %d bytes\n", rounds, nvals, valsize );
+
+	before = allocs;
+	allocbytes = 0;
+	start = clock();
+	for ( i = 0; i < rounds; ++i ) {
+		vals = ldap_get_values_len( ld, &entry, "jpegPhoto" );
+		n = ldap_count_values_len( vals );
+		ldap_value_free_len( vals );
+	}
+	printf( "ldap_get_values_len:     %d values, %lu allocations "
+	    "(%lu bytes) per call, %.3f ms per call\n", n,
+	    ( allocs - before ) / rounds, allocbytes / rounds,
+	    ( clock() - start ) * 1000.0 / CLOCKS_PER_SEC / rounds );
+
+	before = allocs;
+	allocbytes = 0;
+	start = clock();
+	for ( i = 0; i < rounds; ++i ) {
+		vals = ldap_get_values_len_ref( ld, &entry, "jpegPhoto" );
+		n = ldap_count_values_len( vals );
+		ldap_memfree( vals );
+	}
+	printf( "ldap_get_values_len_ref: %d values, %lu allocations "
+	    "(%lu bytes) per call, %.3f ms per call\n", n,
+	    ( allocs - before ) / rounds, allocbytes / rounds,
+	    ( clock() - start ) * 1000.0 / CLOCKS_PER_SEC / rounds );
+
+	ber_free( entry.lm_ber, 1 );
+	ldap_unbind( ld );
+	return( 0 );
+}
@@ -27,17 +27,29 @@
 #include "nsLDAPUtils.h"
 #include "nsProxyRelease.h"
 #include "mozilla/Attributes.h"
+#include "nsCOMArray.h"
 
 using namespace mozilla;
 
 const char kDNSServiceContractId[] = "@mozilla.org/network/dns-service;1";
 
+// How long the result pump blocks waiting for the server before it checks
+// whether it still has work to do. Results wake it up immediately, so this
+// only bounds how quickly it notices the connection being closed.
+static const int32_t kResultWaitMicroseconds = 100 * 1000;
+
+// Maximum number of results handed to the main thread in one event.
+static const uint32_t kMaxBatchedResults = 64;
+
 // constructor
 //
 nsLDAPConnection::nsLDAPConnection()
     : mConnectionHandle(nullptr),
       mPendingOperationsMutex("nsLDAPConnection.mPendingOperationsMutex"),
       mPendingOperations(10),
+      mPumping(false),
+      mClosing(false),
+      mLastOperationID(0),
       mSSL(false),
       mVersion(nsILDAPConnection::VERSION3),
       mDNSRequest(nullptr)
@@ -53,6 +65,11 @@ nsLDAPConnection::~nsLDAPConnection()
   if (obsServ)
       obsServ->RemoveObserver(this, "profile-change-net-teardown");
   Close();
+
+  // no pump is running any more, as it holds a reference to us, and
+  // nobody is left to claim these
+  for (uint32_t i = 0; i < mOrphans.Length(); i++)
+    ldap_msgfree(mOrphans[i]);
 }
 
 NS_IMPL_ADDREF(nsLDAPConnection)
@@ -179,6 +196,21 @@ nsLDAPConnection::Close()
   int rc;
   MOZ_LOG(gLDAPLogModule, mozilla::LogLevel::Debug, ("unbinding\n"));
 
+  {
+    // stop the result pump from starting another wait on the handle
+    MutexAutoLock lock(mPendingOperationsMutex);
+    mClosing = true;
+  }
+
+  // The pump may be waiting in ldap_result() on the handle, which the C SDK
+  // doesn't lock, so let it return and stop before unbinding.
+  if (mThread) {
+      nsresult rv = mThread->Shutdown();
+      if (NS_FAILED(rv))
+          NS_WARNING("Failed to shutdown thread cleanly");
+      mThread = nullptr;
+  }
+
   if (mConnectionHandle) {
       // note that the ldap_unbind() call in the 5.0 version of the LDAP C SDK
       // appears to be exactly identical to ldap_unbind_s(), so it may in fact
@@ -195,9 +227,6 @@ nsLDAPConnection::Close()
 
   MOZ_LOG(gLDAPLogModule, mozilla::LogLevel::Debug, ("unbound\n"));
 
-  NS_ASSERTION(!mThread || NS_SUCCEEDED(mThread->Shutdown()),
-               "Failed to shutdown thread cleanly");
-
   // Cancel the DNS lookup if needed, and also drop the reference to the
   // Init listener (if still there).
   //
@@ -319,31 +348,52 @@ nsLDAPConnection::AddPendingOperation(uint32_t aOperationID, nsILDAPOperation *a
 {
   NS_ENSURE_ARG_POINTER(aOperation);
 
-  nsIRunnable* runnable = new nsLDAPConnectionRunnable(aOperationID, aOperation,
-                                                       this);
   {
     MutexAutoLock lock(mPendingOperationsMutex);
     mPendingOperations.Put((uint32_t)aOperationID, aOperation);
+    if (aOperationID > mLastOperationID)
+      mLastOperationID = aOperationID;
     MOZ_LOG(gLDAPLogModule, mozilla::LogLevel::Debug,
            ("pending operation added; total pending operations now = %d\n",
             mPendingOperations.Count()));
+
+    // A running pump picks up results for any registered operation, so we
+    // only need to start one if it has stopped.
+    if (mPumping)
+      return NS_OK;
+    mPumping = true;
   }
 
+  nsCOMPtr<nsIRunnable> runnable = new nsLDAPConnectionRunnable(this);
   nsresult rv;
   if (!mThread)
   {
     rv = NS_NewThread(getter_AddRefs(mThread), runnable);
-    NS_ENSURE_SUCCESS(rv, rv);
   }
   else
   {
     rv = mThread->Dispatch(runnable, nsIEventTarget::DISPATCH_NORMAL);
-    NS_ENSURE_SUCCESS(rv, rv);
+  }
+
+  if (NS_FAILED(rv))
+  {
+    MutexAutoLock lock(mPendingOperationsMutex);
+    mPumping = false;
+    return rv;
   }
 
   return NS_OK;
 }
 
+bool
+nsLDAPConnection::IsPendingOperation(int32_t aOperationID, bool *aStale)
+{
+  MutexAutoLock lock(mPendingOperationsMutex);
+  bool pending = mPendingOperations.Contains((uint32_t)aOperationID);
+  *aStale = !pending && (uint32_t)aOperationID <= mLastOperationID;
+  return pending;
+}
+
 /**
  * Remove an nsILDAPOperation from the list of operations pending on this
  * connection.  Mainly intended for use by the nsLDAPOperation code.
@@ -375,48 +425,66 @@ nsLDAPConnection::RemovePendingOperation(uint32_t aOperationID)
   return NS_OK;
 }
 
+/**
+ * Delivers a batch of results, in the order they were received, to the
+ * listeners of their operations on the main thread.
+ */
 class nsOnLDAPMessageRunnable : public Runnable
 {
 public:
-  nsOnLDAPMessageRunnable(nsLDAPMessage *aMsg, bool aClear)
+  nsOnLDAPMessageRunnable()
     : Runnable("nsOnLDAPMessageRunnable")
-    , m_msg(aMsg)
-    , m_clear(aClear)
   {}
   NS_DECL_NSIRUNNABLE
+
+  void AppendMessage(nsLDAPMessage *aMsg, bool aClear)
+  {
+    m_msgs.AppendElement(aMsg);
+    m_clear.AppendElement(aClear);
+  }
+  uint32_t Length() const { return m_msgs.Length(); }
+
 private:
-  RefPtr<nsLDAPMessage> m_msg;
-  bool m_clear;
+  nsTArray<RefPtr<nsLDAPMessage> > m_msgs;
+  nsTArray<bool> m_clear;
 };
 
 NS_IMETHODIMP nsOnLDAPMessageRunnable::Run()
 {
-  // get the message listener object.
-  nsLDAPOperation *nsoperation = static_cast<nsLDAPOperation *>(m_msg->mOperation.get());
-  nsCOMPtr<nsILDAPMessageListener> listener;
-  nsresult rv = nsoperation->GetMessageListener(getter_AddRefs(listener));
-
-  if (m_clear)
+  for (uint32_t i = 0; i < m_msgs.Length(); i++)
   {
-    // try to break cycles
-    nsoperation->Clear();
-  }
+    // get the message listener object.
+    nsLDAPOperation *nsoperation =
+      static_cast<nsLDAPOperation *>(m_msgs[i]->mOperation.get());
+    nsCOMPtr<nsILDAPMessageListener> listener;
+    nsoperation->GetMessageListener(getter_AddRefs(listener));
 
-  if (!listener)
-  {
-    NS_ERROR("nsLDAPConnection::InvokeMessageCallback(): probable "
-             "memory corruption: GetMessageListener() returned nullptr");
-    return rv;
-  }
+    if (m_clear[i])
+    {
+      // try to break cycles
+      nsoperation->Clear();
+    }
+
+    if (!listener)
+    {
+      NS_ERROR("nsLDAPConnection::InvokeMessageCallback(): probable "
+               "memory corruption: GetMessageListener() returned nullptr");
+      continue;
+    }
 
-  return listener->OnLDAPMessage(m_msg);
+    // a failing listener shouldn't keep the rest of the batch from
+    // being delivered
+    listener->OnLDAPMessage(m_msgs[i]);
+  }
+  return NS_OK;
 }
 
 nsresult
 nsLDAPConnection::InvokeMessageCallback(LDAPMessage *aMsgHandle,
                                         nsILDAPMessage *aMsg,
                                         int32_t aOperation,
-                                        bool aRemoveOpFromConnQ)
+                                        bool aRemoveOpFromConnQ,
+                                        nsOnLDAPMessageRunnable *aBatch)
 {
 #if defined(DEBUG)
   // We only want this being logged for debug builds so as not to affect performance too much.
@@ -435,11 +503,9 @@ nsLDAPConnection::InvokeMessageCallback(LDAPMessage *aMsgHandle,
   nsLDAPMessage *msg = static_cast<nsLDAPMessage *>(aMsg);
   msg->mOperation = operation;
 
-  // proxy the listener callback to the ui thread.
-  RefPtr<nsOnLDAPMessageRunnable> runnable =
-    new nsOnLDAPMessageRunnable(msg, aRemoveOpFromConnQ);
-  // invoke the callback
-  NS_DispatchToMainThread(runnable);
+  // queue the listener callback; the batch is proxied to the ui thread
+  // by the caller.
+  aBatch->AppendMessage(msg, aRemoveOpFromConnQ);
 
   // if requested (ie the operation is done), remove the operation
   // from the connection queue.
@@ -607,10 +673,8 @@ nsLDAPConnection::OnLookupByTypeComplete(nsICancelable      *aRequest,
   return NS_OK;
 }
 
-nsLDAPConnectionRunnable::nsLDAPConnectionRunnable(int32_t aOperationID,
-                                                   nsILDAPOperation *aOperation,
-                                                   nsLDAPConnection *aConnection)
-  : mOperationID(aOperationID),  mConnection(aConnection)
+nsLDAPConnectionRunnable::nsLDAPConnectionRunnable(nsLDAPConnection *aConnection)
+  : mConnection(aConnection)
 {
 }
 
@@ -625,120 +689,190 @@ NS_IMPL_ISUPPORTS(nsLDAPConnectionRunnable, nsIRunnable)
 
 NS_IMETHODIMP nsLDAPConnectionRunnable::Run()
 {
-  if (!mOperationID) {
-    NS_ERROR("mOperationID is null");
-    return NS_ERROR_NULL_POINTER;
+  int32_t returnCode = 0;
+
+  while (true)
+  {
+    {
+      MutexAutoLock lock(mConnection->mPendingOperationsMutex);
+      if (mConnection->mClosing || returnCode == -1 ||
+          !mConnection->mPendingOperations.Count())
+      {
+        // AddPendingOperation() starts a new pump when it sees this
+        mConnection->mPumping = false;
+        break;
+      }
+    }
+
+    RefPtr<nsOnLDAPMessageRunnable> batch = new nsOnLDAPMessageRunnable();
+
+    // deliver results whose operation has been registered since they came
+    // in, possibly while an earlier pump was running
+    nsTArray<LDAPMessage *> &orphans = mConnection->mOrphans;
+    for (uint32_t i = 0; i < orphans.Length();)
+    {
+      LDAPMessage *msgHandle = orphans[i];
+      bool stale;
+      if (mConnection->IsPendingOperation(ldap_msgid(msgHandle), &stale))
+      {
+        orphans.RemoveElementAt(i);
+        HandleResult(msgHandle, batch);
+      }
+      else if (stale)
+      {
+        orphans.RemoveElementAt(i);
+        ldap_msgfree(msgHandle);
+      }
+      else
+        i++;
+    }
+
+    // Block until the server sends something for any of our operations,
+    // then drain whatever else is already readable without waiting, so
+    // the entries of a large search reach the main thread in batches.
+    LDAPMessage *msgHandle;
+    struct timeval timeout = { 0, kResultWaitMicroseconds };
+    returnCode = ldap_result(mConnection->mConnectionHandle, LDAP_RES_ANY,
+                             LDAP_MSG_ONE, &timeout, &msgHandle);
+    while (returnCode > 0)
+    {
+      HandleResult(msgHandle, batch);
+      if (batch->Length() >= kMaxBatchedResults)
+        break;
+
+      struct timeval noWait = { 0, 0 };
+      returnCode = ldap_result(mConnection->mConnectionHandle, LDAP_RES_ANY,
+                               LDAP_MSG_ONE, &noWait, &msgHandle);
+    }
+
+    // Nothing more is coming for the pending operations, so don't leave
+    // their listeners waiting.
+    if (returnCode == -1)
+      FailPendingOperations(batch);
+
+    if (batch->Length())
+      NS_DispatchToMainThread(batch);
+  }
+
+  return NS_OK;
+}
+
+void nsLDAPConnectionRunnable::FailPendingOperations(nsOnLDAPMessageRunnable *aBatch)
+{
+  int32_t errorCode = ldap_get_lderrno(mConnection->mConnectionHandle, 0, 0);
+  MOZ_LOG(gLDAPLogModule, mozilla::LogLevel::Error,
+         ("ldap_result() failed with %d, failing the pending operations\n",
+          errorCode));
+  if (errorCode == LDAP_SUCCESS)
+    errorCode = LDAP_SERVER_DOWN;
+
+  nsTArray<uint32_t> operationIDs;
+  nsCOMArray<nsILDAPOperation> operations;
+  {
+    MutexAutoLock lock(mConnection->mPendingOperationsMutex);
+    // Close() unbinds on purpose, the operations die with the connection
+    if (mConnection->mClosing)
+      return;
+    for (auto iter = mConnection->mPendingOperations.Iter(); !iter.Done();
+         iter.Next()) {
+      operationIDs.AppendElement(iter.Key());
+      operations.AppendObject(iter.UserData());
+    }
   }
 
-  LDAPMessage *msgHandle;
-  bool operationFinished = true;
-  RefPtr<nsLDAPMessage> msg;
+  for (uint32_t i = 0; i < operationIDs.Length(); i++)
+  {
+    nsLDAPOperation *operation = static_cast<nsLDAPOperation *>(operations[i]);
+    RefPtr<nsLDAPMessage> msg = new nsLDAPMessage;
+    msg->InitFailed(mConnection, operation->mResultType, errorCode);
+    mConnection->InvokeMessageCallback(nullptr, msg, operationIDs[i], true,
+                                       aBatch);
+  }
+}
 
-  struct timeval timeout = { 0, 0 };
+void nsLDAPConnectionRunnable::HandleResult(LDAPMessage *msgHandle,
+                                            nsOnLDAPMessageRunnable *aBatch)
+{
+  int32_t operationID = ldap_msgid(msgHandle);
 
-  nsCOMPtr<nsIThread> thread = do_GetCurrentThread();
-  int32_t returnCode = ldap_result(mConnection->mConnectionHandle, mOperationID, LDAP_MSG_ONE, &timeout, &msgHandle);
-  switch (returnCode)
+  // The operation may have been sent but not registered yet, keep the
+  // result until it is. Results for operations which are done or were
+  // abandoned are dropped.
+  bool stale;
+  if (!mConnection->IsPendingOperation(operationID, &stale))
   {
-    // timeout
-    case 0:
-      // XXX do we need a timer?
-      return thread->Dispatch(this, nsIEventTarget::DISPATCH_NORMAL);
-    case -1:
-      NS_ERROR("We don't know what went wrong with the ldap operation");
-      return NS_ERROR_FAILURE;
+    if (stale)
+      ldap_msgfree(msgHandle);
+    else
+      mConnection->mOrphans.AppendElement(msgHandle);
+    return;
+  }
 
+  bool operationFinished = true;
+  switch (ldap_msgtype(msgHandle))
+  {
     case LDAP_RES_SEARCH_ENTRY:
     case LDAP_RES_SEARCH_REFERENCE:
       // XXX what should we do with LDAP_RES_SEARCH_EXTENDED
       operationFinished = false;
-      MOZ_FALLTHROUGH;
-    default:
-    {
-      msg = new nsLDAPMessage;
-      if (!msg)
-        return NS_ERROR_NULL_POINTER;
+      break;
+  }
 
-      // initialize the message, using a protected method not available
-      // through nsILDAPMessage (which is why we need the raw pointer)
-      nsresult rv = msg->Init(mConnection, msgHandle);
+  RefPtr<nsLDAPMessage> msg = new nsLDAPMessage;
 
-      switch (rv)
-      {
-        case NS_OK:
-        {
-          int32_t errorCode;
-          msg->GetErrorCode(&errorCode);
-
-          // maybe a version error, e.g., using v3 on a v2 server.
-          // if we're using v3, try v2.
-          if (errorCode == LDAP_PROTOCOL_ERROR &&
-              mConnection->mVersion == nsILDAPConnection::VERSION3)
-          {
-            nsAutoCString password;
-            mConnection->mVersion = nsILDAPConnection::VERSION2;
-            ldap_set_option(mConnection->mConnectionHandle,
-                            LDAP_OPT_PROTOCOL_VERSION, &mConnection->mVersion);
-
-            if (NS_SUCCEEDED(rv))
-            {
-              // We don't want to notify callers that we are done, so
-              // redispatch the runnable.
-              // XXX do we need a timer?
-              rv = thread->Dispatch(this, nsIEventTarget::DISPATCH_NORMAL);
-              NS_ENSURE_SUCCESS(rv, rv);
-              return NS_OK;
-            }
-          }
-          // If we're midway through a SASL Bind, we need to continue
-          // without letting our caller know what we're up to!
-          //
-          if (errorCode == LDAP_SASL_BIND_IN_PROGRESS) {
-            struct berval *creds;
-            ldap_parse_sasl_bind_result(
-              mConnection->mConnectionHandle, msgHandle,
-              &creds, 0);
-
-            nsCOMPtr<nsILDAPOperation> operation;
-            {
-              MutexAutoLock lock(mConnection->mPendingOperationsMutex);
-              mConnection->mPendingOperations.Get((uint32_t)mOperationID, getter_AddRefs(operation));
-            }
+  // initialize the message, using a protected method not available
+  // through nsILDAPMessage (which is why we need the raw pointer)
+  nsresult rv = msg->Init(mConnection, msgHandle);
+  if (NS_FAILED(rv))
+    return;
 
-            NS_ENSURE_TRUE(operation, NS_ERROR_NULL_POINTER);
+  int32_t errorCode;
+  msg->GetErrorCode(&errorCode);
 
-            nsresult rv = operation->SaslStep(creds->bv_val, creds->bv_len);
-            if (NS_SUCCEEDED(rv))
-              return NS_OK;
-          }
-          break;
-        }
-          // Error code handling in here
-        default:
-          return NS_OK;
-      }
+  // maybe a version error, e.g., using v3 on a v2 server.
+  // if we're using v3, try v2.
+  if (errorCode == LDAP_PROTOCOL_ERROR &&
+      mConnection->mVersion == nsILDAPConnection::VERSION3)
+  {
+    mConnection->mVersion = nsILDAPConnection::VERSION2;
+    ldap_set_option(mConnection->mConnectionHandle,
+                    LDAP_OPT_PROTOCOL_VERSION, &mConnection->mVersion);
 
-      // invoke the callback on the nsILDAPOperation corresponding to
-      // this message
-      rv = mConnection->InvokeMessageCallback(msgHandle, msg, mOperationID,
-                                              operationFinished);
-      if (NS_FAILED(rv))
-      {
-        NS_ERROR("CheckLDAPOperationResult(): error invoking message"
-                 " callback");
-        // punt and hope things work out better next time around
-        return NS_OK;
-      }
+    // We don't want to notify callers that we are done, so keep
+    // waiting on the operation.
+    return;
+  }
 
-      if (!operationFinished)
-      {
-        // XXX do we need a timer?
-        rv = thread->Dispatch(this, nsIEventTarget::DISPATCH_NORMAL);
-        NS_ENSURE_SUCCESS(rv, rv);
-      }
+  // If we're midway through a SASL Bind, we need to continue
+  // without letting our caller know what we're up to!
+  //
+  if (errorCode == LDAP_SASL_BIND_IN_PROGRESS) {
+    struct berval *creds;
+    ldap_parse_sasl_bind_result(
+      mConnection->mConnectionHandle, msgHandle,
+      &creds, 0);
 
-      break;
+    nsCOMPtr<nsILDAPOperation> operation;
+    {
+      MutexAutoLock lock(mConnection->mPendingOperationsMutex);
+      mConnection->mPendingOperations.Get((uint32_t)operationID, getter_AddRefs(operation));
     }
+
+    if (!operation)
+      return;
+
+    rv = operation->SaslStep(creds->bv_val, creds->bv_len);
+    if (NS_SUCCEEDED(rv))
+      return;
+  }
+
+  // invoke the callback on the nsILDAPOperation corresponding to
+  // this message
+  rv = mConnection->InvokeMessageCallback(msgHandle, msg, operationID,
+                                          operationFinished, aBatch);
+  if (NS_FAILED(rv))
+  {
+    NS_ERROR("CheckLDAPOperationResult(): error invoking message"
+             " callback");
   }
-  return NS_OK;
 }
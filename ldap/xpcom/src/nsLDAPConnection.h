@@ -24,6 +24,9 @@
 #include "nsIObserver.h"
 #include "nsAutoPtr.h"
 #include "mozilla/Mutex.h"
+#include "nsTArray.h"
+
+class nsOnLDAPMessageRunnable;
 
 /**
  * Casting nsILDAPConnection to nsISupports is ambiguous.
@@ -64,13 +67,20 @@ class nsLDAPConnection : public nsILDAPConnection,
 
   protected:
     virtual ~nsLDAPConnection();
-    // invoke the callback associated with a given message, and possibly
-    // delete it from the connection queue
+    // queue the callback associated with a given message on aBatch, which
+    // the caller dispatches to the main thread, and possibly delete the
+    // operation from the connection queue
     //
     nsresult InvokeMessageCallback(LDAPMessage *aMsgHandle,
                                    nsILDAPMessage *aMsg,
                                    int32_t aOperation,
-                                   bool aRemoveOpFromConnQ);
+                                   bool aRemoveOpFromConnQ,
+                                   nsOnLDAPMessageRunnable *aBatch);
+    // is aOperationID registered in mPendingOperations? If it isn't,
+    // *aStale tells whether it was registered before, i.e. its operation
+    // is done or was abandoned, rather than not registered yet.
+    //
+    bool IsPendingOperation(int32_t aOperationID, bool *aStale);
     /**
      * Add an nsILDAPOperation to the list of operations pending on
      * this connection.  This is mainly intended for use by the
@@ -103,6 +113,19 @@ class nsLDAPConnection : public nsILDAPConnection,
 
     Mutex mPendingOperationsMutex;
     nsInterfaceHashtable<nsUint32HashKey, nsILDAPOperation> mPendingOperations;
+    bool mPumping;                      // is a result pump running on mThread?
+    bool mClosing;                      // set by Close(), stops the pump
+    // The highest operation ID registered so far. The C SDK hands out
+    // increasing message IDs, and operations are sent and registered on
+    // the main thread, so a lower ID which isn't pending never will be.
+    uint32_t mLastOperationID;
+
+    // results that arrived before their operation was registered with
+    // AddPendingOperation(); kept across pumps, as the pump may stop before
+    // the operation is registered, and dropped once it is stale. Only
+    // touched on the connection thread.
+    //
+    nsTArray<LDAPMessage *> mOrphans;
 
     int32_t mPort;                      // The LDAP port we're binding to
     bool mSSL;                        // the options
@@ -115,24 +138,37 @@ class nsLDAPConnection : public nsILDAPConnection,
     nsCOMPtr<nsISupports> mClosure;     // private parameter (anything caller desires)
 };
 
+/**
+ * The result pump of a connection. One instance runs on the connection
+ * thread while any operation is pending. It blocks in ldap_result() until
+ * the socket has data, demultiplexes the results of all pending operations
+ * by message id, and hands them to the main thread in batches.
+ */
 class nsLDAPConnectionRunnable : public nsIRunnable
 {
   friend class nsLDAPConnection;
   friend class nsLDAPMessage;
 
 public:
-  nsLDAPConnectionRunnable(int32_t aOperationID,
-                           nsILDAPOperation *aOperation,
-                           nsLDAPConnection *aConnection);
+  explicit nsLDAPConnectionRunnable(nsLDAPConnection *aConnection);
 
   NS_DECL_THREADSAFE_ISUPPORTS
   NS_DECL_NSIRUNNABLE
 
-  int32_t mOperationID;
   RefPtr<nsLDAPConnection> mConnection;
 
 private:
   virtual ~nsLDAPConnectionRunnable();
+
+  // process one result returned by ldap_result(), queueing any callback
+  // on aBatch
+  //
+  void HandleResult(LDAPMessage *aMsgHandle, nsOnLDAPMessageRunnable *aBatch);
+
+  // queue a failed result on aBatch for every pending operation, once
+  // ldap_result() has given up on the connection
+  //
+  void FailPendingOperations(nsOnLDAPMessageRunnable *aBatch);
 };
 
 #endif // _nsLDAPConnection_h_
@@ -33,6 +33,7 @@ NS_IMPL_CI_INTERFACE_GETTER(nsLDAPMessage, nsILDAPMessage)
 //
 nsLDAPMessage::nsLDAPMessage()
     : mMsgHandle(0),
+      mFailedType(-1),
       mErrorCode(LDAP_SUCCESS),
       mMatchedDn(0),
       mErrorMessage(0),
@@ -201,6 +202,16 @@ nsLDAPMessage::Init(nsILDAPConnection *aConnection, LDAPMessage *aMsgHandle)
     return NS_OK;
 }
 
+void
+nsLDAPMessage::InitFailed(nsILDAPConnection *aConnection, int32_t aType,
+                          int32_t aErrorCode)
+{
+    mConnection = aConnection;
+    mConnectionHandle = static_cast<nsLDAPConnection *>(aConnection)->mConnectionHandle;
+    mFailedType = aType;
+    mErrorCode = aErrorCode;
+}
+
 /**
  * The result code of the (possibly partial) operation.
  *
@@ -226,7 +237,7 @@ nsLDAPMessage::GetType(int32_t *aType)
         return NS_ERROR_ILLEGAL_VALUE;
     }
 
-    *aType = ldap_msgtype(mMsgHandle);
+    *aType = mMsgHandle ? ldap_msgtype(mMsgHandle) : mFailedType;
     if (*aType == -1) {
         return NS_ERROR_UNEXPECTED;
     };
@@ -537,7 +548,10 @@ nsLDAPMessage::GetBinaryValues(const char *aAttr, uint32_t *aCount,
             aAttr));
 #endif
 
-    values = ldap_get_values_len(mConnectionHandle, mMsgHandle, aAttr);
+    // The values are copied into the nsLDAPBERValues below, so look at them
+    // in place rather than having the SDK copy them out of the message first.
+    //
+    values = ldap_get_values_len_ref(mConnectionHandle, mMsgHandle, aAttr);
 
     // bail out if there was a problem
     //
@@ -549,7 +563,7 @@ nsLDAPMessage::GetBinaryValues(const char *aAttr, uint32_t *aCount,
             // caller has asked for an attribute that doesn't exist.
             //
             MOZ_LOG(gLDAPLogModule, mozilla::LogLevel::Warning,
-                   ("nsLDAPMessage::GetBinaryValues(): ldap_get_values "
+                   ("nsLDAPMessage::GetBinaryValues(): ldap_get_values_len_ref "
                     "returned LDAP_DECODING_ERROR"));
             return NS_ERROR_LDAP_DECODING_ERROR;
 
@@ -572,7 +586,7 @@ nsLDAPMessage::GetBinaryValues(const char *aAttr, uint32_t *aCount,
     *aValues =
         static_cast<nsILDAPBERValue **>(moz_xmalloc(numVals * sizeof(nsILDAPBERValue)));
     if (!aValues) {
-        ldap_value_free_len(values);
+        ldap_memfree(values);
         return NS_ERROR_OUT_OF_MEMORY;
     }
 
@@ -590,7 +604,7 @@ nsLDAPMessage::GetBinaryValues(const char *aAttr, uint32_t *aCount,
             NS_ERROR("nsLDAPMessage::GetBinaryValues(): out of memory"
                      " creating nsLDAPBERValue object");
             NS_FREE_XPCOM_ALLOCATED_POINTER_ARRAY(i, aValues);
-            ldap_value_free_len(values);
+            ldap_memfree(values);
             return NS_ERROR_OUT_OF_MEMORY;
         }
 
@@ -601,7 +615,7 @@ nsLDAPMessage::GetBinaryValues(const char *aAttr, uint32_t *aCount,
         if (NS_FAILED(rv)) {
             NS_ERROR("nsLDAPMessage::GetBinaryValues(): error setting"
                      " nsBERValue");
-            ldap_value_free_len(values);
+            ldap_memfree(values);
             return rv == NS_ERROR_OUT_OF_MEMORY ? rv : NS_ERROR_UNEXPECTED;
         }
 
@@ -611,7 +625,7 @@ nsLDAPMessage::GetBinaryValues(const char *aAttr, uint32_t *aCount,
     }
 
     *aCount = numVals;
-    ldap_value_free_len(values);
+    ldap_memfree(values);
     return NS_OK;
 }
 
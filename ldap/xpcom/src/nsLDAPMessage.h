@@ -43,7 +43,12 @@ class nsLDAPMessage : public nsILDAPMessage
                               bool getP);
     nsresult Init(nsILDAPConnection *aConnection,
                   LDAPMessage *aMsgHandle);
+    // make this a result of type aType with aErrorCode for an operation the
+    // server can no longer answer
+    void InitFailed(nsILDAPConnection *aConnection, int32_t aType,
+                    int32_t aErrorCode);
     LDAPMessage *mMsgHandle; // the message we're wrapping
+    int32_t mFailedType; // the type when there is no message, see InitFailed()
     nsCOMPtr<nsILDAPOperation> mOperation;  // operation this msg relates to
 
     LDAP *mConnectionHandle; // cached connection this op is on
@@ -58,6 +58,7 @@ static nsresult TranslateLDAPErrorToNSError(const int ldapError)
 
 // constructor
 nsLDAPOperation::nsLDAPOperation()
+  : mResultType(-1)
 {
 }
 
@@ -198,6 +199,8 @@ nsLDAPOperation::SaslBind(const nsACString &service,
   if (lderrno != LDAP_SUCCESS)
     return TranslateLDAPErrorToNSError(lderrno);
 
+  mResultType = LDAP_RES_BIND;
+
   // make sure the connection knows where to call back once the messages
   // for this operation start coming in
   rv = mConnection->AddPendingOperation(mMsgID, this);
@@ -241,6 +244,8 @@ nsLDAPOperation::SaslStep(const char *token, uint32_t tokenLen)
   if (lderrno != LDAP_SUCCESS)
     return TranslateLDAPErrorToNSError(lderrno);
 
+  mResultType = LDAP_RES_BIND;
+
   // make sure the connection knows where to call back once the messages
   // for this operation start coming in
   rv = mConnection->AddPendingOperation(mMsgID, this);
@@ -301,6 +306,8 @@ nsLDAPOperation::SimpleBind(const nsACString& passwd)
                                                           0, 0));
     }
 
+    mResultType = LDAP_RES_BIND;
+
     // make sure the connection knows where to call back once the messages
     // for this operation start coming in
     rv = connection->AddPendingOperation(mMsgID, this);
@@ -490,6 +497,8 @@ nsLDAPOperation::SearchExt(const nsACString& aBaseDn, int32_t aScope,
     rv = TranslateLDAPErrorToNSError(retVal);
     NS_ENSURE_SUCCESS(rv, rv);
 
+    mResultType = LDAP_RES_SEARCH_RESULT;
+
     // make sure the connection knows where to call back once the messages
     // for this operation start coming in
     //
@@ -702,6 +711,8 @@ nsLDAPOperation::AddExt(const nsACString& aBaseDn,
   if (NS_FAILED(rv))
     return rv;
 
+  mResultType = LDAP_RES_ADD;
+
   // make sure the connection knows where to call back once the messages
   // for this operation start coming in
   rv = mConnection->AddPendingOperation(mMsgID, this);
@@ -752,6 +763,8 @@ nsLDAPOperation::DeleteExt(const nsACString& aBaseDn)
   if (NS_FAILED(rv))
     return rv;
 
+  mResultType = LDAP_RES_DELETE;
+
   // make sure the connection knows where to call back once the messages
   // for this operation start coming in
   rv = mConnection->AddPendingOperation(mMsgID, this);
@@ -865,6 +878,8 @@ nsLDAPOperation::ModifyExt(const nsACString& aBaseDn,
   if (NS_FAILED(rv))
     return rv;
 
+  mResultType = LDAP_RES_MODIFY;
+
   // make sure the connection knows where to call back once the messages
   // for this operation start coming in
   rv = mConnection->AddPendingOperation(mMsgID, this);
@@ -928,6 +943,8 @@ nsLDAPOperation::Rename(const nsACString& aBaseDn,
   if (NS_FAILED(rv))
     return rv;
 
+  mResultType = LDAP_RES_MODRDN;
+
   // make sure the connection knows where to call back once the messages
   // for this operation start coming in
   rv = mConnection->AddPendingOperation(mMsgID, this);
@@ -41,6 +41,10 @@ class nsLDAPOperation : public nsILDAPOperation
     // Stores the request number for later check of the operation is still valid
     uint32_t mRequestNum;
 
+    // The type of the result that ends the request in progress, so that the
+    // connection can end it with an error when the server is gone
+    int32_t mResultType;
+
   private:
     virtual ~nsLDAPOperation();
 
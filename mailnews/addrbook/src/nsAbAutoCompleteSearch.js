@@ -11,6 +11,8 @@ var {
   generateQueryURI,
 } = ChromeUtils.import("resource:///modules/ABQueryUtils.jsm");
 var {XPCOMUtils} = ChromeUtils.import("resource://gre/modules/XPCOMUtils.jsm");
+var {fixIterator} = ChromeUtils.import("resource:///modules/iteratorUtils.jsm");
+var {ABAutoCompleteIndex} = ChromeUtils.import("resource:///modules/ABAutoCompleteIndex.jsm");
 
 var ACR = Ci.nsIAutoCompleteResult;
 var nsIAbAutoCompleteResult = Ci.nsIAbAutoCompleteResult;
@@ -184,14 +186,23 @@ nsAbAutoCompleteSearch.prototype = {
    * a mailing list) then the function will add a result for each email address
    * that exists.
    *
+   * If the model query is the default one and the directory is a local
+   * address book, the in-memory ABAutoCompleteIndex is searched instead of
+   * running the boolean query against every card of the directory.
+   *
    * @param searchQuery  The boolean search query to use.
+   * @param searchWords  Array of the lowercased words of the search string.
+   * @param useIndex     Whether the model query allows the index to be used.
    * @param directory    An nsIAbDirectory to search.
    * @param result       The result element to append results to.
    */
-  _searchCards(searchQuery, directory, result) {
+  _searchCards(searchQuery, searchWords, useIndex, directory, result) {
     let childCards;
     try {
-      childCards = this._abManager.getDirectory(directory.URI + searchQuery).childCards;
+      if (useIndex && ABAutoCompleteIndex.canIndex(directory))
+        childCards = ABAutoCompleteIndex.search(directory, searchWords);
+      else
+        childCards = fixIterator(this._abManager.getDirectory(directory.URI + searchQuery).childCards);
     } catch (e) {
       Cu.reportError("Error running addressbook query '" + searchQuery + "': " + e);
       return;
@@ -201,9 +212,7 @@ nsAbAutoCompleteSearch.prototype = {
     var commentColumn = this._commentColumn == 1 ? directory.dirName : "";
 
     // Now iterate through all the cards.
-    while (childCards.hasMoreElements()) {
-      var card = childCards.getNext();
-
+    for (let card of childCards) {
       if (card instanceof Ci.nsIAbCard) {
         if (card.isMailList) {
           this._addToResult(commentColumn, directory, card, "", true, result);
@@ -422,7 +431,8 @@ nsAbAutoCompleteSearch.prototype = {
         let dir = allABs.getNext();
         if (dir instanceof Ci.nsIAbDirectory &&
             dir.useForAutocomplete(("idKey" in params) ? params.idKey : null)) {
-          this._searchCards(searchQuery, dir, result);
+          this._searchCards(searchQuery, searchWords,
+                            !result._modelQueryHasUserValue, dir, result);
         }
       }
 
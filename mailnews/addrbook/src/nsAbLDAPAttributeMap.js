@@ -131,9 +131,9 @@ nsAbLDAPAttributeMap.prototype = {
     var msgAttrCount = {};
     var msgAttrs = aMessage.getAttributes(msgAttrCount);
 
-    // downcase the array for comparison
-    function toLower(a) { return a.toLowerCase(); }
-    msgAttrs = msgAttrs.map(toLower);
+    // downcase the attributes for comparison; replication calls this for
+    // every entry, so keep the lookups below constant time
+    msgAttrs = new Set(msgAttrs.map(a => a.toLowerCase()));
 
     // deal with each addressbook property
     for (var prop in this.mPropertyMap) {
@@ -142,7 +142,7 @@ nsAbLDAPAttributeMap.prototype = {
         attr = attr.toLowerCase();
 
         // find the first attr that exists in this message
-        if (msgAttrs.includes(attr)) {
+        if (msgAttrs.has(attr)) {
           try {
             var values = aMessage.getValues(attr, {});
             // strip out the optional label from the labeledURI
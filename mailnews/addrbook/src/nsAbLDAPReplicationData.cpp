@@ -12,6 +12,9 @@
 #include "nsILDAPErrors.h"
 #include "nsComponentManagerUtils.h"
 #include "nsMsgUtils.h"
+#include "mozilla/Logging.h"
+
+extern mozilla::LazyLogModule gLDAPLogModule;  // defined in nsLDAPService.cpp
 
 // once bug # 101252 gets fixed, this should be reverted back to be non threadsafe
 // implementation is not really thread safe since each object should exist
@@ -23,6 +26,7 @@ nsAbLDAPProcessReplicationData::nsAbLDAPProcessReplicationData() :
   mState(kIdle),
   mProtocol(-1),
   mCount(0),
+  mStartTime(0),
   mDBOpen(false),
   mInitialized(false)
 {
@@ -204,6 +208,7 @@ nsresult nsAbLDAPProcessReplicationData::DoTask()
     return rv;
 
   mState = kReplicatingAll;
+  mStartTime = PR_Now();
 
   if (mListener && NS_SUCCEEDED(rv))
     // XXX Cast from bool to nsresult
@@ -251,13 +256,9 @@ nsresult nsAbLDAPProcessReplicationData::OnLDAPSearchEntry(nsILDAPMessage *aMess
         return NS_OK;
     }
 
-    rv = mReplicationDB->CreateNewCardAndAddToDB(newCard, false, nullptr);
-    if(NS_FAILED(rv)) {
-        Abort();
-        return rv;
-    }
-
-    // now set the attribute for the DN of the entry in the card in the DB
+    // Set the DN and modification date before the card is added, so the
+    // row is written once instead of being looked up again and rewritten
+    // by EditCard().
     nsAutoCString authDN;
     rv = aMessage->GetDn(authDN);
     if(NS_SUCCEEDED(rv) && !authDN.IsEmpty())
@@ -265,7 +266,11 @@ nsresult nsAbLDAPProcessReplicationData::OnLDAPSearchEntry(nsILDAPMessage *aMess
         newCard->SetPropertyAsAUTF8String("_DN", authDN);
     }
 
-    rv = mReplicationDB->EditCard(newCard, false, nullptr);
+    uint32_t nowInSeconds;
+    PRTime2Seconds(PR_Now(), &nowInSeconds);
+    newCard->SetPropertyAsUint32(kLastModifiedDateProperty, nowInSeconds);
+
+    rv = mReplicationDB->CreateNewCardAndAddToDB(newCard, false, nullptr);
     if(NS_FAILED(rv)) {
         Abort();
         return rv;
@@ -302,6 +307,13 @@ nsresult nsAbLDAPProcessReplicationData::OnLDAPSearchResult(nsILDAPMessage *aMes
     if(NS_SUCCEEDED(rv)) {
         // We are done with the LDAP search for all entries.
         if(errorCode == nsILDAPErrors::SUCCESS || errorCode == nsILDAPErrors::SIZELIMIT_EXCEEDED) {
+            if (MOZ_LOG_TEST(gLDAPLogModule, mozilla::LogLevel::Info)) {
+                double seconds = double(PR_Now() - mStartTime) / PR_USEC_PER_SEC;
+                MOZ_LOG(gLDAPLogModule, mozilla::LogLevel::Info,
+                       ("LDAP replication: %d entries in %.2fs (%.0f entries/s)",
+                        mCount, seconds,
+                        seconds > 0 ? mCount / seconds : 0.0));
+            }
             Done(true);
             if(mReplicationDB && mDBOpen) {
                 rv = mReplicationDB->Close(true);
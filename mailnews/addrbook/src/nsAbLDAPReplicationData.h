@@ -48,6 +48,7 @@ protected:
   int32_t         mState;
   int32_t         mProtocol;
   int32_t         mCount;
+  PRTime          mStartTime;
   bool            mDBOpen;
   bool            mInitialized;
 
@@ -0,0 +1,138 @@
+/*
+ * Tests for the in-memory autocomplete index - checks that address book
+ * changes are reflected in autocomplete results without a rebuild, and
+ * measures lookup latency on a large synthetic book.
+ */
+
+var {ABAutoCompleteIndex, ABDirectoryIndex} =
+  ChromeUtils.import("resource:///modules/ABAutoCompleteIndex.jsm");
+
+var ACR = Ci.nsIAutoCompleteResult;
+
+function acObserver() {}
+
+acObserver.prototype = {
+  _search: null,
+  _result: null,
+
+  onSearchResult(aSearch, aResult) {
+    this._search = aSearch;
+    this._result = aResult;
+  },
+};
+
+var acs;
+var obs = new acObserver();
+
+function search(aString) {
+  acs.startSearch(aString, JSON.stringify({ type: "addr_to", idKey: "" }),
+                  null, obs);
+  let values = [];
+  for (let i = 0; i < obs._result.matchCount; i++)
+    values.push(obs._result.getValueAt(i));
+  return values;
+}
+
+// A card-like object, enough for ABDirectoryIndex.
+function FakeCard(aId, aFirstName, aLastName, aEmail) {
+  this.localId = String(aId);
+  this.firstName = aFirstName;
+  this.lastName = aLastName;
+  this.displayName = aFirstName + " " + aLastName;
+  this.primaryEmail = aEmail;
+}
+
+FakeCard.prototype = {
+  isMailList: false,
+  getProperty(aName, aDefault) {
+    return aDefault;
+  },
+};
+
+function test_incremental_updates() {
+  MailServices.ab.directories;
+  let ab = MailServices.ab.getDirectory(kPABData.URI);
+  Assert.ok(ABAutoCompleteIndex.canIndex(ab));
+
+  let card = Cc["@mozilla.org/addressbook/cardproperty;1"]
+               .createInstance(Ci.nsIAbCard);
+  card.displayName = "Original Name";
+  card.primaryEmail = "tester@index.invalid";
+  card = ab.addCard(card);
+
+  // The first search builds the index.
+  Assert.deepEqual(search("tester"), ["Original Name <tester@index.invalid>"]);
+
+  // Additions are picked up.
+  let other = Cc["@mozilla.org/addressbook/cardproperty;1"]
+                .createInstance(Ci.nsIAbCard);
+  other.displayName = "Another Tester";
+  other.primaryEmail = "another@index.invalid";
+  other = ab.addCard(other);
+  Assert.deepEqual(search("tester"), ["Another Tester <another@index.invalid>",
+                                      "Original Name <tester@index.invalid>"]);
+
+  // Modifications are picked up, and the old text no longer matches.
+  card.displayName = "Renamed Person";
+  ab.modifyCard(card);
+  Assert.deepEqual(search("renamed"),
+                   ["Renamed Person <tester@index.invalid>"]);
+  Assert.deepEqual(search("original"), []);
+
+  // Short words are answered by scanning.
+  Assert.deepEqual(search("re pe"),
+                   ["Renamed Person <tester@index.invalid>"]);
+
+  // Deletions are picked up.
+  let cards = Cc["@mozilla.org/array;1"].createInstance(Ci.nsIMutableArray);
+  cards.appendElement(other);
+  ab.deleteCards(cards);
+  Assert.deepEqual(search("another"), []);
+  Assert.equal(obs._result.searchResult, ACR.RESULT_NOMATCH);
+}
+
+function test_benchmark() {
+  const kCards = 100000;
+  const kFirst = ["john", "jane", "alex", "maria", "wei", "olga", "pierre",
+                  "sven", "yuki", "amir"];
+  const kLast = ["smith", "doe", "garcia", "müller", "tanaka", "novak",
+                 "dubois", "larsen", "cohen", "singh"];
+
+  let index = new ABDirectoryIndex(false);
+  let start = Date.now();
+  for (let i = 0; i < kCards; i++) {
+    let first = kFirst[i % kFirst.length];
+    let last = kLast[Math.floor(i / kFirst.length) % kLast.length] +
+               Math.floor(i / 100);
+    index.addCard(new FakeCard(i, first, last,
+                               first + "." + last + "@example" +
+                               (i % 37) + ".invalid"));
+  }
+  info("Indexed " + kCards + " cards in " + (Date.now() - start) + "ms");
+  Assert.equal(index.size, kCards);
+
+  const kQueries = [["smith42"], ["john", "doe3"], ["ller99"],
+                    ["yuki", "example7."], ["nomatch"]];
+  const kRounds = 100;
+  start = Date.now();
+  let matches = 0;
+  for (let round = 0; round < kRounds; round++) {
+    for (let query of kQueries)
+      matches += index.search(query).length;
+  }
+  let elapsed = Date.now() - start;
+  info("Ran " + kRounds * kQueries.length + " lookups in " + elapsed +
+       "ms (" + (elapsed / (kRounds * kQueries.length)).toFixed(3) +
+       "ms per lookup, " + matches / kRounds + " matches per round)");
+
+  Assert.equal(index.search(["smith42"]).length, 110);
+  Assert.equal(index.search(["nomatch"]).length, 0);
+}
+
+function run_test() {
+  acs = Cc["@mozilla.org/autocomplete/search;1?name=addrbook"]
+          .getService(Ci.nsIAutoCompleteSearch);
+
+  test_incremental_updates();
+  test_benchmark();
+}
@@ -543,7 +543,10 @@ function saveFilter()
     AssignMeaningfulName();
 
   gFilter.filterType = gFilterType;
-  saveSearchTerms(gFilter.searchTerms, gFilter);
+  let searchTerms = gFilter.searchTerms;
+  saveSearchTerms(searchTerms, gFilter);
+  // The terms were edited in place; set them again so the filter notices.
+  gFilter.searchTerms = searchTerms;
 
   if (isNewFilter)
   {
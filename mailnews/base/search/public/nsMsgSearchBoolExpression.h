@@ -4,10 +4,15 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
 #include "nsMsgSearchCore.h"
+#include "nsDataHashtable.h"
+#include "nsHashKeys.h"
+#include "nsTArray.h"
 
 #ifndef __nsMsgSearchBoolExpression_h
 #define __nsMsgSearchBoolExpression_h
 
+class nsMsgSearchTermCache;
+
 //-----------------------------------------------------------------------------
 // nsMsgSearchBoolExpression is a class added to provide AND/OR terms in search queries.
 //  A nsMsgSearchBoolExpression contains either a search term or two nsMsgSearchBoolExpressions and
@@ -63,9 +68,12 @@ public:
     // parses the expression tree and all
     // expressions underneath this node to
     // determine if the end result is true or false.
+    // If aTermCache is given, terms it knows about are only matched
+    // once per message.
   bool OfflineEvaluate(nsIMsgDBHdr *msgToMatch,
           const char *defaultCharset, nsIMsgSearchScopeTerm *scope,
-          nsIMsgDatabase *db, const nsACString& headers, bool Filtering);
+          nsIMsgDatabase *db, const nsACString& headers, bool Filtering,
+          nsMsgSearchTermCache *aTermCache = nullptr);
 
     // assuming the expression is for online
     // searches, determine the length of the
@@ -84,6 +92,8 @@ public:
   nsMsgSearchBooleanOperator m_boolOp;
 
 protected:
+  friend class nsMsgSearchTermCache;
+
   // if we are a leaf node, all we have is a search term
 
     nsIMsgSearchTerm * m_term;
@@ -103,4 +113,28 @@ protected:
                                                    char * encodingStr);
 };
 
+/* nsMsgSearchTermCache --> remembers the results of the search terms of
+   several expression trees which are evaluated on the same message, e.g.
+   when a whole filter list is run in one pass over a folder. Terms which
+   have the same termAsString share one result, so a body term used by
+   several filters only reads the message body once.
+ */
+class nsMsgSearchTermCache
+{
+public:
+  // give the terms of an expression tree their result slots
+  void AddTerms(nsMsgSearchBoolExpression *aExpression);
+  // forget all results, before moving on to the next message
+  void Clear();
+
+  bool GetResult(nsIMsgSearchTerm *aTerm, bool *aResult);
+  void SetResult(nsIMsgSearchTerm *aTerm, bool aResult);
+
+protected:
+  nsDataHashtable<nsPtrHashKey<nsIMsgSearchTerm>, uint32_t> m_slots;
+  nsDataHashtable<nsCStringHashKey, uint32_t> m_slotsByTerm;
+  // per slot: -1 if not evaluated yet, else the result
+  nsTArray<int8_t> m_results;
+};
+
 #endif
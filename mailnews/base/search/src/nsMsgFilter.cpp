@@ -172,6 +172,7 @@ nsMsgFilter::nsMsgFilter():
     m_temporary(false),
     m_unparseable(false),
     m_filterList(nullptr),
+    m_termsGeneration(0),
     m_expressionTree(nullptr)
 {
   m_termList = nsArray::Create();
@@ -246,6 +247,7 @@ NS_IMETHODIMP nsMsgFilter::AppendTerm(nsIMsgSearchTerm * aTerm)
     // invalidate expression tree if we're changing the terms
     delete m_expressionTree;
     m_expressionTree = nullptr;
+    m_termsGeneration++;
     return m_termList->AppendElement(aTerm);
 }
 
@@ -448,6 +450,7 @@ NS_IMETHODIMP nsMsgFilter::SetSearchTerms(nsIMutableArray *aSearchList)
 {
     delete m_expressionTree;
     m_expressionTree = nullptr;
+    m_termsGeneration++;
     m_termList = aSearchList;
     return NS_OK;
 }
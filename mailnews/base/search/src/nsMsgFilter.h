@@ -70,6 +70,10 @@ public:
   static const char *GetActionStr(nsMsgRuleActionType action);
   static nsresult GetActionFilingStr(nsMsgRuleActionType action, nsCString &actionStr);
   static nsMsgRuleActionType GetActionForFilingStr(nsCString &actionStr);
+
+  // Incremented by AppendTerm and SetSearchTerms. Callers which edit the
+  // terms in place through GetSearchTerms must set them again afterwards.
+  uint32_t  GetTermsGeneration() const { return m_termsGeneration; }
 protected:
 
   /*
@@ -93,6 +97,7 @@ protected:
   bool m_temporary;
   bool m_unparseable;
   nsIMsgFilterList *m_filterList;  /* owning filter list */
+  uint32_t m_termsGeneration;
   nsCOMPtr<nsIMutableArray> m_termList;       /* linked list of criteria terms */
   nsCOMPtr<nsIMsgSearchScopeTerm> m_scope;         /* default for mail rules is inbox, but news rules could
                                                   have a newsgroup - LDAP would be invalid */
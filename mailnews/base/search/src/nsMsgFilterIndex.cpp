@@ -0,0 +1,664 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "msgCore.h"
+#include "nsMsgFilterIndex.h"
+#include "nsMsgFilter.h"
+#include "nsIMsgHdr.h"
+#include "nsIMutableArray.h"
+#include "nsArrayUtils.h"
+#include "nsIMimeConverter.h"
+#include "nsMsgMimeCID.h"
+#include "nsMsgMessageFlags.h"
+#include "nsMsgSearchCore.h"
+#include "nsUnicharUtils.h"
+#include "nsServiceManagerUtils.h"
+#include "mozilla/mailnews/MimeHeaderParser.h"
+
+using namespace mozilla::mailnews;
+
+static bool
+HasSurrogates(const nsAString &aText)
+{
+  const char16_t *cur = aText.BeginReading();
+  const char16_t *end = aText.EndReading();
+  for (; cur < end; cur++)
+  {
+    if (NS_IS_HIGH_SURROGATE(*cur) || NS_IS_LOW_SURROGATE(*cur))
+      return true;
+  }
+  return false;
+}
+
+// Whether raw headers decode to themselves: printable ASCII, no encoded words
+// and no escape sequences of stateful charsets. Lines may be separated by
+// nulls, as the mail parser passes them.
+static bool
+IsPlainHeader(const nsACString &aRaw)
+{
+  const char *cur = aRaw.BeginReading();
+  const char *end = aRaw.EndReading();
+  for (; cur < end; cur++)
+  {
+    unsigned char c = *cur;
+    if (c >= 0x7f ||
+        (c < 0x20 && c != '\t' && c != '\r' && c != '\n' && c != '\0'))
+      return false;
+    if (c == '=' && cur + 1 < end && cur[1] == '?')
+      return false;
+  }
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+// nsMsgStringMatcher
+////////////////////////////////////////////////////////////////////////////////////////
+
+nsMsgStringMatcher::nsMsgStringMatcher()
+{
+  State *root = m_states.AppendElement();
+  root->fail = 0;
+  root->output = 0;
+  m_stateChars.AppendElement(0);
+}
+
+void nsMsgStringMatcher::AddNeedle(const nsAString &aNeedle, uint32_t aId)
+{
+  uint32_t state = 0;
+  const char16_t *cur = aNeedle.BeginReading();
+  const char16_t *end = aNeedle.EndReading();
+  for (; cur < end; cur++)
+  {
+    uint32_t next;
+    if (!m_transitions.Get(TransitionKey(state, *cur), &next))
+    {
+      next = m_states.Length();
+      State *added = m_states.AppendElement();
+      added->fail = 0;
+      added->output = 0;
+      m_stateChars.AppendElement(*cur);
+      m_states[state].children.AppendElement(next);
+      m_transitions.Put(TransitionKey(state, *cur), next);
+    }
+    state = next;
+  }
+  if (!m_states[state].ids.Contains(aId))
+    m_states[state].ids.AppendElement(aId);
+}
+
+void nsMsgStringMatcher::Compile()
+{
+  // Breadth first, so the fail state of a state is done before the state.
+  nsTArray<uint32_t> queue;
+  for (uint32_t child : m_states[0].children)
+  {
+    m_states[child].fail = 0;
+    m_states[child].output = 0;
+    queue.AppendElement(child);
+  }
+
+  for (uint32_t i = 0; i < queue.Length(); i++)
+  {
+    uint32_t state = queue[i];
+    for (uint32_t child : m_states[state].children)
+    {
+      char16_t c = m_stateChars[child];
+      uint32_t fail = m_states[state].fail;
+      uint32_t next = 0;
+      while (!m_transitions.Get(TransitionKey(fail, c), &next) && fail)
+        fail = m_states[fail].fail;
+      if (next == child)
+        next = 0;
+      m_states[child].fail = next;
+      m_states[child].output = m_states[next].ids.IsEmpty() ?
+                               m_states[next].output : next;
+      queue.AppendElement(child);
+    }
+  }
+}
+
+uint32_t nsMsgStringMatcher::Next(uint32_t aState, char16_t aChar) const
+{
+  uint32_t next;
+  while (!m_transitions.Get(TransitionKey(aState, aChar), &next))
+  {
+    if (!aState)
+      return 0;
+    aState = m_states[aState].fail;
+  }
+  return next;
+}
+
+void nsMsgStringMatcher::Match(const nsAString &aText,
+                               nsTArray<uint32_t> &aIds) const
+{
+  if (IsEmpty())
+    return;
+
+  uint32_t state = 0;
+  const char16_t *cur = aText.BeginReading();
+  const char16_t *end = aText.EndReading();
+  for (; cur < end; cur++)
+  {
+    state = Next(state, *cur);
+    for (uint32_t found = m_states[state].ids.IsEmpty() ?
+                          m_states[state].output : state;
+         found; found = m_states[found].output)
+      aIds.AppendElements(m_states[found].ids);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+// nsMsgFilterIndex
+////////////////////////////////////////////////////////////////////////////////////////
+
+nsMsgFilterIndex::nsMsgFilterIndex() :
+  m_stamp(0)
+{
+  for (uint32_t i = 0; i < kNumHeaderFields; i++)
+    m_fields.AppendElement(mozilla::MakeUnique<FieldIndex>());
+}
+
+bool nsMsgFilterIndex::IsCurrent(const nsTArray<nsCOMPtr<nsIMsgFilter> > &aFilters) const
+{
+  if (aFilters.Length() != m_generations.Length())
+    return false;
+  for (uint32_t i = 0; i < aFilters.Length(); i++)
+  {
+    if (aFilters[i] &&
+        static_cast<nsMsgFilter*>(aFilters[i].get())->GetTermsGeneration() !=
+          m_generations[i])
+      return false;
+  }
+  return true;
+}
+
+uint32_t nsMsgFilterIndex::GetHeaderField(const nsACString &aHeaderName)
+{
+  nsAutoCString headerName(aHeaderName);
+  ToLowerCase(headerName);
+  for (uint32_t i = kNumHeaderFields; i < m_fields.Length(); i++)
+  {
+    if (m_fields[i]->headerName.Equals(headerName))
+      return i;
+  }
+  m_fields.AppendElement(mozilla::MakeUnique<FieldIndex>());
+  m_fields.LastElement()->headerName = headerName;
+  return m_fields.Length() - 1;
+}
+
+nsresult nsMsgFilterIndex::ClassifyTerm(nsIMsgSearchTerm *aTerm, Probe &aProbe)
+{
+  aProbe.kind = kNoProbe;
+  aProbe.numFields = 0;
+
+  nsMsgSearchAttribValue attrib;
+  nsMsgSearchOpValue op;
+  nsresult rv = aTerm->GetAttrib(&attrib);
+  NS_ENSURE_SUCCESS(rv, rv);
+  rv = aTerm->GetOp(&op);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  nsCOMPtr<nsIMsgSearchValue> value;
+  rv = aTerm->GetValue(getter_AddRefs(value));
+  if (NS_FAILED(rv) || !value)
+    return NS_OK;
+
+  if (op == nsMsgSearchOp::IsInAB)
+  {
+    switch (attrib)
+    {
+      case nsMsgSearchAttrib::Sender:
+        aProbe.fields[aProbe.numFields++] = kFrom;
+        break;
+      case nsMsgSearchAttrib::To:
+        aProbe.fields[aProbe.numFields++] = kTo;
+        break;
+      case nsMsgSearchAttrib::CC:
+        aProbe.fields[aProbe.numFields++] = kCc;
+        break;
+      case nsMsgSearchAttrib::ToOrCC:
+        aProbe.fields[aProbe.numFields++] = kTo;
+        aProbe.fields[aProbe.numFields++] = kCc;
+        break;
+      case nsMsgSearchAttrib::AllAddresses:
+        aProbe.fields[aProbe.numFields++] = kFrom;
+        aProbe.fields[aProbe.numFields++] = kTo;
+        aProbe.fields[aProbe.numFields++] = kCc;
+        aProbe.fields[aProbe.numFields++] = kBcc;
+        break;
+      default:
+        return NS_OK;
+    }
+    nsAutoString uri;
+    value->GetStr(uri);
+    if (uri.IsEmpty())
+    {
+      aProbe.numFields = 0;
+      return NS_OK;
+    }
+    CopyUTF16toUTF8(uri, aProbe.addressBook);
+    aProbe.kind = kInAddressBook;
+    return NS_OK;
+  }
+
+  if (op != nsMsgSearchOp::Contains && op != nsMsgSearchOp::Is &&
+      op != nsMsgSearchOp::BeginsWith && op != nsMsgSearchOp::EndsWith)
+    return NS_OK;
+
+  nsAutoString needle;
+  value->GetStr(needle);
+  if (needle.IsEmpty() || HasSurrogates(needle))
+    return NS_OK;
+  ToFoldedCase(needle);
+
+  switch (attrib)
+  {
+    case nsMsgSearchAttrib::Subject:
+      aProbe.fields[aProbe.numFields++] = kSubject;
+      aProbe.kind = op == nsMsgSearchOp::Is ? kEquals : kContains;
+      break;
+    case nsMsgSearchAttrib::Sender:
+    case nsMsgSearchAttrib::To:
+    case nsMsgSearchAttrib::CC:
+    case nsMsgSearchAttrib::ToOrCC:
+    case nsMsgSearchAttrib::AllAddresses:
+      if (attrib == nsMsgSearchAttrib::Sender ||
+          attrib == nsMsgSearchAttrib::AllAddresses)
+        aProbe.fields[aProbe.numFields++] = kFrom;
+      if (attrib != nsMsgSearchAttrib::Sender &&
+          attrib != nsMsgSearchAttrib::CC)
+        aProbe.fields[aProbe.numFields++] = kTo;
+      if (attrib != nsMsgSearchAttrib::Sender &&
+          attrib != nsMsgSearchAttrib::To)
+        aProbe.fields[aProbe.numFields++] = kCc;
+      if (attrib == nsMsgSearchAttrib::AllAddresses)
+        aProbe.fields[aProbe.numFields++] = kBcc;
+      // Contains matches the whole decoded header, the other operators each
+      // name and address in it.
+      if (op == nsMsgSearchOp::Contains)
+        aProbe.kind = kContains;
+      else if (op == nsMsgSearchOp::Is)
+        aProbe.kind = kEquals;
+      else
+        aProbe.kind = kTokenContains;
+      break;
+    default:
+    {
+      if (attrib <= nsMsgSearchAttrib::OtherHeader ||
+          attrib >= nsMsgSearchAttrib::kNumMsgSearchAttributes)
+        return NS_OK;
+      // Continuation lines are matched joined by a space, which the raw
+      // headers don't have.
+      if (needle.FindChar(' ') != kNotFound || needle.FindChar('\t') != kNotFound)
+        return NS_OK;
+      nsAutoCString headerName;
+      aTerm->GetArbitraryHeader(headerName);
+      if (headerName.IsEmpty())
+        return NS_OK;
+      aProbe.fields[aProbe.numFields++] = GetHeaderField(headerName);
+      aProbe.kind = kContains;
+      break;
+    }
+  }
+  aProbe.needle = needle;
+  return NS_OK;
+}
+
+void nsMsgFilterIndex::AddProbe(const Probe &aProbe, nsIMsgSearchTerm *aTerm,
+                                uint32_t aFilterIndex)
+{
+  for (uint32_t i = 0; i < aProbe.numFields; i++)
+  {
+    FieldIndex *field = m_fields[aProbe.fields[i]].get();
+    if (field->filters.IsEmpty() || field->filters.LastElement() != aFilterIndex)
+      field->filters.AppendElement(aFilterIndex);
+
+    switch (aProbe.kind)
+    {
+      case kContains:
+        field->contains.AddNeedle(aProbe.needle, aFilterIndex);
+        break;
+      case kEquals:
+        field->equals.LookupOrAdd(aProbe.needle)->AppendElement(aFilterIndex);
+        break;
+      case kTokenContains:
+        field->tokenContains.AddNeedle(aProbe.needle, aFilterIndex);
+        break;
+      case kInAddressBook:
+      {
+        AddressBookProbe *probe = nullptr;
+        for (AddressBookProbe &existing : field->inAddressBook)
+        {
+          if (existing.uri.Equals(aProbe.addressBook))
+          {
+            probe = &existing;
+            break;
+          }
+        }
+        if (!probe)
+        {
+          probe = field->inAddressBook.AppendElement();
+          probe->uri = aProbe.addressBook;
+          probe->term = aTerm;
+        }
+        probe->filters.AppendElement(aFilterIndex);
+        break;
+      }
+      default:
+        break;
+    }
+  }
+}
+
+nsresult nsMsgFilterIndex::Build(const nsTArray<nsCOMPtr<nsIMsgFilter> > &aFilters)
+{
+  m_fields.TruncateLength(kNumHeaderFields);
+  for (uint32_t i = 0; i < kNumHeaderFields; i++)
+    m_fields[i] = mozilla::MakeUnique<FieldIndex>();
+  m_unindexed.Clear();
+  m_firedStamp.Clear();
+  m_firedStamp.SetLength(aFilters.Length());
+  for (uint32_t &stamp : m_firedStamp)
+    stamp = 0;
+  m_stamp = 0;
+  m_generations.Clear();
+  m_generations.SetLength(aFilters.Length());
+
+  nsTArray<Probe> probes;
+  nsTArray<nsCOMPtr<nsIMsgSearchTerm> > probeTerms;
+  for (uint32_t filterIndex = 0; filterIndex < aFilters.Length(); filterIndex++)
+  {
+    nsCOMPtr<nsIMutableArray> terms;
+    uint32_t numTerms = 0;
+    if (aFilters[filterIndex])
+    {
+      m_generations[filterIndex] =
+        static_cast<nsMsgFilter*>(aFilters[filterIndex].get())->GetTermsGeneration();
+      aFilters[filterIndex]->GetSearchTerms(getter_AddRefs(terms));
+    }
+    if (terms)
+      terms->GetLength(&numTerms);
+
+    // Only plain conjunctions and disjunctions are indexed. For an AND, one
+    // term has to match, so it is enough to index the most selective one; for
+    // an OR, every term has to be indexed.
+    bool indexable = numTerms > 0;
+    bool booleanAnd = true;
+    probes.Clear();
+    probeTerms.Clear();
+    for (uint32_t i = 0; indexable && i < numTerms; i++)
+    {
+      nsCOMPtr<nsIMsgSearchTerm> term = do_QueryElementAt(terms, i);
+      if (!term)
+      {
+        indexable = false;
+        break;
+      }
+
+      bool flag;
+      term->GetMatchAll(&flag);
+      if (flag)
+        indexable = false;
+      term->GetBeginsGrouping(&flag);
+      if (flag)
+        indexable = false;
+      term->GetEndsGrouping(&flag);
+      if (flag)
+        indexable = false;
+      // The operator of the first term is not used.
+      term->GetBooleanAnd(&flag);
+      if (i == 1)
+        booleanAnd = flag;
+      else if (i > 1 && flag != booleanAnd)
+        indexable = false;
+
+      Probe *probe = probes.AppendElement();
+      if (NS_FAILED(ClassifyTerm(term, *probe)))
+        probe->kind = kNoProbe;
+      probeTerms.AppendElement(term);
+    }
+
+    int32_t best = -1;
+    if (indexable && booleanAnd)
+    {
+      for (uint32_t i = 0; i < probes.Length(); i++)
+      {
+        if (probes[i].kind == kNoProbe)
+          continue;
+        if (best < 0)
+        {
+          best = i;
+          continue;
+        }
+        // equals lookups and address books narrow down most, then longer
+        // needles
+        const Probe &current = probes[best];
+        const Probe &candidate = probes[i];
+        if (candidate.kind == kEquals && current.kind != kEquals)
+          best = i;
+        else if (candidate.kind == kInAddressBook &&
+                 current.kind != kEquals && current.kind != kInAddressBook)
+          best = i;
+        else if (candidate.kind == current.kind &&
+                 candidate.needle.Length() > current.needle.Length())
+          best = i;
+      }
+      indexable = best >= 0;
+    }
+    else if (indexable)
+    {
+      for (const Probe &probe : probes)
+      {
+        if (probe.kind == kNoProbe)
+          indexable = false;
+      }
+    }
+
+    if (!indexable)
+      m_unindexed.AppendElement(filterIndex);
+    else if (best >= 0)
+      AddProbe(probes[best], probeTerms[best], filterIndex);
+    else
+    {
+      for (uint32_t i = 0; i < probes.Length(); i++)
+        AddProbe(probes[i], probeTerms[i], filterIndex);
+    }
+  }
+
+  for (auto &field : m_fields)
+  {
+    field->contains.Compile();
+    field->tokenContains.Compile();
+  }
+  return NS_OK;
+}
+
+void nsMsgFilterIndex::Fire(uint32_t aFilterIndex, nsTArray<uint32_t> &aFired)
+{
+  if (m_firedStamp[aFilterIndex] == m_stamp)
+    return;
+  m_firedStamp[aFilterIndex] = m_stamp;
+  aFired.AppendElement(aFilterIndex);
+}
+
+void nsMsgFilterIndex::FireAll(FieldIndex &aField, nsTArray<uint32_t> &aFired)
+{
+  for (uint32_t filterIndex : aField.filters)
+    Fire(filterIndex, aFired);
+}
+
+void nsMsgFilterIndex::MatchAddresses(FieldIndex &aField,
+                                      const nsCString &aHeader,
+                                      const char *aCharset,
+                                      nsTArray<uint32_t> &aFired)
+{
+  for (AddressBookProbe &probe : aField.inAddressBook)
+  {
+    bool result = false;
+    nsresult rv = probe.term->MatchRfc822String(aHeader, aCharset, &result);
+    if (NS_FAILED(rv) || result)
+    {
+      for (uint32_t filterIndex : probe.filters)
+        Fire(filterIndex, aFired);
+    }
+  }
+
+  if (aField.equals.Count() == 0 && aField.tokenContains.IsEmpty())
+    return;
+
+  nsTArray<nsString> names, addresses;
+  ExtractAllAddresses(EncodedHeader(aHeader, aCharset), names, addresses);
+  nsTArray<uint32_t> found;
+  for (uint32_t i = 0; i < names.Length(); i++)
+  {
+    for (nsString *token : { &names[i], &addresses[i] })
+    {
+      if (HasSurrogates(*token))
+      {
+        FireAll(aField, aFired);
+        return;
+      }
+      ToFoldedCase(*token);
+      nsTArray<uint32_t> *equals = aField.equals.Get(*token);
+      if (equals)
+        found.AppendElements(*equals);
+      aField.tokenContains.Match(*token, found);
+    }
+  }
+  for (uint32_t filterIndex : found)
+    Fire(filterIndex, aFired);
+}
+
+nsresult nsMsgFilterIndex::GetCandidates(nsIMsgDBHdr *aMsgHdr,
+                                         const char *aDefaultCharset,
+                                         const nsACString &aHeaders,
+                                         nsTArray<uint32_t> &aCandidates)
+{
+  NS_ENSURE_ARG_POINTER(aMsgHdr);
+  aCandidates.Clear();
+
+  if (++m_stamp == 0)
+  {
+    for (uint32_t &stamp : m_firedStamp)
+      stamp = 0;
+    m_stamp = 1;
+  }
+
+  nsresult rv;
+  nsCOMPtr<nsIMimeConverter> mimeConverter =
+    do_GetService(NS_MIME_CONVERTER_CONTRACTID, &rv);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  // Same charset as nsMsgSearchOfflineMail::ProcessSearchTerm.
+  nsCString msgCharset;
+  aMsgHdr->GetCharset(getter_Copies(msgCharset));
+  const char *charset = msgCharset.IsEmpty() ? aDefaultCharset : msgCharset.get();
+
+  nsTArray<uint32_t> fired;
+  nsTArray<uint32_t> found;
+  nsAutoString decoded;
+  for (uint32_t fieldIndex = 0; fieldIndex < m_fields.Length(); fieldIndex++)
+  {
+    FieldIndex &field = *m_fields[fieldIndex];
+    if (field.filters.IsEmpty())
+      continue;
+
+    if (fieldIndex >= kNumHeaderFields)
+    {
+      // Arbitrary headers are searched for in the stored header value, if
+      // any, and in the raw headers. Only text which decodes to itself can
+      // be searched as is.
+      nsCString dbValue;
+      aMsgHdr->GetStringProperty(field.headerName.get(), getter_Copies(dbValue));
+      if (aHeaders.IsEmpty() || !IsPlainHeader(aHeaders) ||
+          !IsPlainHeader(dbValue))
+      {
+        FireAll(field, fired);
+        continue;
+      }
+      found.Clear();
+      CopyASCIItoUTF16(dbValue, decoded);
+      ToFoldedCase(decoded);
+      field.contains.Match(decoded, found);
+      CopyASCIItoUTF16(aHeaders, decoded);
+      ToFoldedCase(decoded);
+      field.contains.Match(decoded, found);
+      for (uint32_t filterIndex : found)
+        Fire(filterIndex, fired);
+      continue;
+    }
+
+    nsCString raw;
+    switch (fieldIndex)
+    {
+      case kSubject:
+      {
+        uint32_t flags = 0;
+        aMsgHdr->GetFlags(&flags);
+        if (flags & nsMsgMessageFlags::HasRe)
+          raw.AssignLiteral("Re: ");
+        nsCString subject;
+        aMsgHdr->GetSubject(getter_Copies(subject));
+        raw.Append(subject);
+        break;
+      }
+      case kFrom:
+        aMsgHdr->GetAuthor(getter_Copies(raw));
+        break;
+      case kTo:
+        aMsgHdr->GetRecipients(getter_Copies(raw));
+        break;
+      case kCc:
+        aMsgHdr->GetCcList(getter_Copies(raw));
+        break;
+      case kBcc:
+        aMsgHdr->GetBccList(getter_Copies(raw));
+        break;
+    }
+
+    found.Clear();
+    if (!field.contains.IsEmpty() ||
+        (fieldIndex == kSubject && field.equals.Count()))
+    {
+      // Decoded the way nsMsgSearchTerm::MatchRfc2047String does.
+      rv = mimeConverter->DecodeMimeHeader(raw.get(), charset, false, false,
+                                           decoded);
+      if (NS_FAILED(rv) || HasSurrogates(decoded))
+      {
+        FireAll(field, fired);
+        continue;
+      }
+      ToFoldedCase(decoded);
+      field.contains.Match(decoded, found);
+      if (fieldIndex == kSubject)
+      {
+        nsTArray<uint32_t> *equals = field.equals.Get(decoded);
+        if (equals)
+          found.AppendElements(*equals);
+      }
+    }
+    for (uint32_t filterIndex : found)
+      Fire(filterIndex, fired);
+
+    if (fieldIndex != kSubject)
+      MatchAddresses(field, raw, charset, fired);
+  }
+
+  // Merge the indexed hits into the filters which are always candidates,
+  // keeping filter order.
+  fired.Sort();
+  aCandidates.SetCapacity(m_unindexed.Length() + fired.Length());
+  uint32_t unindexed = 0, hit = 0;
+  while (unindexed < m_unindexed.Length() || hit < fired.Length())
+  {
+    if (hit == fired.Length() ||
+        (unindexed < m_unindexed.Length() && m_unindexed[unindexed] < fired[hit]))
+      aCandidates.AppendElement(m_unindexed[unindexed++]);
+    else
+      aCandidates.AppendElement(fired[hit++]);
+  }
+  return NS_OK;
+}
@@ -0,0 +1,160 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef _nsMsgFilterIndex_H_
+#define _nsMsgFilterIndex_H_
+
+#include "nsCOMPtr.h"
+#include "nsTArray.h"
+#include "nsString.h"
+#include "nsClassHashtable.h"
+#include "nsDataHashtable.h"
+#include "nsHashKeys.h"
+#include "nsIMsgFilter.h"
+#include "nsIMsgSearchTerm.h"
+#include "mozilla/UniquePtr.h"
+
+class nsIMsgDBHdr;
+
+////////////////////////////////////////////////////////////////////////////////////////
+// nsMsgStringMatcher is an Aho-Corasick automaton: it finds which of a set of
+// needles occur in a text in one pass over the text. Needles and texts are
+// case folded by the caller.
+////////////////////////////////////////////////////////////////////////////////////////
+
+class nsMsgStringMatcher
+{
+public:
+  nsMsgStringMatcher();
+
+  void AddNeedle(const nsAString &aNeedle, uint32_t aId);
+  // must be called after the last AddNeedle and before Match
+  void Compile();
+  bool IsEmpty() const { return m_states.Length() == 1; }
+  // appends the ids of the needles found in aText, possibly more than once
+  void Match(const nsAString &aText, nsTArray<uint32_t> &aIds) const;
+
+protected:
+  struct State
+  {
+    uint32_t fail;      // state of the longest proper suffix
+    uint32_t output;    // next state on the fail chain with ids, or 0
+    nsTArray<uint32_t> ids;
+    nsTArray<uint32_t> children;
+  };
+
+  uint32_t Next(uint32_t aState, char16_t aChar) const;
+  static uint64_t TransitionKey(uint32_t aState, char16_t aChar)
+  {
+    return (uint64_t(aState) << 16) | aChar;
+  }
+
+  nsTArray<State> m_states;
+  nsTArray<char16_t> m_stateChars;  // character leading to each state
+  nsDataHashtable<nsUint64HashKey, uint32_t> m_transitions;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////
+// nsMsgFilterIndex is a filter list compiled for matching incoming headers.
+// Filters whose terms are all ANDed or all ORed are indexed by their
+// subject, address and arbitrary header terms which can only match when the
+// header contains the term's value: is, contains, begins with, ends with and
+// is in address book. For a new header the index then gives the filters which
+// can possibly match, in filter order, with one pass over each header the
+// index needs; the caller still has to match these filters. Filters which
+// can't be indexed are always candidates.
+////////////////////////////////////////////////////////////////////////////////////////
+
+class nsMsgFilterIndex
+{
+public:
+  nsMsgFilterIndex();
+
+  nsresult Build(const nsTArray<nsCOMPtr<nsIMsgFilter> > &aFilters);
+  // whether aFilters are the filters of Build and none changed its terms since
+  bool IsCurrent(const nsTArray<nsCOMPtr<nsIMsgFilter> > &aFilters) const;
+
+  /**
+   * Get the indexes of the filters which may match a header, in filter order.
+   *
+   * @param aMsgHdr         the header
+   * @param aDefaultCharset charset to use when the header doesn't have one
+   * @param aHeaders        the raw headers of the message, if available
+   * @param aCandidates     returns the filter indexes
+   */
+  nsresult GetCandidates(nsIMsgDBHdr *aMsgHdr, const char *aDefaultCharset,
+                         const nsACString &aHeaders,
+                         nsTArray<uint32_t> &aCandidates);
+
+protected:
+  enum
+  {
+    kSubject,
+    kFrom,
+    kTo,
+    kCc,
+    kBcc,
+    kNumHeaderFields,
+    kNoField = kNumHeaderFields
+  };
+
+  // filters whose term "is in address book" for one address book hit
+  struct AddressBookProbe
+  {
+    nsCString uri;
+    nsCOMPtr<nsIMsgSearchTerm> term;
+    nsTArray<uint32_t> filters;
+  };
+
+  struct FieldIndex
+  {
+    // needles searched for in the decoded header
+    nsMsgStringMatcher contains;
+    // subject: the decoded header. Addresses: each name and address.
+    nsClassHashtable<nsStringHashKey, nsTArray<uint32_t> > equals;
+    // needles searched for in each name and address
+    nsMsgStringMatcher tokenContains;
+    nsTArray<AddressBookProbe> inAddressBook;
+    // arbitrary headers only: header name
+    nsCString headerName;
+    // all filters with terms on this field
+    nsTArray<uint32_t> filters;
+  };
+
+  // how a term can be looked up
+  enum ProbeKind
+  {
+    kNoProbe,
+    kContains,
+    kEquals,
+    kTokenContains,
+    kInAddressBook
+  };
+
+  struct Probe
+  {
+    ProbeKind kind = kNoProbe;
+    uint32_t fields[4];
+    uint32_t numFields = 0;
+    nsString needle;
+    nsCString addressBook;
+  };
+
+  nsresult ClassifyTerm(nsIMsgSearchTerm *aTerm, Probe &aProbe);
+  void AddProbe(const Probe &aProbe, nsIMsgSearchTerm *aTerm, uint32_t aFilterIndex);
+  uint32_t GetHeaderField(const nsACString &aHeaderName);
+  void Fire(uint32_t aFilterIndex, nsTArray<uint32_t> &aFired);
+  void FireAll(FieldIndex &aField, nsTArray<uint32_t> &aFired);
+  void MatchAddresses(FieldIndex &aField, const nsCString &aHeader,
+                      const char *aCharset, nsTArray<uint32_t> &aFired);
+
+  nsTArray<mozilla::UniquePtr<FieldIndex> > m_fields;
+  nsTArray<uint32_t> m_unindexed;   // filters that are always candidates
+  nsTArray<uint32_t> m_firedStamp;  // per filter, m_stamp when last found
+  nsTArray<uint32_t> m_generations; // per filter, terms generation at Build
+  uint32_t m_stamp;
+};
+
+#endif
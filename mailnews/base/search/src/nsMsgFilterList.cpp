@@ -10,6 +10,7 @@
 #include "msgCore.h"
 #include "nsMsgFilterList.h"
 #include "nsMsgFilter.h"
+#include "nsMsgFilterIndex.h"
 #include "nsIMsgFilterHitNotify.h"
 #include "nsMsgUtils.h"
 #include "nsMsgSearchTerm.h"
@@ -271,14 +272,28 @@ nsMsgFilterList::ApplyFiltersToHdr(nsMsgFilterTypeType filterType,
                                    nsIMsgWindow *msgWindow)
 {
   nsCOMPtr<nsIMsgFilter> filter;
-  uint32_t filterCount = 0;
-  nsresult rv = GetFilterCount(&filterCount);
+  nsresult rv = NS_OK;
+
+  // Only match the filters which the index says can match this header.
+  if (!m_filterIndex || !m_filterIndex->IsCurrent(m_filters))
+  {
+    m_filterIndex = mozilla::MakeUnique<nsMsgFilterIndex>();
+    rv = m_filterIndex->Build(m_filters);
+    NS_ENSURE_SUCCESS(rv, rv);
+  }
+
+  nsCString folderCharset;
+  if (folder)
+    folder->GetCharset(folderCharset);
+  nsTArray<uint32_t> candidates;
+  rv = m_filterIndex->GetCandidates(msgHdr, folderCharset.get(), headers,
+                                    candidates);
   NS_ENSURE_SUCCESS(rv, rv);
 
   RefPtr<nsMsgSearchScopeTerm> scope =
     new nsMsgSearchScopeTerm(nullptr, nsMsgSearchScope::offlineMail, folder);
 
-  for (uint32_t filterIndex = 0; filterIndex < filterCount; filterIndex++)
+  for (uint32_t filterIndex : candidates)
   {
     if (NS_SUCCEEDED(GetFilterAt(filterIndex, getter_AddRefs(filter))))
     {
@@ -566,6 +581,7 @@ nsresult nsMsgFilterList::LoadTextFilters(already_AddRefed<nsIInputStream> aStre
         }
         m_curFilter = filter;
         m_filters.AppendElement(filter);
+        m_filterIndex = nullptr;
       }
       break;
     case nsIMsgFilterList::attribEnabled:
@@ -936,6 +952,7 @@ nsMsgFilterList::GetFilterNamed(const nsAString &aName, nsIMsgFilter **aResult)
 nsresult nsMsgFilterList::SetFilterAt(uint32_t filterIndex, nsIMsgFilter *filter)
 {
   m_filters[filterIndex] = filter;
+  m_filterIndex = nullptr;
   return NS_OK;
 }
 
@@ -943,6 +960,7 @@ nsresult nsMsgFilterList::SetFilterAt(uint32_t filterIndex, nsIMsgFilter *filter
 nsresult nsMsgFilterList::RemoveFilterAt(uint32_t filterIndex)
 {
   m_filters.RemoveElementAt(filterIndex);
+  m_filterIndex = nullptr;
   return NS_OK;
 }
 
@@ -950,6 +968,7 @@ nsresult
 nsMsgFilterList::RemoveFilter(nsIMsgFilter *aFilter)
 {
   m_filters.RemoveElement(aFilter);
+  m_filterIndex = nullptr;
   return NS_OK;
 }
 
@@ -958,6 +977,7 @@ nsresult nsMsgFilterList::InsertFilterAt(uint32_t filterIndex, nsIMsgFilter *aFi
   if (!m_temporaryList)
     aFilter->SetFilterList(this);
   m_filters.InsertElementAt(filterIndex, aFilter);
+  m_filterIndex = nullptr;
 
   return NS_OK;
 }
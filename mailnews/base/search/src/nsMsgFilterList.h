@@ -13,6 +13,7 @@
 #include "nsTArray.h"
 #include "nsIFile.h"
 #include "nsIOutputStream.h"
+#include "mozilla/UniquePtr.h"
 
 const int16_t kFileVersion = 9;
 const int16_t kManualContextVersion = 9;
@@ -28,6 +29,7 @@ const int16_t k45Version = 6;
 
 class nsIMsgFilter;
 class nsMsgFilter;
+class nsMsgFilterIndex;
 
 class nsMsgFilterList : public nsIMsgFilterList
 {
@@ -64,6 +66,8 @@ protected:
   nsCString m_arbitraryHeaders;
   nsCOMPtr<nsIFile> m_defaultFile;
   nsCString m_unparsedFilterBuffer; //holds one entire filter unparsed
+  // candidate filters for ApplyFiltersToHdr, built on demand
+  mozilla::UniquePtr<nsMsgFilterIndex> m_filterIndex;
 
 private:
   nsresult TruncateLog();
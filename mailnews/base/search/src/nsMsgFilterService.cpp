@@ -45,7 +45,13 @@
 #include "nsAutoPtr.h"
 #include "nsIMsgFilter.h"
 #include "nsIMsgOperationListener.h"
+#include "nsITimer.h"
+#include "nsTHashtable.h"
+#include "nsHashKeys.h"
+#include "nsMsgLocalSearch.h"
+#include "nsMsgSearchBoolExpression.h"
 #include "mozilla/Attributes.h"
+#include "mozilla/UniquePtr.h"
 
 #define BREAK_IF_FAILURE(_rv, _text) if (NS_FAILED(_rv)) { \
   NS_WARNING(_text); \
@@ -268,10 +274,15 @@ nsMsgFilterService::ThrowAlertMsg(const char*aMsgName, nsIMsgWindow *aMsgWindow)
 
 // this class holds the list of filters and folders, and applies them in turn, first iterating
 // over all the filters on one folder, and then advancing to the next folder and repeating.
-// For each filter,we take the filter criteria and create a search term list. Then, we execute the search.
-// We are a search listener so that we can build up the list of search hits.
-// Then, when the search is done, we will apply the filter action(s) en-masse, so, for example, if the action is a move,
-// we calls one method to move all the messages to the destination folder. Or, mark all the messages read.
+// Rather than searching the folder once per filter, the filters are grouped into passes.
+// A pass is a run of filters where no filter depends on what an earlier filter of the run
+// changes (e.g. a filter on tags after a filter that adds a tag). For each pass we enumerate
+// the folder once, in time slices, and evaluate the terms of all the filters of the pass on
+// each message, sharing the results of equal terms between the filters. A message that hits
+// a filter which moves, deletes it or stops execution is not evaluated by the later filters.
+// Once the pass is done, we apply the filter action(s) of each filter en-masse to its hits,
+// so, for example, if the action is a move, we call one method to move all the messages to
+// the destination folder. Or, mark all the messages read.
 // In the case of imap operations, or imap/local  moves, the action will be asynchronous, so we'll need to be a url listener
 // as well, and kick off the next filter when the action completes.
 class nsMsgFilterAfterTheFact : public nsIUrlListener, public nsIMsgSearchNotify, public nsIMsgCopyServiceListener
@@ -296,6 +307,28 @@ protected:
   nsresult  OnEndExecution(); // do what we have to do to cleanup.
   bool      ContinueExecutionPrompt();
   nsresult  DisplayConfirmationPrompt(nsIMsgWindow *msgWindow, const char16_t *confirmString, bool *confirmed);
+
+  /**
+   * collect the filters of the next pass, starting at m_curFilterIndex
+   */
+  nsresult  BuildNextPass();
+  /**
+   * evaluate the filters of the pass on the messages of the current folder
+   * for a while. Sets aDone once all messages have been evaluated.
+   */
+  nsresult  ScanTimeSlice(bool *aDone);
+  static void ScanTimerCallback(nsITimer *aTimer, void *aClosure);
+
+  // a filter of the current pass, with its hits in the current folder
+  struct PassFilter
+  {
+    nsCOMPtr<nsIMsgFilter> filter;
+    mozilla::UniquePtr<nsMsgSearchBoolExpression> expression;
+    bool stopsFiltering;  // hits aren't evaluated by later filters
+    bool deletesPartial;  // only partial messages among the hits are
+    nsTArray<nsMsgKey> hits;
+  };
+
   nsCOMPtr<nsIMsgWindow>      m_msgWindow;
   nsCOMPtr<nsIMsgFilterList>  m_filters;
   nsCOMPtr<nsIArray>          m_folders;
@@ -308,12 +341,19 @@ protected:
   uint32_t                    m_numFolders;
   nsTArray<nsMsgKey>          m_searchHits;
   nsCOMPtr<nsIMutableArray>   m_searchHitHdrs;
-  nsTArray<nsMsgKey>          m_stopFiltering;
-  nsCOMPtr<nsIMsgSearchSession> m_searchSession;
+  nsTHashtable<nsUint32HashKey> m_stopFiltering;
   nsCOMPtr<nsIMsgOperationListener> m_callback;
   uint32_t                    m_nextAction; // next filter action to perform
   nsresult                    mFinalResult; // report of overall success or failure
   bool                        mNeedsRelease; // Did we need to release ourself?
+
+  nsTArray<PassFilter>        m_pass;       // filters of the current pass
+  uint32_t                    m_passIndex;  // next pass filter to apply
+  mozilla::UniquePtr<nsMsgSearchTermCache> m_termCache;
+  nsCOMPtr<nsIMsgSearchScopeTerm> m_scope;
+  nsCString                   m_charset;
+  nsCOMPtr<nsISimpleEnumerator> m_scanEnumerator;
+  nsCOMPtr<nsITimer>          m_scanTimer;
 };
 
 NS_IMPL_ISUPPORTS(nsMsgFilterAfterTheFact, nsIUrlListener, nsIMsgSearchNotify, nsIMsgCopyServiceListener)
@@ -323,7 +363,7 @@ nsMsgFilterAfterTheFact::nsMsgFilterAfterTheFact(nsIMsgWindow *aMsgWindow,
                                                  nsIArray *aFolderList,
                                                  nsIMsgOperationListener *aCallback)
 {
-  m_curFilterIndex = m_curFolderIndex = m_nextAction = 0;
+  m_curFilterIndex = m_curFolderIndex = m_nextAction = m_passIndex = 0;
   m_msgWindow = aMsgWindow;
   m_filters = aFilterList;
   m_folders = aFolderList;
@@ -345,8 +385,13 @@ nsMsgFilterAfterTheFact::~nsMsgFilterAfterTheFact()
 // do what we have to do to cleanup.
 nsresult nsMsgFilterAfterTheFact::OnEndExecution()
 {
-  if (m_searchSession)
-    m_searchSession->UnregisterListener(this);
+  if (m_scanTimer)
+  {
+    m_scanTimer->Cancel();
+    m_scanTimer = nullptr;
+  }
+  m_scanEnumerator = nullptr;
+  m_pass.Clear();
 
   if (m_filters)
     (void)m_filters->FlushLogIfNecessary();
@@ -371,45 +416,295 @@ nsresult nsMsgFilterAfterTheFact::RunNextFilter()
   while (true)
   {
     m_curFilter = nullptr;
+    // First apply the filters of the current pass to their hits, in order.
+    if (m_passIndex < m_pass.Length())
+    {
+      PassFilter &entry = m_pass[m_passIndex++];
+      m_curFilter = entry.filter;
+      OnNewSearch();
+      for (uint32_t i = 0; i < entry.hits.Length(); i++)
+      {
+        // An earlier filter of the pass may have moved or deleted it since.
+        if (m_stopFiltering.Contains(entry.hits[i]))
+          continue;
+        nsCOMPtr<nsIMsgDBHdr> msgHdr;
+        m_curFolderDB->GetMsgHdrForKey(entry.hits[i], getter_AddRefs(msgHdr));
+        if (!msgHdr)
+          continue;
+        m_searchHits.AppendElement(entry.hits[i]);
+        m_searchHitHdrs->AppendElement(msgHdr);
+      }
+      if (m_searchHits.IsEmpty())
+        continue;
+      m_nextAction = 0;
+      return ApplyFilter();
+    }
+
     if (m_curFilterIndex >= m_numFilters)
       break;
     BREAK_IF_FALSE(m_filters, "Missing filters");
-    rv = m_filters->GetFilterAt(m_curFilterIndex++, getter_AddRefs(m_curFilter));
-    CONTINUE_IF_FAILURE(rv, "Could not get filter at index");
+    BREAK_IF_FALSE(m_curFolder, "Missing folder");
+    if (!m_curFolderDB)
+    {
+      // We may get here after the folder was reparsed.
+      rv = m_curFolder->GetMsgDatabase(getter_AddRefs(m_curFolderDB));
+      BREAK_IF_FAILURE(rv, "Could not get folder db");
+    }
 
-    nsCOMPtr<nsIMutableArray> searchTerms;
-    rv = m_curFilter->GetSearchTerms(getter_AddRefs(searchTerms));
-    CONTINUE_IF_FAILURE(rv, "Could not get searchTerms");
+    rv = BuildNextPass();
+    if (NS_FAILED(rv))
+    {
+      // Run the filters we could set up, and go on after the failed one.
+      NS_WARNING("Failed to set up filter");
+      mFinalResult = rv;
+      if (m_msgWindow && !ContinueExecutionPrompt())
+        return OnEndExecution();
+    }
+    if (m_pass.IsEmpty())
+      continue;
+
+    m_curFilter = m_pass[0].filter;
+    rv = m_curFolderDB->ReverseEnumerateMessages(getter_AddRefs(m_scanEnumerator));
+    CONTINUE_IF_FAILURE(rv, "Could not enumerate messages");
+    m_scanTimer = do_CreateInstance("@mozilla.org/timer;1", &rv);
+    CONTINUE_IF_FAILURE(rv, "Could not create timer");
+    rv = m_scanTimer->InitWithNamedFuncCallback(ScanTimerCallback, (void *) this, 0,
+                                                nsITimer::TYPE_REPEATING_SLACK,
+                                                "nsMsgFilterAfterTheFact::ScanTimerCallback");
+    CONTINUE_IF_FAILURE(rv, "Could not start timer");
+    return NS_OK; // ScanTimerCallback will continue
+  }
+  m_curFilter = nullptr;
+  NS_WARNING_ASSERTION(NS_SUCCEEDED(rv), "Search failed");
+  return AdvanceToNextFolder();
+}
+
+nsresult nsMsgFilterAfterTheFact::BuildNextPass()
+{
+  m_pass.Clear();
+  m_passIndex = 0;
+  m_termCache = mozilla::MakeUnique<nsMsgSearchTermCache>();
+  m_scope = new nsMsgSearchScopeTerm(nullptr, nsMsgSearchScope::offlineMail, m_curFolder);
+  m_curFolder->GetCharset(m_charset);
+
+  nsCString folderUri;
+  m_curFolder->GetURI(folderUri);
+
+  // Whether an earlier filter of the pass changes message state that search
+  // terms look at, like flags, tags or priority, or possibly anything.
+  bool changesState = false;
+  bool changesAnything = false;
+  while (m_curFilterIndex < m_numFilters)
+  {
+    nsCOMPtr<nsIMsgFilter> filter;
+    nsresult rv = m_filters->GetFilterAt(m_curFilterIndex, getter_AddRefs(filter));
+    if (NS_FAILED(rv))
+    {
+      m_curFilterIndex++;
+      return rv;
+    }
 
-    if (m_searchSession)
-      m_searchSession->UnregisterListener(this);
-    m_searchSession = do_CreateInstance(NS_MSGSEARCHSESSION_CONTRACTID, &rv);
-    BREAK_IF_FAILURE(rv, "Failed to get search session");
+    nsCOMPtr<nsIMutableArray> searchTerms;
+    nsCOMPtr<nsIArray> actionList;
+    rv = filter->GetSearchTerms(getter_AddRefs(searchTerms));
+    if (NS_SUCCEEDED(rv))
+      rv = filter->GetSortedActionList(getter_AddRefs(actionList));
+    if (NS_FAILED(rv))
+    {
+      m_curFilter = filter;
+      m_curFilterIndex++;
+      return rv;
+    }
 
-    nsMsgSearchScopeValue searchScope = nsMsgSearchScope::offlineMail;
     uint32_t termCount = 0;
     searchTerms->GetLength(&termCount);
-    for (uint32_t termIndex = 0; termIndex < termCount; termIndex++)
+    if (!m_pass.IsEmpty() && (changesState || changesAnything))
     {
-      nsCOMPtr<nsIMsgSearchTerm> term = do_QueryElementAt(searchTerms, termIndex, &rv);
-      BREAK_IF_FAILURE(rv, "Could not get search term");
-      rv = m_searchSession->AppendTerm(term);
-      BREAK_IF_FAILURE(rv, "Could not append search term");
+      bool readsState = false;
+      for (uint32_t termIndex = 0; termIndex < termCount && !readsState; termIndex++)
+      {
+        nsCOMPtr<nsIMsgSearchTerm> term = do_QueryElementAt(searchTerms, termIndex);
+        nsMsgSearchAttribValue attrib = nsMsgSearchAttrib::Default;
+        if (term)
+          term->GetAttrib(&attrib);
+        switch (attrib)
+        {
+          case nsMsgSearchAttrib::MsgStatus:
+          case nsMsgSearchAttrib::Keywords:
+          case nsMsgSearchAttrib::Label:
+          case nsMsgSearchAttrib::Priority:
+          case nsMsgSearchAttrib::JunkStatus:
+          case nsMsgSearchAttrib::JunkPercent:
+          case nsMsgSearchAttrib::JunkScoreOrigin:
+          case nsMsgSearchAttrib::HdrProperty:
+          case nsMsgSearchAttrib::Uint32HdrProperty:
+          case nsMsgSearchAttrib::Custom:
+            readsState = true;
+            break;
+          default:
+            readsState = changesAnything;
+            break;
+        }
+      }
+      // This filter has to see the results of the earlier ones, so it
+      // starts the next pass.
+      if (readsState)
+        return NS_OK;
     }
-    CONTINUE_IF_FAILURE(rv, "Failed to setup search terms");
-    m_searchSession->RegisterListener(this,
-                                      nsIMsgSearchSession::allNotifications);
 
-    rv = m_searchSession->AddScopeTerm(searchScope, m_curFolder);
-    CONTINUE_IF_FAILURE(rv, "Failed to add scope term");
-    m_nextAction = 0;
-    rv = m_searchSession->Search(m_msgWindow);
-    CONTINUE_IF_FAILURE(rv, "Search failed");
-    return NS_OK; // OnSearchDone will continue
+    nsMsgSearchBoolExpression *expression = nullptr;
+    uint32_t startPos = 0;
+    rv = nsMsgSearchOfflineMail::ConstructExpressionTree(searchTerms, termCount,
+                                                         startPos, &expression);
+    if (NS_FAILED(rv))
+    {
+      delete expression;
+      m_curFilter = filter;
+      m_curFilterIndex++;
+      return rv;
+    }
+
+    PassFilter *entry = m_pass.AppendElement();
+    entry->filter = filter;
+    entry->expression.reset(expression);
+    entry->stopsFiltering = false;
+    entry->deletesPartial = false;
+    m_termCache->AddTerms(expression);
+    m_curFilterIndex++;
+
+    uint32_t numActions = 0;
+    actionList->GetLength(&numActions);
+    for (uint32_t actionIndex = 0; actionIndex < numActions; actionIndex++)
+    {
+      nsCOMPtr<nsIMsgRuleAction> filterAction(do_QueryElementAt(actionList, actionIndex));
+      nsMsgRuleActionType actionType = nsMsgFilterAction::Custom;
+      if (filterAction)
+        filterAction->GetType(&actionType);
+      switch (actionType)
+      {
+        case nsMsgFilterAction::MoveToFolder:
+        {
+          // ApplyFilter leaves messages moved to their own folder alone.
+          nsCString targetUri;
+          filterAction->GetTargetFolderUri(targetUri);
+          if (!targetUri.IsEmpty() && !targetUri.Equals(folderUri))
+            entry->stopsFiltering = true;
+          break;
+        }
+        case nsMsgFilterAction::Delete:
+        case nsMsgFilterAction::StopExecution:
+          entry->stopsFiltering = true;
+          break;
+        case nsMsgFilterAction::DeleteFromPop3Server:
+          entry->deletesPartial = true;
+          break;
+        case nsMsgFilterAction::CopyToFolder:
+        case nsMsgFilterAction::LeaveOnPop3Server:
+        case nsMsgFilterAction::None:
+          break;
+        case nsMsgFilterAction::FetchBodyFromPop3Server:
+        case nsMsgFilterAction::Custom:
+          changesAnything = true;
+          break;
+        default:
+          changesState = true;
+          break;
+      }
+    }
   }
-  m_curFilter = nullptr;
-  NS_WARNING_ASSERTION(NS_SUCCEEDED(rv), "Search failed");
-  return AdvanceToNextFolder();
+  return NS_OK;
+}
+
+nsresult nsMsgFilterAfterTheFact::ScanTimeSlice(bool *aDone)
+{
+  const uint32_t kTimeSliceInMS = 200;
+
+  *aDone = false;
+  PRIntervalTime startTime = PR_IntervalNow();
+  while (true)
+  {
+    bool hasMore = false;
+    nsresult rv = m_scanEnumerator->HasMoreElements(&hasMore);
+    if (NS_FAILED(rv) || !hasMore)
+    {
+      *aDone = true;
+      return rv;
+    }
+
+    nsCOMPtr<nsISupports> supports;
+    rv = m_scanEnumerator->GetNext(getter_AddRefs(supports));
+    nsCOMPtr<nsIMsgDBHdr> msgHdr = do_QueryInterface(supports);
+    if (NS_FAILED(rv) || !msgHdr)
+    {
+      *aDone = true;
+      return NS_FAILED(rv) ? rv : NS_ERROR_UNEXPECTED;
+    }
+
+    nsMsgKey msgKey;
+    msgHdr->GetMessageKey(&msgKey);
+    if (!m_stopFiltering.Contains(msgKey))
+    {
+      uint32_t flags = 0;
+      msgHdr->GetFlags(&flags);
+      m_termCache->Clear();
+      for (PassFilter &entry : m_pass)
+      {
+        // An empty expression is vacuously true, as in MatchTerms.
+        if (entry.expression &&
+            !entry.expression->OfflineEvaluate(msgHdr, m_charset.get(), m_scope,
+                                               m_curFolderDB, EmptyCString(),
+                                               false, m_termCache.get()))
+          continue;
+
+        entry.hits.AppendElement(msgKey);
+        // Later filters would not get to see this message.
+        if (entry.stopsFiltering ||
+            (entry.deletesPartial && (flags & nsMsgMessageFlags::Partial)))
+          break;
+      }
+    }
+
+    if (PR_IntervalToMilliseconds(PR_IntervalNow() - startTime) > kTimeSliceInMS)
+      return NS_OK;
+  }
+}
+
+/* static */
+void nsMsgFilterAfterTheFact::ScanTimerCallback(nsITimer *aTimer, void *aClosure)
+{
+  NS_ENSURE_TRUE_VOID(aClosure);
+  // We may release ourselves when execution ends below.
+  RefPtr<nsMsgFilterAfterTheFact> self =
+    static_cast<nsMsgFilterAfterTheFact *>(aClosure);
+  bool done;
+  bool stopped = false;
+
+  nsresult rv = self->ScanTimeSlice(&done);
+  if (self->m_msgWindow)
+    self->m_msgWindow->GetStopped(&stopped);
+  if (!done && !stopped)
+    return;
+
+  if (self->m_scanTimer)
+    self->m_scanTimer->Cancel();
+  self->m_scanTimer = nullptr;
+  self->m_scanEnumerator = nullptr;
+  if (self->m_scope)
+    self->m_scope->CloseInputStream();
+
+  if (NS_FAILED(rv))
+  {
+    self->mFinalResult = rv;
+    self->m_curFilter = self->m_pass[0].filter;
+    if (self->m_msgWindow && !self->ContinueExecutionPrompt())
+    {
+      self->OnEndExecution();
+      return;
+    }
+    // The scan failed, so move on to the next pass.
+    self->m_pass.Clear();
+  }
+  self->RunNextFilter();
 }
 
 nsresult nsMsgFilterAfterTheFact::AdvanceToNextFolder()
@@ -419,7 +714,10 @@ nsresult nsMsgFilterAfterTheFact::AdvanceToNextFolder()
   while (true)
   {
     m_stopFiltering.Clear();
+    m_pass.Clear();
+    m_passIndex = 0;
     m_curFolder = nullptr;
+    m_curFolderDB = nullptr;
     if (m_curFolderIndex >= m_numFolders)
       // final end of nsMsgFilterAfterTheFact object
       return OnEndExecution();
@@ -593,9 +891,11 @@ nsresult nsMsgFilterAfterTheFact::ApplyFilter()
         curFolder->DeleteMessages(m_searchHitHdrs, m_msgWindow, false, false, nullptr, false /*allow Undo*/ );
 
         // don't allow any more filters on this message
-        m_stopFiltering.AppendElements(m_searchHits);
         for (uint32_t i = 0; i < m_searchHits.Length(); i++)
+        {
+          m_stopFiltering.PutEntry(m_searchHits[i]);
           curFolder->OrProcessingFlags(m_searchHits[i], nsMsgProcessingFlags::FilterToMove);
+        }
         //if we are deleting then we couldn't care less about applying remaining filter actions
         m_nextAction = numActions;
         break;
@@ -644,10 +944,12 @@ nsresult nsMsgFilterAfterTheFact::ApplyFilter()
 
           if (actionType == nsMsgFilterAction::MoveToFolder)
           {
-            m_stopFiltering.AppendElements(m_searchHits);
             for (uint32_t i = 0; i < m_searchHits.Length(); i++)
+            {
+              m_stopFiltering.PutEntry(m_searchHits[i]);
               curFolder->OrProcessingFlags(m_searchHits[i],
                                              nsMsgProcessingFlags::FilterToMove);
+            }
           }
 
           rv = copyService->CopyMessages(curFolder, m_searchHitHdrs,
@@ -814,7 +1116,7 @@ nsresult nsMsgFilterAfterTheFact::ApplyFilter()
                 partialMsgs = do_CreateInstance(NS_ARRAY_CONTRACTID, &rv);
               CONTINUE_IF_FALSE(partialMsgs, "Could not create partialMsgs array");
               partialMsgs->AppendElement(msgHdr);
-              m_stopFiltering.AppendElement(m_searchHits[msgIndex]);
+              m_stopFiltering.PutEntry(m_searchHits[msgIndex]);
               curFolder->OrProcessingFlags(m_searchHits[msgIndex],
                                              nsMsgProcessingFlags::FilterToMove);
             }
@@ -854,7 +1156,8 @@ nsresult nsMsgFilterAfterTheFact::ApplyFilter()
       case nsMsgFilterAction::StopExecution:
         {
           // don't apply any more filters
-          m_stopFiltering.AppendElements(m_searchHits);
+          for (uint32_t i = 0; i < m_searchHits.Length(); i++)
+            m_stopFiltering.PutEntry(m_searchHits[i]);
           m_nextAction = numActions;
         }
       break;
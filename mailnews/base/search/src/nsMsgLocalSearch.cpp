@@ -130,15 +130,19 @@ nsMsgSearchBoolExpression::leftToRightAddTerm(nsIMsgSearchTerm * newTerm, char *
 // returns true or false depending on what the current expression evaluates to.
 bool nsMsgSearchBoolExpression::OfflineEvaluate(nsIMsgDBHdr *msgToMatch, const char *defaultCharset,
   nsIMsgSearchScopeTerm *scope, nsIMsgDatabase *db, const nsACString& headers,
-  bool Filtering)
+  bool Filtering, nsMsgSearchTermCache *aTermCache)
 {
     bool result = true;    // always default to false positives
     bool isAnd;
 
     if (m_term) // do we contain just a search term?
     {
+      if (aTermCache && aTermCache->GetResult(m_term, &result))
+        return result;
       nsMsgSearchOfflineMail::ProcessSearchTerm(msgToMatch, m_term,
         defaultCharset, scope, db, headers, Filtering, &result);
+      if (aTermCache)
+        aTermCache->SetResult(m_term, result);
       return result;
     }
 
@@ -149,7 +153,7 @@ bool nsMsgSearchBoolExpression::OfflineEvaluate(nsIMsgDBHdr *msgToMatch, const c
     if (m_leftChild)
     {
         result = m_leftChild->OfflineEvaluate(msgToMatch, defaultCharset,
-          scope, db, headers, Filtering);
+          scope, db, headers, Filtering, aTermCache);
         if ( (result && !isAnd) || (!result && isAnd))
           return result;
     }
@@ -159,11 +163,70 @@ bool nsMsgSearchBoolExpression::OfflineEvaluate(nsIMsgDBHdr *msgToMatch, const c
     // means the outcome depends entirely on the rightChild.
     if (m_rightChild)
         result = m_rightChild->OfflineEvaluate(msgToMatch, defaultCharset,
-          scope, db, headers, Filtering);
+          scope, db, headers, Filtering, aTermCache);
 
     return result;
 }
 
+void nsMsgSearchTermCache::AddTerms(nsMsgSearchBoolExpression *aExpression)
+{
+  if (!aExpression)
+    return;
+
+  if (aExpression->m_term)
+  {
+    if (m_slots.Contains(aExpression->m_term))
+      return;
+
+    // Terms which print the same match the same messages. Terms which can't
+    // be printed get a slot of their own.
+    nsAutoCString termString;
+    uint32_t slot;
+    if (NS_SUCCEEDED(aExpression->m_term->GetTermAsString(termString)) &&
+        !termString.IsEmpty())
+    {
+      if (!m_slotsByTerm.Get(termString, &slot))
+      {
+        slot = m_results.Length();
+        m_results.AppendElement(-1);
+        m_slotsByTerm.Put(termString, slot);
+      }
+    }
+    else
+    {
+      slot = m_results.Length();
+      m_results.AppendElement(-1);
+    }
+    m_slots.Put(aExpression->m_term, slot);
+    return;
+  }
+
+  AddTerms(aExpression->m_leftChild);
+  AddTerms(aExpression->m_rightChild);
+}
+
+void nsMsgSearchTermCache::Clear()
+{
+  for (uint32_t i = 0; i < m_results.Length(); i++)
+    m_results[i] = -1;
+}
+
+bool nsMsgSearchTermCache::GetResult(nsIMsgSearchTerm *aTerm, bool *aResult)
+{
+  uint32_t slot;
+  if (!m_slots.Get(aTerm, &slot) || m_results[slot] < 0)
+    return false;
+  *aResult = m_results[slot] != 0;
+  return true;
+}
+
+void nsMsgSearchTermCache::SetResult(nsIMsgSearchTerm *aTerm, bool aResult)
+{
+  uint32_t slot;
+  if (m_slots.Get(aTerm, &slot))
+    m_results[slot] = aResult ? 1 : 0;
+}
+
 // ### Maybe we can get rid of these because of our use of nsString???
 // constants used for online searching with IMAP/NNTP encoded search terms.
 // the + 1 is to account for null terminators we add at each stage of assembling the expression...
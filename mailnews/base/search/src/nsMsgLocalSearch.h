@@ -62,6 +62,11 @@ public:
                                const nsACString& headers,
                                bool Filtering,
                  bool *pResult);
+
+  static nsresult ConstructExpressionTree(nsIArray *termList,
+                                          uint32_t termCount,
+                                          uint32_t &aStartPosInList,
+                                          nsMsgSearchBoolExpression ** aExpressionTree);
 protected:
   virtual ~nsMsgSearchOfflineMail();
   static nsresult MatchTerms(nsIMsgDBHdr *msgToMatch,
@@ -74,11 +79,6 @@ protected:
                                 nsMsgSearchBoolExpression ** aExpressionTree,
                 bool *pResult);
 
-    static nsresult ConstructExpressionTree(nsIArray *termList,
-                                      uint32_t termCount,
-                                      uint32_t &aStartPosInList,
-                                      nsMsgSearchBoolExpression ** aExpressionTree);
-
   nsCOMPtr <nsIMsgDatabase> m_db;
   nsCOMPtr<nsISimpleEnumerator> m_listContext;
   void CleanUpScope();
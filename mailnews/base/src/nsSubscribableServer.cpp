@@ -322,7 +322,7 @@ nsSubscribableServer::FreeRows()
 }
 
 nsresult
-nsSubscribableServer::CreateNode(SubscribeTreeNode *parent, const char *name, const nsACString &aPath, SubscribeTreeNode **result)
+nsSubscribableServer::CreateNode(SubscribeTreeNode *parent, const char *name, SubscribeTreeNode **result)
 {
     NS_ASSERTION(result && name, "result or name is null");
     NS_ENSURE_ARG_POINTER(result);
@@ -334,8 +334,6 @@ nsSubscribableServer::CreateNode(SubscribeTreeNode *parent, const char *name, co
     (*result)->name = strdup(name);
     if (!(*result)->name) return NS_ERROR_OUT_OF_MEMORY;
 
-    (*result)->path.Assign(aPath);
-
     (*result)->parent = parent;
     (*result)->prevSibling = nullptr;
     (*result)->nextSibling = nullptr;
@@ -361,15 +359,15 @@ nsSubscribableServer::CreateNode(SubscribeTreeNode *parent, const char *name, co
 }
 
 nsresult
-nsSubscribableServer::AddChildNode(SubscribeTreeNode *parent, const char *name, const nsACString &aPath, SubscribeTreeNode **child)
+nsSubscribableServer::AddChildNode(SubscribeTreeNode *parent, const char *name, SubscribeTreeNode **child)
 {
     nsresult rv = NS_OK;
-    NS_ASSERTION(parent && child && name && !aPath.IsEmpty(), "parent, child or name is null");
-    if (!parent || !child || !name || aPath.IsEmpty()) return NS_ERROR_NULL_POINTER;
+    NS_ASSERTION(parent && child && name, "parent, child or name is null");
+    if (!parent || !child || !name) return NS_ERROR_NULL_POINTER;
 
     if (!parent->firstChild) {
         // CreateNode will set the parent->cachedChild
-        rv = CreateNode(parent, name, aPath, child);
+        rv = CreateNode(parent, name, child);
         NS_ENSURE_SUCCESS(rv,rv);
 
         parent->firstChild = *child;
@@ -385,7 +383,46 @@ nsSubscribableServer::AddChildNode(SubscribeTreeNode *parent, const char *name,
         }
     }
 
-    SubscribeTreeNode *current = parent->firstChild;
+    // Groups fed to us in alphabetical order go to the start of the list,
+    // and in reverse alphabetical order to the end of it, so check both ends
+    // before walking all of it.
+    int32_t compare = strcmp(parent->firstChild->name, name);
+    if (compare == 0) {
+        *child = parent->firstChild;
+        parent->cachedChild = *child;
+        return NS_OK;
+    }
+    if (compare < 0) {
+        // CreateNode will set the parent->cachedChild
+        rv = CreateNode(parent, name, child);
+        NS_ENSURE_SUCCESS(rv,rv);
+
+        (*child)->prevSibling = nullptr;
+        (*child)->nextSibling = parent->firstChild;
+        parent->firstChild->prevSibling = *child;
+        parent->firstChild = *child;
+        return NS_OK;
+    }
+
+    compare = strcmp(parent->lastChild->name, name);
+    if (compare == 0) {
+        *child = parent->lastChild;
+        parent->cachedChild = *child;
+        return NS_OK;
+    }
+    if (compare > 0) {
+        // CreateNode will set the parent->cachedChild
+        rv = CreateNode(parent, name, child);
+        NS_ENSURE_SUCCESS(rv,rv);
+
+        (*child)->prevSibling = parent->lastChild;
+        (*child)->nextSibling = nullptr;
+        parent->lastChild->nextSibling = *child;
+        parent->lastChild = *child;
+        return NS_OK;
+    }
+
+    SubscribeTreeNode *current = parent->firstChild->nextSibling;
 
     /*
      * insert in reverse alphabetical order
@@ -400,12 +437,12 @@ nsSubscribableServer::AddChildNode(SubscribeTreeNode *parent, const char *name,
      * we can efficiently reverse the order when dumping to hostinfo.dat
      * or to GetTargets()
      */
-    int32_t compare = strcmp(current->name, name);
+    compare = strcmp(current->name, name);
 
     while (current && (compare != 0)) {
         if (compare < 0) {
             // CreateNode will set the parent->cachedChild
-            rv = CreateNode(parent, name, aPath, child);
+            rv = CreateNode(parent, name, child);
             NS_ENSURE_SUCCESS(rv,rv);
 
             (*child)->nextSibling = current;
@@ -440,7 +477,7 @@ nsSubscribableServer::AddChildNode(SubscribeTreeNode *parent, const char *name,
     }
 
     // CreateNode will set the parent->cachedChild
-    rv = CreateNode(parent, name, aPath, child);
+    rv = CreateNode(parent, name, child);
     NS_ENSURE_SUCCESS(rv,rv);
 
     (*child)->prevSibling = parent->lastChild;
@@ -461,7 +498,7 @@ nsSubscribableServer::FindAndCreateNode(const nsACString &aPath,
 
   if (!mTreeRoot) {
       // the root has no parent, and its name is server uri
-      rv = CreateNode(nullptr, mIncomingServerUri.get(), EmptyCString(), &mTreeRoot);
+      rv = CreateNode(nullptr, mIncomingServerUri.get(), &mTreeRoot);
       NS_ENSURE_SUCCESS(rv,rv);
   }
 
@@ -487,7 +524,7 @@ nsSubscribableServer::FindAndCreateNode(const nsACString &aPath,
       tokenEnd = aPath.Length();
     }
     nsCString token(Substring(aPath, tokenStart, tokenEnd - tokenStart));
-    rv = AddChildNode(parent, token.BeginReading(), Substring(aPath, 0, tokenEnd), &child);
+    rv = AddChildNode(parent, token.BeginReading(), &child);
     if (NS_FAILED(rv))
       return rv;
     tokenStart = tokenEnd + 1;
@@ -500,6 +537,25 @@ nsSubscribableServer::FindAndCreateNode(const nsACString &aPath,
   return rv;
 }
 
+void
+nsSubscribableServer::GetNodePath(SubscribeTreeNode *node, nsACString &aPath)
+{
+  aPath.Truncate();
+  if (!node)
+    return;
+
+  // the root has the server uri as its name, but isn't part of the paths
+  AutoTArray<SubscribeTreeNode*, 8> ancestors;
+  for (; node && node->parent; node = node->parent)
+    ancestors.AppendElement(node);
+
+  for (uint32_t i = ancestors.Length(); i > 0; i--) {
+    if (i < ancestors.Length())
+      aPath.Append(mDelimiter);
+    aPath.Append(ancestors[i - 1]->name);
+  }
+}
+
 NS_IMETHODIMP
 nsSubscribableServer::HasChildren(const nsACString &aPath, bool *aHasChildren)
 {
@@ -596,7 +652,7 @@ nsSubscribableServer::GetFirstChildURI(const nsACString &aPath,
     // no children
     if (!node->firstChild) return NS_ERROR_FAILURE;
 
-    aResult.Assign(node->firstChild->path);
+    GetNodePath(node->firstChild, aResult);
 
     return NS_OK;
 }
@@ -632,7 +688,7 @@ nsSubscribableServer::GetChildURIs(const nsACString &aPath,
         if (!current->name)
           return NS_ERROR_FAILURE;
 
-        result->AppendElement(current->path);
+        GetNodePath(current, *result->AppendElement());
 
         current = current->prevSibling;
     }
@@ -864,7 +920,8 @@ nsSubscribableServer::GetCellText(int32_t aRow, nsTreeColumn *aCol,
   nsString colId;
   aCol->GetId(colId);
   if (colId.EqualsLiteral("nameColumn")) {
-    nsCString path(mRowMap[aRow]->path);
+    nsCString path;
+    GetNodePath(mRowMap[aRow], path);
     GetLeafName(path, retval);
   }
   return NS_OK;
@@ -877,7 +934,11 @@ nsSubscribableServer::GetCellValue(int32_t aRow, nsTreeColumn *aCol,
   nsString colId;
   aCol->GetId(colId);
   if (colId.EqualsLiteral("nameColumn"))
-    retval = NS_ConvertUTF8toUTF16(mRowMap[aRow]->path);
+  {
+    nsCString path;
+    GetNodePath(mRowMap[aRow], path);
+    CopyUTF8toUTF16(path, retval);
+  }
   if (colId.EqualsLiteral("subscribedColumn"))
   {
     retval = mRowMap[aRow]->isSubscribed ? NS_LITERAL_STRING("true")
@@ -18,11 +18,12 @@
 /**
  * The basic structure for the tree of the implementation.
  *
- * These elements are stored in reverse alphabetical order.
+ * These elements are stored in reverse alphabetical order. The path of a
+ * node isn't stored, it is made of the names of the node and its ancestors,
+ * so the names the folders of a hierarchy start with are only stored once.
  */
 typedef struct _subscribeTreeNode {
   char *name;
-  nsCString path;
   bool isSubscribed;
   struct _subscribeTreeNode *prevSibling;
   struct _subscribeTreeNode *nextSibling;
@@ -70,9 +71,10 @@ private:
   RefPtr<mozilla::dom::XULTreeElement> mTree;
   nsresult FreeSubtree(SubscribeTreeNode *node);
   nsresult FreeRows();
-  nsresult CreateNode(SubscribeTreeNode *parent, const char *name, const nsACString &aPath, SubscribeTreeNode **result);
-  nsresult AddChildNode(SubscribeTreeNode *parent, const char *name, const nsACString &aPath, SubscribeTreeNode **child);
+  nsresult CreateNode(SubscribeTreeNode *parent, const char *name, SubscribeTreeNode **result);
+  nsresult AddChildNode(SubscribeTreeNode *parent, const char *name, SubscribeTreeNode **child);
   nsresult FindAndCreateNode(const nsACString &aPath, SubscribeTreeNode **aResult);
+  void GetNodePath(SubscribeTreeNode *node, nsACString &aPath);
 
   int32_t GetRow(SubscribeTreeNode *node, bool *open);
   int32_t AddSubtree(SubscribeTreeNode *node, int32_t index);
@@ -0,0 +1,181 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+ * Runs a list of filters on a folder with applyFiltersToFolders, which
+ * evaluates the filters in as few passes over the folder as it can, and checks
+ * that the outcome is the same as running the filters one at a time. Also
+ * compares how long both take.
+ */
+
+load("../../../resources/messageGenerator.js");
+
+var {MailServices} = ChromeUtils.import("resource:///modules/MailServices.jsm");
+
+var kMessages = 2000;
+var kFilters = 80;
+
+var gMessageStrings = [];
+
+function makeMessageStrings() {
+  let messageGenerator = new MessageGenerator();
+  for (let i = 0; i < kMessages; i++) {
+    let message = messageGenerator.makeMessage({
+      subject: "Report " + i + " for group" + (i % 13),
+      from: ["Sender " + (i % 17), "sender" + (i % 17) + "@example.com"],
+      body: { body: "This is about topic" + (i % 23) + ".\n" },
+    });
+    gMessageStrings.push(message.toMboxString());
+  }
+}
+
+function appendTerm(aFilter, aAttrib, aValue) {
+  let searchTerm = aFilter.createTerm();
+  searchTerm.attrib = aAttrib;
+  searchTerm.op = Ci.nsMsgSearchOp.Contains;
+  let value = searchTerm.value;
+  value.attrib = aAttrib;
+  value.str = aValue;
+  searchTerm.value = value;
+  searchTerm.booleanAnd = true;
+  aFilter.appendTerm(searchTerm);
+}
+
+function appendAction(aFilter, aType, aSetup) {
+  let action = aFilter.createAction();
+  action.type = aType;
+  if (aSetup) {
+    aSetup(action);
+  }
+  aFilter.appendAction(action);
+}
+
+/**
+ * Add filter number aIndex of the test to a filter list. Most filters tag,
+ * mark or flag messages; some move them, some only match messages tagged by
+ * earlier filters and several use the same body terms.
+ */
+function addFilter(aFilterList, aIndex, aMoveFolder) {
+  let filter = aFilterList.createFilter("filter" + aIndex);
+  switch (aIndex % 4) {
+    case 0:
+      appendTerm(filter, Ci.nsMsgSearchAttrib.Subject, "group" + (aIndex % 13));
+      appendAction(filter, Ci.nsMsgFilterAction.AddTag,
+                   action => { action.strValue = "tag" + aIndex; });
+      break;
+    case 1:
+      appendTerm(filter, Ci.nsMsgSearchAttrib.Body, "topic" + (aIndex % 23));
+      appendAction(filter, Ci.nsMsgFilterAction.MarkRead);
+      break;
+    case 2:
+      appendTerm(filter, Ci.nsMsgSearchAttrib.Sender, "sender" + (aIndex % 17));
+      appendTerm(filter, Ci.nsMsgSearchAttrib.Keywords, "tag" + (aIndex - 2));
+      appendAction(filter, Ci.nsMsgFilterAction.ChangePriority,
+                   action => { action.priority = Ci.nsMsgPriority.high; });
+      break;
+    case 3:
+      appendTerm(filter, Ci.nsMsgSearchAttrib.Body, "topic" + ((aIndex - 2) % 23));
+      if (aIndex % 20 == 3) {
+        appendTerm(filter, Ci.nsMsgSearchAttrib.Subject, "group" + (aIndex % 13));
+        appendAction(filter, Ci.nsMsgFilterAction.MoveToFolder,
+                     action => { action.targetFolderUri = aMoveFolder.URI; });
+      } else {
+        appendAction(filter, Ci.nsMsgFilterAction.MarkFlagged);
+      }
+      break;
+  }
+  filter.enabled = true;
+  filter.filterType = Ci.nsMsgFilterType.Manual;
+  aFilterList.insertFilterAt(aFilterList.filterCount, filter);
+}
+
+function applyFilters(aFilterList, aFolder) {
+  return new Promise(resolve => {
+    let folders = Cc["@mozilla.org/array;1"]
+                    .createInstance(Ci.nsIMutableArray);
+    folders.appendElement(aFolder);
+    MailServices.filters.applyFiltersToFolders(aFilterList, folders, null, {
+      QueryInterface: ChromeUtils.generateQI([Ci.nsIMsgOperationListener]),
+      onStopOperation(aStatus) {
+        resolve(aStatus);
+      },
+    });
+  });
+}
+
+function makeFolders(aName) {
+  let folder = localAccountUtils.rootFolder.createLocalSubfolder(aName)
+                 .QueryInterface(Ci.nsIMsgLocalMailFolder);
+  folder.addMessageBatch(gMessageStrings.length, gMessageStrings);
+  let moveFolder = localAccountUtils.rootFolder.createLocalSubfolder(aName + "Moved");
+  return [folder, moveFolder];
+}
+
+/**
+ * The state the filters leave the messages in, by subject.
+ */
+function folderState(aFolder, aMoveFolder) {
+  let state = {};
+  for (let folder of [aFolder, aMoveFolder]) {
+    let enumerator = folder.msgDatabase.EnumerateMessages();
+    while (enumerator.hasMoreElements()) {
+      let hdr = enumerator.getNext().QueryInterface(Ci.nsIMsgDBHdr);
+      state[hdr.mime2DecodedSubject] = {
+        moved: folder == aMoveFolder,
+        read: hdr.isRead,
+        flagged: hdr.isFlagged,
+        priority: hdr.priority,
+        keywords: hdr.getStringProperty("keywords").split(" ").sort().join(" "),
+      };
+    }
+  }
+  return state;
+}
+
+add_task(async function test_passes_match_single_filters() {
+  makeMessageStrings();
+
+  let [singleFolder, singleMoveFolder] = makeFolders("single");
+  let start = Date.now();
+  for (let i = 0; i < kFilters; i++) {
+    let filterList = MailServices.filters.getTempFilterList(singleFolder);
+    addFilter(filterList, i, singleMoveFolder);
+    Assert.equal(await applyFilters(filterList, singleFolder), Cr.NS_OK);
+  }
+  let singleTime = Date.now() - start;
+
+  let [folder, moveFolder] = makeFolders("passes");
+  let filterList = MailServices.filters.getTempFilterList(folder);
+  for (let i = 0; i < kFilters; i++) {
+    addFilter(filterList, i, moveFolder);
+  }
+  start = Date.now();
+  Assert.equal(await applyFilters(filterList, folder), Cr.NS_OK);
+  let passesTime = Date.now() - start;
+
+  info("Ran " + kFilters + " filters on " + kMessages + " messages one by " +
+       "one in " + singleTime + "ms, all at once in " + passesTime + "ms");
+
+  let expected = folderState(singleFolder, singleMoveFolder);
+  let actual = folderState(folder, moveFolder);
+  Assert.equal(Object.keys(actual).length, kMessages);
+  Assert.ok(folderCount(moveFolder) > 0);
+  Assert.ok(folderCount(folder) > 0);
+  Assert.deepEqual(actual, expected);
+});
+
+function folderCount(aFolder) {
+  let enumerator = aFolder.msgDatabase.EnumerateMessages();
+  let count = 0;
+  while (enumerator.hasMoreElements()) {
+    enumerator.getNext();
+    count++;
+  }
+  return count;
+}
+
+function run_test() {
+  localAccountUtils.loadLocalMailAccount();
+  run_next_test();
+}
@@ -0,0 +1,223 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+ * Applies a long list of incoming filters to new headers with
+ * applyFiltersToHdr, which only matches the filters its index of the filter
+ * terms picks out, and checks that the hits and their order are the same as
+ * matching every filter. Also compares how long both take.
+ */
+
+load("../../../resources/messageGenerator.js");
+
+var {MailServices} = ChromeUtils.import("resource:///modules/MailServices.jsm");
+
+var kMessages = 500;
+var kSenderFilters = 300;
+
+var gHeaders = new Map();
+
+function makeFolder() {
+  let messageGenerator = new MessageGenerator();
+  let messageStrings = [];
+  for (let i = 0; i < kMessages; i++) {
+    let clobberHeaders = { "List-Id": "<list" + (i % 7) + ".example.com>" };
+    // Encoded words have to be decoded before they can be searched.
+    if (i % 11 == 0) {
+      clobberHeaders.Subject = "=?UTF-8?Q?Caf=C3=A9_report_" + i + "?=";
+    }
+    let message = messageGenerator.makeMessage({
+      subject: "Report " + i + " for group" + (i % 13),
+      from: ["Sender " + (i % 400), "sender" + (i % 400) + "@example.com"],
+      to: [["Team " + (i % 5), "team" + (i % 5) + "@example.org"]],
+      cc: [["Boss", i % 9 ? "boss@example.org" : "bigboss@example.org"]],
+      clobberHeaders,
+    });
+    let messageString = message.toMboxString();
+    messageStrings.push(messageString);
+    // The mail parser passes the headers with lines separated by nulls.
+    let headers = message.toMessageString().split("\r\n\r\n")[0];
+    gHeaders.set(message.messageId, headers.split("\r\n").join("\0") + "\0");
+  }
+
+  let folder = localAccountUtils.rootFolder.createLocalSubfolder("filterIndex")
+                 .QueryInterface(Ci.nsIMsgLocalMailFolder);
+  folder.addMessageBatch(messageStrings.length, messageStrings);
+  return folder;
+}
+
+function appendTerm(aFilter, aAttrib, aOp, aValue, aBooleanAnd) {
+  let searchTerm = aFilter.createTerm();
+  searchTerm.attrib = aAttrib;
+  searchTerm.op = aOp;
+  let value = searchTerm.value;
+  value.attrib = aAttrib;
+  value.str = aValue;
+  searchTerm.value = value;
+  searchTerm.booleanAnd = aBooleanAnd;
+  if (aAttrib > Ci.nsMsgSearchAttrib.OtherHeader) {
+    searchTerm.arbitraryHeader = "List-Id";
+  }
+  aFilter.appendTerm(searchTerm);
+  return searchTerm;
+}
+
+function addFilter(aFilterList, aName, aTerms, aEnabled = true) {
+  let filter = aFilterList.createFilter(aName);
+  for (let [attrib, op, value, booleanAnd] of aTerms) {
+    appendTerm(filter, attrib, op, value, booleanAnd !== false);
+  }
+  let action = filter.createAction();
+  action.type = Ci.nsMsgFilterAction.MarkRead;
+  filter.appendAction(action);
+  filter.enabled = aEnabled;
+  filter.filterType = Ci.nsMsgFilterType.InboxRule;
+  aFilterList.insertFilterAt(aFilterList.filterCount, filter);
+  return filter;
+}
+
+function makeFilterList(aFolder) {
+  const {Subject, Sender, To, CC, ToOrCC, AllAddresses, Size,
+         OtherHeader} = Ci.nsMsgSearchAttrib;
+  const {Contains, DoesntContain, Is, BeginsWith, EndsWith,
+         IsGreaterThan} = Ci.nsMsgSearchOp;
+
+  let filterList = MailServices.filters.getTempFilterList(aFolder);
+  for (let i = 0; i < kSenderFilters; i++) {
+    addFilter(filterList, "sender" + i,
+              [[Sender, Is, "sender" + (i * 7 % 450) + "@example.com"]]);
+    if (i % 25 == 0) {
+      addFilter(filterList, "group" + i,
+                [[Subject, Contains, "GROUP" + (i % 13)]]);
+      addFilter(filterList, "prefix" + i,
+                [[Subject, BeginsWith, "report " + (i / 25)]]);
+      addFilter(filterList, "list" + i,
+                [[OtherHeader + 1, Contains, "list" + (i % 7) + ".example"]]);
+    }
+  }
+  addFilter(filterList, "cafe", [[Subject, Contains, "café"]]);
+  addFilter(filterList, "subjectIs", [[Subject, Is, "report 12 for group12"]]);
+  addFilter(filterList, "name", [[Sender, Is, "SENDER 42"]]);
+  addFilter(filterList, "domain", [[Sender, EndsWith, "@example.com"],
+                                   [Subject, Contains, "group3"]]);
+  addFilter(filterList, "either", [[To, Contains, "team2@"],
+                                   [CC, Is, "bigboss@example.org", false]]);
+  addFilter(filterList, "toOrCc", [[ToOrCC, BeginsWith, "team4"]]);
+  addFilter(filterList, "all", [[AllAddresses, Contains, "sender399"]]);
+  // These can't be indexed.
+  addFilter(filterList, "negative", [[Subject, DoesntContain, "group"]]);
+  addFilter(filterList, "size", [[Size, IsGreaterThan, "0"],
+                                 [Subject, Contains, "group5"]]);
+  addFilter(filterList, "mixed", [[Subject, Contains, "group6"],
+                                  [Sender, Contains, "sender1", false],
+                                  [To, Contains, "team1", true]]);
+  addFilter(filterList, "disabled", [[Sender, Contains, "@"]], false);
+  // Stops the filters after it for the messages it matches.
+  addFilter(filterList, "stop", [[Subject, Contains, "group8"]]);
+  for (let i = 0; i < 20; i++) {
+    addFilter(filterList, "late" + i,
+              [[Sender, Contains, "sender" + (i * 3)]]);
+  }
+  return filterList;
+}
+
+/**
+ * The names of the filters hit for each message, the way applyFiltersToHdr
+ * should report them: every enabled filter in order, until a hit asks to
+ * stop.
+ */
+function matchAll(aFilterList, aFolder, aHdrs) {
+  let db = aFolder.msgDatabase;
+  let hits = [];
+  for (let hdr of aHdrs) {
+    let headers = gHeaders.get(hdr.messageId);
+    let names = [];
+    for (let i = 0; i < aFilterList.filterCount; i++) {
+      let filter = aFilterList.getFilterAt(i);
+      if (!filter.enabled ||
+          !(filter.filterType & Ci.nsMsgFilterType.InboxRule) ||
+          !filter.MatchHdr(hdr, aFolder, db, headers)) {
+        continue;
+      }
+      names.push(filter.filterName);
+      if (filter.filterName == "stop") {
+        break;
+      }
+    }
+    hits.push(names);
+  }
+  return hits;
+}
+
+function applyAll(aFilterList, aFolder, aHdrs) {
+  let db = aFolder.msgDatabase;
+  let hits = [];
+  for (let hdr of aHdrs) {
+    let names = [];
+    aFilterList.applyFiltersToHdr(Ci.nsMsgFilterType.InboxRule, hdr, aFolder,
+                                  db, gHeaders.get(hdr.messageId), {
+      QueryInterface: ChromeUtils.generateQI([Ci.nsIMsgFilterHitNotify]),
+      applyFilterHit(aFilter, aMsgWindow) {
+        names.push(aFilter.filterName);
+        return aFilter.filterName != "stop";
+      },
+    }, null);
+    hits.push(names);
+  }
+  return hits;
+}
+
+add_task(function test_index_matches_all_filters() {
+  let folder = makeFolder();
+  let hdrs = [];
+  let enumerator = folder.msgDatabase.EnumerateMessages();
+  while (enumerator.hasMoreElements()) {
+    hdrs.push(enumerator.getNext().QueryInterface(Ci.nsIMsgDBHdr));
+  }
+  Assert.equal(hdrs.length, kMessages);
+
+  let filterList = makeFilterList(folder);
+  let start = Date.now();
+  let expected = matchAll(filterList, folder, hdrs);
+  let allTime = Date.now() - start;
+  start = Date.now();
+  let actual = applyAll(filterList, folder, hdrs);
+  let indexTime = Date.now() - start;
+  info("Matched " + filterList.filterCount + " filters against " +
+       kMessages + " headers one by one in " + allTime + "ms, with the " +
+       "index in " + indexTime + "ms");
+
+  Assert.deepEqual(actual, expected);
+  let hitNames = new Set([].concat(...actual));
+  for (let name of ["sender0", "group0", "prefix0", "list0", "cafe",
+                    "subjectIs", "name", "domain", "either", "toOrCc", "all",
+                    "negative", "size", "mixed", "stop", "late0"]) {
+    Assert.ok(hitNames.has(name), name + " hit");
+  }
+  Assert.ok(!hitNames.has("disabled"));
+
+  // Changing the terms of a filter takes effect once they are set again.
+  let filter = filterList.getFilterNamed("cafe");
+  let searchTerms = filter.searchTerms;
+  let term = searchTerms.queryElementAt(0, Ci.nsIMsgSearchTerm);
+  let value = term.value;
+  value.str = "report 33 ";
+  term.value = value;
+  filter.searchTerms = searchTerms;
+  filterList.getFilterNamed("name").enabled = false;
+  Assert.deepEqual(applyAll(filterList, folder, hdrs),
+                   matchAll(filterList, folder, hdrs));
+
+  // So does changing the filters themselves.
+  filterList.removeFilterAt(0);
+  addFilter(filterList, "added", [[Ci.nsMsgSearchAttrib.Subject,
+                                   Ci.nsMsgSearchOp.EndsWith, "group2"]]);
+  Assert.deepEqual(applyAll(filterList, folder, hdrs),
+                   matchAll(filterList, folder, hdrs));
+});
+
+function run_test() {
+  localAccountUtils.loadLocalMailAccount();
+  run_next_test();
+}
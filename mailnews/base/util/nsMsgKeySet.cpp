@@ -10,9 +10,14 @@
 #include "nsMsgKeySet.h"
 #include "prprf.h"
 #include "prmem.h"
+#include "prinrval.h"
 #include "nsTArray.h"
 #include "nsMemory.h"
+#include "nsString.h"
+#include "mozilla/MathAlgorithms.h"
+#include <algorithm>
 #include <ctype.h>
+#include <stdlib.h>
 
 #if defined(DEBUG_seth_) || defined(DEBUG_sspitzer_)
 #define DEBUG_MSGKEYSET 1
@@ -23,55 +28,483 @@
 
    1-29627,29635,29658,32861-32863
 
-   so the data has these properties:
+   but groups can have millions of articles, and the read state of a large
+   group can be fragmented, so marking articles read and counting unread
+   articles must not have to walk the whole set.
 
-   - strictly increasing
-   - large subsequences of monotonically increasing ranges
-   - gaps in the set are usually small, but not always
-   - consecutive ranges tend to be large
+   The set is split into containers by the high 16 bits of the articles, kept
+   sorted by those bits, the way roaring bitmaps do it. A container holds the
+   low 16 bits of its members in whichever of these takes the least space:
 
-   The biggest win is to run-length encode the data, storing ranges as two
-   numbers (start+length or start,end). We could also store each number as a
-   delta from the previous number for further compression, but that gets kind
-   of tricky, since there are no guarantees about the sizes of the gaps, and
-   we'd have to store variable-length words.
+   - a sorted array of the values, for up to 4096 members,
+   - a bitmap of all 65536 values, 8K,
+   - a sorted list of runs, as first,last pairs.
 
-   Current data format:
+   So lookups and changes only look at one container, and runs, which the
+   newsrc format is all about, stay as cheap as they were with the old run
+   length encoding.
 
-   DATA := SIZE [ CHUNK ]*
-   CHUNK := [ RANGE | VALUE ]
-   RANGE := -LENGTH START
-   START := VALUE
-   LENGTH := int32_t
-   VALUE := a literal positive integer, for now
-   it could also be an offset from the previous value.
-   LENGTH could also perhaps be a less-than-32-bit quantity,
-   at least most of the time.
+   Another optimization we make is to notice that we typically ask the
+   question ``is N a member of the set'' for increasing values of N. So the
+   set remembers the container it found last, and tries it first.  */
 
-   Lengths of CHUNKs are stored negative to distinguish the beginning of
-   a chunk from a literal: negative means two-word sequence, positive
-   means one-word sequence.
+namespace {
 
-   0 represents a literal 0, but should not occur, and should never occur
-   except in the first position.
+const int32_t kMaxArrayValues = 4096;     // more take more space than a bitmap
+const uint32_t kBitmapWords = 0x10000 / 64;
+const int32_t kMaxRuns = kBitmapWords * 8 / 4;  // same for runs
 
-   A length of -1 won't occur either, except temporarily - a sequence of
-   two elements is represented as two literals, since they take up the same
-   space.
+// The bits of word aWord of a bitmap which are in [aFirst, aLast].
+uint64_t
+WordMask(uint32_t aWord, int32_t aFirst, int32_t aLast)
+{
+  int32_t first = std::max(aFirst - int32_t(aWord * 64), 0);
+  int32_t last = std::min(aLast - int32_t(aWord * 64), 63);
+  return (~uint64_t(0) >> (63 - last)) & (~uint64_t(0) << first);
+}
+
+uint32_t
+PopCount(uint64_t aWord)
+{
+  return mozilla::CountPopulation32(uint32_t(aWord)) +
+         mozilla::CountPopulation32(uint32_t(aWord >> 32));
+}
+
+} // namespace
+
+/* Index of the first value >= aValue, in an array container. */
+uint32_t
+nsMsgKeySet::Container::LowerBound(int32_t aValue) const
+{
+  uint32_t low = 0, high = values.Length();
+  while (low < high) {
+    uint32_t mid = (low + high) / 2;
+    if (values[mid] < aValue)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low;
+}
+
+/* Index of the last run which starts at or before aValue, or -1. */
+int32_t
+nsMsgKeySet::Container::RunAt(int32_t aValue) const
+{
+  int32_t low = 0, high = values.Length() / 2;
+  while (low < high) {
+    int32_t mid = (low + high) / 2;
+    if (values[2 * mid] <= aValue)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low - 1;
+}
+
+/* Index of the first run which ends at or after aValue. */
+int32_t
+nsMsgKeySet::Container::FirstRunEndingFrom(int32_t aValue) const
+{
+  int32_t low = 0, high = values.Length() / 2;
+  while (low < high) {
+    int32_t mid = (low + high) / 2;
+    if (values[2 * mid + 1] < aValue)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low;
+}
+
+/* The first value >= aValue whose bit is aMember, in a bitmap container, or
+   -1. */
+int32_t
+nsMsgKeySet::Container::ScanUp(int32_t aValue, bool aMember) const
+{
+  if (aValue > 0xFFFF)
+    return -1;
+  uint32_t w = aValue >> 6;
+  uint64_t word = (aMember ? words[w] : ~words[w]) &
+                  (~uint64_t(0) << (aValue & 63));
+  while (!word) {
+    if (++w == kBitmapWords)
+      return -1;
+    word = aMember ? words[w] : ~words[w];
+  }
+  return w * 64 + mozilla::CountTrailingZeroes64(word);
+}
+
+/* The last value <= aValue whose bit is aMember, in a bitmap container, or
+   -1. */
+int32_t
+nsMsgKeySet::Container::ScanDown(int32_t aValue, bool aMember) const
+{
+  if (aValue < 0)
+    return -1;
+  uint32_t w = aValue >> 6;
+  uint64_t word = (aMember ? words[w] : ~words[w]) &
+                  (~uint64_t(0) >> (63 - (aValue & 63)));
+  while (!word) {
+    if (w-- == 0)
+      return -1;
+    word = aMember ? words[w] : ~words[w];
+  }
+  return w * 64 + 63 - mozilla::CountLeadingZeroes64(word);
+}
+
+bool
+nsMsgKeySet::Container::Contains(int32_t aValue) const
+{
+  switch (type) {
+  case kArray: {
+    uint32_t i = LowerBound(aValue);
+    return i < values.Length() && values[i] == aValue;
+  }
+  case kBitmap:
+    return (words[aValue >> 6] >> (aValue & 63)) & 1;
+  case kRun: {
+    int32_t r = RunAt(aValue);
+    return r >= 0 && aValue <= values[2 * r + 1];
+  }
+  }
+  return false;
+}
+
+int32_t
+nsMsgKeySet::Container::AddRange(int32_t aFirst, int32_t aLast)
+{
+  int32_t added = 0;
+  switch (type) {
+  case kArray: {
+    uint32_t i = LowerBound(aFirst);
+    uint32_t j = LowerBound(aLast + 1);
+    added = (aLast - aFirst + 1) - (j - i);
+    if (!added)
+      return 0;
+    if (cardinality + added > kMaxArrayValues) {
+      ToBitmap();
+      return AddRange(aFirst, aLast);
+    }
+    values.RemoveElementsAt(i, j - i);
+    uint16_t *inserted = values.InsertElementsAt(i, aLast - aFirst + 1);
+    for (int32_t v = aFirst; v <= aLast; v++)
+      *inserted++ = v;
+    break;
+  }
+  case kBitmap:
+    for (uint32_t w = aFirst >> 6; w <= uint32_t(aLast >> 6); w++) {
+      uint64_t mask = WordMask(w, aFirst, aLast);
+      added += PopCount(mask & ~words[w]);
+      words[w] |= mask;
+    }
+    break;
+  case kRun: {
+    // Merge the runs which overlap or touch the new one into it.
+    int32_t lo = FirstRunEndingFrom(aFirst - 1);
+    int32_t hi = RunAt(aLast + 1);
+    if (lo > hi) {
+      uint16_t *run = values.InsertElementsAt(2 * lo, 2);
+      run[0] = aFirst;
+      run[1] = aLast;
+      added = aLast - aFirst + 1;
+    } else {
+      int32_t first = std::min<int32_t>(aFirst, values[2 * lo]);
+      int32_t last = std::max<int32_t>(aLast, values[2 * hi + 1]);
+      added = last - first + 1;
+      for (int32_t r = lo; r <= hi; r++)
+        added -= values[2 * r + 1] - values[2 * r] + 1;
+      values[2 * lo] = first;
+      values[2 * lo + 1] = last;
+      values.RemoveElementsAt(2 * lo + 2, 2 * (hi - lo));
+    }
+    cardinality += added;
+    if (NumRuns() > kMaxRuns)
+      Optimize();
+    return added;
+  }
+  }
+  cardinality += added;
+  return added;
+}
+
+int32_t
+nsMsgKeySet::Container::RemoveRange(int32_t aFirst, int32_t aLast)
+{
+  int32_t removed = 0;
+  switch (type) {
+  case kArray: {
+    uint32_t i = LowerBound(aFirst);
+    uint32_t j = LowerBound(aLast + 1);
+    values.RemoveElementsAt(i, j - i);
+    removed = j - i;
+    break;
+  }
+  case kBitmap:
+    for (uint32_t w = aFirst >> 6; w <= uint32_t(aLast >> 6); w++) {
+      uint64_t mask = WordMask(w, aFirst, aLast);
+      removed += PopCount(mask & words[w]);
+      words[w] &= ~mask;
+    }
+    cardinality -= removed;
+    // Not right at kMaxArrayValues, so adding and removing one article there
+    // doesn't keep converting.
+    if (cardinality <= kMaxArrayValues / 2)
+      ToArray();
+    return removed;
+  case kRun: {
+    int32_t lo = FirstRunEndingFrom(aFirst);
+    int32_t hi = RunAt(aLast);
+    if (lo > hi)
+      return 0;
+    // What is left of the first and last runs.
+    uint16_t pieces[4];
+    uint32_t numPieces = 0;
+    int32_t first = values[2 * lo];
+    int32_t last = values[2 * hi + 1];
+    for (int32_t r = lo; r <= hi; r++)
+      removed += values[2 * r + 1] - values[2 * r] + 1;
+    if (first < aFirst) {
+      pieces[numPieces++] = first;
+      pieces[numPieces++] = aFirst - 1;
+      removed -= aFirst - first;
+    }
+    if (last > aLast) {
+      pieces[numPieces++] = aLast + 1;
+      pieces[numPieces++] = last;
+      removed -= last - aLast;
+    }
+    values.ReplaceElementsAt(2 * lo, 2 * (hi - lo + 1), pieces, numPieces);
+    cardinality -= removed;
+    if (NumRuns() > kMaxRuns)
+      Optimize();
+    return removed;
+  }
+  }
+  cardinality -= removed;
+  return removed;
+}
+
+int32_t
+nsMsgKeySet::Container::CountRange(int32_t aFirst, int32_t aLast) const
+{
+  int32_t count = 0;
+  switch (type) {
+  case kArray:
+    return LowerBound(aLast + 1) - LowerBound(aFirst);
+  case kBitmap:
+    for (uint32_t w = aFirst >> 6; w <= uint32_t(aLast >> 6); w++)
+      count += PopCount(words[w] &
+                                          WordMask(w, aFirst, aLast));
+    break;
+  case kRun:
+    for (uint32_t r = FirstRunEndingFrom(aFirst);
+         r < values.Length() / 2 && values[2 * r] <= aLast; r++) {
+      count += std::min<int32_t>(values[2 * r + 1], aLast) -
+               std::max<int32_t>(values[2 * r], aFirst) + 1;
+    }
+    break;
+  }
+  return count;
+}
+
+int32_t
+nsMsgKeySet::Container::NextMember(int32_t aValue) const
+{
+  switch (type) {
+  case kArray: {
+    uint32_t i = LowerBound(aValue);
+    return i < values.Length() ? values[i] : -1;
+  }
+  case kBitmap:
+    return ScanUp(aValue, true);
+  case kRun: {
+    int32_t r = RunAt(aValue);
+    if (r >= 0 && aValue <= values[2 * r + 1])
+      return aValue;
+    return uint32_t(r + 1) < values.Length() / 2 ? values[2 * (r + 1)] : -1;
+  }
+  }
+  return -1;
+}
+
+int32_t
+nsMsgKeySet::Container::NextNonMember(int32_t aValue) const
+{
+  switch (type) {
+  case kArray:
+    for (uint32_t i = LowerBound(aValue);
+         i < values.Length() && values[i] == aValue; i++)
+      aValue++;
+    return aValue;
+  case kBitmap: {
+    int32_t v = ScanUp(aValue, false);
+    return v < 0 ? 0x10000 : v;
+  }
+  case kRun: {
+    int32_t r = RunAt(aValue);
+    if (r >= 0 && aValue <= values[2 * r + 1])
+      return values[2 * r + 1] + 1;
+    return aValue;
+  }
+  }
+  return aValue;
+}
+
+int32_t
+nsMsgKeySet::Container::PrevMember(int32_t aValue) const
+{
+  switch (type) {
+  case kArray: {
+    uint32_t i = LowerBound(aValue + 1);
+    return i > 0 ? values[i - 1] : -1;
+  }
+  case kBitmap:
+    return ScanDown(aValue, true);
+  case kRun: {
+    int32_t r = RunAt(aValue);
+    return r < 0 ? -1 : std::min<int32_t>(aValue, values[2 * r + 1]);
+  }
+  }
+  return -1;
+}
+
+int32_t
+nsMsgKeySet::Container::PrevNonMember(int32_t aValue) const
+{
+  switch (type) {
+  case kArray:
+    for (uint32_t i = LowerBound(aValue + 1);
+         i > 0 && values[i - 1] == aValue; i--)
+      aValue--;
+    return aValue;
+  case kBitmap:
+    return ScanDown(aValue, false);
+  case kRun: {
+    int32_t r = RunAt(aValue);
+    if (r >= 0 && aValue <= values[2 * r + 1])
+      return values[2 * r] - 1;
+    return aValue;
+  }
+  }
+  return aValue;
+}
+
+int32_t
+nsMsgKeySet::Container::NumRuns() const
+{
+  int32_t runs = 0;
+  switch (type) {
+  case kArray:
+    for (uint32_t i = 0; i < values.Length(); i++) {
+      if (!i || values[i] != values[i - 1] + 1)
+        runs++;
+    }
+    break;
+  case kBitmap: {
+    // A run starts at each set bit whose lower neighbour isn't set.
+    uint64_t carry = 0;
+    for (uint32_t w = 0; w < kBitmapWords; w++) {
+      runs += PopCount(words[w] & ~((words[w] << 1) | carry));
+      carry = words[w] >> 63;
+    }
+    break;
+  }
+  case kRun:
+    runs = values.Length() / 2;
+    break;
+  }
+  return runs;
+}
+
+void
+nsMsgKeySet::Container::Optimize()
+{
+  uint32_t runBytes = NumRuns() * 4;
+  uint32_t arrayBytes = cardinality <= kMaxArrayValues ? cardinality * 2
+                                                       : UINT32_MAX;
+  uint32_t bitmapBytes = kBitmapWords * 8;
+  if (runBytes < arrayBytes && runBytes < bitmapBytes) {
+    if (type != kRun)
+      ToRuns();
+  } else if (arrayBytes <= bitmapBytes) {
+    if (type != kArray)
+      ToArray();
+  } else if (type != kBitmap) {
+    ToBitmap();
+  }
+}
+
+void
+nsMsgKeySet::Container::ToArray()
+{
+  nsTArray<uint16_t> array;
+  array.SetCapacity(cardinality);
+  if (type == kBitmap) {
+    for (uint32_t w = 0; w < kBitmapWords; w++) {
+      for (uint64_t word = words[w]; word; word &= word - 1)
+        array.AppendElement(w * 64 + mozilla::CountTrailingZeroes64(word));
+    }
+  } else if (type == kRun) {
+    for (uint32_t r = 0; r < values.Length(); r += 2) {
+      for (int32_t v = values[r]; v <= values[r + 1]; v++)
+        array.AppendElement(v);
+    }
+  } else {
+    return;
+  }
+  values.SwapElements(array);
+  words.Clear();
+  words.Compact();
+  type = kArray;
+}
+
+void
+nsMsgKeySet::Container::ToBitmap()
+{
+  if (type == kBitmap)
+    return;
+  words.SetLength(kBitmapWords);
+  memset(words.Elements(), 0, kBitmapWords * sizeof(uint64_t));
+  if (type == kArray) {
+    for (uint32_t i = 0; i < values.Length(); i++)
+      words[values[i] >> 6] |= uint64_t(1) << (values[i] & 63);
+  } else {
+    for (uint32_t r = 0; r < values.Length(); r += 2) {
+      for (uint32_t w = values[r] >> 6; w <= uint32_t(values[r + 1] >> 6); w++)
+        words[w] |= WordMask(w, values[r], values[r + 1]);
+    }
+  }
+  values.Clear();
+  values.Compact();
+  type = kBitmap;
+}
+
+void
+nsMsgKeySet::Container::ToRuns()
+{
+  if (type == kRun)
+    return;
+  nsTArray<uint16_t> runs;
+  for (int32_t v = NextMember(0); v >= 0; ) {
+    int32_t end = NextNonMember(v);
+    runs.AppendElement(v);
+    runs.AppendElement(end - 1);
+    v = NextMember(end);
+  }
+  values.SwapElements(runs);
+  values.Compact();
+  words.Clear();
+  words.Compact();
+  type = kRun;
+}
 
-   Another optimization we make is to notice that we typically ask the
-   question ``is N a member of the set'' for increasing values of N. So the
-   set holds a cache of the last value asked for, and can simply resume the
-   search from there.  */
 
 nsMsgKeySet::nsMsgKeySet(/* MSG_NewsHost* host*/)
 {
   MOZ_COUNT_CTOR(nsMsgKeySet);
-  m_cached_value = -1;
-  m_cached_value_index = 0;
-  m_length = 0;
-  m_data_size = 10;
-  m_data = (int32_t *) PR_Malloc (sizeof (int32_t) * m_data_size);
+  m_cached_index = 0;
+  m_listener = nullptr;
 #ifdef NEWSRC_DOES_HOST_STUFF
   m_host = host;
 #endif
@@ -81,42 +514,18 @@ nsMsgKeySet::nsMsgKeySet(/* MSG_NewsHost* host*/)
 nsMsgKeySet::~nsMsgKeySet()
 {
   MOZ_COUNT_DTOR(nsMsgKeySet);
-  PR_FREEIF(m_data);
-}
-
-
-bool nsMsgKeySet::Grow()
-{
-  int32_t new_size;
-  int32_t *new_data;
-  new_size = m_data_size * 2;
-  new_data = (int32_t *) PR_REALLOC (m_data, sizeof (int32_t) * new_size);
-  if (! new_data)
-    return false;
-  m_data_size = new_size;
-  m_data = new_data;
-  return true;
 }
 
 
 nsMsgKeySet::nsMsgKeySet(const char* numbers /* , MSG_NewsHost* host */)
 {
-  int32_t *head, *tail, *end;
-    MOZ_COUNT_CTOR(nsMsgKeySet);
+  MOZ_COUNT_CTOR(nsMsgKeySet);
 
 #ifdef NEWSRC_DOES_HOST_STUFF
   m_host = host;
 #endif
-  m_cached_value = -1;
-  m_cached_value_index = 0;
-  m_length = 0;
-  m_data_size = 10;
-  m_data = (int32_t *) PR_Malloc (sizeof (int32_t) * m_data_size);
-  if (!m_data) return;
-
-  head = m_data;
-  tail = head;
-  end = head + m_data_size;
+  m_cached_index = 0;
+  m_listener = nullptr;
 
   if(!numbers) {
     return;
@@ -127,19 +536,6 @@ nsMsgKeySet::nsMsgKeySet(const char* numbers /* , MSG_NewsHost* host */)
     int32_t from = 0;
     int32_t to;
 
-    if (tail >= end - 4) {
-      /* out of room! */
-      int32_t tailo = tail - head;
-      if (!Grow()) {
-        PR_FREEIF(m_data);
-        return;
-      }
-      /* data may have been relocated */
-      head = m_data;
-      tail = head + tailo;
-      end = head + m_data_size;
-    }
-
     while (isspace(*numbers)) numbers++;
     if (*numbers && !isdigit(*numbers)) {
       break;      /* illegal character */
@@ -168,23 +564,15 @@ nsMsgKeySet::nsMsgKeySet(const char* numbers /* , MSG_NewsHost* host */)
        file has lines beginning with 0...   ### */
     if (from == 1) from = 0;
 
-    if (to == from) {
-      /* Write it as a literal */
-      *tail = from;
-      tail++;
-    } else /* Write it as a range. */ {
-      *tail = -(to - from);
-      tail++;
-      *tail = from;
-      tail++;
-    }
+    AddToContainers(from, to, false);
 
     while (*numbers == ',' || isspace(*numbers)) {
       numbers++;
     }
   }
 
-  m_length = tail - head; /* size of data */
+  for (uint32_t i = 0; i < m_containers.Length(); i++)
+    m_containers[i].Optimize();
 }
 
 
@@ -192,12 +580,7 @@ nsMsgKeySet::nsMsgKeySet(const char* numbers /* , MSG_NewsHost* host */)
 nsMsgKeySet*
 nsMsgKeySet::Create(/*MSG_NewsHost* host*/)
 {
-  nsMsgKeySet* set = new nsMsgKeySet(/* host */);
-  if (set && set->m_data == NULL) {
-    delete set;
-    set = NULL;
-  }
-  return set;
+  return new nsMsgKeySet(/* host */);
 }
 
 
@@ -208,14 +591,120 @@ nsMsgKeySet::Create(const char* value /* , MSG_NewsHost* host */)
     printf("create from %s\n",value);
 #endif
 
-  nsMsgKeySet* set = new nsMsgKeySet(value /* , host */);
-  if (set && set->m_data == NULL) {
-    delete set;
-    set = NULL;
+  return new nsMsgKeySet(value /* , host */);
+}
+
+
+/* Returns the index of the container for the articles whose high 16 bits are
+   aKey, or the index it should be inserted at if there is none.
+ */
+uint32_t
+nsMsgKeySet::FindContainer(uint32_t aKey, bool *aFound)
+{
+  uint32_t count = m_containers.Length();
+  if (m_cached_index < count && m_containers[m_cached_index].key == aKey) {
+    *aFound = true;
+    return m_cached_index;
+  }
+  uint32_t low = 0, high = count;
+  while (low < high) {
+    uint32_t mid = (low + high) / 2;
+    if (m_containers[mid].key < aKey)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  *aFound = low < count && m_containers[low].key == aKey;
+  if (*aFound)
+    m_cached_index = low;
+  return low;
+}
+
+nsMsgKeySet::Container&
+nsMsgKeySet::InsertContainer(uint32_t aIndex, uint32_t aKey,
+                             Container::Type aType)
+{
+  Container *container = m_containers.InsertElementAt(aIndex);
+  container->key = aKey;
+  container->type = aType;
+  m_cached_index = aIndex;
+  return *container;
+}
+
+int64_t
+nsMsgKeySet::NextMember(int64_t aNumber)
+{
+  if (aNumber > INT32_MAX)
+    return -1;
+  if (aNumber < 0)
+    aNumber = 0;
+  uint32_t key = aNumber >> 16;
+  bool found;
+  for (uint32_t i = FindContainer(key, &found); i < m_containers.Length(); i++) {
+    Container &container = m_containers[i];
+    int32_t v = container.NextMember(container.key == key ? aNumber & 0xFFFF : 0);
+    if (v >= 0)
+      return (int64_t(container.key) << 16) | v;
+  }
+  return -1;
+}
+
+int64_t
+nsMsgKeySet::NextNonMember(int64_t aNumber)
+{
+  if (aNumber < 0)
+    return aNumber;
+  bool found;
+  for (uint32_t i = FindContainer(aNumber >> 16, &found);
+       i < m_containers.Length() && m_containers[i].key == aNumber >> 16; i++) {
+    int32_t v = m_containers[i].NextNonMember(aNumber & 0xFFFF);
+    if (v <= 0xFFFF)
+      return (aNumber & ~int64_t(0xFFFF)) | v;
+    // The container is full from there on; go on with the next one.
+    aNumber = (int64_t(m_containers[i].key) + 1) << 16;
+  }
+  return aNumber;
+}
+
+int64_t
+nsMsgKeySet::PrevMember(int64_t aNumber)
+{
+  if (aNumber < 0)
+    return -1;
+  if (aNumber > INT32_MAX)
+    aNumber = INT32_MAX;
+  uint32_t key = aNumber >> 16;
+  bool found;
+  int32_t i = FindContainer(key, &found);
+  if (!found)
+    i--;
+  for (; i >= 0; i--) {
+    Container &container = m_containers[i];
+    int32_t v = container.PrevMember(container.key == key ? aNumber & 0xFFFF
+                                                          : 0xFFFF);
+    if (v >= 0)
+      return (int64_t(container.key) << 16) | v;
   }
-  return set;
+  return -1;
 }
 
+int64_t
+nsMsgKeySet::PrevNonMember(int64_t aNumber)
+{
+  if (aNumber < 0)
+    return -1;
+  bool found;
+  for (int32_t i = FindContainer(aNumber >> 16, &found);
+       i >= 0 && uint32_t(i) < m_containers.Length() &&
+       m_containers[i].key == aNumber >> 16; i--) {
+    int32_t v = m_containers[i].PrevNonMember(aNumber & 0xFFFF);
+    if (v >= 0)
+      return (aNumber & ~int64_t(0xFFFF)) | v;
+    // The container is full up to there; go on with the one before.
+    aNumber = (int64_t(m_containers[i].key) << 16) - 1;
+  }
+  return aNumber;
+}
 
 
 /* Returns the lowest non-member of the set greater than 0.
@@ -223,45 +712,7 @@ nsMsgKeySet::Create(const char* value /* , MSG_NewsHost* host */)
 int32_t
 nsMsgKeySet::FirstNonMember ()
 {
-  if (m_length <= 0) {
-    return 1;
-  } else if(m_data[0] < 0 && m_data[1] != 1 && m_data[1] != 0) {
-    /* first range not equal to 0 or 1, always return 1 */
-    return 1;
-  } else if (m_data[0] < 0) {
-    /* it's a range */
-    /* If there is a range [N-M] we can presume that M+1 is not in the
-       set. */
-    return (m_data[1] - m_data[0] + 1);
-  } else {
-    /* it's a literal */
-    if (m_data[0] == 1) {
-      /* handle "1,..." */
-      if (m_length > 1 && m_data[1] == 2) {
-        /* This is "1,2,M-N,..." or "1,2,M,..."  where M >= 4.  Note
-           that M will never be 3, because in that case we would have
-           started with a range: "1-3,..." */
-        return 3;
-      } else {
-        return 2;              /* handle "1,M-N,.." or "1,M,..."
-                      where M >= 3; */
-      }
-    }
-    else if (m_data[0] == 0) {
-      /* handle "0,..." */
-      if (m_length > 1 && m_data[1] == 1) {
-        /* this is 0,1, (see above) */
-        return 2;
-      }
-      else {
-        return 1;
-      }
-
-    } else {
-      /* handle "M,..." where M >= 2. */
-      return 1;
-    }
-  }
+  return int32_t(NextNonMember(1));
 }
 
 
@@ -269,158 +720,40 @@ nsresult
 nsMsgKeySet::Output(char **outputStr)
 {
   NS_ENSURE_ARG(outputStr);
-  int32_t size;
-  int32_t *head;
-  int32_t *tail;
-  int32_t *end;
-  int32_t s_size;
-  char *s_head;
-  char *s, *s_end;
-  int32_t last_art = -1;
-
-  *outputStr = nullptr;
-
-  size = m_length;
-  head = m_data;
-  tail = head;
-  end = head + size;
-
-  s_size = (size * 12) + 10;  // dmb - try to make this allocation get used at least once.
-  s_head = (char *) moz_xmalloc(s_size);
-  if (! s_head) return NS_ERROR_OUT_OF_MEMORY;
-
-  s_head[0] = '\0';      // otherwise, s_head will contain garbage.
-  s = s_head;
-  s_end = s + s_size;
-
-  while (tail < end) {
-    int32_t from;
-    int32_t to;
-
-    if (s > (s_end - (12 * 2 + 10))) { /* 12 bytes for each number (enough
-                        for "2147483647" aka 2^31-1),
-                        plus 10 bytes of slop. */
-      int32_t so = s - s_head;
-      s_size += 200;
-      char* tmp = (char *) moz_xmalloc(s_size);
-      if (tmp) PL_strcpy(tmp, s_head);
-      free(s_head);
-      s_head = tmp;
-      if (!s_head) return NS_ERROR_OUT_OF_MEMORY;
-      s = s_head + so;
-      s_end = s_head + s_size;
-    }
-
-    if (*tail < 0) {
-      /* it's a range */
-      from = tail[1];
-      to = from + (-(tail[0]));
-      tail += 2;
-    }
-    else /* it's a literal */
-      {
-        from = *tail;
-        to = from;
-        tail++;
-      }
-    if (from == 0) {
-      from = 1;        /* See 'hack' comment above  ### */
-    }
-    if (from <= last_art) from = last_art + 1;
-    if (from <= to) {
-      if (from < to) {
-        PR_snprintf(s, s_end - s, "%lu-%lu,", from, to);
-      } else {
-        PR_snprintf(s, s_end - s, "%lu,", from);
-      }
-      s += PL_strlen(s);
-      last_art = to;
+  nsAutoCString output;
+
+  /* Article 0 is never written out, see the 'hack' comment in the
+     constructor. ### */
+  for (int64_t from = NextMember(1); from >= 0; ) {
+    int64_t to = NextNonMember(from) - 1;
+    if (!output.IsEmpty())
+      output.Append(',');
+    output.AppendInt(int32_t(from));
+    if (from < to) {
+      output.Append('-');
+      output.AppendInt(int32_t(to));
     }
-  }
-  if (last_art >= 0) {
-    s--;              /* Strip off the last ',' */
+    from = NextMember(to + 1);
   }
 
-  *s = 0;
-
-  *outputStr = s_head;
-  return NS_OK;
+  *outputStr = ToNewCString(output);
+  return *outputStr ? NS_OK : NS_ERROR_OUT_OF_MEMORY;
 }
 
 int32_t
 nsMsgKeySet::GetLastMember()
 {
-  if (m_length > 1)
-  {
-    int32_t nextToLast = m_data[m_length - 2];
-    if (nextToLast < 0)  // is range at end?
-    {
-      int32_t last = m_data[m_length - 1];
-      return (-nextToLast + last - 1);
-    }
-    else  // no, so last number must be last member
-    {
-      return m_data[m_length - 1];
-    }
-  }
-  else if (m_length == 1)
-    return m_data[0];  // must be only 1 read.
-  else
-    return 0;
+  int64_t last = PrevMember(INT32_MAX);
+  return last < 0 ? 0 : int32_t(last);
 }
 
 void nsMsgKeySet::SetLastMember(int32_t newHighWaterMark)
 {
   if (newHighWaterMark < GetLastMember())
   {
-    while (true)
-    {
-      if (m_length > 1)
-      {
-        int32_t nextToLast = m_data[m_length - 2];
-        int32_t curHighWater;
-        if (nextToLast < 0)  // is range at end?
-        {
-          int32_t rangeStart = m_data[m_length - 1];
-          int32_t rangeLength = -nextToLast;
-          curHighWater = (rangeLength + rangeStart - 1);
-          if (curHighWater > newHighWaterMark)
-          {
-            if (rangeStart > newHighWaterMark)
-            {
-              m_length -= 2;  // throw away whole range
-            }
-            else if (rangeStart == newHighWaterMark)
-            {
-              // turn range into single element.
-              m_data[m_length - 2] = newHighWaterMark;
-              m_length--;
-              break;
-            }
-            else  // just shorten range
-            {
-              m_data[m_length - 2] = -(newHighWaterMark - rangeStart);
-              break;
-            }
-          }
-          else {
-            // prevent the infinite loop
-            // see bug #13062
-            break;
-          }
-        }
-        else if (m_data[m_length - 1] > newHighWaterMark)  // no, so last number must be last member
-        {
-          m_length--;
-        }
-        else
-          break;
-      }
-      else
-        break;
-    }
     // well, the whole range is probably invalid, because the server probably re-ordered ids,
     // but what can you do?
+    RemoveRange(newHighWaterMark + 1, INT32_MAX);
 #ifdef NEWSRC_DOES_HOST_STUFF
     if (m_host)
       m_host->MarkDirty();
@@ -431,307 +764,42 @@ void nsMsgKeySet::SetLastMember(int32_t newHighWaterMark)
 int32_t
 nsMsgKeySet::GetFirstMember()
 {
-  if (m_length > 1)
-  {
-    int32_t first = m_data[0];
-    if (first < 0)  // is range at start?
-    {
-      int32_t second = m_data[1];
-      return (second);
-    }
-    else  // no, so first number must be first member
-    {
-      return m_data[0];
-    }
-  }
-  else if (m_length == 1)
-    return m_data[0];  // must be only 1 read.
-  else
-    return 0;
+  int64_t first = NextMember(0);
+  return first < 0 ? 0 : int32_t(first);
 }
 
-/* Re-compresses a `nsMsgKeySet' object.
-
-   The assumption is made that the `nsMsgKeySet' is syntactically correct
-   (all ranges have a length of at least 1, and all values are non-
-   decreasing) but will optimize the compression, for example, merging
-   consecutive literals or ranges into one range.
-
-   Returns true if successful, false if there wasn't enough memory to
-   allocate scratch space.
-
-   #### This should be changed to modify the buffer in place.
-
-   Also note that we never call Optimize() unless we actually changed
-   something, so it's a great place to tell the MSG_NewsHost* that something
-   changed.
-   */
-bool
-nsMsgKeySet::Optimize()
-{
-  int32_t input_size;
-  int32_t output_size;
-  int32_t *input_tail;
-  int32_t *output_data;
-  int32_t *output_tail;
-  int32_t *input_end;
-  int32_t *output_end;
-
-  input_size = m_length;
-  output_size = input_size + 1;
-  input_tail = m_data;
-  output_data = (int32_t *) PR_Malloc (sizeof (int32_t) * output_size);
-  if (!output_data) return false;
-
-  output_tail = output_data;
-  input_end = input_tail + input_size;
-  output_end = output_data + output_size;
-
-  /* We're going to modify the set, so invalidate the cache. */
-  m_cached_value = -1;
-
-  while (input_tail < input_end) {
-    int32_t from, to;
-    bool range_p = (*input_tail < 0);
-
-    if (range_p) {
-      /* it's a range */
-      from = input_tail[1];
-      to = from + (-(input_tail[0]));
-
-      /* Copy it over */
-      *output_tail++ = *input_tail++;
-      *output_tail++ = *input_tail++;
-    } else {
-      /* it's a literal */
-      from = *input_tail;
-      to = from;
-
-      /* Copy it over */
-      *output_tail++ = *input_tail++;
-    }
-    NS_ASSERTION(output_tail < output_end, "invalid end of output string");
-    if (output_tail >= output_end) {
-      PR_Free(output_data);
-      return false;
-    }
-
-    /* As long as this chunk is followed by consecutive chunks,
-       keep extending it. */
-    while (input_tail < input_end &&
-         ((*input_tail > 0 && /* literal... */
-         *input_tail == to + 1) || /* ...and consecutive, or */
-        (*input_tail <= 0 && /* range... */
-         input_tail[1] == to + 1)) /* ...and consecutive. */
-         ) {
-      if (! range_p) {
-        /* convert the literal to a range. */
-        output_tail++;
-        output_tail [-2] = 0;
-        output_tail [-1] = from;
-        range_p = true;
-      }
-
-      if (*input_tail > 0) { /* literal */
-        output_tail[-2]--; /* increase length by 1 */
-        to++;
-        input_tail++;
-      } else {
-        int32_t L2 = (- *input_tail) + 1;
-        output_tail[-2] -= L2; /* increase length by N */
-        to += L2;
-        input_tail += 2;
-      }
-    }
-  }
-
-  PR_Free (m_data);
-  m_data = output_data;
-  m_data_size = output_size;
-  m_length = output_tail - output_data;
-
-  /* One last pass to turn [N - N+1] into [N, N+1]. */
-  output_tail = output_data;
-  output_end = output_tail + m_length;
-  while (output_tail < output_end) {
-    if (*output_tail < 0) {
-      /* it's a range */
-      if (output_tail[0] == -1) {
-        output_tail[0] = output_tail[1];
-        output_tail[1]++;
-      }
-      output_tail += 2;
-    } else {
-      /* it's a literal */
-      output_tail++;
-    }
-  }
-
-#ifdef NEWSRC_DOES_HOST_STUFF
-  if (m_host) m_host->MarkDirty();
-#endif
-  return true;
-}
-
-
 
 bool
 nsMsgKeySet::IsMember(int32_t number)
 {
-  bool value = false;
-  int32_t size;
-  int32_t *head;
-  int32_t *tail;
-  int32_t *end;
-
-  size = m_length;
-  head = m_data;
-  tail = head;
-  end = head + size;
-
-  /* If there is a value cached, and that value is smaller than the
-     value we're looking for, skip forward that far. */
-  if (m_cached_value > 0 &&
-    m_cached_value < number) {
-    tail += m_cached_value_index;
-  }
-
-  while (tail < end) {
-    if (*tail < 0) {
-      /* it's a range */
-      int32_t from = tail[1];
-      int32_t to = from + (-(tail[0]));
-      if (from > number) {
-        /* This range begins after the number - we've passed it. */
-        value = false;
-        goto DONE;
-      } else if (to >= number) {
-        /* In range. */
-        value = true;
-        goto DONE;
-      } else {
-        tail += 2;
-      }
-    }
-    else {
-      /* it's a literal */
-      if (*tail == number) {
-        /* bang */
-        value = true;
-        goto DONE;
-      } else if (*tail > number) {
-        /* This literal is after the number - we've passed it. */
-        value = false;
-        goto DONE;
-      } else {
-        tail++;
-      }
-    }
-  }
-
-DONE:
-  /* Store the position of this chunk for next time. */
-  m_cached_value = number;
-  m_cached_value_index = tail - head;
-
-  return value;
+  if (number < 0)
+    return false;
+  bool found;
+  uint32_t i = FindContainer(number >> 16, &found);
+  return found && m_containers[i].Contains(number & 0xFFFF);
 }
 
 
 int
 nsMsgKeySet::Add(int32_t number)
 {
-  int32_t size;
-  int32_t *head;
-  int32_t *tail;
-  int32_t *end;
-
 #ifdef DEBUG_MSGKEYSET
     printf("add %d\n",number);
 #endif
 
-  size = m_length;
-  head = m_data;
-  tail = head;
-  end = head + size;
-
   NS_ASSERTION (number >= 0, "can't have negative items");
   if (number < 0)
     return 0;
 
-  /* We're going to modify the set, so invalidate the cache. */
-  m_cached_value = -1;
-
-  while (tail < end) {
-    if (*tail < 0) {
-      /* it's a range */
-      int32_t from = tail[1];
-      int32_t to = from + (-(tail[0]));
-
-      if (from <= number && to >= number) {
-        /* This number is already present - we don't need to do
-           anything. */
-        return 0;
-      }
-
-      if (to > number) {
-        /* We have found the point before which the new number
-           should be inserted. */
-        break;
-      }
-
-      tail += 2;
-    } else {
-      /* it's a literal */
-      if (*tail == number) {
-        /* This number is already present - we don't need to do
-           anything. */
-        return 0;
-      }
-
-      if (*tail > number) {
-        /* We have found the point before which the new number
-           should be inserted. */
-        break;
-      }
-
-      tail++;
-    }
-  }
-
-  /* At this point, `tail' points to a position in the set which represents
-     a value greater than `new'; or it is at `end'. In the interest of
-     avoiding massive duplication of code, simply insert a literal here and
-     then run the optimizer.
-     */
-  int mid = (tail - head);
-
-  if (m_data_size <= m_length + 1) {
-    int endo = end - head;
-    if (!Grow()) {
-      // out of memory
-      return -1;
-    }
-    head = m_data;
-    end = head + endo;
-  }
-
-  if (tail == end) {
-    /* at the end */
-    /* Add a literal to the end. */
-    m_data[m_length++] = number;
-  } else {
-    /* need to insert (or edit) in the middle */
-    int32_t i;
-    for (i = size; i > mid; i--) {
-      m_data[i] = m_data[i-1];
-    }
-    m_data[i] = number;
-    m_length++;
-  }
-
-  Optimize();
-  return 1;
+  bool found;
+  uint32_t i = FindContainer(number >> 16, &found);
+  Container &container = found ? m_containers[i]
+    : InsertContainer(i, number >> 16, Container::kArray);
+  int32_t low = number & 0xFFFF;
+  int added = container.AddRange(low, low);
+  if (added && m_listener)
+    m_listener->OnKeySetChanged(this, number, number, true);
+  return added;
 }
 
 
@@ -739,290 +807,121 @@ nsMsgKeySet::Add(int32_t number)
 int
 nsMsgKeySet::Remove(int32_t number)
 {
-  int32_t size;
-  int32_t *head;
-  int32_t *tail;
-  int32_t *end;
 #ifdef DEBUG_MSGKEYSET
     printf("remove %d\n",number);
 #endif
 
-  size = m_length;
-  head = m_data;
-  tail = head;
-  end = head + size;
-
-  // **** I am not sure this is a right thing to comment the following
-  // statements out. The reason for this is due to the implementation of
-  // offline save draft and template. We use faked UIDs (negative ids) for
-  // offline draft and template in order to distinguish them from real
-  // UID. David I need your help here. **** jt
-
-  // PR_ASSERT(number >= 0);
-  // if (number < 0) {
-  //  return -1;
-  /// }
-
-  /* We're going to modify the set, so invalidate the cache. */
-  m_cached_value = -1;
-
-  while (tail < end) {
-    int32_t mid = (tail - m_data);
-
-    if (*tail < 0) {
-      /* it's a range */
-      int32_t from = tail[1];
-      int32_t to = from + (-(tail[0]));
-
-      if (number < from || number > to) {
-        /* Not this range */
-        tail += 2;
-        continue;
-      }
+  // Negative numbers are faked UIDs used for offline drafts and templates;
+  // they are never in the set.
+  if (number < 0)
+    return 0;
 
-      if (to == from + 1) {
-        /* If this is a range [N - N+1] and we are removing M
-           (which must be either N or N+1) replace it with a
-           literal. This reduces the length by 1. */
-        m_data[mid] = (number == from ? to : from);
-        while (++mid < m_length) {
-          m_data[mid] = m_data[mid+1];
-        }
-        m_length--;
-        Optimize();
-        return 1;
-      } else if (to == from + 2) {
-        /* If this is a range [N - N+2] and we are removing M,
-           replace it with the literals L,M (that is, either
-           (N, N+1), (N, N+2), or (N+1, N+2). The overall
-           length remains the same. */
-        m_data[mid] = from;
-        m_data[mid+1] = to;
-        if (from == number) {
-          m_data[mid] = from+1;
-        } else if (to == number) {
-          m_data[mid+1] = to-1;
-        }
-        Optimize();
-        return 1;
-      } else if (from == number) {
-        /* This number is at the beginning of a long range (meaning a
-           range which will still be long enough to remain a range.)
-           Increase start and reduce length of the range. */
-        m_data[mid]++;
-        m_data[mid+1]++;
-        Optimize();
-        return 1;
-      } else if (to == number) {
-        /* This number is at the end of a long range (meaning a range
-           which will still be long enough to remain a range.)
-           Just decrease the length of the range. */
-        m_data[mid]++;
-        Optimize();
-        return 1;
-      } else {
-        /* The number being deleted is in the middle of a range which
-           must be split. This increases overall length by 2.
-           */
-        int32_t i;
-        int endo = end - head;
-        if (m_data_size - m_length <= 2) {
-          if (!Grow())
-            // out of memory
-            return -1;
-        }
-        head = m_data;
-        end = head + endo;
+  bool found;
+  uint32_t i = FindContainer(number >> 16, &found);
+  if (!found)
+    return 0;
+  int32_t low = number & 0xFFFF;
+  int removed = m_containers[i].RemoveRange(low, low);
+  if (!m_containers[i].cardinality)
+    m_containers.RemoveElementAt(i);
+  if (removed && m_listener)
+    m_listener->OnKeySetChanged(this, number, number, false);
+  return removed;
+}
 
-        for (i = m_length + 2; i > mid + 2; i--) {
-          m_data[i] = m_data[i-2];
-        }
 
-        m_data[mid] = (- (number - from - 1));
-        m_data[mid+1] = from;
-        m_data[mid+2] = (- (to - number - 1));
-        m_data[mid+3] = number + 1;
-        m_length += 2;
-
-        /* Oops, if we've ended up with a range with a 0 length,
-           which is illegal, convert it to a literal, which reduces
-           the overall length by 1. */
-        if (m_data[mid] == 0) {
-          /* first range */
-          m_data[mid] = m_data[mid+1];
-          for (i = mid + 1; i < m_length; i++) {
-            m_data[i] = m_data[i+1];
-          }
-          m_length--;
-        }
-        if (m_data[mid+2] == 0) {
-          /* second range */
-          m_data[mid+2] = m_data[mid+3];
-          for (i = mid + 3; i < m_length; i++) {
-            m_data[i] = m_data[i+1];
-          }
-          m_length--;
-        }
-        Optimize();
-        return 1;
-      }
-    } else {
-      /* it's a literal */
-      if (*tail != number) {
-        /* Not this literal */
-        tail++;
-        continue;
-      }
+int
+nsMsgKeySet::AddRange(int32_t start, int32_t end)
+{
+  NS_ASSERTION(start <= end, "invalid range");
+  if (start > end) return -1;
 
-      /* Excise this literal. */
-      m_length--;
-      while (mid < m_length) {
-        m_data[mid] = m_data[mid+1];
-        mid++;
-      }
-      Optimize();
-      return 1;
-    }
-  }
+  NS_ASSERTION(start >= 0, "can't have negative items");
+  if (end < 0) return 0;
+  if (start < 0) start = 0;
 
-  /* It wasn't here at all. */
-  return 0;
-}
+  int32_t added = AddToContainers(start, end, true);
+  if (added && m_listener)
+    m_listener->OnKeySetChanged(this, start, end, true);
 
+#ifdef NEWSRC_DOES_HOST_STUFF
+  if (added && m_host) m_host->MarkDirty();
+#endif
+  return added ? 1 : 0;
+}
 
-static int32_t*
-msg_emit_range(int32_t* tmp, int32_t a, int32_t b)
+/* Adds [start, end] to the containers, returning how many articles weren't
+   in the set yet. Choosing the best container type means counting the runs
+   of the container, so that is only done when asked to and when more than
+   one article was added; the parser optimizes all containers at the end. */
+int32_t
+nsMsgKeySet::AddToContainers(int32_t start, int32_t end, bool optimize)
 {
-  if (a == b) {
-    *tmp++ = a;
-  } else {
-    NS_ASSERTION(a < b && a >= 0, "range is out of order");
-    *tmp++ = -(b - a);
-    *tmp++ = a;
+  int32_t added = 0;
+  for (uint32_t key = start >> 16; key <= uint32_t(end >> 16); key++) {
+    int32_t first = key == uint32_t(start >> 16) ? start & 0xFFFF : 0;
+    int32_t last = key == uint32_t(end >> 16) ? end & 0xFFFF : 0xFFFF;
+    bool found;
+    uint32_t i = FindContainer(key, &found);
+    Container &container = found ? m_containers[i]
+      : InsertContainer(i, key, first == last ? Container::kArray
+                                              : Container::kRun);
+    int32_t count = container.AddRange(first, last);
+    if (optimize && count > 1 && container.type != Container::kRun)
+      container.Optimize();
+    added += count;
   }
-  return tmp;
+  return added;
 }
 
-
 int
-nsMsgKeySet::AddRange(int32_t start, int32_t end)
+nsMsgKeySet::RemoveRange(int32_t start, int32_t end)
 {
-  int32_t tmplength;
-  int32_t* tmp;
-  int32_t* in;
-  int32_t* out;
-  int32_t* tail;
-  int32_t a;
-  int32_t b;
-  bool didit = false;
-
-  /* We're going to modify the set, so invalidate the cache. */
-  m_cached_value = -1;
-
   NS_ASSERTION(start <= end, "invalid range");
   if (start > end) return -1;
 
-  if (start == end) {
-    return Add(start);
+  if (end < 0) return 0;
+  if (start < 0) start = 0;
+
+  int32_t removed = 0;
+  bool found;
+  uint32_t i = FindContainer(start >> 16, &found);
+  while (i < m_containers.Length() &&
+         m_containers[i].key <= uint32_t(end >> 16)) {
+    Container &container = m_containers[i];
+    int32_t first = container.key == uint32_t(start >> 16) ? start & 0xFFFF : 0;
+    int32_t last = container.key == uint32_t(end >> 16) ? end & 0xFFFF : 0xFFFF;
+    removed += container.RemoveRange(first, last);
+    if (container.cardinality)
+      i++;
+    else
+      m_containers.RemoveElementAt(i);
   }
 
-  tmplength = m_length + 2;
-  tmp = (int32_t*) PR_Malloc(sizeof(int32_t) * tmplength);
-
-  if (!tmp)
-    // out of memory
-    return -1;
-
-  in = m_data;
-  out = tmp;
-  tail = in + m_length;
-
-#define EMIT(x, y) out = msg_emit_range(out, x, y)
-
-  while (in < tail) {
-    // Set [a,b] to be this range.
-    if (*in < 0) {
-      b = - *in++;
-      a = *in++;
-      b += a;
-    } else {
-      a = b = *in++;
-    }
-
-    if (a <= start && b >= end) {
-      // We already have the entire range marked.
-      PR_Free(tmp);
-      return 0;
-    }
-    if (start > b + 1) {
-      // No overlap yet.
-      EMIT(a, b);
-    } else if (end < a - 1) {
-      // No overlap, and we passed it.
-      EMIT(start, end);
-      EMIT(a, b);
-      didit = true;
-      break;
-    } else {
-      // The ranges overlap.  Suck this range into our new range, and
-      // keep looking for other ranges that might overlap.
-      start = start < a ? start : a;
-      end = end > b ? end : b;
-    }
-  }
-  if (!didit) EMIT(start, end);
-  while (in < tail) {
-    *out++ = *in++;
-  }
-
-#undef EMIT
-
-  PR_Free(m_data);
-  m_data = tmp;
-  m_length = out - tmp;
-  m_data_size = tmplength;
-#ifdef NEWSRC_DOES_HOST_STUFF
-  if (m_host) m_host->MarkDirty();
-#endif
-  return 1;
+  if (removed && m_listener)
+    m_listener->OnKeySetChanged(this, start, end, false);
+  return removed ? 1 : 0;
 }
 
 int32_t
 nsMsgKeySet::CountMissingInRange(int32_t range_start, int32_t range_end)
 {
-  int32_t count;
-  int32_t *head;
-  int32_t *tail;
-  int32_t *end;
-
   NS_ASSERTION (range_start >= 0 && range_end >= 0 && range_end >= range_start, "invalid range");
   if (range_start < 0 || range_end < 0 || range_end < range_start) return -1;
 
-  head = m_data;
-  tail = head;
-  end = head + m_length;
-
-  count = range_end - range_start + 1;
-
-  while (tail < end) {
-    if (*tail < 0) {
-      /* it's a range */
-      int32_t from = tail[1];
-      int32_t to = from + (-(tail[0]));
-      if (from < range_start) from = range_start;
-      if (to > range_end) to = range_end;
-
-      if (to >= from)
-        count -= (to - from + 1);
-
-      tail += 2;
-    } else {
-      /* it's a literal */
-      if (*tail >= range_start && *tail <= range_end) count--;
-      tail++;
-    }
-    NS_ASSERTION (count >= 0, "invalid count");
+  int32_t count = range_end - range_start + 1;
+  uint32_t startKey = range_start >> 16;
+  uint32_t endKey = range_end >> 16;
+  bool found;
+  for (uint32_t i = FindContainer(startKey, &found);
+       i < m_containers.Length() && m_containers[i].key <= endKey; i++) {
+    Container &container = m_containers[i];
+    int32_t first = container.key == startKey ? range_start & 0xFFFF : 0;
+    int32_t last = container.key == endKey ? range_end & 0xFFFF : 0xFFFF;
+    count -= (first == 0 && last == 0xFFFF) ? container.cardinality
+                                            : container.CountRange(first, last);
   }
+  NS_ASSERTION (count >= 0, "invalid count");
   return count;
 }
 
@@ -1031,15 +930,6 @@ int
 nsMsgKeySet::FirstMissingRange(int32_t min, int32_t max,
                   int32_t* first, int32_t* last)
 {
-  int32_t size;
-  int32_t *head;
-  int32_t *tail;
-  int32_t *end;
-  int32_t from = 0;
-  int32_t to = 0;
-  int32_t a;
-  int32_t b;
-
   NS_ASSERTION(first && last, "invalid parameter");
   if (!first || !last) return -1;
 
@@ -1048,102 +938,31 @@ nsMsgKeySet::FirstMissingRange(int32_t min, int32_t max,
   NS_ASSERTION(min <= max && min > 0, "invalid min or max param");
   if (min > max || min <= 0) return -1;
 
-  size = m_length;
-  head = m_data;
-  tail = head;
-  end = head + size;
-
-  while (tail < end) {
-    a = to + 1;
-    if (*tail < 0) {      /* We got a range. */
-      from = tail[1];
-      to = from + (-(tail[0]));
-      tail += 2;
-    } else {
-      from = to = tail[0];
-      tail++;
-    }
-    b = from - 1;
-    /* At this point, [a,b] is the range of unread articles just before
-       the current range of read articles [from,to].  See if this range
-       intersects the [min,max] range we were given. */
-    if (a > max) return 0;  /* It's hopeless; there are none. */
-    if (a <= b && b >= min) {
-      /* Ah-hah!  We found an intersection. */
-      *first = a > min ? a : min;
-      *last = b < max ? b : max;
-      return 0;
-    }
-  }
-  /* We found no holes in the newsrc that overlaps the range, nor did we hit
-     something read beyond the end of the range.  So, the great infinite
-     range of unread articles at the end of any newsrc line intersects the
-     range we want, and we just need to return that. */
-  a = to + 1;
-  *first = a > min ? a : min;
-  *last = max;
+  int64_t a = NextNonMember(min);
+  if (a > max) return 0;  /* It's hopeless; there are none. */
+  int64_t b = NextMember(a);
+  *first = int32_t(a);
+  *last = (b < 0 || b - 1 > max) ? max : int32_t(b - 1);
   return 0;
 }
 
-// I'm guessing we didn't include this because we didn't think we're going
-// to need it. I'm not so sure. I'm putting it in for now.
 int
 nsMsgKeySet::LastMissingRange(int32_t min, int32_t max,
                   int32_t* first, int32_t* last)
 {
-  int32_t size;
-  int32_t *head;
-  int32_t *tail;
-  int32_t *end;
-  int32_t from = 0;
-  int32_t to = 0;
-  int32_t a;
-  int32_t b;
-
   NS_ASSERTION(first && last, "invalid null param");
   if (!first || !last) return -1;
 
   *first = *last = 0;
 
-
   NS_ASSERTION(min <= max && min > 0, "invalid min or max");
   if (min > max || min <= 0) return -1;
 
-  size = m_length;
-  head = m_data;
-  tail = head;
-  end = head + size;
-
-  while (tail < end) {
-  a = to + 1;
-  if (*tail < 0) {      /* We got a range. */
-    from = tail[1];
-    to = from + (-(tail[0]));
-    tail += 2;
-  } else {
-    from = to = tail[0];
-    tail++;
-  }
-  b = from - 1;
-  /* At this point, [a,b] is the range of unread articles just before
-     the current range of read articles [from,to].  See if this range
-     intersects the [min,max] range we were given. */
-  if (a > max) return 0;  /* We're done.  If we found something, it's already
-                 sitting in [*first,*last]. */
-  if (a <= b && b >= min) {
-    /* Ah-hah!  We found an intersection. */
-    *first = a > min ? a : min;
-    *last = b < max ? b : max;
-    /* Continue on, looking for a later range. */
-  }
-  }
-  if (to < max) {
-  /* The great infinite range of unread articles at the end of any newsrc
-     line intersects the range we want, and we just need to return that. */
-  a = to + 1;
-  *first = a > min ? a : min;
-  *last = max;
-  }
+  int64_t b = PrevNonMember(max);
+  if (b < min) return 0;
+  int64_t a = PrevMember(b);
+  *last = int32_t(b);
+  *first = a + 1 < min ? min : int32_t(a + 1);
   return 0;
 }
 
@@ -1153,47 +972,13 @@ nsMsgKeySet::LastMissingRange(int32_t min, int32_t max,
 nsresult
 nsMsgKeySet::ToMsgKeyArray(nsTArray<nsMsgKey> &aArray)
 {
-    int32_t size;
-    int32_t *head;
-    int32_t *tail;
-    int32_t *end;
-    int32_t last_art = -1;
-
-    size = m_length;
-    head = m_data;
-    tail = head;
-    end = head + size;
-
-    while (tail < end) {
-        int32_t from;
-        int32_t to;
-
-        if (*tail < 0) {
-            /* it's a range */
-            from = tail[1];
-            to = from + (-(tail[0]));
-            tail += 2;
-        }
-        else /* it's a literal */
-            {
-                from = *tail;
-                to = from;
-                tail++;
-            }
-        // The horrible news-hack used to adjust from to 1 if it was zero right
-        // here, but there is no longer a consumer of this method with that
-        // broken use-case.
-        if (from <= last_art) from = last_art + 1;
-        if (from <= to) {
-            if (from < to) {
-                for (int32_t i = from; i <= to ; ++i ) {
-                    aArray.AppendElement(i);
-                }
-            } else {
-                aArray.AppendElement(from);
-            }
-            last_art = to;
-        }
+    // The horrible news-hack used to leave out article 0 here, but there is
+    // no longer a consumer of this method with that broken use-case.
+    for (int64_t from = NextMember(0); from >= 0; ) {
+        int64_t to = NextNonMember(from) - 1;
+        for (int64_t i = from; i <= to; ++i)
+            aArray.AppendElement(nsMsgKey(i));
+        from = NextMember(to + 1);
     }
 
     return NS_OK;
@@ -1222,7 +1007,7 @@ nsMsgKeySet::test_decoder (const char *string)
 #define FROB(N,PUSHP)                  \
   i = N;                        \
   if (!(NS_SUCCEEDED(set->Output(&s)))) abort ();          \
-  printf ("%3lu: %-58s %c %3lu =\n", (unsigned long)set->m_length, s,  \
+  printf ("%3lu: %-58s %c %3lu =\n", (unsigned long)set->getLength(), s,  \
       (PUSHP ? '+' : '-'), (unsigned long)i);            \
   free(s);                      \
   if (PUSHP                        \
@@ -1230,12 +1015,12 @@ nsMsgKeySet::test_decoder (const char *string)
     : set->Remove(i) < 0)                \
   abort ();                      \
   if (!(NS_SUCCEEDED(set->Output(&s)))) abort ();          \
-  printf ("%3lu: %-58s optimized =\n", (unsigned long)set->m_length, s);  \
+  printf ("%3lu: %-58s optimized =\n", (unsigned long)set->getLength(), s);  \
   free(s);                      \
 
 #define END()                 \
   if (!(NS_SUCCEEDED(set->Output(&s)))) abort ();          \
-  printf ("%3lu: %s\n\n", (unsigned long)set->m_length, s); \
+  printf ("%3lu: %s\n\n", (unsigned long)set->getLength(), s); \
   free(s);                      \
   delete set;                 \
 
@@ -1331,7 +1116,7 @@ nsMsgKeySet::test_adder (void)
   i = N;                            \
   j = M;                            \
   if (!(NS_SUCCEEDED(set->Output(&s)))) abort ();          \
-  printf ("%3lu: %-58s + %3lu-%3lu =\n", (unsigned long)set->m_length, s, (unsigned long)i, (unsigned long)j);  \
+  printf ("%3lu: %-58s + %3lu-%3lu =\n", (unsigned long)set->getLength(), s, (unsigned long)i, (unsigned long)j);  \
   free(s);                      \
   switch (set->AddRange(i, j)) {                \
   case 0:                            \
@@ -1343,13 +1128,13 @@ nsMsgKeySet::test_adder (void)
   abort();                          \
   }                                \
   if (!(NS_SUCCEEDED(set->Output(&s)))) abort ();          \
-  printf ("%3lu: %-58s\n", (unsigned long)set->m_length, s);            \
+  printf ("%3lu: %-58s\n", (unsigned long)set->getLength(), s);            \
   free(s);                      \
 
 
 #define END()                 \
   if (!(NS_SUCCEEDED(set->Output(&s)))) abort ();          \
-  printf ("%3lu: %s\n\n", (unsigned long)set->m_length, s); \
+  printf ("%3lu: %s\n\n", (unsigned long)set->getLength(), s); \
   free(s);                      \
   delete set;
 
@@ -1387,7 +1172,7 @@ nsMsgKeySet::test_ranges(void)
 
 
 #define TEST(N)                    \
-  if (! with_cache) set->m_cached_value = -1;    \
+  if (! with_cache) set->m_cached_index = UINT32_MAX; \
   if (!(NS_SUCCEEDED(set->Output(&s)))) abort ();          \
   printf (" %3d = %s\n", N,              \
       (set->IsMember(N) ? "true" : "false")); \
@@ -1450,6 +1235,180 @@ nsMsgKeySet::test_member(bool with_cache)
 #undef TEST
 
 
+/* Applies random changes to a set spread over a few containers and checks
+   it against a plain array of flags, so each kind of container and the
+   conversions between them get exercised. */
+void
+nsMsgKeySet::test_random()
+{
+  const int32_t kMax = 5 * 0x10000 + 1234;
+  nsTArray<bool> flags;
+  flags.SetLength(kMax + 1);
+  for (int32_t i = 0; i <= kMax; i++)
+    flags[i] = false;
+  nsMsgKeySet *set = Create();
+  char *s;
+
+  srand(42);
+  for (int32_t round = 0; round < 200; round++) {
+    for (int32_t op = 0; op < 500; op++) {
+      int32_t n = rand() % (kMax + 1);
+      switch (rand() % 8) {
+      case 0: case 1: case 2: {
+        int result = set->Add(n);
+        if (result != (flags[n] ? 0 : 1)) abort();
+        flags[n] = true;
+        break;
+      }
+      case 3: case 4: {
+        int result = set->Remove(n);
+        if (result != (flags[n] ? 1 : 0)) abort();
+        flags[n] = false;
+        break;
+      }
+      case 5: case 6: {
+        // mostly short ranges, sometimes long ones
+        int32_t end = std::min(kMax, n + (rand() % 4 ? rand() % 40
+                                                     : rand() % 200000));
+        bool all = true;
+        for (int32_t i = n; i <= end; i++) {
+          all = all && flags[i];
+          flags[i] = true;
+        }
+        if (set->AddRange(n, end) != (all ? 0 : 1)) abort();
+        break;
+      }
+      case 7:
+        if (rand() % 50 == 0) {
+          set->SetLastMember(n);
+          for (int32_t i = n + 1; i <= kMax; i++)
+            flags[i] = false;
+        } else if (set->IsMember(n) != flags[n]) {
+          abort();
+        }
+        break;
+      }
+    }
+
+    int32_t first = -1, last = -1, firstNonMember = -1;
+    for (int32_t i = 0; i <= kMax; i++) {
+      if (set->IsMember(i) != flags[i]) {
+        printf("%d is%s a member\n", i, flags[i] ? " not" : "");
+        abort();
+      }
+      if (flags[i]) {
+        if (first < 0) first = i;
+        last = i;
+      } else if (i > 0 && firstNonMember < 0) {
+        firstNonMember = i;
+      }
+    }
+    if (set->GetFirstMember() != std::max(first, 0) ||
+        set->GetLastMember() != std::max(last, 0) ||
+        set->FirstNonMember() != firstNonMember)
+      abort();
+
+    for (int32_t check = 0; check < 20; check++) {
+      int32_t min = 1 + rand() % kMax;
+      int32_t max = std::min(kMax, min + rand() % 100000);
+      int32_t missing = 0, firstStart = 0, firstEnd = 0, lastStart = 0, lastEnd = 0;
+      for (int32_t i = min; i <= max; i++) {
+        if (flags[i])
+          continue;
+        missing++;
+        if (!firstStart)
+          firstStart = i;
+        if (firstEnd == i - 1 || firstStart == i)
+          firstEnd = i;
+        if (lastEnd != i - 1 || !lastStart)
+          lastStart = i;
+        lastEnd = i;
+      }
+      int32_t a, b;
+      if (set->CountMissingInRange(min, max) != missing) abort();
+      set->FirstMissingRange(min, max, &a, &b);
+      if (a != firstStart || b != firstEnd) abort();
+      set->LastMissingRange(min, max, &a, &b);
+      if (a != lastStart || b != lastEnd) abort();
+    }
+
+    // Writing the set out and reading it back gives the same set, bar
+    // article 0.
+    if (!(NS_SUCCEEDED(set->Output(&s)))) abort ();
+    nsMsgKeySet *copy = Create(s);
+    char *copied;
+    if (!(NS_SUCCEEDED(copy->Output(&copied)))) abort ();
+    if (strcmp(s, copied)) abort();
+    free(copied);
+    free(s);
+    delete copy;
+
+    nsTArray<nsMsgKey> keys;
+    set->ToMsgKeyArray(keys);
+    uint32_t k = 0;
+    for (int32_t i = 0; i <= kMax; i++) {
+      if (flags[i] && (k >= keys.Length() || keys[k++] != nsMsgKey(i)))
+        abort();
+    }
+    if (k != keys.Length()) abort();
+  }
+  printf("random changes: ok, %d containers\n", set->getLength());
+  delete set;
+}
+
+
+/* Times the operations the news code uses on a large group whose read
+   articles are scattered. */
+void
+nsMsgKeySet::test_benchmark()
+{
+  const int32_t kArticles = 2000000;
+  nsMsgKeySet *set = Create();
+  char *s;
+
+  srand(7);
+  PRIntervalTime start = PR_IntervalNow();
+  // about half of the articles read, in random order
+  for (int32_t i = 0; i < kArticles / 2; i++)
+    set->Add(1 + rand() % kArticles);
+  PRIntervalTime added = PR_IntervalNow();
+
+  int32_t members = 0;
+  for (int32_t i = 1; i <= kArticles; i++)
+    members += set->IsMember(i);
+  PRIntervalTime looked = PR_IntervalNow();
+
+  int32_t unread = 0;
+  for (int32_t i = 0; i < 10000; i++) {
+    int32_t first = 1 + rand() % kArticles;
+    unread += set->CountMissingInRange(first, std::min(kArticles, first + 5000));
+  }
+  PRIntervalTime counted = PR_IntervalNow();
+
+  if (!(NS_SUCCEEDED(set->Output(&s)))) abort ();
+  nsMsgKeySet *copy = Create(s);
+  PRIntervalTime written = PR_IntervalNow();
+
+  // mark everything read in runs, the way XOVER gaps and catching up do
+  for (int32_t i = 1; i <= kArticles; i += 1000)
+    copy->AddRange(i, i + 499);
+  PRIntervalTime ranged = PR_IntervalNow();
+
+  printf("%d sparse articles: added in %u ms, %d members looked up in %u ms, "
+         "counted %d unread in %u ms, newsrc of %u bytes written and read in "
+         "%u ms, ranges added in %u ms, %d containers\n",
+         kArticles,
+         PR_IntervalToMilliseconds(added - start), members,
+         PR_IntervalToMilliseconds(looked - added), unread,
+         PR_IntervalToMilliseconds(counted - looked), (unsigned)strlen(s),
+         PR_IntervalToMilliseconds(written - counted),
+         PR_IntervalToMilliseconds(ranged - written), set->getLength());
+  free(s);
+  delete copy;
+  delete set;
+}
+
+
 // static void
 // test_newsrc (char *file)
 // {
@@ -1503,6 +1462,7 @@ nsMsgKeySet::RunTests ()
   test_decoder ("0-70,72-99,100,101");
   test_decoder (" 0-70 , 72 - 99 ,100,101 ");
   test_decoder ("0 - 268435455");
+  test_decoder ("1-70000,65535,65537,131072-131073,200000-199999");
   /* This one overflows - we can't help it.
    test_decoder ("0 - 4294967295"); */
 
@@ -1513,6 +1473,9 @@ nsMsgKeySet::RunTests ()
   test_member (false);
   test_member (true);
 
+  test_random ();
+  test_benchmark ();
+
   // test_newsrc ("/u/montulli/.newsrc");
   /* test_newsrc ("/u/jwz/.newsrc");*/
 }
@@ -19,6 +19,19 @@
 class MSG_NewsHost;
 #endif
 
+class nsMsgKeySet;
+
+// A listener is told about every change made to a set, e.g. so the changes to
+// the read set of a newsgroup can be journaled instead of writing out the
+// whole newsrc.
+class nsMsgKeySetListener {
+public:
+  // The articles first..last were added to the set, or removed from it.
+  // Some of them may have been in that state already.
+  virtual void OnKeySetChanged(nsMsgKeySet *aSet, int32_t aFirst,
+                               int32_t aLast, bool aAdded) = 0;
+};
+
 class NS_MSG_BASE nsMsgKeySet {
 public:
   // Creates an empty set.
@@ -50,6 +63,10 @@ public:
   // AddRange() adds the (inclusive) given range of articles to the set.
   int AddRange(int32_t first, int32_t last);
 
+  // RemoveRange() removes the (inclusive) given range of articles from the
+  // set.  (Returns 1 if a change was made, 0 if none of them were there.)
+  int RemoveRange(int32_t first, int32_t last);
+
   // CountMissingInRange() takes an inclusive range of articles and returns
   // the number of articles in that range which are not in the set.
   int32_t CountMissingInRange(int32_t start, int32_t end);
@@ -66,14 +83,18 @@ public:
   int32_t GetLastMember();
   int32_t GetFirstMember();
   void  SetLastMember(int32_t highWaterMark);
-  // For debugging only...
-  int32_t getLength() {return m_length;}
+  // For debugging only; zero when the set is empty.
+  int32_t getLength() {return m_containers.Length();}
 
 /**
  * Fill the passed in aArray with the keys in the message key set.
  */
   nsresult ToMsgKeyArray(nsTArray<nsMsgKey> &aArray);
 
+  // The listener isn't owned by the set, and isn't told about the articles
+  // the set was created with.
+  void SetListener(nsMsgKeySetListener *aListener) {m_listener = aListener;}
+
 #ifdef DEBUG
   static void RunTests();
 #endif
@@ -81,24 +102,72 @@ public:
 protected:
   nsMsgKeySet(/* MSG_NewsHost* host */);
   explicit nsMsgKeySet(const char* /* , MSG_NewsHost* host */);
-  bool Grow();
-  bool Optimize();
+
+  // The members of the set which share their high 16 bits, as whichever of
+  // a sorted array, a bitmap or a sorted list of runs of their low 16 bits
+  // takes the least space.
+  struct Container
+  {
+    enum Type : uint8_t { kArray, kBitmap, kRun };
+
+    uint16_t key = 0;         // the high 16 bits
+    Type type = kArray;
+    int32_t cardinality = 0;
+    nsTArray<uint16_t> values;  // kArray: the values; kRun: first, last pairs
+    nsTArray<uint64_t> words;   // kBitmap: one bit per value
+
+    bool Contains(int32_t aValue) const;
+    // these return the number of values added, removed or found
+    int32_t AddRange(int32_t aFirst, int32_t aLast);
+    int32_t RemoveRange(int32_t aFirst, int32_t aLast);
+    int32_t CountRange(int32_t aFirst, int32_t aLast) const;
+    // lowest member >= aValue, or -1
+    int32_t NextMember(int32_t aValue) const;
+    // lowest non-member >= aValue, 0x10000 if none
+    int32_t NextNonMember(int32_t aValue) const;
+    // highest member <= aValue, or -1
+    int32_t PrevMember(int32_t aValue) const;
+    // highest non-member <= aValue, or -1
+    int32_t PrevNonMember(int32_t aValue) const;
+    // switch to the smallest type
+    void Optimize();
+
+  protected:
+    uint32_t LowerBound(int32_t aValue) const;
+    int32_t RunAt(int32_t aValue) const;
+    int32_t FirstRunEndingFrom(int32_t aValue) const;
+    int32_t ScanUp(int32_t aValue, bool aMember) const;
+    int32_t ScanDown(int32_t aValue, bool aMember) const;
+    int32_t NumRuns() const;
+    void ToArray();
+    void ToBitmap();
+    void ToRuns();
+  };
+
+  uint32_t FindContainer(uint32_t aKey, bool *aFound);
+  Container &InsertContainer(uint32_t aIndex, uint32_t aKey,
+                             Container::Type aType);
+  // The set wide versions of the Container methods above. -1 means none;
+  // there is always a non-member above the members.
+  int64_t NextMember(int64_t aNumber);
+  int64_t NextNonMember(int64_t aNumber);
+  int64_t PrevMember(int64_t aNumber);
+  int64_t PrevNonMember(int64_t aNumber);
+  int32_t AddToContainers(int32_t start, int32_t end, bool optimize);
 
 #ifdef DEBUG
   static void test_decoder(const char*);
   static void test_adder();
   static void test_ranges();
   static void test_member(bool with_cache);
+  static void test_random();
+  static void test_benchmark();
 #endif
 
-  int32_t *m_data;          /* the numbers composing the `chunks' */
-  int32_t m_data_size;        /* size of that malloc'ed block */
-  int32_t m_length;        /* active area */
-
-  int32_t m_cached_value;      /* a potential set member, or -1 if unset*/
-  int32_t m_cached_value_index;    /* the index into `data' at which a search
-                     to determine whether `cached_value' was
-                     a member of the set ended. */
+  nsTArray<Container> m_containers;   /* sorted by key */
+  uint32_t m_cached_index;            /* the container found last; sets are
+                                         mostly used in order */
+  nsMsgKeySetListener *m_listener;
 #ifdef NEWSRC_DOES_HOST_STUFF
   MSG_NewsHost* m_host;
 #endif
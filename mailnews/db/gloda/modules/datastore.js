@@ -763,6 +763,13 @@ var GlodaDatastore = {
   _schemaVersion: 30,
   // what is the schema in the database right now?
   _actualSchemaVersion: 0,
+  /**
+   * Whether messagesText is an FTS4 table and so keeps the document and column
+   *  lengths the glodaBM25 ranking function needs.  Fulltext tables in
+   *  databases created before the switch to FTS4 are FTS3 ones; those keep
+   *  being ranked with glodaRank.
+   */
+  fulltextSupportsBM25: false,
   _schema: {
     tables: {
 
@@ -1114,6 +1121,9 @@ var GlodaDatastore = {
     this.syncConnection = dbConnection;
     this.asyncConnection = dbConnection;
 
+    this.fulltextSupportsBM25 = this._tableUsesFTS4(dbConnection,
+                                                    "messagesText");
+
     this._log.debug("Initializing folder mappings.");
     this._getAllFolderMappings();
     // we need to figure out the next id's for all of the tables where we
@@ -1283,6 +1293,23 @@ var GlodaDatastore = {
     }
   },
 
+  /**
+   * Check whether the virtual table aTableName was created with FTS4.
+   */
+  _tableUsesFTS4: function gloda_ds_tableUsesFTS4(aDBConn, aTableName) {
+    let stmt = aDBConn.createStatement(
+      "SELECT sql FROM sqlite_master WHERE name = ?1");
+    let usesFTS4 = false;
+    try {
+      stmt.bindByIndex(0, aTableName);
+      if (stmt.executeStep())
+        usesFTS4 = /\bUSING\s+fts4\b/i.test(stmt.row.sql);
+    } finally {
+      stmt.finalize();
+    }
+    return usesFTS4;
+  },
+
   /**
    * Create our database; basically a wrapper around _createSchema.
    */
@@ -1347,7 +1374,7 @@ var GlodaDatastore = {
         columnDefs.push(column + " " + type);
       }
       let createFulltextSQL = "CREATE VIRTUAL TABLE " + aTableName + "Text" +
-        " USING fts3(tokenize mozporter, " + columnDefs.join(", ") + ")";
+        " USING fts4(tokenize mozporter, " + columnDefs.join(", ") + ")";
       this._log.info("Creating fulltext table: " + createFulltextSQL);
       aDBConnection.executeSimpleSQL(createFulltextSQL);
     }
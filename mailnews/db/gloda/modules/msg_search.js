@@ -6,6 +6,7 @@ this.EXPORTED_SYMBOLS = ["GlodaMsgSearcher"];
 
 const {Services} = ChromeUtils.import("resource://gre/modules/Services.jsm");
 const {Gloda} = ChromeUtils.import("resource:///modules/gloda/public.js");
+const {GlodaDatastore} = ChromeUtils.import("resource:///modules/gloda/datastore.js");
 
 /**
  * How much time boost should a 'score point' amount to?  The authoritative,
@@ -18,10 +19,19 @@ var FUZZSCORE_TIMESTAMP_FACTOR = 1000 * 1000 * 60 * 60 * 24 * 7;
 var RANK_USAGE =
   "glodaRank(matchinfo(messagesText), 1.0, 2.0, 2.0, 1.5, 1.5)";
 
-var DASCORE =
-  "(((" + RANK_USAGE + " + messages.notability) * " +
-    FUZZSCORE_TIMESTAMP_FACTOR +
-   ") + messages.date)";
+/**
+ * BM25 with the same column weights as RANK_USAGE.  glodaBM25 is a native
+ *  SQLite function and needs the document and column lengths that only FTS4
+ *  tables keep, see GlodaDatastore.fulltextSupportsBM25.
+ */
+var BM25_RANK_USAGE =
+  "glodaBM25(matchinfo(messagesText, 'pcnalx'), 1.0, 2.0, 2.0, 1.5, 1.5)";
+
+function makeDascore(aRankUsage) {
+  return "(((" + aRankUsage + " + messages.notability) * " +
+           FUZZSCORE_TIMESTAMP_FACTOR +
+         ") + messages.date)";
+}
 
 /**
  * A new optimization decision we are making is that we do not want to carry
@@ -68,22 +78,27 @@ var DASCORE =
  *    LIMIT.)  Since offsets() also needs to retrieve the row from messagesText
  *    there is a nice synergy there.
  */
-var NUEVO_FULLTEXT_SQL =
-  "SELECT messages.*, messagesText.*, offsets(messagesText) AS osets " +
-  "FROM messagesText, messages " +
-  "WHERE" +
-    " messagesText MATCH ?1 " +
-    " AND messagesText.docid IN (" +
-       "SELECT docid " +
-       "FROM messagesText JOIN messages ON messagesText.docid = messages.id " +
-       "WHERE messagesText MATCH ?1 " +
-       "ORDER BY " + DASCORE + " DESC " +
-       "LIMIT ?2" +
-    " )" +
-    " AND messages.id = messagesText.docid " +
-    " AND +messages.deleted = 0" +
-    " AND +messages.folderID IS NOT NULL" +
-    " AND +messages.messageKey IS NOT NULL";
+function makeFulltextSQL(aRankUsage) {
+  return (
+    "SELECT messages.*, messagesText.*, offsets(messagesText) AS osets " +
+    "FROM messagesText, messages " +
+    "WHERE" +
+      " messagesText MATCH ?1 " +
+      " AND messagesText.docid IN (" +
+         "SELECT docid " +
+         "FROM messagesText JOIN messages ON messagesText.docid = messages.id " +
+         "WHERE messagesText MATCH ?1 " +
+         "ORDER BY " + makeDascore(aRankUsage) + " DESC " +
+         "LIMIT ?2" +
+      " )" +
+      " AND messages.id = messagesText.docid " +
+      " AND +messages.deleted = 0" +
+      " AND +messages.folderID IS NOT NULL" +
+      " AND +messages.messageKey IS NOT NULL");
+}
+
+var NUEVO_FULLTEXT_SQL = makeFulltextSQL(RANK_USAGE);
+var NUEVO_BM25_FULLTEXT_SQL = makeFulltextSQL(BM25_RANK_USAGE);
 
 function identityFunc(x) {
   return x;
@@ -254,7 +269,8 @@ GlodaMsgSearcher.prototype = {
   buildFulltextQuery: function GlodaMsgSearcher_buildFulltextQuery() {
     let query = Gloda.newQuery(Gloda.NOUN_MESSAGE, {
       noMagic: true,
-      explicitSQL: NUEVO_FULLTEXT_SQL,
+      explicitSQL: GlodaDatastore.fulltextSupportsBM25 ?
+                     NUEVO_BM25_FULLTEXT_SQL : NUEVO_FULLTEXT_SQL,
       limitClauseAlreadyIncluded: true,
       // osets is 0-based column number 14 (volatile to column changes)
       // save the offset column for extra analysis
@@ -0,0 +1,139 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+ * Tests the native glodaBM25 ranking function registered along with the
+ * mozporter tokenizer on a small synthetic index.  With
+ * MOZ_GLODA_BM25_BENCHMARK set in the environment, the index has a million
+ * documents instead, and the test logs how many ranked queries per second
+ * glodaBM25 manages compared to glodaRank.
+ */
+
+var kDocuments = 2000;
+var kBenchmarkDocuments = 1000000;
+
+function openDatabase() {
+  let conn = Services.storage.openSpecialDatabase("memory");
+  Cc["@mozilla.org/messenger/fts3tokenizer;1"]
+    .getService(Ci.nsIFts3Tokenizer)
+    .registerTokenizer(conn);
+  conn.executeSimpleSQL(
+    "CREATE VIRTUAL TABLE docs USING fts4(tokenize mozporter, body, subject)");
+  return conn;
+}
+
+function rank(aConn, aQuery, aRankUsage) {
+  let stmt = aConn.createStatement(
+    "SELECT docid, " + aRankUsage + " AS score FROM docs " +
+    "WHERE docs MATCH ?1 ORDER BY score DESC LIMIT 100");
+  let results = [];
+  try {
+    stmt.bindByIndex(0, aQuery);
+    while (stmt.executeStep())
+      results.push({ docid: stmt.row.docid, score: stmt.row.score });
+  } finally {
+    stmt.finalize();
+  }
+  return results;
+}
+
+function bm25(aConn, aQuery, aWeights = "1.0, 2.0") {
+  return rank(aConn, aQuery,
+              "glodaBM25(matchinfo(docs, 'pcnalx'), " + aWeights + ")");
+}
+
+function test_ranking() {
+  let conn = openDatabase();
+  let docs = [
+    [1, "apple banana cherry", "fruit"],
+    [2, "apple filler filler filler filler filler filler filler filler", "more"],
+    [3, "nothing relevant here", "apple"],
+    [4, "banana split", "dessert"],
+    [5, "cherry pie", "dessert"],
+  ];
+  let insert = conn.createStatement(
+    "INSERT INTO docs (docid, body, subject) VALUES (?1, ?2, ?3)");
+  for (let [docid, body, subject] of docs) {
+    insert.bindByIndex(0, docid);
+    insert.bindByIndex(1, body);
+    insert.bindByIndex(2, subject);
+    insert.execute();
+  }
+  insert.finalize();
+
+  // Same term frequency, so the shorter document wins; the subject match
+  //  beats both because of its column weight and the shorter column.
+  Assert.deepEqual(bm25(conn, "apple").map(r => r.docid), [3, 1, 2]);
+  // Without the subject weight the body matches come first.
+  Assert.deepEqual(bm25(conn, "apple", "1.0, 0.0").map(r => r.docid),
+                   [1, 2, 3]);
+
+  // Check the exact score of one row.  "banana" is in 2 of 5 bodies; doc 1's
+  //  body is 3 tokens long and the average body length is 19 / 5, which
+  //  matchinfo rounds to 4.
+  let [k1, b] = [1.2, 0.75];
+  let idf = Math.log((5 - 2 + 0.5) / (2 + 0.5));
+  let expected = idf * (1 * (k1 + 1)) / (1 + k1 * (1 - b + b * 3 / 4));
+  let banana = bm25(conn, "banana");
+  Assert.equal(banana.length, 2);
+  Assert.ok(Math.abs(banana.find(r => r.docid == 1).score - expected) < 1e-9);
+
+  // A rarer term contributes more than a common one.
+  let [withCherry] = bm25(conn, "cherry OR fruit");
+  Assert.equal(withCherry.docid, 1);
+  Assert.ok(bm25(conn, "fruit")[0].score > bm25(conn, "cherry")[0].score);
+
+  // Plain FTS3 matchinfo lacks the statistics BM25 needs.
+  Assert.throws(() => rank(conn, "apple", "glodaBM25(matchinfo(docs))"),
+                /NS_ERROR_FAILURE|glodaBM25/);
+  conn.close();
+}
+
+function test_large_index(aDocuments) {
+  let conn = openDatabase();
+  let start = Date.now();
+  conn.beginTransaction();
+  conn.executeSimpleSQL(
+    "WITH RECURSIVE seq(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM seq " +
+    "LIMIT " + aDocuments + ") " +
+    "INSERT INTO docs (docid, body, subject) SELECT i, " +
+    "'word' || (i % 10007) || ' word' || (i % 101) || ' topic' || (i % 13) " +
+    "|| ' filler' || (i % 7), " +
+    "'subject' || (i % 997) FROM seq");
+  conn.commitTransaction();
+  info("Indexed " + aDocuments + " documents in " + (Date.now() - start) +
+       "ms");
+
+  const kQueries = ["word5", "word42 topic3", "subject17", "word99 OR word100",
+                    "word9000"];
+  const kRounds = 5;
+  for (let [name, usage] of [
+         ["glodaRank", "glodaRank(matchinfo(docs), 1.0, 2.0)"],
+         ["glodaBM25", "glodaBM25(matchinfo(docs, 'pcnalx'), 1.0, 2.0)"]]) {
+    let hits = 0;
+    start = Date.now();
+    for (let round = 0; round < kRounds; round++) {
+      for (let query of kQueries)
+        hits += rank(conn, query, usage).length;
+    }
+    let elapsed = Math.max(Date.now() - start, 1);
+    info(name + ": ran " + kRounds * kQueries.length + " ranked queries in " +
+         elapsed + "ms (" +
+         (kRounds * kQueries.length * 1000 / elapsed).toFixed(1) +
+         " queries/s, " + hits / kRounds + " results per round)");
+  }
+
+  // The LIMIT keeps only the top results however many documents match.
+  Assert.equal(bm25(conn, "topic3").length, 100);
+  Assert.equal(bm25(conn, "nomatch").length, 0);
+  conn.close();
+}
+
+function run_test() {
+  test_ranking();
+  let env = Cc["@mozilla.org/process/environment;1"]
+              .getService(Ci.nsIEnvironment);
+  test_large_index(env.exists("MOZ_GLODA_BM25_BENCHMARK") ?
+                   kBenchmarkDocuments : kDocuments);
+}
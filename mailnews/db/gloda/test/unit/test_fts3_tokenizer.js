@@ -56,6 +56,22 @@ var intlPhrases = [
       { body: 'bbb', match: true },
     ],
   },
+  // -- Mixed case. ASCII runs directly next to CJK characters must still be
+  // split into stemmed words and bi-grams.
+  {
+    name: "Mixed ASCII and CJK",
+    actual: 'indexing漢字machines',
+    encodings: {
+      'utf-8': ['=?utf-8?b?aW5kZXhpbmfmvKLlrZdtYWNoaW5lcw==?=',
+                'indexing\xe6\xbc\xa2\xe5\xad\x97machines'],
+    },
+    searchPhrases: [
+      { body: 'index', match: true },
+      { body: 'machine', match: true },
+      { body: '"漢字"', match: true },
+      { body: 'indexingmachines', match: false },
+    ],
+  },
 ];
 
 /**
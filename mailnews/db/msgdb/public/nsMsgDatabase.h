@@ -171,6 +171,9 @@ public:
   virtual nsresult GetThreadForMsgKey(nsMsgKey msgKey, nsIMsgThread **result);
   virtual nsresult EnumerateMessagesWithFlag(nsISimpleEnumerator* *result, uint32_t *pFlag);
   nsresult         GetSearchResultsTable(const char *searchFolderUri, bool createIfMissing, nsIMdbTable **table);
+  // Adds new headers like AddNewHdrToDB, in order, but writes the folder info
+  // counts and high water mark once for the whole batch.
+  nsresult         AddNewHdrsToDB(const nsCOMArray<nsIMsgDBHdr> &newHdrs, bool notify);
 
   // this might just be for debugging - we'll see.
   nsresult ListAllThreads(nsTArray<nsMsgKey> *threadIds);
@@ -264,6 +267,8 @@ protected:
   virtual nsresult ThreadNewHdr(nsMsgHdr* hdr, bool &newThread);
   virtual nsresult AddNewThread(nsMsgHdr *msgHdr);
   virtual nsresult AddToThread(nsMsgHdr *newHdr, nsIMsgThread *thread, nsIMsgDBHdr *pMsgHdr, bool threadInThread);
+  // AddNewHdrToDB, leaving the folder info cells to the caller when inBatch
+  nsresult AddNewHdrToDBInternal(nsIMsgDBHdr *newHdr, bool notify, bool inBatch);
 
   static PRTime gLastUseTime; // global last use time
   PRTime m_lastUseTime;       // last use time for this db
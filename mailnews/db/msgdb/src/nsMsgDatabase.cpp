@@ -3449,6 +3449,45 @@ NS_IMETHODIMP nsMsgDatabase::CreateNewHdr(nsMsgKey key, nsIMsgDBHdr **pnewHdr)
 }
 
 NS_IMETHODIMP nsMsgDatabase::AddNewHdrToDB(nsIMsgDBHdr *newHdr, bool notify)
+{
+  return AddNewHdrToDBInternal(newHdr, notify, false);
+}
+
+nsresult nsMsgDatabase::AddNewHdrsToDB(const nsCOMArray<nsIMsgDBHdr> &newHdrs,
+                                       bool notify)
+{
+  nsresult rv = NS_OK;
+  nsMsgKey highKey = nsMsgKey_None;
+  int32_t count = newHdrs.Count();
+  for (int32_t i = 0; i < count; i++)
+  {
+    // like adding the headers one by one, a header that can't be added
+    // doesn't stop the others
+    nsresult hdrRv = AddNewHdrToDBInternal(newHdrs[i], notify, true);
+    if (NS_FAILED(hdrRv))
+    {
+      rv = hdrRv;
+      continue;
+    }
+    nsMsgKey key;
+    newHdrs[i]->GetMessageKey(&key);
+    if (highKey == nsMsgKey_None || key > highKey)
+      highKey = key;
+  }
+  // The counts were kept up to date in memory for the listeners; write the
+  // cells once.
+  if (m_dbFolderInfo && count)
+  {
+    m_dbFolderInfo->ChangeNumMessages(0);
+    m_dbFolderInfo->ChangeNumUnreadMessages(0);
+    if (highKey != nsMsgKey_None)
+      m_dbFolderInfo->OnKeyAdded(highKey);
+  }
+  return rv;
+}
+
+nsresult nsMsgDatabase::AddNewHdrToDBInternal(nsIMsgDBHdr *newHdr, bool notify,
+                                              bool inBatch)
 {
   NS_ENSURE_ARG_POINTER(newHdr);
   nsMsgHdr* hdr = static_cast<nsMsgHdr*>(newHdr);          // closed system, cast ok
@@ -3483,7 +3522,16 @@ NS_IMETHODIMP nsMsgDatabase::AddNewHdrToDB(nsIMsgDBHdr *newHdr, bool notify)
       newHdr->AndFlags(~nsMsgMessageFlags::New, &newFlags);  // make sure not filed out
       AddToNewList(key);
     }
-    if (m_dbFolderInfo)
+    if (m_dbFolderInfo && inBatch)
+    {
+      // AddNewHdrsToDB writes the cells at the end of the batch.
+      m_dbFolderInfo->m_numMessages++;
+      bool isRead = true;
+      IsHeaderRead(newHdr, &isRead);
+      if (!isRead)
+        m_dbFolderInfo->m_numUnreadMessages++;
+    }
+    else if (m_dbFolderInfo)
     {
       m_dbFolderInfo->ChangeNumMessages(1);
       bool isRead = true;
@@ -171,6 +171,12 @@ NS_IMETHODIMP nsNewsDatabase::SetReadSet(nsMsgKeySet *pSet)
   return NS_OK;
 }
 
+NS_IMETHODIMP nsNewsDatabase::AddNewHdrsToDB(nsCOMArray<nsIMsgDBHdr> &aHdrs,
+                                             bool aNotify)
+{
+  return nsMsgDatabase::AddNewHdrsToDB(aHdrs, aNotify);
+}
+
 
 bool nsNewsDatabase::SetHdrReadFlag(nsIMsgDBHdr *msgHdr, bool bRead)
 {
@@ -47,6 +47,7 @@ using namespace mozilla;
 #include "nsIMsgTraitService.h"
 #include "mozilla/Services.h"
 #include "mozilla/Attributes.h"
+#include "mozilla/HashFunctions.h"
 #include <cstdlib> // for std::abs(int/long)
 #include <cmath> // for std::abs(float/double)
 
@@ -141,10 +142,29 @@ inline BaseToken* TokenEnumeration::nextToken()
     return token;
 }
 
+TokenKey::TokenKey(const char* aWord, uint32_t aLength)
+  : mWord(aWord), mLength(aLength),
+    // the same as PLDHashTable::HashStringKey()
+    mHash(mozilla::HashString(aWord, aLength))
+{
+}
+
+static PLDHashNumber TokenKeyHash(const void* aKey)
+{
+    return static_cast<const TokenKey*>(aKey)->mHash;
+}
+
+static bool TokenKeyMatch(const PLDHashEntryHdr* aEntry, const void* aKey)
+{
+    const char* word = static_cast<const BaseToken*>(aEntry)->mWord;
+    const TokenKey* key = static_cast<const TokenKey*>(aKey);
+    return !strncmp(word, key->mWord, key->mLength) && !word[key->mLength];
+}
+
 // member variables
 static const PLDHashTableOps gTokenTableOps = {
-    PLDHashTable::HashStringKey,
-    PLDHashTable::MatchStringKey,
+    TokenKeyHash,
+    TokenKeyMatch,
     PLDHashTable::MoveEntryStub,
     PLDHashTable::ClearEntryStub,
     nullptr
@@ -176,7 +196,8 @@ char* TokenHash::copyWord(const char* word, uint32_t len)
 
 inline BaseToken* TokenHash::get(const char* word)
 {
-    PLDHashEntryHdr* entry = mTokenTable.Search(word);
+    TokenKey key(word, strlen(word));
+    PLDHashEntryHdr* entry = mTokenTable.Search(&key);
     if (entry)
         return static_cast<BaseToken*>(entry);
     return NULL;
@@ -189,17 +210,25 @@ BaseToken* TokenHash::add(const char* word)
       NS_ERROR("Trying to add a null word");
       return nullptr;
     }
+    return add(TokenKey(word, strlen(word)));
+}
+
+BaseToken* TokenHash::add(const TokenKey& aKey)
+{
+    const char* word = aKey.mWord;
+    uint32_t len = aKey.mLength;
+    if (!word || !len)
+    {
+      NS_ERROR("Trying to add a null word");
+      return nullptr;
+    }
 
     MOZ_LOG(BayesianFilterLogModule, LogLevel::Debug, ("add word: %s", word));
 
-    PLDHashEntryHdr* entry = mTokenTable.Add(word, mozilla::fallible);
+    PLDHashEntryHdr* entry = mTokenTable.Add(&aKey, mozilla::fallible);
     BaseToken* token = static_cast<BaseToken*>(entry);
     if (token) {
         if (token->mWord == NULL) {
-            uint32_t len = strlen(word);
-            NS_ASSERTION(len != 0, "adding zero length word to tokenizer");
-            if (!len)
-              MOZ_LOG(BayesianFilterLogModule, LogLevel::Debug, ("adding zero length word to tokenizer"));
             token->mWord = copyWord(word, len);
             NS_ASSERTION(token->mWord, "copyWord failed");
             if (!token->mWord) {
@@ -222,6 +251,33 @@ inline TokenEnumeration TokenHash::getTokens()
   return TokenEnumeration(&mTokenTable);
 }
 
+inline bool isUpperCase(char c) { return ('A' <= c) && (c <= 'Z'); }
+
+// What a byte of UTF-8 text is to the tokenizer. The classes of the bytes of
+// a word or'ed together tell whether it is a number, or ASCII, and needs
+// folding to lower case, without looking at it again.
+static const uint8_t kCharClassDelimiter = 0x01;
+static const uint8_t kCharClassDigit = 0x02;
+static const uint8_t kCharClassUpper = 0x04;
+static const uint8_t kCharClassNonASCII = 0x08;
+static const uint8_t kCharClassOther = 0x10;
+
+static void fillCharClasses(uint8_t* aClasses, const char* aDelimiters)
+{
+    for (uint32_t c = 0; c < 256; c++) {
+        if (c > 127)
+            aClasses[c] = kCharClassNonASCII;
+        else if (isdigit(c))
+            aClasses[c] = kCharClassDigit;
+        else if (isUpperCase(c))
+            aClasses[c] = kCharClassUpper;
+        else
+            aClasses[c] = kCharClassOther;
+    }
+    for (const unsigned char* p = (const unsigned char*)aDelimiters; *p; p++)
+        aClasses[*p] |= kCharClassDelimiter;
+}
+
 Tokenizer::Tokenizer() :
   TokenHash(sizeof(Token)),
   mBodyDelimiters(kBayesianFilterTokenDelimiters),
@@ -230,6 +286,9 @@ Tokenizer::Tokenizer() :
   mMaxLengthForToken(kMaxLengthForToken),
   mIframeToDiv(false)
 {
+  fillCharClasses(mBodyCharClasses, kBayesianFilterTokenDelimiters);
+  fillCharClasses(mHeaderCharClasses, kBayesianFilterTokenDelimiters);
+
   nsresult rv;
   nsCOMPtr<nsIPrefService> prefs = do_GetService(NS_PREFSERVICE_CONTRACTID, &rv);
   NS_ENSURE_SUCCESS_VOID(rv);
@@ -270,6 +329,9 @@ Tokenizer::Tokenizer() :
   else
     mHeaderDelimiters.Assign(kBayesianFilterTokenDelimiters);
 
+  fillCharClasses(mBodyCharClasses, mBodyDelimiters.get());
+  fillCharClasses(mHeaderCharClasses, mHeaderDelimiters.get());
+
   /*
    * Extensions may wish to enable or disable tokenization of certain headers.
    * Define any headers to enable/disable in a string preference like this:
@@ -347,17 +409,27 @@ inline Token* Tokenizer::get(const char* word)
 }
 
 Token* Tokenizer::add(const char* word, uint32_t count)
+{
+  if (!word || !*word)
+  {
+    NS_ERROR("Trying to add a null word");
+    return nullptr;
+  }
+  return add(TokenKey(word, strlen(word)), count);
+}
+
+Token* Tokenizer::add(const TokenKey& aKey, uint32_t count)
 {
   MOZ_LOG(BayesianFilterLogModule, LogLevel::Debug, ("add word: %s (count=%d)",
-         word, count));
+         aKey.mWord, count));
 
-  Token* token = static_cast<Token*>(TokenHash::add(word));
+  Token* token = static_cast<Token*>(TokenHash::add(aKey));
   if (token)
   {
     token->mCount += count; // hash code initializes this to zero
     MOZ_LOG(BayesianFilterLogModule, LogLevel::Debug,
            ("adding word to tokenizer: %s (count=%d) (mCount=%d)",
-           word, count, token->mCount));
+           aKey.mWord, count, token->mCount));
   }
   return token;
 }
@@ -374,27 +446,45 @@ static bool isDecimalNumber(const char* word)
     return true;
 }
 
-static bool isASCII(const char* word)
-{
-    const unsigned char* p = (const unsigned char*)word;
-    unsigned char c;
-    while ((c = *p++)) {
-        if (c > 127)
-            return false;
+/*
+ * Returns the next word of the text at *aNext, ending it with a NUL where
+ * the delimiter was like NS_strtok() does, together with its length and
+ * the classes of its bytes. Returns nullptr at the end of the text.
+ */
+static char* nextWord(const uint8_t* aClasses, char** aNext,
+                      uint32_t* aLength, uint8_t* aWordClasses)
+{
+    unsigned char* p = (unsigned char*)*aNext;
+    if (!p)
+        return nullptr;
+    while (*p && (aClasses[*p] & kCharClassDelimiter))
+        p++;
+    if (!*p) {
+        *aNext = nullptr;
+        return nullptr;
     }
-    return true;
-}
 
-inline bool isUpperCase(char c) { return ('A' <= c) && (c <= 'Z'); }
+    unsigned char* word = p;
+    uint8_t classes = 0;
+    uint8_t charClass;
+    while (*p && !((charClass = aClasses[*p]) & kCharClassDelimiter)) {
+        classes |= charClass;
+        p++;
+    }
+    *aLength = p - word;
+    *aWordClasses = classes;
+    if (*p) {
+        *p = '\0';
+        *aNext = (char*)p + 1;
+    } else {
+        *aNext = nullptr;
+    }
+    return (char*)word;
+}
 
-static char* toLowerCase(char* str)
+inline bool isDecimalNumber(const char* aWord, uint8_t aClasses)
 {
-    char c, *p = str;
-    while ((c = *p++)) {
-        if (isUpperCase(c))
-            p[-1] = c + ('a' - 'A');
-    }
-    return str;
+    return aWord[0] == '-' ? isDecimalNumber(aWord) : aClasses == kCharClassDigit;
 }
 
 void Tokenizer::addTokenForHeader(const char * aTokenPrefix, nsACString& aValue,
@@ -403,35 +493,43 @@ void Tokenizer::addTokenForHeader(const char * aTokenPrefix, nsACString& aValue,
   if (aValue.Length())
   {
     ToLowerCase(aValue);
+    mTokenBuffer.Truncate();
+    mTokenBuffer.Append(aTokenPrefix);
+    mTokenBuffer.Append(':');
     if (!aTokenizeValue)
     {
-      nsCString tmpStr;
-      tmpStr.Assign(aTokenPrefix);
-      tmpStr.Append(':');
-      tmpStr.Append(aValue);
+      mTokenBuffer.Append(aValue);
 
-      add(tmpStr.get());
+      add(mTokenBuffer.get());
     }
     else
     {
+      uint8_t customClasses[256];
+      const uint8_t* classes = mHeaderCharClasses;
+      if (aDelimiters)
+      {
+        fillCharClasses(customClasses, aDelimiters);
+        classes = customClasses;
+      }
+      uint32_t prefixLength = mTokenBuffer.Length();
+      mHeaderValue.Truncate();
+      mHeaderValue.Append(aValue);
+
       char* word;
-      nsCString str(aValue);
-      char *next = str.BeginWriting();
-      const char* delimiters = !aDelimiters ?
-          mHeaderDelimiters.get() : aDelimiters;
-      while ((word = NS_strtok(delimiters, &next)) != NULL)
+      uint32_t length;
+      uint8_t wordClasses;
+      char *next = mHeaderValue.BeginWriting();
+      while ((word = nextWord(classes, &next, &length, &wordClasses)) != NULL)
       {
-        if (strlen(word) < kMinLengthForToken)
+        if (length < kMinLengthForToken)
           continue;
-        if (isDecimalNumber(word))
+        if (isDecimalNumber(word, wordClasses))
           continue;
-        if (isASCII(word))
+        if (!(wordClasses & kCharClassNonASCII))
         {
-          nsCString tmpStr;
-          tmpStr.Assign(aTokenPrefix);
-          tmpStr.Append(':');
-          tmpStr.Append(word);
-          add(tmpStr.get());
+          mTokenBuffer.SetLength(prefixLength);
+          mTokenBuffer.Append(word, length);
+          add(TokenKey(mTokenBuffer.get(), mTokenBuffer.Length()));
         }
       }
     }
@@ -560,20 +658,25 @@ void Tokenizer::tokenizeHeaders(nsIUTF8StringEnumerator * aHeaderNames, nsIUTF8S
   }
 }
 
-void Tokenizer::tokenize_ascii_word(char * aWord)
+void Tokenizer::tokenize_ascii_word(char * aWord, uint32_t aLength,
+                                    uint8_t aClasses)
 {
   // always deal with normalized lower case strings
-  toLowerCase(aWord);
-  uint32_t wordLength = strlen(aWord);
+  if (aClasses & kCharClassUpper)
+  {
+    for (char* p = aWord; p < aWord + aLength; p++)
+      if (isUpperCase(*p))
+        *p += 'a' - 'A';
+  }
+  uint32_t wordLength = aLength;
 
   // if the wordLength is within our accepted token limit, then add it
   if (wordLength >= kMinLengthForToken && wordLength <= mMaxLengthForToken)
-    add(aWord);
+    add(TokenKey(aWord, wordLength));
   else if (wordLength > mMaxLengthForToken)
   {
     // don't skip over the word if it looks like an email address,
     // there is value in adding tokens for addresses
-    nsDependentCString word (aWord, wordLength); // CHEAP, no allocation occurs here...
 
     // XXX: i think the 40 byte check is just for perf reasons...if the email address is longer than that then forget about it.
     const char *atSign = strchr(aWord, '@');
@@ -583,26 +686,26 @@ void Tokenizer::tokenize_ascii_word(char * aWord)
       if (numBytesToSep < wordLength - 1) // if the @ sign is the last character, it must not be an email address
       {
         // split the john@foo.com into john and foo.com, treat them as separate tokens
-        nsCString emailNameToken;
-        emailNameToken.AssignLiteral("email name:");
-        emailNameToken.Append(Substring(word, 0, numBytesToSep++));
-        add(emailNameToken.get());
-        nsCString emailAddrToken;
-        emailAddrToken.AssignLiteral("email addr:");
-        emailAddrToken.Append(Substring(word, numBytesToSep, wordLength - numBytesToSep));
-        add(emailAddrToken.get());
+        mTokenBuffer.Truncate();
+        mTokenBuffer.AppendLiteral("email name:");
+        mTokenBuffer.Append(aWord, numBytesToSep++);
+        add(TokenKey(mTokenBuffer.get(), mTokenBuffer.Length()));
+        mTokenBuffer.Truncate();
+        mTokenBuffer.AppendLiteral("email addr:");
+        mTokenBuffer.Append(aWord + numBytesToSep, wordLength - numBytesToSep);
+        add(TokenKey(mTokenBuffer.get(), mTokenBuffer.Length()));
         return;
       }
     }
 
     // there is value in generating a token indicating the number
     // of characters we are skipping. We'll round to the nearest 10
-    nsCString skipToken;
-    skipToken.AssignLiteral("skip:");
-    skipToken.Append(word[0]);
-    skipToken.Append(' ');
-    skipToken.AppendInt((wordLength/10) * 10);
-    add(skipToken.get());
+    mTokenBuffer.Truncate();
+    mTokenBuffer.AppendLiteral("skip:");
+    mTokenBuffer.Append(aWord[0]);
+    mTokenBuffer.Append(' ');
+    mTokenBuffer.AppendInt((wordLength/10) * 10);
+    add(TokenKey(mTokenBuffer.get(), mTokenBuffer.Length()));
   }
 }
 
@@ -654,56 +757,81 @@ static char_class getCharClass(char16_t c)
   return charClass;
 }
 
-static bool isJapanese(const char* word)
+/*
+ * Returns the first UTF-16 code unit of the character at *aText in valid
+ * UTF-8, and moves *aText past it. Characters beyond the BMP give their high
+ * surrogate, which is all the character classes need.
+ */
+static inline char16_t nextUTF16Unit(const unsigned char** aText,
+                                     const unsigned char* aEnd)
 {
-  nsString text = NS_ConvertUTF8toUTF16(word);
-  char16_t* p = (char16_t*)text.get();
+  const unsigned char* p = *aText;
   char16_t c;
+  uint32_t length;
+  if (p[0] < 0x80) {
+    c = p[0];
+    length = 1;
+  } else if (p[0] < 0xE0 && aEnd - p >= 2) {
+    c = ((p[0] & 0x1F) << 6) | (p[1] & 0x3F);
+    length = 2;
+  } else if (p[0] < 0xF0 && aEnd - p >= 3) {
+    c = ((p[0] & 0x0F) << 12) | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F);
+    length = 3;
+  } else {
+    c = 0xD800;
+    length = aEnd - p < 4 ? aEnd - p : 4;
+  }
+  *aText = p + length;
+  return c;
+}
+
+static bool isJapanese(const char* word, uint32_t aLength)
+{
+  const unsigned char* p = (const unsigned char*)word;
+  const unsigned char* end = p + aLength;
 
   // it is japanese chunk if it contains any hiragana or katakana.
-  while((c = *p++))
-    if( IS_JAPANESE_SPECIFIC(c))
+  while (p < end)
+    if (IS_JAPANESE_SPECIFIC(nextUTF16Unit(&p, end)))
       return true;
 
   return false;
 }
 
-static bool isFWNumeral(const char16_t* p1, const char16_t* p2)
-{
-  for(;p1<p2;p1++)
-    if(!IS_JA_FWNUMERAL(*p1))
-      return false;
-
-  return true;
-}
-
 // The japanese tokenizer was added as part of Bug #277354
-void Tokenizer::tokenize_japanese_word(char* chunk)
+void Tokenizer::tokenize_japanese_word(const char* chunk, uint32_t aLength)
 {
   MOZ_LOG(BayesianFilterLogModule, LogLevel::Debug, ("entering tokenize_japanese_word(%s)", chunk));
 
-  nsString srcStr = NS_ConvertUTF8toUTF16(chunk);
-  const char16_t* p1 = srcStr.get();
-  const char16_t* p2 = p1;
-  if(!*p2) return;
+  // This works on the UTF-8 text, but splits it where the UTF-16 one was.
+  const unsigned char* p1 = (const unsigned char*)chunk;
+  const unsigned char* end = p1 + aLength;
+  const unsigned char* p2 = p1;
+  if (p2 == end) return;
 
-  char_class cc = getCharClass(*p2);
-  while(*(++p2))
+  char16_t c = nextUTF16Unit(&p2, end);
+  char_class cc = getCharClass(c);
+  bool fwNumeral = IS_JA_FWNUMERAL(c);
+  while (p2 < end)
   {
-    if(cc == getCharClass(*p2))
-      continue;
-
-    nsCString token = NS_ConvertUTF16toUTF8(p1, p2-p1);
-    if( (!isDecimalNumber(token.get())) && (!isFWNumeral(p1, p2)))
+    const unsigned char* next = p2;
+    c = nextUTF16Unit(&p2, end);
+    if (cc == getCharClass(c))
     {
-      nsCString tmpStr;
-      tmpStr.AppendLiteral("JA:");
-      tmpStr.Append(token);
-      add(tmpStr.get());
+      fwNumeral = fwNumeral && IS_JA_FWNUMERAL(c);
+      continue;
     }
 
-    cc = getCharClass(*p2);
-    p1 = p2;
+    // The last piece is left out, as it always was.
+    mTokenBuffer.Truncate();
+    mTokenBuffer.AppendLiteral("JA:");
+    mTokenBuffer.Append((const char*)p1, next - p1);
+    if (!isDecimalNumber(mTokenBuffer.get() + 3) && !fwNumeral)
+      add(TokenKey(mTokenBuffer.get(), mTokenBuffer.Length()));
+
+    cc = getCharClass(c);
+    fwNumeral = IS_JA_FWNUMERAL(c);
+    p1 = next;
   }
 }
 
@@ -807,23 +935,26 @@ void Tokenizer::tokenize(const char* aText)
     ++substr_start;
   }
 
-  nsCString strippedStr = NS_ConvertUTF16toUTF8(strippedUCS2);
+  NS_ConvertUTF16toUTF8 strippedStr(strippedUCS2);
   char * strippedText = strippedStr.BeginWriting();
   MOZ_LOG(BayesianFilterLogModule, LogLevel::Debug, ("tokenize stripped html: %s", strippedText));
 
+  // The words are split off, classified and folded to lower case in place,
+  // and only copied when they are added as new tokens.
   char* word;
+  uint32_t length;
+  uint8_t classes;
   char* next = strippedText;
-  while ((word = NS_strtok(mBodyDelimiters.get(), &next)) != NULL) {
-    if (!*word) continue;
-    if (isDecimalNumber(word)) continue;
-    if (isASCII(word))
-        tokenize_ascii_word(word);
-    else if (isJapanese(word))
-        tokenize_japanese_word(word);
+  while ((word = nextWord(mBodyCharClasses, &next, &length, &classes)) != NULL) {
+    if (isDecimalNumber(word, classes)) continue;
+    if (!(classes & kCharClassNonASCII))
+        tokenize_ascii_word(word, length, classes);
+    else if (isJapanese(word, length))
+        tokenize_japanese_word(word, length);
     else {
         nsresult rv;
         // Convert this word from UTF-8 into UCS2.
-        NS_ConvertUTF8toUTF16 uword(word);
+        NS_ConvertUTF8toUTF16 uword(word, length);
         ToLowerCase(uword);
         const char16_t* utext = uword.get();
         int32_t len = uword.Length(), pos = 0, begin, end;
@@ -831,8 +962,9 @@ void Tokenizer::tokenize(const char* aText)
         while (pos < len) {
             rv = ScannerNext(utext, len, pos, true, &begin, &end, &gotUnit);
             if (NS_SUCCEEDED(rv) && gotUnit) {
-                NS_ConvertUTF16toUTF8 utfUnit(utext + begin, end - begin);
-                add(utfUnit.get());
+                CopyUTF16toUTF8(Substring(utext + begin, end - begin),
+                                mTokenBuffer);
+                add(TokenKey(mTokenBuffer.get(), mTokenBuffer.Length()));
                 // Advance to end of current unit.
                 pos = end;
             } else {
@@ -80,6 +80,17 @@ struct AnalysisPerToken
   AnalysisPerToken(uint32_t aTraitIndex, double aDistance, double aProbability);
 };
 
+/**
+ * A word to look up in a TokenHash, with its length and hash already known,
+ * so that they are not worked out again. The word must end at mLength.
+ */
+struct TokenKey {
+    TokenKey(const char* aWord, uint32_t aLength);
+    const char* mWord;
+    uint32_t mLength;
+    PLDHashNumber mHash;
+};
+
 class TokenHash {
 public:
 
@@ -91,6 +102,7 @@ public:
     uint32_t countTokens();
     TokenEnumeration getTokens();
     BaseToken* add(const char* word);
+    BaseToken* add(const TokenKey& aKey);
 
 protected:
     explicit TokenHash(uint32_t entrySize);
@@ -113,6 +125,7 @@ public:
     // When add/remove is called while tokenizing a message and NOT the training set,
     //
     Token* add(const char* word, uint32_t count = 1);
+    Token* add(const TokenKey& aKey, uint32_t count = 1);
 
     Token* copyTokens();
 
@@ -141,8 +154,16 @@ public:
 
 private:
 
-    void tokenize_ascii_word(char * word);
-    void tokenize_japanese_word(char* chunk);
+    // what the bytes of UTF-8 text are to the tokenizer, see kCharClass*
+    uint8_t mBodyCharClasses[256];
+    uint8_t mHeaderCharClasses[256];
+    // where the tokens made of more than a word are put together
+    nsCString mTokenBuffer;
+    // the header value being tokenized
+    nsCString mHeaderValue;
+
+    void tokenize_ascii_word(char * word, uint32_t aLength, uint8_t aClasses);
+    void tokenize_japanese_word(const char* chunk, uint32_t aLength);
     inline void addTokenForHeader(const char * aTokenPrefix, nsACString& aValue,
         bool aTokenizeValue = false, const char* aDelimiters = nullptr);
     nsresult stripHTML(const nsAString& inString, nsAString& outString);
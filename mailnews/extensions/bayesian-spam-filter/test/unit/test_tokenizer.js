@@ -0,0 +1,144 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// Tests the tokens made of the words of a message body: ASCII words in any
+// case, numbers, long words and addresses, Japanese and other non ASCII text
+
+var {MailServices} = ChromeUtils.import("resource:///modules/MailServices.jsm");
+
+// command functions for test data
+var kTrain = 0;  // train a file
+var kTest = 1;   // test headers returned from detail
+var kSetup = 2;  // run a setup function
+
+// trait ids
+var kProArray = [3];
+var kAntiArray = [4];
+
+var gTest; // currently active test
+
+// The tests array defines the tests to attempt.
+
+var tests =
+[
+  // the default delimiters split the address at the "."
+  {command: kTrain,
+   fileName: "tokenizerText.eml"
+  },
+  {command: kTest,
+   fileName: "tokenizerText.eml",
+   tokens: ["important", "vegetables", "good", "you", "call", "before",
+            "skip:s 20", "skip:s 10", "com", "today",
+            "subject:mixed", "subject:case", "subject:words",
+            "JA:\u65e5\u672c\u8a9e", "JA:\u306e", "JA:\u30c6\u30ad\u30b9\u30c8",
+            "ein", "r\u00e9sum\u00e9", "f\u00fcr", "m\u00fcller"],
+   nottokens: ["IMPORTANT", "Vegetables", "12345", "-42", "or",
+               "supercalifragilistic", "JA:\u3067\u3059", "M\u00fcller",
+               "subject:CASE", "email name:someone"]
+  },
+
+  // without "." in the body delimiters, the address is kept whole
+  {command: kSetup,
+   operation: function()
+     {
+       Services.prefs.setCharPref("mailnews.bayesian_spam_filter.body_delimiters", " \t\r\n\v");
+     }
+  },
+  {command: kTrain,
+   fileName: "tokenizerText.eml"
+  },
+  {command: kTest,
+   fileName: "tokenizerText.eml",
+   tokens: ["important", "you.", "email name:someone", "email addr:example.com",
+            "skip:s 20", "r\u00e9sum\u00e9"],
+   nottokens: ["12345", "-42", "skip:s 10", "someone@example.com"]
+  }
+
+]
+
+// main test
+function run_test()
+{
+  localAccountUtils.loadLocalMailAccount();
+  do_test_pending();
+
+  startCommand();
+}
+
+var listener =
+{
+  //nsIMsgTraitClassificationListener implementation
+  onMessageTraitsClassified: function(aMsgURI, {}, aTraits, aPercents)
+  {
+    startCommand();
+  },
+
+  onMessageTraitDetails: function(aMsgURI, aProTrait, {}, aTokenString,
+                                  aTokenPercents, aRunningPercents)
+  {
+    print("Details for " + aMsgURI);
+    for (var i = 0; i < aTokenString.length; i++)
+      print("Token " + aTokenString[i]);
+
+    // we should have these tokens
+    for (var value of gTest.tokens)
+    {
+      print("We should have '" + value + "'? ");
+      Assert.ok(aTokenString.indexOf(value) >= 0);
+    }
+
+    // should not have these tokens
+    for (var value of gTest.nottokens)
+    {
+      print("We should not have '" + value + "'? ");
+      Assert.ok(aTokenString.indexOf(value) < 0);
+    }
+    startCommand();
+  }
+};
+
+// start the next test command
+function startCommand()
+{
+  if (!tests.length)       // Do we have more commands?
+  {
+    // no, all done
+    do_test_finished();
+    return;
+  }
+
+  gTest = tests.shift();
+  //print("StartCommand command = " + gTest.command + ", remaining tests " + tests.length);
+  switch (gTest.command)
+  {
+    case kTrain:
+      // train message
+
+      MailServices.junk.setMsgTraitClassification(
+        getSpec(gTest.fileName), //in string aMsgURI
+        0,
+        null,         // in nsIArray aOldTraits
+        kProArray.length,
+        kProArray,     // in nsIArray aNewTraits
+        listener);    // [optional] in nsIMsgTraitClassificationListener aTraitListener
+        // null,      // [optional] in nsIMsgWindow aMsgWindow
+        // null,      // [optional] in nsIJunkMailClassificationListener aJunkListener
+      break;
+
+    case kTest:
+      // test headers from detail message
+      MailServices.junk.detailMessage(
+        getSpec(gTest.fileName), // in string aMsgURI
+        kProArray[0], // proTrait
+        kAntiArray[0],   // antiTrait
+        listener);   // in nsIMsgTraitDetailListener aDetailListener
+      break;
+
+    case kSetup:
+      gTest.operation();
+      startCommand();
+      break;
+
+  }
+}
@@ -62,6 +62,12 @@
 #include <string.h>
 #include <ctype.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PORTER_USE_SSE2 1
+#endif
+
 #include "fts3_tokenizer.h"
 
 /* need some defined to compile without sqlite3 code */
@@ -573,8 +579,15 @@ static void porter_stemmer(
     return;
   }
   for (j = sizeof(zReverse) - 6; zTmp < zTerm; j--) {
-    READ_UTF8(zTmp, zTerm, c);
-    c = normalize_character(c);
+    if (*zTmp < 0x80) {
+      /* ASCII only needs case folding */
+      c = *zTmp++;
+      if (c >= 'A' && c <= 'Z')
+        c += 'a' - 'A';
+    } else {
+      READ_UTF8(zTmp, zTerm, c);
+      c = normalize_character(c);
+    }
     if( c>='a' && c<='z' ){
       zReverse[j] = c;
     }else{
@@ -791,6 +804,53 @@ static const char porterIdChar[] = {
     1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,  /* 7x */
 };
 
+#define isAsciiIdChar(ch) ((ch) >= 0x30 && (ch) < 0x80 && porterIdChar[(ch) - 0x30])
+
+/**
+ * Return the number of bytes at the start of zIn that are ASCII token
+ *  characters (or ASCII delimiters if wantDelims is set).  isDelim has to
+ *  decode and normalize every character; for ASCII, normalization only folds
+ *  case, which never changes whether a character is a delimiter, so runs of
+ *  plain ASCII can be classified directly, 16 bytes at a time where SSE2 is
+ *  available.  Stops at the first non-ASCII byte.
+ */
+static int asciiRunLength(
+  const unsigned char *zIn,
+  const unsigned char *zTerm,
+  int wantDelims
+){
+  const unsigned char *z = zIn;
+#ifdef PORTER_USE_SSE2
+  /* Bytes >= 0x80 are negative as signed chars, so they never fall in any of
+   * the ranges below and never count as delimiters because of the sign mask.
+   */
+  const __m128i digitLow = _mm_set1_epi8('0' - 1);
+  const __m128i digitHigh = _mm_set1_epi8('9' + 1);
+  const __m128i alphaLow = _mm_set1_epi8('a' - 1);
+  const __m128i alphaHigh = _mm_set1_epi8('z' + 1);
+  const __m128i caseBit = _mm_set1_epi8(0x20);
+  const __m128i underscore = _mm_set1_epi8('_');
+  while (zTerm - z >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) z);
+    __m128i lower = _mm_or_si128(v, caseBit);
+    __m128i isDigit = _mm_and_si128(_mm_cmpgt_epi8(v, digitLow),
+                                    _mm_cmplt_epi8(v, digitHigh));
+    __m128i isAlpha = _mm_and_si128(_mm_cmpgt_epi8(lower, alphaLow),
+                                    _mm_cmplt_epi8(lower, alphaHigh));
+    __m128i isId = _mm_or_si128(_mm_or_si128(isDigit, isAlpha),
+                                _mm_cmpeq_epi8(v, underscore));
+    int idMask = _mm_movemask_epi8(isId);
+    int mask = wantDelims ? ~(idMask | _mm_movemask_epi8(v)) & 0xffff : idMask;
+    if (mask != 0xffff)
+      break; /* finish the run byte by byte */
+    z += 16;
+  }
+#endif
+  while (z < zTerm && *z < 0x80 && !isAsciiIdChar(*z) == !!wantDelims)
+    z++;
+  return z - zIn;
+}
+
 /**
  * Test whether a character is a (non-ascii) space character or not.  isDelim
  *  uses the existing porter stemmer logic for anything in the ASCII (< 0x80)
@@ -1023,8 +1083,12 @@ static int porterNext(
     if (c->iPrevBigramOffset == 0) {
       /* Scan past delimiter characters */
       state = BIGRAM_RESET; /* reset */
-      while (c->iOffset < c->nInput &&
-             isDelim(z + c->iOffset, z + c->nInput, &len, &state)) {
+      while (c->iOffset < c->nInput) {
+        // ASCII delimiters leave the state reset, so skip them in bulk.
+        c->iOffset += asciiRunLength(z + c->iOffset, z + c->nInput, 1);
+        if (c->iOffset >= c->nInput ||
+            !isDelim(z + c->iOffset, z + c->nInput, &len, &state))
+          break;
         c->iOffset += len;
       }
 
@@ -1055,8 +1119,23 @@ static int porterNext(
     //  when we don't terminate.  However, if we terminate, len still contains
     //  the number of bytes in the character found at iOffset.  (This is useful
     //  in the CJK case.)
-    while (c->iOffset < c->nInput &&
-           !isDelim(z + c->iOffset, z + c->nInput, &len, &state)) {
+    while (c->iOffset < c->nInput) {
+      // Outside of CJK mode a run of ASCII letters and digits just keeps us
+      //  in ALPHA mode, so consume it without going through isDelim.  The
+      //  character that ends the run is still classified by isDelim so that
+      //  state and len are what the CJK handling below expects.
+      if (state == BIGRAM_RESET || state == BIGRAM_ALPHA) {
+        int run = asciiRunLength(z + c->iOffset, z + c->nInput, 0);
+        if (run) {
+          c->iOffset += run;
+          numChars += run;
+          state = BIGRAM_ALPHA;
+          if (c->iOffset >= c->nInput)
+            break;
+        }
+      }
+      if (isDelim(z + c->iOffset, z + c->nInput, &len, &state))
+        break;
       c->iOffset += len;
       numChars++;
     }
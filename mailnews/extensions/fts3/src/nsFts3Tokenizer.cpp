@@ -68,5 +68,14 @@ nsFts3Tokenizer::RegisterTokenizer(mozIStorageConnection *connection)
        );
   NS_ENSURE_SUCCESS(rv, rv);
 
+  // -- register the BM25 ranking function straight with SQLite; it runs for
+  //    every matching row, which is too often for variant marshalling.
+  sqlite3 *db = sqlite3_db_handle(selectStatement->GetNativeStatementPointer());
+  NS_ENSURE_TRUE(db, NS_ERROR_FAILURE);
+  int srv = sqlite3_create_function(db, "glodaBM25", -1,
+                                    SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                                    nullptr, glodaBM25Func, nullptr, nullptr);
+  NS_ENSURE_TRUE(srv == SQLITE_OK, NS_ERROR_FAILURE);
+
   return rv;
 }
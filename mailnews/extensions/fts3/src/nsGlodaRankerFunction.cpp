@@ -11,6 +11,8 @@
 #include "nsVariant.h"
 #include "nsComponentManagerUtils.h"
 
+#include <math.h>
+
 #ifndef SQLITE_VERSION_NUMBER
 #error "We need SQLITE_VERSION_NUMBER defined!"
 #endif
@@ -111,3 +113,80 @@ nsGlodaRankerFunction::OnFunctionCall(mozIStorageValueArray *aArguments,
   result.forget(_result);
   return NS_OK;
 }
+
+// Standard BM25 parameters: term frequency saturation and length normalization.
+static const double BM25_K1 = 1.2;
+static const double BM25_B = 0.75;
+
+/**
+ * Okapi BM25 over the FTS4 matchinfo 'pcnalx' blob, with optional per-column
+ * weights as the remaining arguments:
+ *
+ *   glodaBM25(matchinfo(t, 'pcnalx'), weight0, weight1, ...)
+ *
+ * Columns without a weight get 1.0.  This is registered directly with SQLite
+ * by nsFts3Tokenizer because it runs once for every row matching a query, and
+ * going through mozIStorageFunction would marshal all of that into variants.
+ */
+void
+glodaBM25Func(sqlite3_context *aCtx, int aArgc, sqlite3_value **aArgv)
+{
+  if (aArgc < 1) {
+    sqlite3_result_error(aCtx, "wrong number of arguments to glodaBM25", -1);
+    return;
+  }
+
+  // The blob is a sequence of 32-bit unsigned integers:
+  //   p, c, n, a[c], l[c], x[3 * p * c]
+  const uint32_t *info =
+    static_cast<const uint32_t *>(sqlite3_value_blob(aArgv[0]));
+  int infoSize = sqlite3_value_bytes(aArgv[0]);
+  if (!info || infoSize < int(3 * sizeof(uint32_t))) {
+    sqlite3_result_error(aCtx, "invalid matchinfo blob passed to glodaBM25",
+                         -1);
+    return;
+  }
+
+  uint32_t nPhrase = info[0];
+  uint32_t nCol = info[1];
+  uint64_t expected = 3 + 2 * uint64_t(nCol) + 3 * uint64_t(nPhrase) * nCol;
+  if (uint64_t(infoSize) < expected * sizeof(uint32_t) ||
+      uint32_t(aArgc) > 1 + nCol) {
+    sqlite3_result_error(aCtx,
+                         "glodaBM25 expects matchinfo(t, 'pcnalx') and at most "
+                         "one weight per column", -1);
+    return;
+  }
+
+  double nDoc = info[2];
+  const uint32_t *avgLength = &info[3];
+  const uint32_t *length = &info[3 + nCol];
+  const uint32_t *hits = &info[3 + 2 * nCol];
+
+  double score = 0.0;
+  for (uint32_t iCol = 0; iCol < nCol; iCol++) {
+    double weight = (iCol + 1 < uint32_t(aArgc)) ?
+                    sqlite3_value_double(aArgv[iCol + 1]) : 1.0;
+    if (weight == 0.0)
+      continue;
+    // An empty column has no average; any term frequency there is zero anyway.
+    double relLength = avgLength[iCol] ?
+                       double(length[iCol]) / avgLength[iCol] : 1.0;
+    double lengthNorm = BM25_K1 * (1.0 - BM25_B + BM25_B * relLength);
+    for (uint32_t iPhrase = 0; iPhrase < nPhrase; iPhrase++) {
+      const uint32_t *phraseInfo = &hits[3 * (iPhrase * nCol + iCol)];
+      double tf = phraseInfo[0];
+      if (tf == 0.0)
+        continue;
+      double nMatchingDocs = phraseInfo[2];
+      // Phrases present in most documents would get a negative weight; keep
+      // them slightly positive so a match never scores below no match.
+      double idf = log((nDoc - nMatchingDocs + 0.5) / (nMatchingDocs + 0.5));
+      if (idf < 1e-6)
+        idf = 1e-6;
+      score += weight * idf * (tf * (BM25_K1 + 1.0)) / (tf + lengthNorm);
+    }
+  }
+
+  sqlite3_result_double(aCtx, score);
+}
@@ -6,6 +6,7 @@
 #define _nsGlodaRankerFunction_h_
 
 #include "mozIStorageFunction.h"
+#include "sqlite3.h"
 
 /**
  * Basically a port of the example FTS3 ranking function to mozStorage's
@@ -22,4 +23,10 @@ private:
   ~nsGlodaRankerFunction();
 };
 
+/**
+ * Native BM25 ranking function over FTS4 matchinfo 'pcnalx' data, registered
+ * as glodaBM25.
+ */
+void glodaBM25Func(sqlite3_context *aCtx, int aArgc, sqlite3_value **aArgv);
+
 #endif // _nsGlodaRankerFunction_h_
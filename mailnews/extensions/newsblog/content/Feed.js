@@ -480,60 +480,19 @@ Feed.prototype = {
   },
 
   invalidateItems() {
-    let ds = FeedUtils.getItemsDS(this.server);
     FeedUtils.log.debug("Feed.invalidateItems: for url - " + this.url);
-    let items = ds.GetSources(FeedUtils.FZ_FEED, this.resource, true);
-    let item;
-
-    while (items.hasMoreElements()) {
-      item = items.getNext();
-      item = item.QueryInterface(Ci.nsIRDFResource);
-      FeedUtils.log.trace("Feed.invalidateItems: item - " + item.Value);
-      let valid = ds.GetTarget(item, FeedUtils.FZ_VALID, true);
-      if (valid) {
-        ds.Unassert(item, FeedUtils.FZ_VALID, valid, true);
-      }
-    }
+    FeedUtils.getItemStore(this.server).invalidateFeedItems(this.url);
   },
 
   removeInvalidItems(aDeleteFeed) {
-    let ds = FeedUtils.getItemsDS(this.server);
     FeedUtils.log.debug("Feed.removeInvalidItems: for url - " + this.url);
-    let items = ds.GetSources(FeedUtils.FZ_FEED, this.resource, true);
-    let item;
-    let currentTime = new Date().getTime();
-    while (items.hasMoreElements()) {
-      item = items.getNext();
-      item = item.QueryInterface(Ci.nsIRDFResource);
-
-      if (ds.HasAssertion(item, FeedUtils.FZ_VALID,
-                          FeedUtils.RDF_LITERAL_TRUE, true)) {
-        continue;
-      }
-
-      let lastSeenTime = ds.GetTarget(item, FeedUtils.FZ_LAST_SEEN_TIMESTAMP, true);
-      if (lastSeenTime) {
-        lastSeenTime = parseInt(lastSeenTime.QueryInterface(Ci.nsIRDFLiteral).Value);
-      } else {
-        lastSeenTime = 0;
-      }
-
-      if ((currentTime - lastSeenTime) < FeedUtils.INVALID_ITEM_PURGE_DELAY &&
-          !aDeleteFeed) {
-        // Don't immediately purge items in active feeds; do so for deleted feeds.
-        continue;
-      }
-
-      FeedUtils.log.trace("Feed.removeInvalidItems: item - " + item.Value);
-      ds.Unassert(item, FeedUtils.FZ_FEED, this.resource, true);
-      if (ds.hasArcOut(item, FeedUtils.FZ_FEED)) {
-        FeedUtils.log.debug("Feed.removeInvalidItems: " + item.Value +
-                            " is from more than one feed; only the reference to" +
-                            " this feed removed");
-      } else {
-        FeedUtils.removeAssertions(ds, item);
-      }
-    }
+    // Don't immediately purge items in active feeds; do so for deleted feeds.
+    let purgeUntil = aDeleteFeed ? Infinity :
+      new Date().getTime() - FeedUtils.INVALID_ITEM_PURGE_DELAY;
+    let removed = FeedUtils.getItemStore(this.server)
+                           .removeInvalidFeedItems(this.url, purgeUntil);
+    FeedUtils.log.debug("Feed.removeInvalidItems: removed " + removed +
+                        " items");
   },
 
   createFolder() {
@@ -634,8 +593,7 @@ Feed.prototype = {
       }
 
       // Flush any feed item changes to disk.
-      let ds = FeedUtils.getItemsDS(aFeed.server);
-      ds.Flush();
+      FeedUtils.getItemStore(aFeed.server).flush();
       FeedUtils.log.debug("Feed.cleanupParsingState: items stored - " + this.itemsStored);
     }
 
@@ -94,13 +94,13 @@ FeedItem.prototype = {
     // this.mUrl and this.contentBase contain plain text.
 
     let stored = false;
-    let resource = this.findStoredResource();
+    let itemURI = this.findStoredResource();
     if (!this.feed.folder) {
       return stored;
     }
 
-    if (resource == null) {
-      resource = FeedUtils.rdf.GetResource(this.itemUniqueURI);
+    if (itemURI == null) {
+      itemURI = this.itemUniqueURI;
       if (!this.content) {
         FeedUtils.log.trace("FeedItem.store: " + this.identity +
                             " no content; storing description or title");
@@ -113,11 +113,11 @@ FeedItem.prototype = {
       content = content.replace(/%CONTENT%/, this.content);
       this.content = content;
       this.writeToFolder();
-      this.markStored(resource);
+      this.markStored(itemURI);
       stored = true;
     }
 
-    this.markValid(resource);
+    this.markValid(itemURI);
     return stored;
   },
 
@@ -139,70 +139,23 @@ FeedItem.prototype = {
       return null;
     }
 
-    let ds = FeedUtils.getItemsDS(server);
     let itemURI = this.itemUniqueURI;
-    let itemResource = FeedUtils.rdf.GetResource(itemURI);
-
-    let downloaded = ds.GetTarget(itemResource, FeedUtils.FZ_STORED, true);
-
-    if (!downloaded ||
-        downloaded.QueryInterface(Ci.nsIRDFLiteral).Value == "false") {
+    if (!FeedUtils.getItemStore(server).isStored(itemURI)) {
       FeedUtils.log.trace("FeedItem.findStoredResource: not stored");
       return null;
     }
 
     FeedUtils.log.trace("FeedItem.findStoredResource: already stored");
-    return itemResource;
+    return itemURI;
   },
 
-  markValid(resource) {
-    let ds = FeedUtils.getItemsDS(this.feed.server);
-
-    let newTimeStamp = FeedUtils.rdf.GetLiteral(new Date().getTime());
-    let currentTimeStamp = ds.GetTarget(resource,
-                                        FeedUtils.FZ_LAST_SEEN_TIMESTAMP,
-                                        true);
-    if (currentTimeStamp) {
-      ds.Change(resource, FeedUtils.FZ_LAST_SEEN_TIMESTAMP,
-                currentTimeStamp, newTimeStamp);
-    } else {
-      ds.Assert(resource, FeedUtils.FZ_LAST_SEEN_TIMESTAMP,
-                newTimeStamp, true);
-    }
-
-    if (!ds.HasAssertion(resource, FeedUtils.FZ_FEED,
-                         FeedUtils.rdf.GetResource(this.feed.url), true)) {
-      ds.Assert(resource, FeedUtils.FZ_FEED,
-                FeedUtils.rdf.GetResource(this.feed.url), true);
-    }
-
-    if (ds.hasArcOut(resource, FeedUtils.FZ_VALID)) {
-      let currentValue = ds.GetTarget(resource, FeedUtils.FZ_VALID, true);
-      ds.Change(resource, FeedUtils.FZ_VALID,
-                currentValue, FeedUtils.RDF_LITERAL_TRUE);
-    } else {
-      ds.Assert(resource, FeedUtils.FZ_VALID, FeedUtils.RDF_LITERAL_TRUE, true);
-    }
+  markValid(aItemURI) {
+    FeedUtils.getItemStore(this.feed.server)
+             .markValid(aItemURI, this.feed.url, new Date().getTime());
   },
 
-  markStored(resource) {
-    let ds = FeedUtils.getItemsDS(this.feed.server);
-
-    if (!ds.HasAssertion(resource, FeedUtils.FZ_FEED,
-                         FeedUtils.rdf.GetResource(this.feed.url), true)) {
-      ds.Assert(resource, FeedUtils.FZ_FEED,
-                FeedUtils.rdf.GetResource(this.feed.url), true);
-    }
-
-    let currentValue;
-    if (ds.hasArcOut(resource, FeedUtils.FZ_STORED)) {
-      currentValue = ds.GetTarget(resource, FeedUtils.FZ_STORED, true);
-      ds.Change(resource, FeedUtils.FZ_STORED,
-                currentValue, FeedUtils.RDF_LITERAL_TRUE);
-    } else {
-      ds.Assert(resource, FeedUtils.FZ_STORED,
-                FeedUtils.RDF_LITERAL_TRUE, true);
-    }
+  markStored(aItemURI) {
+    FeedUtils.getItemStore(this.feed.server).markStored(aItemURI, this.feed.url);
   },
 
   writeToFolder() {
@@ -11,6 +11,7 @@
 #include "nsIMAPNamespace.h"
 
 class nsIMAPBodyShell;
+class nsImapProtocol;
 class nsIImapIncomingServer;
 
 // f4d89e3e-77da-492c-962b-7835f0742c22
@@ -90,7 +91,7 @@ public:
 
   // Message Body Shells
   NS_IMETHOD  AddShellToCacheForHost(const char *serverKey, nsIMAPBodyShell *shell) = 0;
-  NS_IMETHOD  FindShellInCacheForHost(const char *serverKey, const char *mailboxName, const char *UID, IMAP_ContentModifiedType modType, nsIMAPBodyShell **result) = 0;
+  NS_IMETHOD  FindShellInCacheForHost(const char *serverKey, const char *mailboxName, const char *UID, uint32_t UIDValidity, IMAP_ContentModifiedType modType, nsImapProtocol *connection, nsIMAPBodyShell **result) = 0;
   NS_IMETHOD  ClearShellCacheForHost(const char *serverKey) = 0;
 };
 
@@ -22,6 +22,8 @@
 #include "nsIMutableArray.h"
 #include "nsArrayUtils.h"
 #include "mozilla/Logging.h"
+#include "mozilla/Preferences.h"
+#include <algorithm>
 
 using namespace mozilla;
 
@@ -29,6 +31,7 @@ NS_IMPL_ISUPPORTS(nsDefaultAutoSyncMsgStrategy, nsIAutoSyncMsgStrategy)
 
 const char* kAppIdleNotification = "mail:appIdle";
 const char* kStartupDoneNotification = "mail-startup-done";
+const char* kMaxDownloadRatePref = "mail.imap.autosync.max_download_rate";
 LazyLogModule gAutoSyncLog("IMAPAutoSync");
 
 // recommended size of each group of messages per download
@@ -217,6 +220,10 @@ nsDefaultAutoSyncFolderStrategy::IsExcluded(nsIMsgFolder *aFolder, bool *aDecisi
 nsAutoSyncManager::nsAutoSyncManager()
 {
   mGroupSize = kDefaultGroupSize;
+  mBytesDownloaded = 0;
+  mDownloadRate = 0;
+  mRateAllowance = 0;
+  mRateAllowanceTime = 0;
 
   mIdleState = notIdle;
   mStartupDone = false;
@@ -568,12 +575,17 @@ NS_IMETHODIMP nsAutoSyncManager::Observe(nsISupports*, const char *aTopic, const
       observerService->RemoveObserver(this, kStartupDoneNotification);
     }
 
-    // cancel and release the timer
+    // cancel and release the timers
     if (mTimer)
     {
        mTimer->Cancel();
        mTimer = nullptr;
     }
+    if (mThrottleTimer)
+    {
+       mThrottleTimer->Cancel();
+       mThrottleTimer = nullptr;
+    }
     // unsubscribe from idle service
     if (mIdleService)
        mIdleService->RemoveIdleObserver(this, kIdleTimeInSec);
@@ -687,12 +699,12 @@ nsresult nsAutoSyncManager::StartIdleProcessing()
     int32_t state;
     autoSyncStateObj->GetState(&state);
 
-    //TODO: Test cached-connection availability in parallel mode
-    // and do not exceed (cached-connection count - 1)
-
     if (state != nsAutoSyncState::stReadyToDownload)
       continue;
 
+    if (mDownloadModel == dmParallel && !HasFreeConnectionFor(autoSyncStateObj))
+      continue;
+
     nsresult rv = DownloadMessagesForOffline(autoSyncStateObj);
     if (NS_FAILED(rv))
     {
@@ -725,8 +737,11 @@ nsresult nsAutoSyncManager::StartIdleProcessing()
     autoSyncStateObj->SetState(nsAutoSyncState::stCompletedIdle);
 
     if (mPriorityQ.RemoveObject(autoSyncStateObj))
+    {
+      OnFolderDownloaded(autoSyncStateObj);
       NOTIFY_LISTENERS(OnFolderRemovedFromQ,
                       (nsIAutoSyncMgrListener::PriorityQueue, folder));
+    }
   }
 
   return AutoUpdateFolders();
@@ -942,6 +957,11 @@ void nsAutoSyncManager::ScheduleFolderForOfflineDownload(nsIAutoSyncState *aAuto
         break;
       }//endwhile
     }
+
+    // remember when the folder was queued, to log how long it takes to
+    // download all of its messages
+    if (mPriorityQ.IndexOf(aAutoSyncStateObj) != -1)
+      mQueuedTimes.Put(aAutoSyncStateObj, PR_Now());
   }//endif
 }
 
@@ -962,9 +982,18 @@ nsresult nsAutoSyncManager::DownloadMessagesForOffline(nsIAutoSyncState *aAutoSy
   if (!count)
     return NS_ERROR_NOT_AVAILABLE;
 
+  // if we are over the download rate limit, start the group later
+  uint32_t delay = GetThrottleDelay();
+  if (delay)
+  {
+    ThrottleDownload(aAutoSyncStateObj, delay);
+    return NS_OK;
+  }
+
   nsCOMPtr<nsIMutableArray> messagesToDownload;
   uint32_t totalSize = 0;
-  rv = aAutoSyncStateObj->GetNextGroupOfMessages(mGroupSize, &totalSize, getter_AddRefs(messagesToDownload));
+  rv = aAutoSyncStateObj->GetNextGroupOfMessages(GetGroupSizeFor(aAutoSyncStateObj),
+                                                 &totalSize, getter_AddRefs(messagesToDownload));
   NS_ENSURE_SUCCESS(rv,rv);
 
   // there are pending messages but the cumulative size is zero:
@@ -995,11 +1024,273 @@ nsresult nsAutoSyncManager::DownloadMessagesForOffline(nsIAutoSyncState *aAutoSy
     aAutoSyncStateObj->GetOwnerFolder(getter_AddRefs(folder));
     if (NS_SUCCEEDED(rv) && folder)
       NOTIFY_LISTENERS(OnDownloadStarted, (folder, length, totalCount));
+
+    if (NS_SUCCEEDED(rv))
+    {
+      GroupDownload group = { PR_Now(), totalSize };
+      mGroupDownloads.Put(aAutoSyncStateObj, group);
+      mRateAllowance -= totalSize;
+    }
   }
 
   return rv;
 }
 
+static nsresult GetServerKeyFor(nsIAutoSyncState *aAutoSyncStateObj, nsACString &aServerKey)
+{
+  nsCOMPtr<nsIMsgFolder> folder;
+  nsresult rv = aAutoSyncStateObj->GetOwnerFolder(getter_AddRefs(folder));
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  nsCOMPtr<nsIMsgIncomingServer> server;
+  rv = folder->GetServer(getter_AddRefs(server));
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  return server->GetKey(aServerKey);
+}
+
+/**
+ * Returns the size of the next group of messages to download for the given
+ * folder: what its server delivers in kTargetGroupTimeInMs at the measured
+ * rate, but no less than mGroupSize and no more than kMaxGroupSize. Larger
+ * groups spend less time waiting on round trips between the groups, smaller
+ * ones let a higher priority folder take over sooner.
+ */
+uint32_t nsAutoSyncManager::GetGroupSizeFor(nsIAutoSyncState *aAutoSyncStateObj)
+{
+  nsAutoCString serverKey;
+  uint32_t rate = 0;
+  if (NS_SUCCEEDED(GetServerKeyFor(aAutoSyncStateObj, serverKey)))
+    mServerRates.Get(serverKey, &rate);
+
+  uint64_t groupSize = uint64_t(rate) * kTargetGroupTimeInMs / PR_MSEC_PER_SEC;
+  return uint32_t(std::max<uint64_t>(mGroupSize,
+                                     std::min<uint64_t>(groupSize, kMaxGroupSize)));
+}
+
+/**
+ * In parallel model, tests whether the given folder may start a download
+ * without using up the cached connections of its server; one of them is
+ * left for the user.
+ */
+bool nsAutoSyncManager::HasFreeConnectionFor(nsIAutoSyncState *aAutoSyncStateObj)
+{
+  int32_t maxConnections = 1;
+  nsCOMPtr<nsIMsgFolder> folder;
+  aAutoSyncStateObj->GetOwnerFolder(getter_AddRefs(folder));
+  if (folder)
+  {
+    nsCOMPtr<nsIMsgIncomingServer> server;
+    folder->GetServer(getter_AddRefs(server));
+    nsCOMPtr<nsIImapIncomingServer> imapServer(do_QueryInterface(server));
+    if (imapServer)
+      imapServer->GetMaximumConnectionsNumber(&maxConnections);
+  }
+
+  int32_t downloading = 0;
+  int32_t offset = 0;
+  nsIAutoSyncState *sibling;
+  while ((sibling = SearchQForSibling(mPriorityQ, aAutoSyncStateObj, offset, &offset)))
+  {
+    int32_t state;
+    if (NS_SUCCEEDED(sibling->GetState(&state)) &&
+        state == nsAutoSyncState::stDownloadInProgress)
+      downloading++;
+    offset++;
+  }
+
+  return downloading < std::max(1, maxConnections - 1);
+}
+
+/**
+ * In parallel model, starts the folders of the same server as the given one
+ * that wait for a free connection, in priority order, as long as there are
+ * connections to spare. Called when a folder stops downloading.
+ */
+void nsAutoSyncManager::StartWaitingSiblingsOf(nsIAutoSyncState *aAutoSyncStateObj)
+{
+  nsCOMArray<nsIAutoSyncState> waiting;
+  int32_t offset = 0;
+  nsIAutoSyncState *sibling;
+  while ((sibling = SearchQForSibling(mPriorityQ, aAutoSyncStateObj, offset, &offset)))
+  {
+    int32_t state;
+    if (NS_SUCCEEDED(sibling->GetState(&state)) &&
+        state == nsAutoSyncState::stReadyToDownload)
+      waiting.AppendObject(sibling);
+    offset++;
+  }
+
+  // over the rate limit, the folders go to the throttled queue, and the
+  // throttle timer checks for free connections again when it starts them
+  int32_t elemCount = waiting.Count();
+  for (int32_t idx = 0; idx < elemCount && HasFreeConnectionFor(waiting[idx]); idx++)
+  {
+    nsresult rv = DownloadMessagesForOffline(waiting[idx]);
+    if (NS_FAILED(rv))
+      HandleDownloadErrorFor(waiting[idx], rv);
+  }
+}
+
+/**
+ * Returns how many milliseconds to wait before the next group may start,
+ * so that the downloads stay within the rate set by kMaxDownloadRatePref.
+ * Bursts of up to a second's worth of data are allowed.
+ */
+uint32_t nsAutoSyncManager::GetThrottleDelay()
+{
+  int64_t rate = int64_t(Preferences::GetInt(kMaxDownloadRatePref, 0)) * 1024;
+  PRTime now = PR_Now();
+  if (rate <= 0)
+  {
+    mRateAllowance = 0;
+    mRateAllowanceTime = now;
+    return 0;
+  }
+
+  double earned = double(now - mRateAllowanceTime) * rate / PR_USEC_PER_SEC;
+  mRateAllowance = int64_t(std::min(double(rate), mRateAllowance + earned));
+  mRateAllowanceTime = now;
+  if (mRateAllowance >= 0)
+    return 0;
+
+  return uint32_t(-mRateAllowance * PR_MSEC_PER_SEC / rate) + 1;
+}
+
+/**
+ * Defers the download of the next group of the given folder by aDelay
+ * milliseconds.
+ */
+void nsAutoSyncManager::ThrottleDownload(nsIAutoSyncState *aAutoSyncStateObj, uint32_t aDelay)
+{
+  if (mThrottledQ.IndexOf(aAutoSyncStateObj) == -1)
+    mThrottledQ.AppendObject(aAutoSyncStateObj);
+
+  MOZ_LOG(gAutoSyncLog, LogLevel::Debug,
+         ("download rate limit reached, waiting %u ms", aDelay));
+
+  if (mThrottleTimer)
+    return;
+
+  nsresult rv;
+  mThrottleTimer = do_CreateInstance(NS_TIMER_CONTRACTID, &rv);
+  if (NS_SUCCEEDED(rv))
+    rv = mThrottleTimer->InitWithNamedFuncCallback(ThrottleTimerCallback, (void *) this,
+                                                  aDelay, nsITimer::TYPE_ONE_SHOT,
+                                                  "nsAutoSyncManager::ThrottleTimerCallback");
+  if (NS_FAILED(rv))
+    mThrottleTimer = nullptr;
+}
+
+void nsAutoSyncManager::ThrottleTimerCallback(nsITimer *aTimer, void *aClosure)
+{
+  if (!aClosure)
+    return;
+
+  nsAutoSyncManager *autoSyncMgr = static_cast<nsAutoSyncManager*>(aClosure);
+  autoSyncMgr->mThrottleTimer = nullptr;
+
+  nsCOMArray<nsIAutoSyncState> throttledQ;
+  throttledQ.SwapElements(autoSyncMgr->mThrottledQ);
+
+  // if we're not idle anymore, the folders wait in the priority queue
+  // for the next idle
+  if (autoSyncMgr->mPaused || autoSyncMgr->GetIdleState() == notIdle)
+    return;
+
+  int32_t elemCount = throttledQ.Count();
+  for (int32_t idx = 0; idx < elemCount; idx++)
+  {
+    nsIAutoSyncState *autoSyncStateObj = throttledQ[idx];
+    int32_t state;
+    autoSyncStateObj->GetState(&state);
+    if (state != nsAutoSyncState::stReadyToDownload ||
+        autoSyncMgr->mPriorityQ.IndexOf(autoSyncStateObj) == -1)
+      continue;
+
+    // a sibling may have started downloading in the meantime
+    if (autoSyncMgr->mDownloadModel == dmChained ?
+        DoesQContainAnySiblingOf(autoSyncMgr->mPriorityQ, autoSyncStateObj,
+                                 nsAutoSyncState::stDownloadInProgress) :
+        !autoSyncMgr->HasFreeConnectionFor(autoSyncStateObj))
+      continue;
+
+    nsresult rv = autoSyncMgr->DownloadMessagesForOffline(autoSyncStateObj);
+    if (NS_FAILED(rv))
+      autoSyncMgr->HandleDownloadErrorFor(autoSyncStateObj, rv);
+  }
+}
+
+/**
+ * Updates the download rates with the group of the given folder that just
+ * finished downloading.
+ */
+void nsAutoSyncManager::OnGroupDownloaded(nsIAutoSyncState *aAutoSyncStateObj)
+{
+  GroupDownload group;
+  if (!mGroupDownloads.Get(aAutoSyncStateObj, &group))
+    return;
+  mGroupDownloads.Remove(aAutoSyncStateObj);
+  mBytesDownloaded += group.mSize;
+
+  // The elapsed time includes the round trips of the fetch, so smaller
+  // groups measure a lower rate; that only slows down their growth.
+  PRTime elapsed = std::max<PRTime>(PR_Now() - group.mStartTime, PR_USEC_PER_MSEC);
+  uint32_t rate = uint32_t(std::min<uint64_t>(uint64_t(group.mSize) * PR_USEC_PER_SEC / elapsed,
+                                              UINT32_MAX));
+  // new samples weigh a quarter
+  mDownloadRate = mDownloadRate ? uint32_t((3 * uint64_t(mDownloadRate) + rate) / 4) : rate;
+
+  nsAutoCString serverKey;
+  if (NS_SUCCEEDED(GetServerKeyFor(aAutoSyncStateObj, serverKey)))
+  {
+    uint32_t serverRate = 0;
+    mServerRates.Get(serverKey, &serverRate);
+    mServerRates.Put(serverKey,
+                     serverRate ? uint32_t((3 * uint64_t(serverRate) + rate) / 4) : rate);
+  }
+
+  if (MOZ_LOG_TEST(gAutoSyncLog, LogLevel::Info))
+  {
+    nsCString folderName;
+    nsCOMPtr<nsIMsgFolder> folder;
+    aAutoSyncStateObj->GetOwnerFolder(getter_AddRefs(folder));
+    if (folder)
+      folder->GetURI(folderName);
+    int32_t pending = 0;
+    aAutoSyncStateObj->GetPendingMessageCount(&pending);
+    MOZ_LOG(gAutoSyncLog, LogLevel::Info,
+           ("%u bytes of %s downloaded in %" PRId64 " ms (%u bytes/s), next group %u bytes, "
+            "%d messages pending, %d folders in priority q, %d in update q, %d in discovery q",
+            group.mSize, folderName.get(), elapsed / PR_USEC_PER_MSEC, rate,
+            GetGroupSizeFor(aAutoSyncStateObj), pending, mPriorityQ.Count(),
+            mUpdateQ.Count(), mDiscoveryQ.Count()));
+  }
+}
+
+/**
+ * Called when all the messages of the given folder have been downloaded.
+ */
+void nsAutoSyncManager::OnFolderDownloaded(nsIAutoSyncState *aAutoSyncStateObj)
+{
+  PRTime queuedTime;
+  if (!mQueuedTimes.Get(aAutoSyncStateObj, &queuedTime))
+    return;
+  mQueuedTimes.Remove(aAutoSyncStateObj);
+
+  if (MOZ_LOG_TEST(gAutoSyncLog, LogLevel::Info))
+  {
+    nsCString folderName;
+    nsCOMPtr<nsIMsgFolder> folder;
+    aAutoSyncStateObj->GetOwnerFolder(getter_AddRefs(folder));
+    if (folder)
+      folder->GetURI(folderName);
+    MOZ_LOG(gAutoSyncLog, LogLevel::Info,
+           ("%s completely offline %" PRId64 " s after it was queued",
+            folderName.get(), (PR_Now() - queuedTime) / PR_USEC_PER_SEC));
+  }
+}
+
 /**
  * Assuming that the download operation on the given folder has been failed at least once,
  * execute these steps:
@@ -1197,9 +1488,10 @@ NS_IMETHODIMP nsAutoSyncManager::OnDownloadQChanged(nsIAutoSyncState *aAutoSyncS
     autoSyncStateObj->SetState(nsAutoSyncState::stReadyToDownload);
     ScheduleFolderForOfflineDownload(autoSyncStateObj);
 
-    // If we operate in parallel mode or if there is no sibling downloading messages at the moment,
-    // we can download the first group of the messages for this folder
-    if (mDownloadModel == dmParallel ||
+    // If we operate in parallel mode and there is a connection to spare, or if there is no
+    // sibling downloading messages at the moment, we can download the first group of the
+    // messages for this folder
+    if (mDownloadModel == dmParallel ? HasFreeConnectionFor(autoSyncStateObj) :
         !DoesQContainAnySiblingOf(mPriorityQ, autoSyncStateObj, nsAutoSyncState::stDownloadInProgress))
     {
       // this will download the first group of messages immediately;
@@ -1243,6 +1535,7 @@ nsAutoSyncManager::OnDownloadCompleted(nsIAutoSyncState *aAutoSyncStateObj, nsre
 
   if (NS_FAILED(aExitCode))
   {
+    mGroupDownloads.Remove(autoSyncStateObj);
     // retry the same group kGroupRetryCount times
     // try again if TB still idle, otherwise wait for the next idle time
     autoSyncStateObj->TryCurrentGroupAgain(kGroupRetryCount);
@@ -1250,13 +1543,18 @@ nsAutoSyncManager::OnDownloadCompleted(nsIAutoSyncState *aAutoSyncStateObj, nsre
     {
       rv = DownloadMessagesForOffline(autoSyncStateObj);
       if (NS_FAILED(rv))
+      {
         rv = HandleDownloadErrorFor(autoSyncStateObj, rv);
+        if (mDownloadModel == dmParallel)
+          StartWaitingSiblingsOf(autoSyncStateObj);
+      }
     }
     return rv;
   }
 
   // download is successful, reset the retry counter of the folder
   autoSyncStateObj->ResetRetryCounter();
+  OnGroupDownloaded(autoSyncStateObj);
 
   nsCOMPtr<nsIMsgFolder> folder;
   aAutoSyncStateObj->GetOwnerFolder(getter_AddRefs(folder));
@@ -1300,7 +1598,10 @@ nsAutoSyncManager::OnDownloadCompleted(nsIAutoSyncState *aAutoSyncStateObj, nsre
     nsresult rv = autoSyncStateObj->GetOwnerFolder(getter_AddRefs(folder));
 
     if (NS_SUCCEEDED(rv) && mPriorityQ.RemoveObject(autoSyncStateObj))
+    {
+      OnFolderDownloaded(autoSyncStateObj);
       NOTIFY_LISTENERS(OnFolderRemovedFromQ, (nsIAutoSyncMgrListener::PriorityQueue, folder));
+    }
 
     //find the next folder owned by the same server in the queue and continue downloading
     if (mDownloadModel == dmChained)
@@ -1309,13 +1610,22 @@ nsAutoSyncManager::OnDownloadCompleted(nsIAutoSyncState *aAutoSyncStateObj, nsre
   }//endif
 
   // continue downloading if TB is still in idle state
+  bool connectionFreed = !nextFolderToDownload;
   if (nextFolderToDownload && GetIdleState() != notIdle)
   {
     rv = DownloadMessagesForOffline(nextFolderToDownload);
     if (NS_FAILED(rv))
+    {
       rv = HandleDownloadErrorFor(nextFolderToDownload, rv);
+      connectionFreed = true;
+    }
   }
 
+  // in parallel model, the connection this folder used may now be taken by
+  // a folder that StartIdleProcessing skipped for the lack of one
+  if (mDownloadModel == dmParallel && connectionFreed && GetIdleState() != notIdle)
+    StartWaitingSiblingsOf(autoSyncStateObj);
+
   return rv;
 }
 
@@ -1361,6 +1671,20 @@ NS_IMETHODIMP nsAutoSyncManager::GetUpdateQLength(uint32_t *aUpdateQLength)
   return NS_OK;
 }
 
+NS_IMETHODIMP nsAutoSyncManager::GetBytesDownloaded(uint64_t *aBytesDownloaded)
+{
+  NS_ENSURE_ARG_POINTER(aBytesDownloaded);
+  *aBytesDownloaded = mBytesDownloaded;
+  return NS_OK;
+}
+
+NS_IMETHODIMP nsAutoSyncManager::GetDownloadRate(uint32_t *aDownloadRate)
+{
+  NS_ENSURE_ARG_POINTER(aDownloadRate);
+  *aDownloadRate = mDownloadRate;
+  return NS_OK;
+}
+
 /* readonly attribute unsigned long downloadQLength; */
 NS_IMETHODIMP nsAutoSyncManager::GetDownloadQLength(uint32_t *aDownloadQLength)
 {
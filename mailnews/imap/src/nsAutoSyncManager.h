@@ -8,6 +8,7 @@
 #include "nsAutoPtr.h"
 #include "nsString.h"
 #include "nsCOMArray.h"
+#include "nsDataHashtable.h"
 #include "nsIObserver.h"
 #include "nsIUrlListener.h"
 #include "nsITimer.h"
@@ -35,7 +36,11 @@
  *    recent and smallest message first. Also, by sorting the messages by size in the
  *    queue, it tries to maximize the number of messages downloaded.
  *  o It downloads the messages in groups. Default groups size is defined by |kDefaultGroupSize|.
+ *    Once a group of a server has been downloaded, the groups of that server grow to what it
+ *    delivered in |kTargetGroupTimeInMs| at the measured rate, up to |kMaxGroupSize|.
  *  o It downloads the messages larger than the group size one-by-one.
+ *  o If the "mail.imap.autosync.max_download_rate" pref is set, it waits before starting a
+ *    group until the groups downloaded so far fit into that rate.
  *  o If new messages arrive when not idle, it downloads the messages that do fit into
  *    |kFirstGroupSizeLimit| size limit immediately, without waiting for idle time, unless there is
  *    a sibling (a folder owned by the same imap server) in stDownloadInProgress state in the q
@@ -69,7 +74,8 @@
  *
  * Download Model:
  *  Parallel model should be used with the imap servers that do not have any "max number of sessions
- *  per IP" limit, and when the bandwidth is significantly large.
+ *  per IP" limit, and when the bandwidth is significantly large. It downloads at most one folder
+ *  fewer than the cached connections of the server at a time, leaving one for the user.
  *
  * How it really works:
  * The AutoSyncManager gets an idle notification. First it processes any
@@ -128,6 +134,9 @@ class nsAutoSyncManager final : public nsIObserver,
   static const uint32_t kFirstGroupSizeLimit = 60U*1024U /* 60K */;
   static const int32_t kIdleTimeInSec = 10;
   static const uint32_t kGroupRetryCount = 3;
+  // groups are sized to take about this long at the measured download rate
+  static const uint32_t kTargetGroupTimeInMs = 2000;
+  static const uint32_t kMaxGroupSize = 2U*1024U*1024U /* 2M */;
 
   enum IdleState { systemIdle, appIdle, notIdle };
   enum UpdateState { initiated, completed };
@@ -151,6 +160,16 @@ class nsAutoSyncManager final : public nsIObserver,
     nsresult DownloadMessagesForOffline(nsIAutoSyncState *aAutoSyncStateObj, uint32_t aSizeLimit = 0);
     nsresult HandleDownloadErrorFor(nsIAutoSyncState *aAutoSyncStateObj, const nsresult error);
 
+    /// download scheduling helpers
+    uint32_t GetGroupSizeFor(nsIAutoSyncState *aAutoSyncStateObj);
+    bool HasFreeConnectionFor(nsIAutoSyncState *aAutoSyncStateObj);
+    void StartWaitingSiblingsOf(nsIAutoSyncState *aAutoSyncStateObj);
+    uint32_t GetThrottleDelay();
+    void ThrottleDownload(nsIAutoSyncState *aAutoSyncStateObj, uint32_t aDelay);
+    static void ThrottleTimerCallback(nsITimer *aTimer, void *aClosure);
+    void OnGroupDownloaded(nsIAutoSyncState *aAutoSyncStateObj);
+    void OnFolderDownloaded(nsIAutoSyncState *aAutoSyncStateObj);
+
     // Helper methods for priority Q operations
     static
     void ChainFoldersInQ(const nsCOMArray<nsIAutoSyncState> &aQueue,
@@ -200,7 +219,28 @@ class nsAutoSyncManager final : public nsIObserver,
     bool mStartupDone;
 
   private:
+    // a message group being downloaded
+    struct GroupDownload
+    {
+      PRTime mStartTime;
+      uint32_t mSize;
+    };
+
     uint32_t mGroupSize;
+    // smoothed download rate of each imap server, in bytes per second
+    nsDataHashtable<nsCStringHashKey, uint32_t> mServerRates;
+    nsDataHashtable<nsPtrHashKey<nsIAutoSyncState>, GroupDownload> mGroupDownloads;
+    // when the folders in mPriorityQ were added into it
+    nsDataHashtable<nsPtrHashKey<nsIAutoSyncState>, PRTime> mQueuedTimes;
+    uint64_t mBytesDownloaded;
+    uint32_t mDownloadRate;
+    // rate limiting: the bytes that may be downloaded as of mRateAllowanceTime;
+    // negative when the last groups went over the limit
+    int64_t mRateAllowance;
+    PRTime mRateAllowanceTime;
+    // folders waiting for the rate limit to let them download their next group
+    nsCOMArray<nsIAutoSyncState> mThrottledQ;
+    nsCOMPtr<nsITimer> mThrottleTimer;
     IdleState mIdleState;
     int32_t mDownloadModel;
     nsCOMPtr<nsIIdleService> mIdleService;
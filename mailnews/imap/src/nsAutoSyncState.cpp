@@ -17,6 +17,7 @@
 #include "nsIMutableArray.h"
 #include "nsArrayUtils.h"
 #include "mozilla/Logging.h"
+#include <algorithm>
 
 using namespace mozilla;
 
@@ -80,7 +81,7 @@ nsAutoSyncState::nsAutoSyncState(nsImapMailFolder *aOwnerFolder, PRTime aLastSyn
   : mSyncState(stCompletedIdle), mOffset(0U), mLastOffset(0U), mLastServerTotal(0),
     mLastServerRecent(0), mLastServerUnseen(0), mLastNextUID(0),
     mLastSyncTime(aLastSyncTime), mLastUpdateTime(0UL), mProcessPointer(0U),
-    mIsDownloadQChanged(false), mRetryCounter(0U)
+    mIsDownloadQChanged(false), mSortedLength(0U), mRetryCounter(0U)
 {
   mOwnerFolder = do_GetWeakReference(static_cast<nsIMsgImapMailFolder*>(aOwnerFolder));
 }
@@ -185,28 +186,59 @@ nsresult nsAutoSyncState::SortQueueBasedOnStrategy(nsTArray<nsMsgKey> &aQueue)
   return rv;
 }
 
-// This method is a hack to prioritize newly inserted messages,
-// without changing the size of the queue. It is required since
-// we cannot sort ranges in nsTArray.
-nsresult nsAutoSyncState::SortSubQueueBasedOnStrategy(nsTArray<nsMsgKey> &aQueue,
-                                                      uint32_t aStartingOffset)
+// Places the keys queued since the last sort, i.e. those from aSortedLength
+// on, among the pending keys starting at aStartingOffset. The pending keys
+// are still in strategy order, so only the new keys are sorted, and each of
+// them is then binary-inserted. This takes O(k log n) strategy calls for k
+// new keys, where re-sorting the whole pending queue every time new
+// messages arrive took O(n log n).
+nsresult nsAutoSyncState::InsertNewKeysBasedOnStrategy(nsTArray<nsMsgKey> &aQueue,
+                                                       uint32_t aStartingOffset,
+                                                       uint32_t aSortedLength)
 {
-  NS_ASSERTION(aStartingOffset < aQueue.Length(), "*** Starting offset is out of range");
+  NS_ASSERTION(aStartingOffset <= aSortedLength &&
+               aSortedLength <= aQueue.Length(), "*** Offsets are out of range");
 
-  // Copy already downloaded messages into a temporary queue,
-  // we want to exclude them from the sort.
-  nsTArray<nsMsgKey> tmpQ;
-  tmpQ.AppendElements(aQueue.Elements(), aStartingOffset);
+  nsTArray<nsMsgKey> newKeys;
+  newKeys.AppendElements(aQueue.Elements() + aSortedLength,
+                         aQueue.Length() - aSortedLength);
+  aQueue.TruncateLength(aSortedLength);
 
-  // Remove already downloaded messages and sort the resulting queue
-  aQueue.RemoveElementsAt(0, aStartingOffset);
+  nsresult rv = SortQueueBasedOnStrategy(newKeys);
+  if (NS_FAILED(rv))
+  {
+    aQueue.AppendElements(newKeys);
+    return rv;
+  }
 
-  nsresult rv = SortQueueBasedOnStrategy(aQueue);
+  nsCOMPtr <nsIMsgFolder> folder = do_QueryReferent(mOwnerFolder, &rv);
+  NS_ENSURE_SUCCESS(rv, rv);
+  nsCOMPtr<nsIMsgDatabase> database;
+  folder->GetMsgDatabase(getter_AddRefs(database));
+  nsCOMPtr<nsIAutoSyncManager> autoSyncMgr = do_GetService(NS_AUTOSYNCMANAGER_CONTRACTID, &rv);
+  NS_ENSURE_SUCCESS(rv, rv);
+  nsCOMPtr<nsIAutoSyncMsgStrategy> msgStrategy;
+  autoSyncMgr->GetMsgStrategy(getter_AddRefs(msgStrategy));
+  MsgStrategyComparatorAdaptor strategyComp(msgStrategy, folder, database);
 
-  // copy excluded messages back
-  aQueue.InsertElementsAt(0, tmpQ);
+  // Since the new keys are sorted too, each one goes after the previous one.
+  // Equal keys go after the queued ones, as a stable sort would put them.
+  uint32_t low = aStartingOffset;
+  for (uint32_t i = 0; i < newKeys.Length(); i++)
+  {
+    uint32_t high = aQueue.Length();
+    while (low < high)
+    {
+      uint32_t mid = low + (high - low) / 2;
+      if (strategyComp.LessThan(newKeys[i], aQueue[mid]))
+        high = mid;
+      else
+        low = mid + 1;
+    }
+    aQueue.InsertElementAt(low++, newKeys[i]);
+  }
 
-  return rv;
+  return NS_OK;
 }
 
 NS_IMETHODIMP nsAutoSyncState::GetNextGroupOfMessages(uint32_t aSuggestedGroupSizeLimit,
@@ -235,12 +267,14 @@ NS_IMETHODIMP nsAutoSyncState::GetNextGroupOfMessages(uint32_t aSuggestedGroupSi
       {
         // we want to sort only pending messages. mOffset is
         // the position of the first pending message in the download queue
-        rv = (mOffset > 0)
-          ? SortSubQueueBasedOnStrategy(mDownloadQ, mOffset)
-          : SortQueueBasedOnStrategy(mDownloadQ);
+        rv = InsertNewKeysBasedOnStrategy(mDownloadQ, mOffset,
+                                          std::max(mSortedLength, mOffset));
 
         if (NS_SUCCEEDED(rv))
+        {
           mIsDownloadQChanged = false;
+          mSortedLength = mDownloadQ.Length();
+        }
       }
 
       nsCOMPtr<nsIAutoSyncManager> autoSyncMgr = do_GetService(NS_AUTOSYNCMANAGER_CONTRACTID, &rv);
@@ -260,6 +294,8 @@ NS_IMETHODIMP nsAutoSyncState::GetNextGroupOfMessages(uint32_t aSuggestedGroupSi
         {
           mDownloadSet.RemoveEntry(mDownloadQ[idx]);
           mDownloadQ.RemoveElementAt(idx--);
+          if (idx + 1 < mSortedLength)
+            mSortedLength--;
           msgCount--;
           continue;
         }
@@ -572,7 +608,7 @@ NS_IMETHODIMP nsAutoSyncState::Rollback()
 
 NS_IMETHODIMP nsAutoSyncState::ResetDownloadQ()
 {
-  mOffset = mLastOffset = 0;
+  mOffset = mLastOffset = mSortedLength = 0;
   mDownloadSet.Clear();
   mDownloadQ.Clear();
   mDownloadQ.Compact();
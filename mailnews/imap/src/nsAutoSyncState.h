@@ -73,8 +73,9 @@ public:
 
   nsresult PlaceIntoDownloadQ(const nsTArray<nsMsgKey> &aMsgKeyList);
   nsresult SortQueueBasedOnStrategy(nsTArray<nsMsgKey> &aQueue);
-  nsresult SortSubQueueBasedOnStrategy(nsTArray<nsMsgKey> &aQueue,
-                                    uint32_t aStartingOffset);
+  nsresult InsertNewKeysBasedOnStrategy(nsTArray<nsMsgKey> &aQueue,
+                                        uint32_t aStartingOffset,
+                                        uint32_t aSortedLength);
 
   void LogOwnerFolderName(const char *s);
   void LogQWithSize(nsTArray<nsMsgKey>& q, uint32_t toOffset = 0);
@@ -96,6 +97,9 @@ public:
   PRTime mLastUpdateTime;
   uint32_t mProcessPointer;
   bool mIsDownloadQChanged;
+  // Length of the prefix of mDownloadQ that is in strategy order; the keys
+  // after it were queued since the last sort.
+  uint32_t mSortedLength;
   uint32_t mRetryCounter;
   nsTHashtable<nsUint32HashKey> mDownloadSet;
   nsTArray<nsMsgKey> mDownloadQ;
@@ -9,6 +9,11 @@
 
 #include "nsMimeTypes.h"
 #include "nsServiceManagerUtils.h"
+#include "nsPrintfCString.h"
+#include "nsISafeOutputStream.h"
+#include "nsMsgUtils.h"
+#include "plstr.h"
+#include "prio.h"
 
 // need to talk to Rich about this...
 #define IMAP_EXTERNAL_CONTENT_HEADER "X-Mozilla-IMAP-Part"
@@ -61,6 +66,7 @@ nsIMAPBodyShell::nsIMAPBodyShell(nsImapProtocol *protocolConnection,
   m_UID.AppendInt(UID);
   m_UID_validity = m_UID;
   m_UID_validity.AppendInt(UIDValidity);
+  m_UIDValidity = UIDValidity;
 #ifdef DEBUG_chrisf
   NS_ASSERTION(folderName);
 #endif
@@ -87,6 +93,231 @@ void nsIMAPBodyShell::SetIsValid(bool valid)
   m_isValid = valid;
 }
 
+/*
+        Serialized structure
+
+        A shell is serialized as the pre-order walk of the body of its message,
+        so that it can be rebuilt without fetching the BODYSTRUCTURE again.
+        Only what the parser keeps of the BODYSTRUCTURE response is written;
+        part numbers are derived again while rebuilding, as the parser does.
+
+        part      = leaf / message / multipart
+        leaf      = "L" fields
+        message   = "M" fields part
+        multipart = "P" string string number part*   ; subtype, boundary, count
+        fields    = string string string string string number
+                                                  ; type, subtype, id,
+                                                  ; description, encoding, size
+        string    = "-" / number bytes            ; "-" is NIL
+        number    = digits ";"
+*/
+
+static void AppendStructureNumber(nsACString &aStream, int32_t aNumber)
+{
+  aStream.AppendInt(aNumber);
+  aStream.Append(';');
+}
+
+static void AppendStructureString(nsACString &aStream, const char *aString)
+{
+  if (!aString)
+  {
+    aStream.Append('-');
+    return;
+  }
+  uint32_t length = strlen(aString);
+  AppendStructureNumber(aStream, length);
+  aStream.Append(aString, length);
+}
+
+// Reads back what the Append* helpers above wrote.  Once a read fails,
+// all further reads fail too.
+class nsIMAPBodyStructureReader
+{
+public:
+  explicit nsIMAPBodyStructureReader(const nsACString &aStream)
+    : m_cursor(aStream.BeginReading()), m_end(aStream.EndReading()),
+      m_failed(false) {}
+
+  bool Failed() { return m_failed; }
+  bool AtEnd() { return m_cursor == m_end; }
+
+  char ReadTag()
+  {
+    if (m_failed || m_cursor == m_end)
+    {
+      m_failed = true;
+      return 0;
+    }
+    return *m_cursor++;
+  }
+
+  int32_t ReadNumber()
+  {
+    int64_t number = 0;
+    bool negative = !m_failed && m_cursor != m_end && *m_cursor == '-';
+    if (negative)
+      m_cursor++;
+    const char *start = m_cursor;
+    while (!m_failed && m_cursor != m_end && *m_cursor >= '0' &&
+           *m_cursor <= '9' && number <= INT32_MAX)
+      number = number * 10 + (*m_cursor++ - '0');
+    if (m_failed || m_cursor == start || m_cursor == m_end ||
+        *m_cursor != ';' || number > INT32_MAX)
+    {
+      m_failed = true;
+      return 0;
+    }
+    m_cursor++;
+    return negative ? -int32_t(number) : int32_t(number);
+  }
+
+  // Returns a copy of the string, to be freed with PR_Free, or null for NIL
+  // and on failure.
+  char *ReadString()
+  {
+    if (!m_failed && m_cursor != m_end && *m_cursor == '-')
+    {
+      m_cursor++;
+      return nullptr;
+    }
+    int32_t length = ReadNumber();
+    if (m_failed || length < 0 || length > m_end - m_cursor)
+    {
+      m_failed = true;
+      return nullptr;
+    }
+    char *string = PL_strndup(m_cursor, length);
+    m_cursor += length;
+    return string;
+  }
+
+private:
+  const char *m_cursor;
+  const char *m_end;
+  bool m_failed;
+};
+
+// Rebuilds a part serialized by SerializeStructure(), with the constructors
+// the BODYSTRUCTURE parser uses.  Adopts partNum, like they do.
+static nsIMAPBodypart *
+DeserializeStructurePart(nsIMAPBodyStructureReader &aReader, char *partNum,
+                         nsIMAPBodypart *parentPart, bool preferPlainText)
+{
+  if (!partNum)
+    return nullptr;
+
+  char tag = aReader.ReadTag();
+  if (tag == 'L' || tag == 'M')
+  {
+    char *bodyType = aReader.ReadString();
+    char *bodySubType = aReader.ReadString();
+    char *bodyID = aReader.ReadString();
+    char *bodyDescription = aReader.ReadString();
+    char *bodyEncoding = aReader.ReadString();
+    int32_t partLength = aReader.ReadNumber();
+    if (aReader.Failed())
+    {
+      PR_Free(partNum);
+      PR_FREEIF(bodyType);
+      PR_FREEIF(bodySubType);
+      PR_FREEIF(bodyID);
+      PR_FREEIF(bodyDescription);
+      PR_FREEIF(bodyEncoding);
+      return nullptr;
+    }
+    if (tag == 'L')
+      return new nsIMAPBodypartLeaf(partNum, parentPart, bodyType, bodySubType,
+                                    bodyID, bodyDescription, bodyEncoding,
+                                    partLength, preferPlainText);
+
+    nsIMAPBodypartMessage *message =
+      new nsIMAPBodypartMessage(partNum, parentPart, false, bodyType,
+                                bodySubType, bodyID, bodyDescription,
+                                bodyEncoding, partLength, preferPlainText);
+    nsIMAPBodypart *body =
+      DeserializeStructurePart(aReader, PR_smprintf("%s.1", partNum), message,
+                               preferPlainText);
+    if (!body)
+    {
+      delete message;
+      return nullptr;
+    }
+    message->SetBody(body);
+    return message;
+  }
+
+  if (tag != 'P')
+  {
+    PR_Free(partNum);
+    return nullptr;
+  }
+
+  nsIMAPBodypartMultipart *multipart =
+    new nsIMAPBodypartMultipart(partNum, parentPart);
+  multipart->SetBodySubType(aReader.ReadString());
+  char *boundaryData = aReader.ReadString();
+  int32_t childCount = aReader.ReadNumber();
+  if (boundaryData)
+    multipart->SetBoundaryData(boundaryData);
+  bool isValid = multipart->GetIsValid() && boundaryData && !aReader.Failed();
+  for (int32_t i = 1; isValid && i <= childCount; i++)
+  {
+    // note: the multipart constructor does some magic on partNumber
+    char *childPartNum;
+    if (PL_strcmp(multipart->GetPartNumberString(), "0")) // not top-level
+      childPartNum = PR_smprintf("%s.%d", multipart->GetPartNumberString(), i);
+    else // top-level
+      childPartNum = PR_smprintf("%d", i);
+    nsIMAPBodypart *child = DeserializeStructurePart(aReader, childPartNum,
+                                                     multipart,
+                                                     preferPlainText);
+    if (child)
+      multipart->AppendPart(child);
+    else
+      isValid = false;
+  }
+  if (isValid)
+    return multipart;
+  delete multipart;
+  return nullptr;
+}
+
+/* static */ already_AddRefed<nsIMAPBodyShell>
+nsIMAPBodyShell::CreateFromStructure(nsImapProtocol *protocolConnection,
+                                     const nsACString &aStructure,
+                                     uint32_t UID, uint32_t UIDValidity,
+                                     const char *folderName)
+{
+  bool preferPlainText = protocolConnection->GetPreferPlainText();
+  nsIMAPBodypartMessage *message =
+    new nsIMAPBodypartMessage(NULL, NULL, true, strdup("message"),
+                              strdup("rfc822"), NULL, NULL, NULL, 0,
+                              preferPlainText);
+  nsIMAPBodyStructureReader reader(aStructure);
+  nsIMAPBodypart *body = DeserializeStructurePart(reader, PL_strdup("1"),
+                                                  message, preferPlainText);
+  if (!body || !reader.AtEnd())
+  {
+    delete body;
+    delete message;
+    return nullptr;
+  }
+  message->SetBody(body);
+
+  RefPtr<nsIMAPBodyShell> shell =
+    new nsIMAPBodyShell(protocolConnection, message, UID, UIDValidity,
+                        folderName);
+  if (!shell->GetIsValid())
+    return nullptr;
+  return shell.forget();
+}
+
+bool nsIMAPBodyShell::SerializeStructure(nsACString &aStream)
+{
+  return GetIsValid() && m_message->SerializeStructure(aStream);
+}
+
 bool nsIMAPBodyShell::GetShowAttachmentsInline()
 {
   if (!m_gotAttachmentPref)
@@ -560,6 +791,23 @@ nsIMAPBodypartType nsIMAPBodypartLeaf::GetType()
   return IMAP_BODY_LEAF;
 }
 
+void nsIMAPBodypartLeaf::SerializeFields(char aTag, nsACString &aStream)
+{
+  aStream.Append(aTag);
+  AppendStructureString(aStream, m_bodyType);
+  AppendStructureString(aStream, m_bodySubType);
+  AppendStructureString(aStream, m_bodyID);
+  AppendStructureString(aStream, m_bodyDescription);
+  AppendStructureString(aStream, m_bodyEncoding);
+  AppendStructureNumber(aStream, m_partLength);
+}
+
+bool nsIMAPBodypartLeaf::SerializeStructure(nsACString &aStream)
+{
+  SerializeFields('L', aStream);
+  return true;
+}
+
 int32_t nsIMAPBodypartLeaf::Generate(nsIMAPBodyShell *aShell, bool stream, bool prefetch)
 {
   int32_t len = 0;
@@ -802,6 +1050,16 @@ nsIMAPBodypartType nsIMAPBodypartMessage::GetType()
   return IMAP_BODY_MESSAGE_RFC822;
 }
 
+bool nsIMAPBodypartMessage::SerializeStructure(nsACString &aStream)
+{
+  if (!m_body)
+    return false;
+  // The top-level message is implied.
+  if (!m_topLevelMessage)
+    SerializeFields('M', aStream);
+  return m_body->SerializeStructure(aStream);
+}
+
 nsIMAPBodypartMessage::~nsIMAPBodypartMessage()
 {
   delete m_headers;
@@ -957,6 +1215,20 @@ nsIMAPBodypartMultipart::SetBodySubType(char *bodySubType)
     m_contentType = PR_smprintf("%s/%s", m_bodyType, m_bodySubType);
 }
 
+bool nsIMAPBodypartMultipart::SerializeStructure(nsACString &aStream)
+{
+  aStream.Append('P');
+  AppendStructureString(aStream, m_bodySubType);
+  AppendStructureString(aStream, m_boundaryData);
+  AppendStructureNumber(aStream, m_partList->Length());
+  for (uint32_t i = 0; i < m_partList->Length(); i++)
+  {
+    if (!m_partList->ElementAt(i)->SerializeStructure(aStream))
+      return false;
+  }
+  return true;
+}
+
 int32_t nsIMAPBodypartMultipart::Generate(nsIMAPBodyShell *aShell, bool stream, bool prefetch)
 {
   int32_t len = 0;
@@ -1158,15 +1430,22 @@ imap_shell_cache_strcmp (const void *a, const void *b)
 }
 #endif
 
-nsIMAPBodyShellCache::nsIMAPBodyShellCache()
-: m_shellHash(20)
+nsIMAPBodyShellCache::nsIMAPBodyShellCache(nsIFile *aStructureFile)
+: m_shellHash(20),
+  m_structureBytes(0),
+  m_structuresLoaded(!aStructureFile),
+  m_journalBytes(0),
+  m_hits(0),
+  m_misses(0)
 {
   m_shellList = new nsTArray<nsIMAPBodyShell*>();
+  if (aStructureFile)
+    m_structureFile = new nsIMAPBodyStructureFile(aStructureFile);
 }
 
-/* static */ nsIMAPBodyShellCache *nsIMAPBodyShellCache::Create()
+/* static */ nsIMAPBodyShellCache *nsIMAPBodyShellCache::Create(nsIFile *aStructureFile)
 {
-  nsIMAPBodyShellCache *cache = new nsIMAPBodyShellCache();
+  nsIMAPBodyShellCache *cache = new nsIMAPBodyShellCache(aStructureFile);
   if (!cache || !cache->m_shellList)
     return NULL;
 
@@ -1177,6 +1456,8 @@ nsIMAPBodyShellCache::~nsIMAPBodyShellCache()
 {
   while (EjectEntry()) ;
   delete m_shellList;
+  // Deleting the entries takes them off m_structureList.
+  m_structureHash.Clear();
 }
 
 // We'll use an LRU scheme here.
@@ -1190,7 +1471,7 @@ bool nsIMAPBodyShellCache::EjectEntry()
   nsIMAPBodyShell *removedShell = m_shellList->ElementAt(0);
 
   m_shellList->RemoveElementAt(0);
-  m_shellHash.Remove(removedShell->GetUID());
+  m_shellHash.Remove(removedShell->GetUID_validity());
 
   return true;
 }
@@ -1205,11 +1486,26 @@ bool nsIMAPBodyShellCache::AddShellToCache(nsIMAPBodyShell *shell)
   // If it's already in the cache, then just return.
   // This has the side-effect of re-ordering the LRU list
   // to put this at the top, which is good, because it's what we want.
-  if (FindShellForUID(shell->GetUID_validity(), shell->GetFolderName(), shell->GetContentModified()))
+  if (FindLiveShell(shell->GetUID_validity(), shell->GetFolderName(), shell->GetContentModified()))
     return true;
 
-  // OK, so it's not in the cache currently.
+  // Until the structure file is read, structures are only kept live, so
+  // that reading it can't replace newer ones.
+  nsAutoCString structure;
+  if (m_structuresLoaded && shell->SerializeStructure(structure))
+  {
+    StructureEntry *entry =
+      PutStructure(strtoul(shell->GetUID().get(), nullptr, 10),
+                   shell->GetUIDValidity(),
+                   nsDependentCString(shell->GetFolderName()), structure);
+    JournalStructure(entry);
+  }
+
+  return AddLiveShell(shell);
+}
 
+bool nsIMAPBodyShellCache::AddLiveShell(nsIMAPBodyShell *shell)
+{
   // First, for safety sake, remove any entry with the given UID,
   // just in case we have a collision between two messages in different
   // folders with the same UID.
@@ -1236,8 +1532,65 @@ bool nsIMAPBodyShellCache::AddShellToCache(nsIMAPBodyShell *shell)
 
 }
 
-nsIMAPBodyShell *nsIMAPBodyShellCache::FindShellForUID(nsCString &UID, const char *mailboxName,
-                                                       IMAP_ContentModifiedType modType)
+nsIMAPBodyShell *nsIMAPBodyShellCache::FindShellForUID(const nsACString &UID,
+                                                       uint32_t UIDValidity,
+                                                       const char *mailboxName,
+                                                       IMAP_ContentModifiedType modType,
+                                                       nsImapProtocol *connection)
+{
+  nsCString uidValidity(UID);
+  uidValidity.AppendInt(UIDValidity);
+  nsIMAPBodyShell *foundShell = FindLiveShell(uidValidity, mailboxName, modType);
+  const nsCString &flatUID = PromiseFlatCString(UID);
+  char *uidEnd;
+  uint32_t uid = strtoul(flatUID.get(), &uidEnd, 10);
+  if (!foundShell && connection && m_structuresLoaded &&
+      !flatUID.IsEmpty() && !*uidEnd)
+  {
+    // Rebuild the shell if we still know its structure.
+    nsAutoCString key;
+    GetStructureKey(uid, UIDValidity, mailboxName, key);
+    StructureEntry *entry = m_structureHash.Get(key);
+    if (entry && (entry->mUID != uid || entry->mUIDValidity != UIDValidity ||
+                  !entry->mMailbox.Equals(mailboxName ? mailboxName : "")))
+    {
+      NS_WARNING("Body structure stored under the wrong key");
+      entry = nullptr;
+    }
+    if (entry)
+    {
+      RefPtr<nsIMAPBodyShell> shell =
+        nsIMAPBodyShell::CreateFromStructure(connection, entry->mStructure,
+                                             entry->mUID, entry->mUIDValidity,
+                                             entry->mMailbox.get());
+      if (!shell)
+      {
+        m_structureBytes -= entry->Size();
+        m_structureHash.Remove(key);
+      }
+      else if (shell->GetContentModified() == modType)
+      {
+        entry->remove();
+        m_structureList.insertBack(entry);
+        AddLiveShell(shell);
+        foundShell = shell;
+      }
+    }
+  }
+
+  if (foundShell)
+    m_hits++;
+  else
+    m_misses++;
+  MOZ_LOG(IMAPCache, LogLevel::Debug,
+    ("FindShellForUID(): %s for %s in %s (%u hits, %u misses)",
+     foundShell ? "hit" : "miss", uidValidity.get(), mailboxName ? mailboxName : "",
+     m_hits, m_misses));
+  return foundShell;
+}
+
+nsIMAPBodyShell *nsIMAPBodyShellCache::FindLiveShell(nsCString &UID, const char *mailboxName,
+                                                     IMAP_ContentModifiedType modType)
 {
   RefPtr<nsIMAPBodyShell> foundShell;
   m_shellHash.Get(UID, getter_AddRefs(foundShell));
@@ -1263,6 +1616,235 @@ nsIMAPBodyShell *nsIMAPBodyShellCache::FindShellForUID(nsCString &UID, const cha
   return foundShell;
 }
 
+// The structure file starts with this line, followed by one record per
+// structure, oldest first:
+//   <UID> <UIDVALIDITY> <mailbox length> <structure length>\n<mailbox><structure>\n
+// A later record for the same message replaces the earlier ones.
+#define IMAP_BODY_STRUCTURE_FILE_HEADER "IMAPBS1\n"
+
+/* static */ void
+nsIMAPBodyShellCache::GetStructureKey(uint32_t aUID, uint32_t aUIDValidity,
+                                      const char *aMailboxName,
+                                      nsACString &aKey)
+{
+  // "<UID>/<UIDVALIDITY> <mailbox>".  Both numbers are all digits, so the
+  // separators keep keys of different messages apart.
+  aKey.Truncate();
+  aKey.AppendInt(aUID);
+  aKey.Append('/');
+  aKey.AppendInt(aUIDValidity);
+  aKey.Append(' ');
+  if (aMailboxName)
+    aKey.Append(aMailboxName);
+}
+
+nsIMAPBodyShellCache::StructureEntry *
+nsIMAPBodyShellCache::PutStructure(uint32_t aUID, uint32_t aUIDValidity,
+                                   const nsACString &aMailbox,
+                                   const nsACString &aStructure)
+{
+  nsAutoCString key;
+  GetStructureKey(aUID, aUIDValidity, PromiseFlatCString(aMailbox).get(), key);
+
+  StructureEntry *entry = m_structureHash.Get(key);
+  if (entry)
+  {
+    m_structureBytes -= entry->Size();
+    entry->remove();
+  }
+  else
+  {
+    entry = new StructureEntry();
+    entry->mKey = key;
+    m_structureHash.Put(key, entry);
+  }
+  entry->mMailbox = aMailbox;
+  entry->mUID = aUID;
+  entry->mUIDValidity = aUIDValidity;
+  entry->mStructure = aStructure;
+  m_structureBytes += entry->Size();
+  m_structureList.insertBack(entry);
+
+  // Evict the least recently used structures until we're within budget.
+  while (m_structureBytes > kMaxStructureBytes &&
+         m_structureList.getFirst() != entry)
+  {
+    StructureEntry *oldest = m_structureList.getFirst();
+    nsAutoCString oldestKey(oldest->mKey);
+    m_structureBytes -= oldest->Size();
+    m_structureHash.Remove(oldestKey);
+  }
+  return entry;
+}
+
+void nsIMAPBodyShellCache::AppendRecord(StructureEntry *aEntry, nsACString &aBuffer)
+{
+  aBuffer.AppendPrintf("%u %u %u %u\n", aEntry->mUID, aEntry->mUIDValidity,
+                       aEntry->mMailbox.Length(), aEntry->mStructure.Length());
+  aBuffer.Append(aEntry->mMailbox);
+  aBuffer.Append(aEntry->mStructure);
+  aBuffer.Append('\n');
+}
+
+nsIMAPBodyStructureFile *nsIMAPBodyShellCache::GetStructureFileToLoad()
+{
+  return m_structuresLoaded ? nullptr : m_structureFile.get();
+}
+
+void nsIMAPBodyShellCache::LoadStructures(nsIMAPBodyStructureFile *aFile,
+                                          const nsACString &aData)
+{
+  // Another thread may have read the file in the meantime.
+  if (m_structuresLoaded || aFile != m_structureFile)
+    return;
+  m_structuresLoaded = true;
+
+  bool corrupt = !StringBeginsWith(aData, NS_LITERAL_CSTRING(IMAP_BODY_STRUCTURE_FILE_HEADER));
+  const char *cursor = aData.BeginReading() + (corrupt ? aData.Length() :
+                       sizeof(IMAP_BODY_STRUCTURE_FILE_HEADER) - 1);
+  const char *end = aData.EndReading();
+  while (cursor < end)
+  {
+    uint32_t uid, uidValidity, mailboxLength, structureLength;
+    int headerLength = 0;
+    if (sscanf(cursor, "%u %u %u %u%n", &uid, &uidValidity, &mailboxLength,
+               &structureLength, &headerLength) < 4 || !headerLength ||
+        cursor[headerLength++] != '\n' ||
+        (uint64_t) headerLength + mailboxLength + structureLength + 1 >
+          (uint64_t) (end - cursor) ||
+        cursor[headerLength + mailboxLength + structureLength] != '\n')
+    {
+      corrupt = true;
+      break;
+    }
+    cursor += headerLength;
+    PutStructure(uid, uidValidity, Substring(cursor, mailboxLength),
+                 Substring(cursor + mailboxLength, structureLength));
+    cursor += mailboxLength + structureLength + 1;
+  }
+  MOZ_LOG(IMAPCache, LogLevel::Debug,
+    ("LoadStructures(): %u structures, %u bytes%s",
+     m_structureHash.Count(), m_structureBytes, corrupt ? ", corrupt" : ""));
+
+  m_journalBytes = aData.Length();
+  if (corrupt || m_journalBytes > 2 * kMaxStructureBytes)
+    CompactStructures();
+}
+
+void nsIMAPBodyShellCache::JournalStructure(StructureEntry *aEntry)
+{
+  if (!m_structureFile)
+    return;
+
+  nsAutoCString record;
+  if (!m_journalBytes)
+    record.AssignLiteral(IMAP_BODY_STRUCTURE_FILE_HEADER);
+  AppendRecord(aEntry, record);
+  m_structureFile->Queue(record, false);
+  m_journalBytes += record.Length();
+
+  // Replaced and evicted structures are still in the journal; rewrite it
+  // once they take up more space than the live ones could.
+  if (m_journalBytes > 2 * kMaxStructureBytes)
+    CompactStructures();
+}
+
+void nsIMAPBodyShellCache::CompactStructures()
+{
+  if (!m_structureFile)
+    return;
+
+  nsAutoCString data(NS_LITERAL_CSTRING(IMAP_BODY_STRUCTURE_FILE_HEADER));
+  for (StructureEntry *entry = m_structureList.getFirst(); entry;
+       entry = entry->getNext())
+    AppendRecord(entry, data);
+  m_structureFile->Queue(data, true);
+  m_journalBytes = data.Length();
+}
+
+///////////// nsIMAPBodyStructureFile ////////////////////////////////////
+
+nsIMAPBodyStructureFile::nsIMAPBodyStructureFile(nsIFile *aFile)
+: mFile(aFile),
+  mQueueLock("nsIMAPBodyStructureFile.mQueueLock"),
+  mFileLock("nsIMAPBodyStructureFile.mFileLock")
+{
+}
+
+void nsIMAPBodyStructureFile::Read(nsACString &aData)
+{
+  mozilla::MutexAutoLock lock(mFileLock);
+  aData.Truncate();
+  PRFileDesc *fd;
+  nsresult rv = mFile->OpenNSPRFileDesc(PR_RDONLY, 0, &fd);
+  if (NS_FAILED(rv))
+    return;
+  char buffer[4096];
+  int32_t count;
+  while ((count = PR_Read(fd, buffer, sizeof(buffer))) > 0)
+    aData.Append(buffer, count);
+  PR_Close(fd);
+}
+
+void nsIMAPBodyStructureFile::Queue(const nsACString &aData, bool aReplace)
+{
+  mozilla::MutexAutoLock lock(mQueueLock);
+  // A new file content makes the writes queued before it moot.
+  if (aReplace)
+    mQueue.Clear();
+  PendingWrite *write = mQueue.AppendElement();
+  write->mData = aData;
+  write->mReplace = aReplace;
+}
+
+void nsIMAPBodyStructureFile::Flush()
+{
+  // Holding mFileLock while taking the queue keeps the writes of two
+  // threads flushing at once in order.
+  mozilla::MutexAutoLock fileLock(mFileLock);
+  nsTArray<PendingWrite> writes;
+  {
+    mozilla::MutexAutoLock lock(mQueueLock);
+    writes.SwapElements(mQueue);
+  }
+  for (uint32_t i = 0; i < writes.Length(); i++)
+  {
+    if (writes[i].mReplace)
+      Replace(writes[i].mData);
+    else
+      Append(writes[i].mData);
+  }
+}
+
+void nsIMAPBodyStructureFile::Append(const nsACString &aData)
+{
+  PRFileDesc *fd;
+  nsresult rv = mFile->OpenNSPRFileDesc(PR_WRONLY | PR_CREATE_FILE | PR_APPEND,
+                                        0600, &fd);
+  if (NS_FAILED(rv))
+    return;
+  PR_Write(fd, aData.BeginReading(), aData.Length());
+  PR_Close(fd);
+}
+
+void nsIMAPBodyStructureFile::Replace(const nsACString &aData)
+{
+  // Write a new file and move it over the old one, so that the structures
+  // aren't lost if writing fails half way.
+  nsCOMPtr<nsIOutputStream> stream;
+  nsresult rv = MsgNewSafeBufferedFileOutputStream(getter_AddRefs(stream),
+                                                   mFile, -1, 0600);
+  if (NS_FAILED(rv))
+    return;
+  uint32_t bytesWritten;
+  rv = stream->Write(aData.BeginReading(), aData.Length(), &bytesWritten);
+  nsCOMPtr<nsISafeOutputStream> safeStream = do_QueryInterface(stream);
+  if (NS_SUCCEEDED(rv) && bytesWritten == aData.Length() && safeStream)
+    safeStream->Finish();
+  else
+    stream->Close();
+}
+
 ///////////// nsIMAPMessagePartID ////////////////////////////////////
 
 nsIMAPMessagePartID::nsIMAPMessagePartID(nsIMAPeFetchFields fields, const char *partNumberString)
@@ -11,10 +11,15 @@ nsIMAPBodyShell and associated classes
 #define IMAPBODY_H
 
 #include "mozilla/Attributes.h"
+#include "mozilla/LinkedList.h"
+#include "mozilla/Mutex.h"
 #include "nsImapCore.h"
 #include "nsString.h"
+#include "nsClassHashtable.h"
 #include "nsRefPtrHashtable.h"
 #include "nsTArray.h"
+#include "nsCOMPtr.h"
+#include "nsIFile.h"
 
 class nsImapProtocol;
 
@@ -79,6 +84,9 @@ public:
   const char *GetBodyType() { return m_bodyType; }
   const char *GetBodySubType() { return m_bodySubType; }
   void SetBoundaryData(char *boundaryData) { m_boundaryData = boundaryData; }
+  // Appends the structure of this part and of its children, but none of
+  // their data, to aStream.  Returns false if the part can't be serialized.
+  virtual bool SerializeStructure(nsACString &aStream) { return false; }
 
 protected:
   virtual void QueuePrefetchMIMEHeader(nsIMAPBodyShell *aShell);
@@ -137,6 +145,7 @@ public:
   virtual bool IsLastTextPart(const char *partNumberString) override;
   void AppendPart(nsIMAPBodypart *part) { m_partList->AppendElement(part); }
   void SetBodySubType(char *bodySubType);
+  virtual bool SerializeStructure(nsACString &aStream) override;
 
 protected:
     nsTArray<nsIMAPBodypart*>  *m_partList;  // An ordered list of top-level body parts for this shell
@@ -158,6 +167,10 @@ public:
   // returns true if this part should be fetched inline for generation.
   virtual bool ShouldFetchInline(nsIMAPBodyShell *aShell) override;
   virtual bool PreflightCheckAllInline(nsIMAPBodyShell *aShell) override;
+  virtual bool SerializeStructure(nsACString &aStream) override;
+protected:
+  // Appends the BODYSTRUCTURE fields of this part, preceded by aTag.
+  void SerializeFields(char aTag, nsACString &aStream);
 private:
   bool mPreferPlainText;
 };
@@ -185,6 +198,7 @@ public:
                                              // headers correspond.  NULL indicates the top-level message
   virtual nsIMAPBodypartMessage  *GetnsIMAPBodypartMessage() override { return this; }
   virtual bool GetIsTopLevelMessage() { return m_topLevelMessage; }
+  virtual bool SerializeStructure(nsACString &aStream) override;
 
 protected:
   nsIMAPMessageHeaders *m_headers;         // Every body shell should have headers
@@ -211,6 +225,16 @@ public:
   nsIMAPBodyShell(nsImapProtocol *protocolConnection,
                   nsIMAPBodypartMessage *message, uint32_t UID,
                   uint32_t UIDValidity, const char *folderName);
+  // Rebuilds a shell from the output of SerializeStructure(), as if its
+  // BODYSTRUCTURE had just been parsed on protocolConnection.  Returns null
+  // if aStructure is malformed.
+  static already_AddRefed<nsIMAPBodyShell>
+    CreateFromStructure(nsImapProtocol *protocolConnection,
+                        const nsACString &aStructure, uint32_t UID,
+                        uint32_t UIDValidity, const char *folderName);
+  // Appends a compact representation of the part hierarchy (but not of the
+  // part data) to aStream.  Returns false if the shell can't be serialized.
+  bool SerializeStructure(nsACString &aStream);
   // To be used after a shell is uncached
   void SetConnection(nsImapProtocol *con) { m_protocolConnection = con; }
   virtual bool GetIsValid() { return m_isValid; }
@@ -252,6 +276,7 @@ public:
   bool DeathSignalReceived();
   nsCString &GetUID() { return m_UID; }
   nsCString &GetUID_validity() { return m_UID_validity; }
+  uint32_t GetUIDValidity() { return m_UIDValidity; }
   const char *GetFolderName() { return m_folderName; }
   char *GetGeneratingPart() { return m_generatingPart; }
   // Returns true if this is in the process of being generated,
@@ -273,6 +298,7 @@ protected:
   nsImapProtocol            *m_protocolConnection;    // Connection, for filling in parts
   nsCString                 m_UID;                    // UID of this message
   nsCString                 m_UID_validity;           // appended UID and UID-validity of this message
+  uint32_t                  m_UIDValidity;            // UID-validity of the folder
   char                      *m_folderName;            // folder that contains this message
   char                      *m_generatingPart;        // If a specific part is being generated, this is it.  Otherwise, NULL.
   bool                      m_isBeingGenerated;       // true if this body shell is in the process of being generated
@@ -292,35 +318,124 @@ protected:
 // Since we'll only be retrieving shells for messages over a given size, and since the
 // shells themselves won't be very large, this cache will not grow very big (relatively)
 // and should handle most common usage scenarios.
+//
+// Behind the live shells, the cache keeps the serialized structure of the
+// most recently used shells, bounded by kMaxStructureBytes, and journals
+// them to a file in the server directory.  A shell that was evicted, or
+// fetched in an earlier session, is rebuilt from there without asking the
+// server for its BODYSTRUCTURE again.
 
 // A body cache is associated with a given host, spanning folders, so
 // it uses both UID and UIDVALIDITY .
 
+// The file the serialized body structures are kept in between sessions.
+// The cache is used under the host list monitor, so it only queues its
+// changes here; they are written by Flush() once the monitor is released.
+class nsIMAPBodyStructureFile final
+{
+public:
+  NS_INLINE_DECL_THREADSAFE_REFCOUNTING(nsIMAPBodyStructureFile)
+
+  explicit nsIMAPBodyStructureFile(nsIFile *aFile);
+  // Reads the whole file.
+  void Read(nsACString &aData);
+  // Queues records to append to the file, or with aReplace, the new
+  // content of the whole file.
+  void Queue(const nsACString &aData, bool aReplace);
+  // Writes the queued changes, in the order they were queued.
+  void Flush();
+
+private:
+  ~nsIMAPBodyStructureFile() {}
+  void Append(const nsACString &aData);
+  void Replace(const nsACString &aData);
+
+  struct PendingWrite
+  {
+    nsCString mData;
+    bool mReplace;
+  };
+  nsCOMPtr<nsIFile> mFile;
+  mozilla::Mutex mQueueLock; // protects mQueue
+  nsTArray<PendingWrite> mQueue;
+  mozilla::Mutex mFileLock; // held while the file is read or written
+};
+
 class nsIMAPBodyShellCache
 {
 public:
-  static nsIMAPBodyShellCache *Create();
+  // aStructureFile is where the serialized structures are kept between
+  // sessions.  It may be null, in which case they are only kept in memory.
+  static nsIMAPBodyShellCache *Create(nsIFile *aStructureFile);
   virtual ~nsIMAPBodyShellCache();
 
   // Adds shell to cache, possibly ejecting
   // another entry based on scheme in EjectEntry().
   bool AddShellToCache(nsIMAPBodyShell *shell);
-  // Looks up a shell in the cache given the message's UID.
-  nsIMAPBodyShell *FindShellForUID(nsCString &UID, const char *mailboxName,
-                                   IMAP_ContentModifiedType modType);
+  // Looks up a shell in the cache given the message's UID.  If only its
+  // structure is known, the shell is rebuilt for use on connection.
+  nsIMAPBodyShell *FindShellForUID(const nsACString &UID, uint32_t UIDValidity,
+                                   const char *mailboxName,
+                                   IMAP_ContentModifiedType modType,
+                                   nsImapProtocol *connection);
+  // Drops the live shells.  The serialized structures don't depend on the
+  // display prefs, so they are kept.
   void Clear();
 
+  // The structure file, if it still has to be read.  Its content is then
+  // passed to LoadStructures().
+  nsIMAPBodyStructureFile *GetStructureFileToLoad();
+  void LoadStructures(nsIMAPBodyStructureFile *aFile, const nsACString &aData);
+  // The structure file, for flushing the changes queued on it.
+  nsIMAPBodyStructureFile *GetStructureFile() { return m_structureFile; }
+
+  // Lookups answered from the cache, and lookups that weren't.
+  uint32_t GetHitCount() { return m_hits; }
+  uint32_t GetMissCount() { return m_misses; }
+
 protected:
-  nsIMAPBodyShellCache();
+  nsIMAPBodyShellCache(nsIFile *aStructureFile);
   // Chooses an entry to eject;  deletes that entry;  and ejects it from the
   // cache, clearing up a new space.  Returns true if it found an entry
   // to eject, false otherwise.
   bool EjectEntry();
   uint32_t GetSize() { return m_shellList->Length(); }
   uint32_t GetMaxSize() { return 20; }
+  nsIMAPBodyShell *FindLiveShell(nsCString &UID, const char *mailboxName,
+                                 IMAP_ContentModifiedType modType);
+  bool AddLiveShell(nsIMAPBodyShell *shell);
   nsTArray<nsIMAPBodyShell*> *m_shellList; // For maintenance
   // For quick lookup based on UID
   nsRefPtrHashtable <nsCStringHashKey, nsIMAPBodyShell> m_shellHash;
+
+  // Serialized structures, keyed by UID, UIDVALIDITY and mailbox name.
+  class StructureEntry : public mozilla::LinkedListElement<StructureEntry>
+  {
+  public:
+    nsCString mKey;
+    nsCString mMailbox;
+    uint32_t mUID;
+    uint32_t mUIDValidity;
+    nsCString mStructure;
+    uint32_t Size() { return sizeof(*this) + mKey.Length() + mMailbox.Length() + mStructure.Length(); }
+  };
+  static const uint32_t kMaxStructureBytes = 512 * 1024;
+  static void GetStructureKey(uint32_t aUID, uint32_t aUIDValidity,
+                              const char *aMailboxName, nsACString &aKey);
+  StructureEntry *PutStructure(uint32_t aUID, uint32_t aUIDValidity,
+                               const nsACString &aMailbox,
+                               const nsACString &aStructure);
+  void AppendRecord(StructureEntry *aEntry, nsACString &aBuffer);
+  void JournalStructure(StructureEntry *aEntry);
+  void CompactStructures();
+  nsClassHashtable<nsCStringHashKey, StructureEntry> m_structureHash;
+  mozilla::LinkedList<StructureEntry> m_structureList; // least recently used first
+  uint32_t m_structureBytes;
+  RefPtr<nsIMAPBodyStructureFile> m_structureFile;
+  bool m_structuresLoaded;
+  int64_t m_journalBytes;
+  uint32_t m_hits;
+  uint32_t m_misses;
 };
 
 // MessagePartID and MessagePartIDArray are used for pipelining prefetches.
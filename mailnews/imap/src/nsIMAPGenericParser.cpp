@@ -18,6 +18,8 @@ fLineOfTokens(nullptr),
 fStartOfLineOfTokens(nullptr),
 fCurrentTokenPlaceHolder(nullptr),
 fAtEndOfLine(false),
+fTokenBuffer(nullptr),
+fTokenBufferSize(0),
 fParserState(stateOK)
 {
 }
@@ -25,7 +27,7 @@ fParserState(stateOK)
 nsIMAPGenericParser::~nsIMAPGenericParser()
 {
   PR_FREEIF( fCurrentLine );
-  PR_FREEIF( fStartOfLineOfTokens);
+  PR_FREEIF( fTokenBuffer );
 }
 
 void nsIMAPGenericParser::HandleMemoryFailure()
@@ -36,7 +38,14 @@ void nsIMAPGenericParser::HandleMemoryFailure()
 void nsIMAPGenericParser::ResetLexAnalyzer()
 {
   PR_FREEIF( fCurrentLine );
-  PR_FREEIF( fStartOfLineOfTokens );
+
+  // The token buffer is reused for every line of every response; only give
+  // it back if some huge line made it grow.
+  if (fTokenBufferSize > kMaxKeptTokenBufferSize)
+  {
+    PR_FREEIF( fTokenBuffer );
+    fTokenBufferSize = 0;
+  }
 
   fNextToken = fCurrentLine = fLineOfTokens = fStartOfLineOfTokens = fCurrentTokenPlaceHolder = nullptr;
   fAtEndOfLine = false;
@@ -101,8 +110,7 @@ void nsIMAPGenericParser::skip_to_close_paren()
       else if (*loc == '{' || *loc == '"') {
         // quoted or literal
         fNextToken = loc;
-        char *a = CreateString();
-        PR_FREEIF(a);
+        SkipString();
         break; // move to next token
       }
     }
@@ -120,12 +128,20 @@ void nsIMAPGenericParser::AdvanceToNextToken()
     if (!fStartOfLineOfTokens)
     {
       // this is the first token of the line; setup tokenizer now
-      fStartOfLineOfTokens = PL_strdup(fCurrentLine);
-      if (!fStartOfLineOfTokens)
+      uint32_t lineLength = strlen(fCurrentLine) + 1;
+      if (lineLength > fTokenBufferSize)
       {
-        HandleMemoryFailure();
-        return;
+        char *newBuffer = (char *) PR_Realloc(fTokenBuffer, lineLength);
+        if (!newBuffer)
+        {
+          HandleMemoryFailure();
+          return;
+        }
+        fTokenBuffer = newBuffer;
+        fTokenBufferSize = lineLength;
       }
+      memcpy(fTokenBuffer, fCurrentLine, lineLength);
+      fStartOfLineOfTokens = fTokenBuffer;
       fLineOfTokens = fStartOfLineOfTokens;
       fCurrentTokenPlaceHolder = fStartOfLineOfTokens;
     }
@@ -141,13 +157,12 @@ void nsIMAPGenericParser::AdvanceToNextToken()
 void nsIMAPGenericParser::AdvanceToNextLine()
 {
   PR_FREEIF( fCurrentLine );
-  PR_FREEIF( fStartOfLineOfTokens);
+  fStartOfLineOfTokens = nullptr;
 
   bool ok = GetNextLineForParser(&fCurrentLine);
   if (!ok)
   {
     SetConnected(false);
-    fStartOfLineOfTokens = nullptr;
     fLineOfTokens = nullptr;
     fCurrentTokenPlaceHolder = nullptr;
     fAtEndOfLine = true;
@@ -226,32 +241,38 @@ char *nsIMAPGenericParser::CreateAstring()
 // "Characters are 7-bit US-ASCII unless otherwise specified." [RFC3501, 1.2.]
 char *nsIMAPGenericParser::CreateAtom(bool isAstring)
 {
-  char *rv = PL_strdup(fNextToken);
+  nsDependentCSubstring atom;
+  if (!ParseAtom(atom, isAstring))
+    return nullptr;
+  char *rv = PL_strndup(atom.BeginReading(), atom.Length());
   if (!rv)
-  {
     HandleMemoryFailure();
-    return nullptr;
-  }
+  return rv;
+}
+
+// Like CreateAtom(), but returns the atom without copying it. |aAtom| points
+// into the current line, so it is only valid until the next line is read.
+bool nsIMAPGenericParser::ParseAtom(nsDependentCSubstring &aAtom, bool isAstring)
+{
   // We wish to stop at the following characters (in decimal ascii)
   // 1-31 (CTL), 32 (SP), 34 '"', 37 '%', 40-42 "()*", 92 '\\', 123 '{'
   // also, ']' is only allowed in astrings
-  char *last = rv;
+  const char *last = fNextToken;
   char c = *last;
   while ((c > 42 || c == 33 || c == 35 || c == 36 || c == 38 || c == 39)
          && c != '\\' && c != '{' && (isAstring || c != ']'))
      c = *++last;
-  if (rv == last) {
+  if (fNextToken == last) {
      SetSyntaxError(true, "no atom characters found");
-     PL_strfree(rv);
-     return nullptr;
+     return false;
   }
+  aAtom.Rebind(fNextToken, last - fNextToken);
   if (*last)
   {
     // not the whole token was consumed
-    *last = '\0';
-    AdvanceTokenizerStartingPoint((fNextToken - fLineOfTokens) + (last-rv));
+    AdvanceTokenizerStartingPoint(last - fLineOfTokens);
   }
-  return rv;
+  return true;
 }
 
 // CreateNilString return either NULL (for "NIL") or a string
@@ -295,6 +316,17 @@ char *nsIMAPGenericParser::CreateString()
   return NULL;
 }
 
+// Skips a string like CreateString() does, without copying it.
+void nsIMAPGenericParser::SkipString()
+{
+  if (*fNextToken == '{')
+    ReadLiteral(nullptr, atoi(fNextToken + 1));
+  else if (*fNextToken == '"')
+    ReadQuoted(nullptr);
+  else
+    SetSyntaxError(true, "string does not start with '{' or '\"'");
+}
+
 // This function sets fCurrentTokenPlaceHolder immediately after the end of the
 // closing quote.  Call AdvanceToNextToken() to get the token after it.
 // QUOTED_CHAR     ::= <any TEXT_CHAR except quoted_specials> /
@@ -305,32 +337,47 @@ char *nsIMAPGenericParser::CreateString()
 // inside a quoted string.  It is sufficient to read from the current line only.
 char *nsIMAPGenericParser::CreateQuoted(bool /*skipToEnd*/)
 {
-  // one char past opening '"'
-  char *currentChar = fCurrentLine + (fNextToken - fStartOfLineOfTokens) + 1;
+  nsCString returnString;
+  if (!ReadQuoted(&returnString))
+    return nullptr;
+  return ToNewCString(returnString);
+}
 
-  int escapeCharsCut = 0;
-  nsCString returnString(currentChar);
-  int charIndex;
-  for (charIndex = 0; returnString.CharAt(charIndex) != '"'; charIndex++)
+// Reads the quoted string at fNextToken into |aResult|, or just skips it if
+// |aResult| is null.  Returns false on a syntax error.
+bool nsIMAPGenericParser::ReadQuoted(nsACString *aResult)
+{
+  // one char past opening '"'
+  const char *start = fCurrentLine + (fNextToken - fStartOfLineOfTokens) + 1;
+  const char *chunkStart = start;
+  const char *currentChar;
+  for (currentChar = start; *currentChar != '"'; currentChar++)
   {
-    if (!returnString.CharAt(charIndex))
+    if (!*currentChar)
     {
       SetSyntaxError(true, "no closing '\"' found in quoted");
-      return nullptr;
+      return false;
     }
-    if (returnString.CharAt(charIndex) == '\\')
+    if (*currentChar == '\\')
     {
       // eat the escape character, but keep the escaped character
-      returnString.Cut(charIndex, 1);
-      escapeCharsCut++;
+      if (aResult)
+        aResult->Append(chunkStart, currentChar - chunkStart);
+      chunkStart = ++currentChar;
+      if (!*currentChar)
+      {
+        SetSyntaxError(true, "no closing '\"' found in quoted");
+        return false;
+      }
     }
   }
+  if (aResult)
+    aResult->Append(chunkStart, currentChar - chunkStart);
+
   // +2 because of the start and end quotes
   AdvanceTokenizerStartingPoint((fNextToken - fLineOfTokens) +
-                                charIndex + escapeCharsCut + 2);
-
-  returnString.SetLength(charIndex);
-  return ToNewCString(returnString);
+                                (currentChar - start) + 2);
+  return true;
 }
 
 
@@ -355,6 +402,16 @@ char *nsIMAPGenericParser::CreateLiteral()
     return nullptr;
   }
 
+  int32_t charsReadSoFar = ReadLiteral(returnString, numberOfCharsInMessage);
+  returnString[charsReadSoFar] = 0;
+  return returnString;
+}
+
+// Reads the |numberOfCharsInMessage| bytes of the literal whose "{n}" header is
+// fNextToken into |aBuffer|, or just skips them if |aBuffer| is null.
+// Returns the number of bytes read.
+int32_t nsIMAPGenericParser::ReadLiteral(char *aBuffer, int32_t numberOfCharsInMessage)
+{
   int32_t currentLineLength = 0;
   int32_t charsReadSoFar = 0;
   int32_t bytesToCopy = 0;
@@ -368,7 +425,8 @@ char *nsIMAPGenericParser::CreateLiteral()
     bytesToCopy = (currentLineLength > numberOfCharsInMessage - charsReadSoFar ?
                    numberOfCharsInMessage - charsReadSoFar : currentLineLength);
     NS_ASSERTION(bytesToCopy, "zero-length line?");
-    memcpy(returnString + charsReadSoFar, fCurrentLine, bytesToCopy);
+    if (aBuffer)
+      memcpy(aBuffer + charsReadSoFar, fCurrentLine, bytesToCopy);
     charsReadSoFar += bytesToCopy;
   }
 
@@ -389,8 +447,7 @@ char *nsIMAPGenericParser::CreateLiteral()
       AdvanceTokenizerStartingPoint(bytesToCopy);
   }
 
-  returnString[charsReadSoFar] = 0;
-  return returnString;
+  return charsReadSoFar;
 }
 
 
@@ -442,10 +499,8 @@ char *nsIMAPGenericParser::CreateParenGroup()
       AdvanceToNextToken();
       if (!ContinueParse())
         break;
-      char *q = CreateQuoted();
-      if (!q)
+      if (!ReadQuoted(nullptr))
         break;
-      PR_Free(q);
       if (!ContinueParse())
         break;
     }
@@ -10,6 +10,8 @@ nsIMAPGenericParser is the base parser class used by the server parser and body
 #ifndef nsIMAPGenericParser_H
 #define nsIMAPGenericParser_H
 
+#include "nsString.h"
+
 #define WHITESPACE " \015\012"     // token delimiter
 
 
@@ -48,6 +50,9 @@ protected:
   char *CreateAtom(bool isAstring = false);
   char *CreateQuoted(bool skipToEnd = true);
   char *CreateParenGroup();
+  // Non-copying variants of the above, for tokens that are used right away.
+  bool ParseAtom(nsDependentCSubstring &aAtom, bool isAstring = false);
+  void SkipString();
   virtual void SetSyntaxError(bool error, const char *msg);
 
   void AdvanceToNextToken();
@@ -65,6 +70,15 @@ protected:
   bool            fAtEndOfLine;
 
 private:
+  bool ReadQuoted(nsACString *aResult);
+  int32_t ReadLiteral(char *aBuffer, int32_t numberOfCharsInMessage);
+
+  // fStartOfLineOfTokens is a copy of fCurrentLine in this buffer, which is
+  // kept from line to line to save an allocation per line.
+  static const uint32_t kMaxKeptTokenBufferSize = 64U*1024U;
+  char           *fTokenBuffer;
+  uint32_t        fTokenBufferSize;
+
   enum nsIMAPGenericParserState { stateOK = 0,
                                   stateSyntaxErrorFlag = 0x1,
                                   stateDisconnectedFlag = 0x2 };
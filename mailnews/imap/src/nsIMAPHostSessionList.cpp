@@ -36,7 +36,17 @@ nsIMAPHostInfo::nsIMAPHostInfo(const char *serverKey,
   server->GetUsingSubscription(&fUsingSubscription);
   fOnlineTrashFolderExists = false;
   fShouldAlwaysListInbox = true;
-  fShellCache = nsIMAPBodyShellCache::Create();
+  // Don't use GetLocalPath(), which would create the server directory of a
+  // new account before its host name is known.  Such an account only caches
+  // body structures in memory until the next restart.
+  nsCOMPtr<nsIFile> structureFile;
+  nsCOMPtr<nsIMsgIncomingServer> msgServer(do_QueryInterface(server));
+  if (msgServer)
+    msgServer->GetFileValue("directory-rel", "directory",
+                            getter_AddRefs(structureFile));
+  if (structureFile)
+    structureFile->AppendNative(NS_LITERAL_CSTRING("bodystructure.dat"));
+  fShellCache = nsIMAPBodyShellCache::Create(structureFile);
   fPasswordVerifiedOnline = false;
   fDeleteIsMoveToTrash = true;
   fShowDeletedMessages = false;
@@ -646,9 +656,37 @@ NS_IMETHODIMP nsIMAPHostSessionList::SetNamespaceHierarchyDelimiterFromMailboxFo
   return (host) ? NS_OK : NS_ERROR_ILLEGAL_VALUE ;
 }
 
+// Reads the host's body structure file if that hasn't happened yet.  The
+// file is read without holding the monitor.
+void nsIMAPHostSessionList::LoadShellCacheForHost(const char *serverKey)
+{
+  RefPtr<nsIMAPBodyStructureFile> structureFile;
+  PR_EnterMonitor(gCachedHostInfoMonitor);
+  nsIMAPHostInfo *host = FindHost(serverKey);
+  if (host && host->fShellCache)
+    structureFile = host->fShellCache->GetStructureFileToLoad();
+  PR_ExitMonitor(gCachedHostInfoMonitor);
+  if (!structureFile)
+    return;
+
+  nsAutoCString data;
+  structureFile->Read(data);
+
+  PR_EnterMonitor(gCachedHostInfoMonitor);
+  host = FindHost(serverKey);
+  if (host && host->fShellCache)
+    host->fShellCache->LoadStructures(structureFile, data);
+  PR_ExitMonitor(gCachedHostInfoMonitor);
+  // Loading compacts a corrupt or oversized file.
+  structureFile->Flush();
+}
+
 NS_IMETHODIMP nsIMAPHostSessionList::AddShellToCacheForHost(const char *serverKey, nsIMAPBodyShell *shell)
 {
+  LoadShellCacheForHost(serverKey);
+
   nsresult rv = NS_OK;
+  RefPtr<nsIMAPBodyStructureFile> structureFile;
   PR_EnterMonitor(gCachedHostInfoMonitor);
   nsIMAPHostInfo *host = FindHost(serverKey);
   if (host)
@@ -657,26 +695,35 @@ NS_IMETHODIMP nsIMAPHostSessionList::AddShellToCacheForHost(const char *serverKe
     {
       if (!host->fShellCache->AddShellToCache(shell))
         rv = NS_ERROR_UNEXPECTED;
+      structureFile = host->fShellCache->GetStructureFile();
     }
   }
   else
     rv = NS_ERROR_ILLEGAL_VALUE;
 
   PR_ExitMonitor(gCachedHostInfoMonitor);
+  // Write the new structure now that other connections can use the host
+  // list again.
+  if (structureFile)
+    structureFile->Flush();
   return rv;
 }
 
 NS_IMETHODIMP nsIMAPHostSessionList::FindShellInCacheForHost(const char *serverKey, const char *mailboxName, const char *UID,
-                                                             IMAP_ContentModifiedType modType, nsIMAPBodyShell **shell)
+                                                             uint32_t UIDValidity, IMAP_ContentModifiedType modType,
+                                                             nsImapProtocol *connection, nsIMAPBodyShell **shell)
 {
-  nsCString uidString(UID);
+  if (connection)
+    LoadShellCacheForHost(serverKey);
 
   PR_EnterMonitor(gCachedHostInfoMonitor);
   nsIMAPHostInfo *host = FindHost(serverKey);
   if (host && host->fShellCache)
-    NS_IF_ADDREF(*shell = host->fShellCache->FindShellForUID(uidString,
+    NS_IF_ADDREF(*shell = host->fShellCache->FindShellForUID(nsDependentCString(UID),
+                                                             UIDValidity,
                                                              mailboxName,
-                                                             modType));
+                                                             modType,
+                                                             connection));
   PR_ExitMonitor(gCachedHostInfoMonitor);
   return (host == NULL) ? NS_ERROR_ILLEGAL_VALUE : NS_OK;
 }
@@ -122,7 +122,7 @@ public:
 
   // Message Body Shells
   NS_IMETHOD AddShellToCacheForHost(const char *serverKey, nsIMAPBodyShell *shell) override;
-  NS_IMETHOD FindShellInCacheForHost(const char *serverKey, const char *mailboxName, const char *UID, IMAP_ContentModifiedType modType, nsIMAPBodyShell **result) override;
+  NS_IMETHOD FindShellInCacheForHost(const char *serverKey, const char *mailboxName, const char *UID, uint32_t UIDValidity, IMAP_ContentModifiedType modType, nsImapProtocol *connection, nsIMAPBodyShell **result) override;
   NS_IMETHOD ClearShellCacheForHost(const char *serverKey) override;
   PRMonitor *gCachedHostInfoMonitor;
   nsIMAPHostInfo *fHostInfoList;
@@ -132,5 +132,6 @@ protected:
                                     EIMAPNamespaceType type,
                                     const char *pref);
   nsIMAPHostInfo *FindHost(const char *serverKey);
+  void LoadShellCacheForHost(const char *serverKey);
 };
 #endif
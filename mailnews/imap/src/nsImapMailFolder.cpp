@@ -88,6 +88,7 @@
 #include "nsMsgLineBuffer.h"
 #include "mozilla/Logging.h"
 #include "mozilla/Attributes.h"
+#include "mozilla/HashFunctions.h"
 #include "nsStringStream.h"
 #include "nsIStreamListener.h"
 
@@ -182,7 +183,8 @@ nsImapMailFolder::nsImapMailFolder() :
     m_downloadingFolderForOfflineUse(false),
     m_filterListRequiresBody(false),
     m_folderQuotaUsedKB(0),
-    m_folderQuotaMaxKB(0)
+    m_folderQuotaMaxKB(0),
+    m_syncingFlags(false)
 {
   m_boxFlags = 0;
   m_uidValidity = kUidUnknown;
@@ -580,6 +582,8 @@ nsresult nsImapMailFolder::GetDatabase()
       database->AddListener(this);
     UpdateSummaryTotals(true);
     mDatabase = database;
+    // We weren't listening while the database was closed.
+    m_syncedFlags.Clear();
   }
   return rv;
 }
@@ -4585,6 +4589,8 @@ nsImapMailFolder::NormalEndMsgWriteStream(nsMsgKey uidOfMessage,
       MOZ_LOG(IMAP, mozilla::LogLevel::Debug, ("Updating stored message size from %u, new size %d",
                                   msgSize, updatedMessageSize));
       msgHeader->SetMessageSize(updatedMessageSize);
+      // SetMessageSize doesn't notify, and SyncFlags sums the synced sizes.
+      m_syncedFlags.Invalidate(uidOfMessage);
       // only commit here if this isn't an offline message
       // offline header gets committed in EndNewOfflineMessage() called below
       if (mDatabase && !m_offlineHeader)
@@ -4831,6 +4837,66 @@ nsresult nsImapMailFolder::HandleCustomFlags(nsMsgKey uidOfMessage,
           dbHdr->SetStringProperty("keywords", keywords.get()) : NS_OK;
 }
 
+// Flags no server can send, as 0x1000 is unused. Marks synced rows whose
+// header changed locally, so the next sync has to look at it again.
+#define kImapMsgSyncedFlagsUnknown 0xFFFF
+
+void nsImapSyncedFlags::Clear()
+{
+  mUids.Clear();
+  mFlags.Clear();
+  mKeywordHashes.Clear();
+  mSizes.Clear();
+  mDatabase = nullptr;
+  mFolderStateHash = 0;
+}
+
+void nsImapSyncedFlags::Invalidate(nsMsgKey aUid)
+{
+  size_t index = mUids.BinaryIndexOf(aUid);
+  if (index != mUids.NoIndex)
+    mFlags[index] = kImapMsgSyncedFlagsUnknown;
+}
+
+void nsImapSyncedFlags::AppendRow(nsMsgKey aUid, imapMessageFlagsType aFlags,
+                                  uint32_t aKeywordHash, uint32_t aSize)
+{
+  mUids.AppendElement(aUid);
+  mFlags.AppendElement(aFlags);
+  mKeywordHashes.AppendElement(aKeywordHash);
+  mSizes.AppendElement(aSize);
+}
+
+void nsImapSyncedFlags::SwapRows(nsImapSyncedFlags &aOther)
+{
+  mUids.SwapElements(aOther.mUids);
+  mFlags.SwapElements(aOther.mFlags);
+  mKeywordHashes.SwapElements(aOther.mKeywordHashes);
+  mSizes.SwapElements(aOther.mSizes);
+}
+
+// Hash of everything besides a message's own flags and keywords that
+// SyncFlags applies to its header. If it changes, all rows must be redone.
+uint32_t
+nsImapMailFolder::GetSyncedFolderStateHash(nsIImapFlagAndUidState *flagState)
+{
+  uint16_t userFlags;
+  flagState->GetSupportedUserFlags(&userFlags);
+  uint32_t folderFlags;
+  GetSupportedUserFlags(&folderFlags);
+  uint32_t hash = mozilla::HashGeneric(userFlags, folderFlags);
+
+  nsAutoCString keyword;
+  for (uint16_t i = 0; ; i++)
+  {
+    flagState->GetOtherKeywords(i, keyword);
+    if (keyword.IsEmpty())
+      break;
+    hash = mozilla::AddToHash(hash, mozilla::HashString(keyword.get()));
+  }
+  return hash;
+}
+
 // synchronize the message flags in the database with the server flags
 nsresult nsImapMailFolder::SyncFlags(nsIImapFlagAndUidState *flagState)
 {
@@ -4852,12 +4918,77 @@ nsresult nsImapMailFolder::SyncFlags(nsIImapFlagAndUidState *flagState)
   uint16_t supportedUserFlags;
   flagState->GetSupportedUserFlags(&supportedUserFlags);
 
+  // Merge the server state, which is sorted by UID, against the state we
+  // synced last time. Messages whose server flags and keywords are the same
+  // as then, and whose header hasn't changed locally since, are skipped
+  // without loading their header. We can only rely on change notifications
+  // if we're listening to the database.
+  uint32_t folderStateHash = GetSyncedFolderStateHash(flagState);
+  bool useSynced = mAddListener && m_syncedFlags.mDatabase == mDatabase &&
+                   m_syncedFlags.mFolderStateHash == folderStateHash;
+  if (!useSynced)
+    m_syncedFlags.Clear();
+  const nsImapSyncedFlags &oldRows = m_syncedFlags;
+  uint32_t numOldRows = oldRows.mUids.Length();
+  uint32_t oldIndex = 0;
+
+  nsImapSyncedFlags newRows;
+  if (!partialUIDFetch)
+  {
+    newRows.mUids.SetCapacity(messageIndex);
+    newRows.mFlags.SetCapacity(messageIndex);
+    newRows.mKeywordHashes.SetCapacity(messageIndex);
+    newRows.mSizes.SetCapacity(messageIndex);
+  }
+  nsMsgKey lastUid = 0;
+  bool sorted = true;
+  uint32_t numChanged = 0;
+
+  m_syncingFlags = true;
   for (int32_t flagIndex = 0; flagIndex < messageIndex; flagIndex++)
   {
     uint32_t uidOfMessage;
     flagState->GetUidOfMessage(flagIndex, &uidOfMessage);
     imapMessageFlagsType flags;
     flagState->GetMessageFlags(flagIndex, &flags);
+    nsCString keywords;
+    flagState->GetCustomFlags(uidOfMessage, getter_Copies(keywords));
+    uint32_t keywordHash = keywords.IsEmpty() ? 0 :
+                           mozilla::HashString(keywords.get());
+
+    bool validUid = uidOfMessage && uidOfMessage != nsMsgKey_None;
+    if (validUid)
+    {
+      if (uidOfMessage <= lastUid)
+        sorted = false;
+      lastUid = uidOfMessage;
+    }
+
+    if (sorted && validUid)
+    {
+      // A partial fetch only has the changed messages, keep the others.
+      for (; oldIndex < numOldRows && oldRows.mUids[oldIndex] < uidOfMessage;
+           oldIndex++)
+      {
+        if (partialUIDFetch)
+          newRows.AppendRow(oldRows.mUids[oldIndex], oldRows.mFlags[oldIndex],
+                            oldRows.mKeywordHashes[oldIndex],
+                            oldRows.mSizes[oldIndex]);
+      }
+      if (oldIndex < numOldRows && oldRows.mUids[oldIndex] == uidOfMessage)
+      {
+        uint32_t row = oldIndex++;
+        if (oldRows.mFlags[row] == flags &&
+            oldRows.mKeywordHashes[row] == keywordHash)
+        {
+          newFolderSize += oldRows.mSizes[row];
+          newRows.AppendRow(uidOfMessage, flags, keywordHash,
+                            oldRows.mSizes[row]);
+          continue;
+        }
+      }
+    }
+
     nsCOMPtr<nsIMsgDBHdr> dbHdr;
     bool containsKey;
     rv = mDatabase->ContainsKey(uidOfMessage , &containsKey);
@@ -4867,15 +4998,42 @@ nsresult nsImapMailFolder::SyncFlags(nsIImapFlagAndUidState *flagState)
       continue;
 
     rv = mDatabase->GetMsgHdrForKey(uidOfMessage, getter_AddRefs(dbHdr));
+    messageSize = 0;
     if (NS_SUCCEEDED(dbHdr->GetMessageSize(&messageSize)))
       newFolderSize += messageSize;
 
-    nsCString keywords;
-    if (NS_SUCCEEDED(flagState->GetCustomFlags(uidOfMessage, getter_Copies(keywords))))
-        HandleCustomFlags(uidOfMessage, dbHdr, supportedUserFlags, keywords, flagState);
+    HandleCustomFlags(uidOfMessage, dbHdr, supportedUserFlags, keywords, flagState);
 
     NotifyMessageFlagsFromHdr(dbHdr, uidOfMessage, flags);
+    numChanged++;
+
+    if (sorted && validUid)
+      newRows.AppendRow(uidOfMessage, flags, keywordHash, messageSize);
+  }
+  m_syncingFlags = false;
+
+  if (sorted)
+  {
+    if (partialUIDFetch)
+    {
+      for (; oldIndex < numOldRows; oldIndex++)
+        newRows.AppendRow(oldRows.mUids[oldIndex], oldRows.mFlags[oldIndex],
+                          oldRows.mKeywordHashes[oldIndex],
+                          oldRows.mSizes[oldIndex]);
+    }
+    m_syncedFlags.SwapRows(newRows);
+    m_syncedFlags.mDatabase = mDatabase;
+    m_syncedFlags.mFolderStateHash = folderStateHash;
+  }
+  else
+  {
+    // We can't merge against an unsorted server state.
+    m_syncedFlags.Clear();
   }
+  MOZ_LOG(IMAP, mozilla::LogLevel::Debug,
+          ("SyncFlags(): %u of %d messages changed in folder=%s",
+           numChanged, messageIndex, m_onlineFolderName.get()));
+
   if (!partialUIDFetch && newFolderSize != mFolderSize)
   {
     int64_t oldFolderSize = mFolderSize;
@@ -4886,6 +5044,59 @@ nsresult nsImapMailFolder::SyncFlags(nsIImapFlagAndUidState *flagState)
   return NS_OK;
 }
 
+NS_IMETHODIMP
+nsImapMailFolder::OnHdrFlagsChanged(nsIMsgDBHdr *aHdrChanged,
+                                    uint32_t aOldFlags, uint32_t aNewFlags,
+                                    nsIDBChangeListener *aInstigator)
+{
+  if (aHdrChanged && !m_syncingFlags)
+  {
+    nsMsgKey msgKey;
+    aHdrChanged->GetMessageKey(&msgKey);
+    m_syncedFlags.Invalidate(msgKey);
+  }
+  return nsMsgDBFolder::OnHdrFlagsChanged(aHdrChanged, aOldFlags, aNewFlags,
+                                          aInstigator);
+}
+
+NS_IMETHODIMP
+nsImapMailFolder::OnHdrPropertyChanged(nsIMsgDBHdr *aHdrToChange,
+                                       bool aPreChange, uint32_t *aStatus,
+                                       nsIDBChangeListener *aInstigator)
+{
+  if (aHdrToChange && !aPreChange && !m_syncingFlags)
+  {
+    nsMsgKey msgKey;
+    aHdrToChange->GetMessageKey(&msgKey);
+    m_syncedFlags.Invalidate(msgKey);
+  }
+  return nsMsgDBFolder::OnHdrPropertyChanged(aHdrToChange, aPreChange,
+                                             aStatus, aInstigator);
+}
+
+NS_IMETHODIMP
+nsImapMailFolder::OnHdrDeleted(nsIMsgDBHdr *aHdrChanged, nsMsgKey aParentKey,
+                               int32_t aFlags,
+                               nsIDBChangeListener *aInstigator)
+{
+  if (aHdrChanged)
+  {
+    nsMsgKey msgKey;
+    aHdrChanged->GetMessageKey(&msgKey);
+    m_syncedFlags.Invalidate(msgKey);
+  }
+  return nsMsgDBFolder::OnHdrDeleted(aHdrChanged, aParentKey, aFlags,
+                                     aInstigator);
+}
+
+NS_IMETHODIMP
+nsImapMailFolder::OnAnnouncerGoingAway(nsIDBChangeAnnouncer *instigator)
+{
+  if (mDatabase && instigator == mDatabase)
+    m_syncedFlags.Clear();
+  return nsMsgDBFolder::OnAnnouncerGoingAway(instigator);
+}
+
 // helper routine to sync the flags on a given header
 nsresult
 nsImapMailFolder::NotifyMessageFlagsFromHdr(nsIMsgDBHdr *dbHdr,
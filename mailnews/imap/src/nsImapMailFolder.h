@@ -185,6 +185,33 @@ struct nsPlaybackRequest
   nsCOMPtr<nsIMsgWindow> MsgWindow;
 };
 
+/**
+ * The server flag state of a folder as of its last flag sync, kept as
+ * parallel arrays sorted by UID. SyncFlags merges the next server state
+ * against it, so only messages whose flags or keywords changed on the
+ * server, or whose header changed locally since, need their header loaded.
+ */
+class nsImapSyncedFlags
+{
+public:
+  nsImapSyncedFlags() : mDatabase(nullptr), mFolderStateHash(0) {}
+
+  void Clear();
+  void Invalidate(nsMsgKey aUid);
+  void AppendRow(nsMsgKey aUid, imapMessageFlagsType aFlags,
+                 uint32_t aKeywordHash, uint32_t aSize);
+  void SwapRows(nsImapSyncedFlags &aOther);
+
+  nsTArray<nsMsgKey> mUids;
+  nsTArray<imapMessageFlagsType> mFlags;
+  nsTArray<uint32_t> mKeywordHashes;
+  nsTArray<uint32_t> mSizes;
+  // The database the rows were synced into. Only compared, never used.
+  nsIMsgDatabase *mDatabase;
+  // Hash of the folder-wide state the rows were synced with.
+  uint32_t mFolderStateHash;
+};
+
 class nsImapMailFolder :  public nsMsgDBFolder,
                           public nsIMsgImapMailFolder,
                           public nsIImapMailFolderSink,
@@ -226,6 +253,18 @@ public:
 
   NS_IMETHOD UpdateSummaryTotals(bool force) override;
 
+  // nsIDBChangeListener overrides, to notice local changes to synced flags.
+  NS_IMETHOD OnHdrFlagsChanged(nsIMsgDBHdr *aHdrChanged, uint32_t aOldFlags,
+                               uint32_t aNewFlags,
+                               nsIDBChangeListener *aInstigator) override;
+  NS_IMETHOD OnHdrPropertyChanged(nsIMsgDBHdr *aHdrToChange, bool aPreChange,
+                                  uint32_t *aStatus,
+                                  nsIDBChangeListener *aInstigator) override;
+  NS_IMETHOD OnHdrDeleted(nsIMsgDBHdr *aHdrChanged, nsMsgKey aParentKey,
+                          int32_t aFlags,
+                          nsIDBChangeListener *aInstigator) override;
+  NS_IMETHOD OnAnnouncerGoingAway(nsIDBChangeAnnouncer *instigator) override;
+
   NS_IMETHOD GetDeletable (bool *deletable) override;
 
   NS_IMETHOD GetSizeOnDisk(int64_t *size) override;
@@ -353,6 +392,7 @@ protected:
   void TweakHeaderFlags(nsIImapProtocol* aProtocol, nsIMsgDBHdr *tweakMe);
 
   nsresult SyncFlags(nsIImapFlagAndUidState *flagState);
+  uint32_t GetSyncedFolderStateHash(nsIImapFlagAndUidState *flagState);
   nsresult HandleCustomFlags(nsMsgKey uidOfMessage, nsIMsgDBHdr *dbHdr,
                              uint16_t userFlags, nsCString& keywords,
                              nsIImapFlagAndUidState *flagState);
@@ -533,6 +573,12 @@ protected:
   nsTArray<nsMsgKey> m_keysToFetch;
   uint32_t m_totalKeysToFetch;
 
+  // server flags as of the last SyncFlags, see nsImapSyncedFlags.
+  nsImapSyncedFlags m_syncedFlags;
+  // true while SyncFlags applies server flags, whose change notifications
+  // must not invalidate m_syncedFlags.
+  bool m_syncingFlags;
+
   /**
    * delete if appropriate local storage for messages in this folder
    *
@@ -570,8 +570,12 @@ void nsImapServerResponseParser::response_data()
         AdvanceToNextToken();
         if (fNextToken)
         {
-          char *mailboxName = CreateAstring();
-          PL_strfree( mailboxName);
+          // skip the mailbox name
+          nsDependentCSubstring mailboxName;
+          if (*fNextToken == '{' || *fNextToken == '"')
+            SkipString();
+          else
+            ParseAtom(mailboxName, true);
         }
         while (ContinueParse() && !fAtEndOfLine)
         {
@@ -1051,7 +1055,9 @@ void nsImapServerResponseParser::msg_fetch()
   // show any incremental progress, for instance, for header downloading
   fServerConnection.ShowProgress();
 
-  fNextToken++; // eat the '(' character
+  // the fast path leaves fNextToken at the closing ')'
+  if (!msg_fetch_flags_only())
+    fNextToken++; // eat the '(' character
 
   // some of these productions are ignored for now
   while (ContinueParse() && (*fNextToken != ')') )
@@ -1079,12 +1085,7 @@ void nsImapServerResponseParser::msg_fetch()
       AdvanceToNextToken();
       if (ContinueParse())
       {
-        fCurrentResponseUID = strtoul(fNextToken, nullptr, 10);
-        if (fCurrentResponseUID > fHighestRecordedUID)
-          fHighestRecordedUID = fCurrentResponseUID;
-        // size came before UID
-        if (fSizeOfMostRecentMessage)
-          fReceivedHeaderOrSizeForUID = CurrentResponseUID();
+        msg_fetch_uid(strtoul(fNextToken, nullptr, 10));
         // if this token ends in ')', then it is the last token
         // else we advance
         char lastTokenChar = *(fNextToken + strlen(fNextToken) - 1);
@@ -1239,27 +1240,7 @@ void nsImapServerResponseParser::msg_fetch()
         AdvanceToNextToken();
         if (ContinueParse())
         {
-          bool sendEndMsgDownload = (GetDownloadingHeaders()
-                                        && fReceivedHeaderOrSizeForUID == CurrentResponseUID());
-          fSizeOfMostRecentMessage = strtoul(fNextToken, nullptr, 10);
-          fReceivedHeaderOrSizeForUID = CurrentResponseUID();
-          if (sendEndMsgDownload)
-          {
-            fServerConnection.NormalMessageEndDownload();
-            fReceivedHeaderOrSizeForUID = nsMsgKey_None;
-          }
-
-          if (fSizeOfMostRecentMessage == 0 && CurrentResponseUID())
-          {
-            // on no, bogus Netscape 2.0 mail server bug
-            char uidString[100];
-            sprintf(uidString, "%ld", (long)CurrentResponseUID());
-
-            if (!fZeroLengthMessageUidString.IsEmpty())
-              fZeroLengthMessageUidString += ",";
-
-            fZeroLengthMessageUidString += uidString;
-          }
+          msg_fetch_size(strtoul(fNextToken, nullptr, 10));
 
           // if this token ends in ')', then it is the last token
           // else we advance
@@ -1288,15 +1269,15 @@ void nsImapServerResponseParser::msg_fetch()
           SetSyntaxError(true);
         else
         {
-          fMsgID = CreateAtom();
+          nsDependentCSubstring msgID;
+          nsAutoCString msgIDValue;
+          if (ParseAtom(msgID))
+            msgIDValue.Assign(msgID);
           AdvanceToNextToken();
-          nsCString msgIDValue;
-          msgIDValue.Assign(fMsgID);
           if (fCurrentResponseUID == 0)
             fFlagState->GetUidOfMessage(fFetchResponseIndex - 1, &fCurrentResponseUID);
           fFlagState->SetCustomAttribute(fCurrentResponseUID,
                                          NS_LITERAL_CSTRING("X-GM-MSGID"), msgIDValue);
-          PR_FREEIF(fMsgID);
         }
       }
       else if (!PL_strcasecmp(fNextToken, "X-GM-THRID"))
@@ -1306,15 +1287,15 @@ void nsImapServerResponseParser::msg_fetch()
           SetSyntaxError(true);
         else
         {
-          fThreadID = CreateAtom();
+          nsDependentCSubstring threadID;
+          nsAutoCString threadIDValue;
+          if (ParseAtom(threadID))
+            threadIDValue.Assign(threadID);
           AdvanceToNextToken();
-          nsCString threadIDValue;
-          threadIDValue.Assign(fThreadID);
           if (fCurrentResponseUID == 0)
             fFlagState->GetUidOfMessage(fFetchResponseIndex - 1, &fCurrentResponseUID);
           fFlagState->SetCustomAttribute(fCurrentResponseUID,
                                          NS_LITERAL_CSTRING("X-GM-THRID"), threadIDValue);
-          PR_FREEIF(fThreadID);
         }
       }
       else if (!PL_strcasecmp(fNextToken, "X-GM-LABELS"))
@@ -1443,6 +1424,204 @@ void nsImapServerResponseParser::msg_fetch()
         }
 }
 
+void nsImapServerResponseParser::msg_fetch_uid(uint32_t aUID)
+{
+  fCurrentResponseUID = aUID;
+  if (fCurrentResponseUID > fHighestRecordedUID)
+    fHighestRecordedUID = fCurrentResponseUID;
+  // size came before UID
+  if (fSizeOfMostRecentMessage)
+    fReceivedHeaderOrSizeForUID = CurrentResponseUID();
+}
+
+void nsImapServerResponseParser::msg_fetch_size(uint32_t aSize)
+{
+  bool sendEndMsgDownload = (GetDownloadingHeaders()
+                                && fReceivedHeaderOrSizeForUID == CurrentResponseUID());
+  fSizeOfMostRecentMessage = aSize;
+  fReceivedHeaderOrSizeForUID = CurrentResponseUID();
+  if (sendEndMsgDownload)
+  {
+    fServerConnection.NormalMessageEndDownload();
+    fReceivedHeaderOrSizeForUID = nsMsgKey_None;
+  }
+
+  if (fSizeOfMostRecentMessage == 0 && CurrentResponseUID())
+  {
+    // on no, bogus Netscape 2.0 mail server bug
+    char uidString[100];
+    sprintf(uidString, "%ld", (long)CurrentResponseUID());
+
+    if (!fZeroLengthMessageUidString.IsEmpty())
+      fZeroLengthMessageUidString += ",";
+
+    fZeroLengthMessageUidString += uidString;
+  }
+}
+
+// Parses a decimal number of at most |aMaxDigits| digits at |aString|.
+// Returns the character after it, or nullptr if there is no such number.
+static const char *ParseFetchNumber(const char *aString, uint32_t aMaxDigits,
+                                    uint64_t *aNumber)
+{
+  const char *end = aString;
+  uint64_t number = 0;
+  while (*end >= '0' && *end <= '9' && uint32_t(end - aString) < aMaxDigits)
+    number = number * 10 + (*end++ - '0');
+  if (end == aString || (*end >= '0' && *end <= '9'))
+    return nullptr;
+  *aNumber = number;
+  return end;
+}
+
+// Returns the end of the flag or keyword at |aString|.
+static const char *SkipFetchFlag(const char *aString)
+{
+  while (*aString && *aString != ' ' && *aString != '(' && *aString != ')' &&
+         *aString != '"' && *aString != '{' && *aString != '\r' && *aString != '\n')
+    aString++;
+  return aString;
+}
+
+/*
+ The fetch responses of a flag sync ("UID fetch 1:* (FLAGS)") and of most
+ STOREs consist of nothing but the items below, and there may be one per
+ message of the folder. Parse them straight from the current line instead of
+ going through the tokenizer for every item and flag:
+
+   "(" 1#("FLAGS" SPACE "(" #flag ")" / "UID" SPACE uniqueid /
+          "RFC822.SIZE" SPACE number / "MODSEQ" SPACE "(" number ")") ")"
+
+ Returns false, without having consumed anything, if the response has any
+ other item, so that msg_fetch() parses it as usual. Otherwise leaves
+ fNextToken at the closing ')'.
+*/
+bool nsImapServerResponseParser::msg_fetch_flags_only()
+{
+  enum { kFlags, kUID, kSize, kModSeq };
+  struct FetchItem
+  {
+    int type;
+    uint64_t value;
+    const char *flags;  // for kFlags, the flags up to the closing ')'
+  };
+  const uint32_t kMaxItems = 8;
+  FetchItem items[kMaxItems];
+  uint32_t numItems = 0;
+
+  // fNextToken has been cut off at the next space by the tokenizer, so
+  // look at the untouched line
+  const char *start = fCurrentLine + (fNextToken - fStartOfLineOfTokens);
+  if (*start != '(')
+    return false;
+
+  // check that we can handle the whole response before changing anything
+  const char *current = start + 1;
+  while (true)
+  {
+    if (numItems == kMaxItems)
+      return false;
+    FetchItem &item = items[numItems++];
+    if (!PL_strncasecmp(current, "FLAGS (", 7))
+    {
+      item.type = kFlags;
+      item.flags = current += 7;
+      while (*current != ')')
+      {
+        const char *flagEnd = SkipFetchFlag(current);
+        if (flagEnd == current)
+          return false;
+        current = flagEnd;
+        if (*current == ' ' && current[1] != ')')
+          current++;
+        else if (*current != ')')
+          return false;
+      }
+      current++;
+    }
+    else if (!PL_strncasecmp(current, "UID ", 4))
+    {
+      item.type = kUID;
+      current = ParseFetchNumber(current + 4, 10, &item.value);
+    }
+    else if (!PL_strncasecmp(current, "RFC822.SIZE ", 12))
+    {
+      item.type = kSize;
+      current = ParseFetchNumber(current + 12, 10, &item.value);
+    }
+    else if (!PL_strncasecmp(current, "MODSEQ (", 8))
+    {
+      item.type = kModSeq;
+      current = ParseFetchNumber(current + 8, 19, &item.value);
+      if (current && *current++ != ')')
+        return false;
+    }
+    else
+      return false;
+
+    if (!current || (item.type != kFlags && item.type != kModSeq &&
+                     item.value > UINT32_MAX))
+      return false;
+    if (*current == ')')
+      break;
+    if (*current++ != ' ')
+      return false;
+  }
+
+  // nothing but the line end may follow
+  const char *end = current + 1;
+  while (*end == ' ' || *end == '\r' || *end == '\n')
+    end++;
+  if (*end)
+    return false;
+
+  for (uint32_t i = 0; i < numItems; i++)
+  {
+    FetchItem &item = items[i];
+    switch (item.type)
+    {
+    case kFlags:
+    {
+      if (fCurrentResponseUID == 0)
+        fFlagState->GetUidOfMessage(fFetchResponseIndex - 1, &fCurrentResponseUID);
+
+      // as in flags()
+      imapMessageFlagsType messageFlags = kNoImapMsgFlag;
+      fCustomFlags.Clear();
+      if (fFlagState && CurrentResponseUID() != nsMsgKey_None)
+        fFlagState->ClearCustomFlags(CurrentResponseUID());
+      for (const char *flag = item.flags; *flag != ')'; )
+      {
+        const char *flagEnd = SkipFetchFlag(flag);
+        message_flag(flag, flagEnd - flag, messageFlags);
+        flag = *flagEnd == ' ' ? flagEnd + 1 : flagEnd;
+      }
+      fCurrentLineContainedFlagInfo = true;  // handled in PostProcessEndOfLine
+      fSavedFlagInfo = messageFlags;
+      break;
+    }
+    case kUID:
+      msg_fetch_uid(uint32_t(item.value));
+      break;
+    case kSize:
+      msg_fetch_size(uint32_t(item.value));
+      break;
+    case kModSeq:
+      if (item.value > fHighestModSeq)
+        fHighestModSeq = item.value;
+      break;
+    }
+  }
+
+  // let the tokenizer continue after the closing ')', and leave fNextToken
+  // on it for msg_fetch()
+  int32_t closeParenOffset = current - fCurrentLine;
+  AdvanceTokenizerStartingPoint(closeParenOffset + 1 -
+                                (fLineOfTokens - fStartOfLineOfTokens));
+  fNextToken = fStartOfLineOfTokens + closeParenOffset;
+  return true;
+}
+
 typedef enum _envelopeItemType
 {
   envelopeString,
@@ -1688,96 +1867,13 @@ void nsImapServerResponseParser::flags()
   fNextToken++;
   while (ContinueParse() && (*fNextToken != ')'))
   {
-    bool knownFlag = false;
-    if (*fNextToken == '\\')
-    {
-      switch (NS_ToUpper(fNextToken[1])) {
-      case 'S':
-        if (!PL_strncasecmp(fNextToken, "\\Seen",5))
-        {
-          messageFlags |= kImapMsgSeenFlag;
-          knownFlag = true;
-        }
-        break;
-      case 'A':
-        if (!PL_strncasecmp(fNextToken, "\\Answered",9))
-        {
-          messageFlags |= kImapMsgAnsweredFlag;
-          knownFlag = true;
-        }
-        break;
-      case 'F':
-        if (!PL_strncasecmp(fNextToken, "\\Flagged",8))
-        {
-          messageFlags |= kImapMsgFlaggedFlag;
-          knownFlag = true;
-        }
-        break;
-      case 'D':
-        if (!PL_strncasecmp(fNextToken, "\\Deleted",8))
-        {
-          messageFlags |= kImapMsgDeletedFlag;
-          knownFlag = true;
-        }
-        else if (!PL_strncasecmp(fNextToken, "\\Draft",6))
-        {
-          messageFlags |= kImapMsgDraftFlag;
-          knownFlag = true;
-        }
-        break;
-      case 'R':
-        if (!PL_strncasecmp(fNextToken, "\\Recent",7))
-        {
-          messageFlags |= kImapMsgRecentFlag;
-          knownFlag = true;
-        }
-        break;
-      default:
-        break;
-      }
-    }
-    else if (*fNextToken == '$')
-    {
-      switch (NS_ToUpper(fNextToken[1])) {
-      case 'M':
-        if ((fSupportsUserDefinedFlags & (kImapMsgSupportUserFlag |
-          kImapMsgSupportMDNSentFlag))
-          && !PL_strncasecmp(fNextToken, "$MDNSent",8))
-        {
-          messageFlags |= kImapMsgMDNSentFlag;
-          knownFlag = true;
-        }
-        break;
-      case 'F':
-        if ((fSupportsUserDefinedFlags & (kImapMsgSupportUserFlag |
-          kImapMsgSupportForwardedFlag))
-          && !PL_strncasecmp(fNextToken, "$Forwarded",10))
-        {
-          messageFlags |= kImapMsgForwardedFlag;
-          knownFlag = true;
-        }
-        break;
-      default:
-        break;
-      }
-    }
-    if (!knownFlag && fFlagState)
-    {
-      nsAutoCString flag(fNextToken);
-      int32_t parenIndex = flag.FindChar(')');
-      if (parenIndex > 0)
-        flag.SetLength(parenIndex);
-      messageFlags |= kImapMsgCustomKeywordFlag;
-      if (CurrentResponseUID() != nsMsgKey_None && CurrentResponseUID() != 0)
-        fFlagState->AddUidCustomFlagPair(CurrentResponseUID(), flag.get());
-      else
-        fCustomFlags.AppendElement(flag);
-    }
-    if (PL_strcasestr(fNextToken, ")"))
+    const char *flagEnd = strchr(fNextToken, ')');
+    message_flag(fNextToken, flagEnd ? flagEnd - fNextToken : strlen(fNextToken),
+                 messageFlags);
+    if (flagEnd)
     {
       // eat token chars until we get the ')'
-      while (*fNextToken != ')')
-        fNextToken++;
+      fNextToken = flagEnd;
     }
     else
       AdvanceToNextToken();
@@ -1791,6 +1887,95 @@ void nsImapServerResponseParser::flags()
   fSavedFlagInfo = messageFlags;
 }
 
+// Adds the system flag or keyword |aFlag| of the current message to
+// |aMessageFlags|.  Keywords are recorded as its custom flags.
+void nsImapServerResponseParser::message_flag(const char *aFlag, uint32_t aLength,
+                                              imapMessageFlagsType &aMessageFlags)
+{
+  bool knownFlag = false;
+  if (*aFlag == '\\')
+  {
+    switch (NS_ToUpper(aFlag[1])) {
+    case 'S':
+      if (!PL_strncasecmp(aFlag, "\\Seen",5))
+      {
+        aMessageFlags |= kImapMsgSeenFlag;
+        knownFlag = true;
+      }
+      break;
+    case 'A':
+      if (!PL_strncasecmp(aFlag, "\\Answered",9))
+      {
+        aMessageFlags |= kImapMsgAnsweredFlag;
+        knownFlag = true;
+      }
+      break;
+    case 'F':
+      if (!PL_strncasecmp(aFlag, "\\Flagged",8))
+      {
+        aMessageFlags |= kImapMsgFlaggedFlag;
+        knownFlag = true;
+      }
+      break;
+    case 'D':
+      if (!PL_strncasecmp(aFlag, "\\Deleted",8))
+      {
+        aMessageFlags |= kImapMsgDeletedFlag;
+        knownFlag = true;
+      }
+      else if (!PL_strncasecmp(aFlag, "\\Draft",6))
+      {
+        aMessageFlags |= kImapMsgDraftFlag;
+        knownFlag = true;
+      }
+      break;
+    case 'R':
+      if (!PL_strncasecmp(aFlag, "\\Recent",7))
+      {
+        aMessageFlags |= kImapMsgRecentFlag;
+        knownFlag = true;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+  else if (*aFlag == '$')
+  {
+    switch (NS_ToUpper(aFlag[1])) {
+    case 'M':
+      if ((fSupportsUserDefinedFlags & (kImapMsgSupportUserFlag |
+        kImapMsgSupportMDNSentFlag))
+        && !PL_strncasecmp(aFlag, "$MDNSent",8))
+      {
+        aMessageFlags |= kImapMsgMDNSentFlag;
+        knownFlag = true;
+      }
+      break;
+    case 'F':
+      if ((fSupportsUserDefinedFlags & (kImapMsgSupportUserFlag |
+        kImapMsgSupportForwardedFlag))
+        && !PL_strncasecmp(aFlag, "$Forwarded",10))
+      {
+        aMessageFlags |= kImapMsgForwardedFlag;
+        knownFlag = true;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+  if (!knownFlag && fFlagState)
+  {
+    nsAutoCString flag(aFlag, aLength);
+    aMessageFlags |= kImapMsgCustomKeywordFlag;
+    if (CurrentResponseUID() != nsMsgKey_None && CurrentResponseUID() != 0)
+      fFlagState->AddUidCustomFlagPair(CurrentResponseUID(), flag.get());
+    else
+      fCustomFlags.AppendElement(flag);
+  }
+}
+
 // RFC3501:  resp-cond-state = ("OK" / "NO" / "BAD") SP resp-text
 //                             ; Status condition
 void nsImapServerResponseParser::resp_cond_state(bool isTagged)
@@ -2838,13 +3023,13 @@ nsImapServerResponseParser::bodystructure_leaf(char *partNum, nsIMAPBodypart *pa
   // body size
   if (isValid && ContinueParse())
   {
-    char *bodySizeString = CreateAtom();
-    if (!bodySizeString)
+    nsDependentCSubstring bodySizeString;
+    if (!ParseAtom(bodySizeString))
       isValid = false;
     else
     {
-      partLength = atoi(bodySizeString);
-      PR_Free(bodySizeString);
+      // the atom is followed by a non-digit, if anything
+      partLength = atoi(bodySizeString.BeginReading());
       if (ContinueParse())
         AdvanceToNextToken();
     }
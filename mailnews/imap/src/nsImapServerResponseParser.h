@@ -126,6 +126,8 @@ public:
 
 protected:
   virtual void    flags();
+  void            message_flag(const char *aFlag, uint32_t aLength,
+                               imapMessageFlagsType &aMessageFlags);
   virtual void    envelope_data();
   virtual void    xaolenvelope_data();
   virtual void    parse_address(nsAutoCString &addressLine);
@@ -164,6 +166,9 @@ protected:
   virtual void    mime_header_data();
   virtual void    quota_data();
   virtual void    msg_fetch();
+  bool            msg_fetch_flags_only();
+  void            msg_fetch_uid(uint32_t aUID);
+  void            msg_fetch_size(uint32_t aSize);
   virtual void    msg_obsolete();
   virtual void    msg_fetch_headers(const char *partNum);
   virtual void    msg_fetch_content(bool chunk, int32_t origin, const char *content_type);
@@ -239,8 +244,6 @@ private:
   char          *fNetscapeServerVersionString;
   char          *fXSenderInfo; /* changed per message download */
   char          *fLastAlert; /* used to avoid displaying the same alert over and over */
-  char          *fMsgID; /* MessageID for Gmail only (X-GM-MSGID) */
-  char          *fThreadID; /* ThreadID for Gmail only (X-GM-THRID) */
   char          *fLabels; /* Labels for Gmail only (X-GM-LABELS) [will include parens, removed while passing to hashTable ]*/
   nsCString     fManageListsUrl;
   nsCString    fManageFiltersUrl;
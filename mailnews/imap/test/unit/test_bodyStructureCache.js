@@ -0,0 +1,91 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+ * Tests that a message shown by parts is shown again without fetching its
+ * BODYSTRUCTURE, even once its body shell has been dropped from the cache.
+ */
+var {Services} = ChromeUtils.import("resource://gre/modules/Services.jsm");
+
+load("../../../resources/logHelper.js");
+load("../../../resources/asyncTestUtils.js");
+
+// javascript mime emitter functions
+var mimeMsg = {};
+ChromeUtils.import("resource:///modules/gloda/mimemsg.js", mimeMsg);
+
+// IMAP pump
+
+setupIMAPPump();
+
+var tests = [
+  setPrefs,
+  loadImapMessage,
+  streamMessage,
+  checkOneBodystructure,
+  dropLiveShells,
+  streamMessage,
+  checkOneBodystructure,
+  endTest
+]
+
+function* setPrefs() {
+  Services.prefs.setIntPref("mail.imap.mime_parts_on_demand_threshold", 20);
+  Services.prefs.setBoolPref("mail.imap.mime_parts_on_demand", true);
+  Services.prefs.setBoolPref("mail.server.server1.autosync_offline_stores", false);
+  Services.prefs.setBoolPref("mail.server.server1.offline_download", false);
+  Services.prefs.setBoolPref("mail.server.server1.download_on_biff", false);
+  Services.prefs.setIntPref("browser.cache.disk.capacity", 0);
+  yield true;
+}
+
+function* loadImapMessage() {
+  let file = do_get_file("../../../data/bodystructuretest1");
+  let msgURI = Services.io.newFileURI(file).QueryInterface(Ci.nsIFileURL);
+
+  let imapInbox = IMAPPump.daemon.getMailbox("INBOX");
+  let message = new imapMessage(msgURI.spec, imapInbox.uidnext++, []);
+  IMAPPump.mailbox.addMessage(message);
+  IMAPPump.inbox.updateFolderWithListener(null, asyncUrlListener);
+  yield false;
+
+  Assert.equal(1, IMAPPump.inbox.getTotalMessages(false));
+}
+
+function* streamMessage() {
+  let msgHdr = mailTestUtils.firstMsgHdr(IMAPPump.inbox);
+  mimeMsg.MsgHdrToMimeMessage(msgHdr, this, function (aMsgHdr, aMimeMessage) {
+    let url = aMimeMessage.allUserAttachments[0].url;
+    // The attachment is still left out and downloaded on demand.
+    Assert.ok(url.includes("/;section="));
+    async_driver();
+  }, true /* allowDownload */, { partsOnDemand: true });
+  yield false;
+}
+
+function* checkOneBodystructure() {
+  let transactions = [].concat(IMAPPump.server.playTransaction());
+  let fetches = 0;
+  for (let transaction of transactions)
+    fetches += transaction.them.filter(line => /BODYSTRUCTURE/i.test(line)).length;
+  Assert.equal(fetches, 1);
+  yield true;
+}
+
+// Changing this pref makes the next url clear the live shells of the host,
+// leaving only the serialized structures.
+function* dropLiveShells() {
+  Services.prefs.setBoolPref("mailnews.display.prefer_plaintext",
+    !Services.prefs.getBoolPref("mailnews.display.prefer_plaintext"));
+  yield true;
+}
+
+function endTest() {
+  Services.prefs.clearUserPref("mailnews.display.prefer_plaintext");
+  teardownIMAPPump();
+}
+
+function run_test() {
+  async_run_tests(tests);
+}
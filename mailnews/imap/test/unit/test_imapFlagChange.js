@@ -75,6 +75,22 @@ var tests = [
     gSecondFolder.updateFolderWithListener(null, asyncUrlListener);
     yield false;
   },
+  function* clearSeenFlagLocally() {
+    // Change the header behind the server's back. The server flags are
+    // unchanged, but the next flag sync must still restore them.
+    let msgHdr = IMAPPump.inbox.msgDatabase.getMsgHdrForMessageID(gSynthMessage.messageId);
+    IMAPPump.inbox.msgDatabase.markRead(msgHdr.messageKey, false, null);
+    Assert.equal(msgHdr.flags & Ci.nsMsgMessageFlags.Read, 0);
+    IMAPPump.inbox.updateFolderWithListener(null, asyncUrlListener);
+    yield false;
+  },
+  function* checkSeenFlagRestored() {
+    let msgHdr = IMAPPump.inbox.msgDatabase.getMsgHdrForMessageID(gSynthMessage.messageId);
+    Assert.equal(msgHdr.flags & Ci.nsMsgMessageFlags.Read,
+                 Ci.nsMsgMessageFlags.Read);
+    gSecondFolder.updateFolderWithListener(null, asyncUrlListener);
+    yield false;
+  },
   function* simulateTagAdded() {
     gMessage.setFlag("randomtag");
     IMAPPump.inbox.updateFolderWithListener(null, asyncUrlListener);
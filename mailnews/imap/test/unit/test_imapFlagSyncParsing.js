@@ -0,0 +1,109 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+ * Tests that the flags and keywords of a whole folder are parsed correctly
+ * from the FETCH responses of a flag sync, and reports how long the sync of
+ * a large folder takes.
+ */
+
+load("../../../resources/logHelper.js");
+load("../../../resources/asyncTestUtils.js");
+load("../../../resources/messageGenerator.js");
+
+var kMessageCount = 500;
+
+var kFlagSets = [
+  [],
+  ["\\Seen"],
+  ["\\Seen", "\\Flagged"],
+  ["$Forwarded"],
+  ["\\Answered", "randomtag"],
+  ["\\Seen", "\\Answered", "\\Flagged", "randomtag", "othertag"],
+];
+
+var gMessages = [];
+var gSecondFolder;
+var gSyncStart;
+
+var tests = [
+  setup,
+  checkFlags.bind(null, 0),
+  function* switchAwayFromInbox() {
+    let rootFolder = IMAPPump.incomingServer.rootFolder;
+    gSecondFolder = rootFolder.getChildNamed("secondFolder")
+                              .QueryInterface(Ci.nsIMsgImapMailFolder);
+    gSecondFolder.updateFolderWithListener(null, asyncUrlListener);
+    yield false;
+  },
+  function* changeFlagsOnServer() {
+    // Simulate another client changing the flags of every message, which we
+    // discover through the flag sync when the inbox is selected again.
+    gMessages.forEach((message, i) => {
+      message.flags = kFlagSets[(i + 1) % kFlagSets.length].slice();
+    });
+    gSyncStart = Date.now();
+    IMAPPump.inbox.updateFolderWithListener(null, asyncUrlListener);
+    yield false;
+    info("Synced the flags of " + kMessageCount + " messages in " +
+         (Date.now() - gSyncStart) + "ms");
+  },
+  checkFlags.bind(null, 1),
+  teardown
+];
+
+function* setup() {
+  Services.prefs.setBoolPref("mail.server.default.autosync_offline_stores", false);
+
+  setupIMAPPump();
+
+  IMAPPump.daemon.createMailbox("secondFolder", {subscribed : true});
+
+  let messageGenerator = new MessageGenerator();
+  for (let i = 0; i < kMessageCount; i++) {
+    let msgURI =
+      Services.io.newURI("data:text/plain;base64," +
+                         btoa(messageGenerator.makeMessage().toMessageString()));
+    let message = new imapMessage(msgURI.spec, IMAPPump.mailbox.uidnext++,
+                                  kFlagSets[i % kFlagSets.length].slice());
+    IMAPPump.mailbox.addMessage(message);
+    gMessages.push(message);
+  }
+
+  // update folder to download the headers.
+  IMAPPump.inbox.updateFolderWithListener(null, asyncUrlListener);
+  yield false;
+}
+
+function* checkFlags(aRound) {
+  let db = IMAPPump.inbox.msgDatabase;
+  gMessages.forEach((message, i) => {
+    let flagSet = kFlagSets[(i + aRound) % kFlagSets.length];
+    let msgHdr = db.GetMsgHdrForKey(message.uid);
+    Assert.equal(!!(msgHdr.flags & Ci.nsMsgMessageFlags.Read),
+                 flagSet.includes("\\Seen"));
+    Assert.equal(!!(msgHdr.flags & Ci.nsMsgMessageFlags.Marked),
+                 flagSet.includes("\\Flagged"));
+    Assert.equal(!!(msgHdr.flags & Ci.nsMsgMessageFlags.Replied),
+                 flagSet.includes("\\Answered"));
+    Assert.equal(!!(msgHdr.flags & Ci.nsMsgMessageFlags.Forwarded),
+                 flagSet.includes("$Forwarded"));
+    let keywords = msgHdr.getStringProperty("keywords").split(" ");
+    for (let tag of ["randomtag", "othertag"])
+      Assert.equal(keywords.includes(tag), flagSet.includes(tag));
+  });
+  yield true;
+}
+
+asyncUrlListener.callback = function(aUrl, aExitCode) {
+  Assert.equal(aExitCode, 0);
+};
+
+function teardown() {
+  teardownIMAPPump();
+}
+
+function run_test() {
+  async_run_tests(tests);
+}
@@ -534,6 +534,8 @@ nsMovemailService::GetNewMail(nsIMsgWindow *aMsgWindow,
     rv = msgStore->FinishNewMessage(outputStream, newHdr);
     NS_ENSURE_SUCCESS(rv, rv);
     outputStream->Close();
+    // write out the messages moved by filters
+    newMailParser->EndMsgDownload();
   }
   // Truncate the spool file as we parsed it successfully.
   rv = spoolFile->SetFileSize(0);
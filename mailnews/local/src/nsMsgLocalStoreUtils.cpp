@@ -47,6 +47,8 @@ nsMsgLocalStoreUtils::nsShouldIgnoreFile(nsAString& name)
   // don't add popstate files to the list either, or rules (sort.dat).
   if (StringEndsWith(name, NS_LITERAL_STRING(".snm")) ||
       name.LowerCaseEqualsLiteral("popstate.dat") ||
+      name.LowerCaseEqualsLiteral("popstate.bin") ||
+      name.LowerCaseEqualsLiteral("popstate.journal") ||
       name.LowerCaseEqualsLiteral("sort.dat") ||
       name.LowerCaseEqualsLiteral("mailfilt.log") ||
       name.LowerCaseEqualsLiteral("filters.js") ||
@@ -56,6 +58,7 @@ nsMsgLocalStoreUtils::nsShouldIgnoreFile(nsAString& name)
   // ignore RSS data source files
   if (name.LowerCaseEqualsLiteral("feeds.rdf") ||
       name.LowerCaseEqualsLiteral("feeditems.rdf") ||
+      name.LowerCaseEqualsLiteral("feeditems.dat") ||
       StringBeginsWith(name, NS_LITERAL_STRING("feeditems_error")))
     return true;
 
@@ -51,6 +51,7 @@
 #include "mozilla/Services.h"
 #include "nsQueryObject.h"
 #include "nsIOutputStream.h"
+#include "nsStringStream.h"
 #include "mozilla/Attributes.h"
 
 /* the following macros actually implement addref, release and query interface for our component. */
@@ -1681,6 +1682,7 @@ nsParseNewMailState::nsParseNewMailState()
   m_ibuffer_size = 0;
   m_ibuffer_fp = 0;
   m_numNotNewMessages = 0;
+  m_moveBatchBytes = 0;
  }
 
 NS_IMPL_ISUPPORTS_INHERITED(nsParseNewMailState, nsMsgMailboxParser, nsIMsgFilterHitNotify)
@@ -1733,6 +1735,8 @@ nsParseNewMailState::Init(nsIMsgFolder *serverFolder, nsIMsgFolder *downloadFold
 
 nsParseNewMailState::~nsParseNewMailState()
 {
+  // normally done by EndMsgDownload()
+  FlushMoveBatches();
   if (m_mailDB)
     m_mailDB->Close(true);
   if (m_backupMailDB)
@@ -2289,6 +2293,10 @@ NS_IMETHODIMP nsParseNewMailState::ApplyFilterHit(nsIMsgFilter *filter, nsIMsgWi
 nsresult nsParseNewMailState::ApplyForwardAndReplyFilter(nsIMsgWindow *msgWindow)
 {
   nsresult rv = NS_OK;
+
+  // The message has to be in its folder to be forwarded or replied to.
+  if (!m_forwardTo.IsEmpty() || !m_replyTemplateUri.IsEmpty())
+    FlushMoveBatches();
   nsCOMPtr <nsIMsgIncomingServer> server;
 
   uint32_t i;
@@ -2373,6 +2381,8 @@ void nsParseNewMailState::MarkFilteredMessageUnread(nsIMsgDBHdr *msgHdr)
 
 nsresult nsParseNewMailState::EndMsgDownload()
 {
+  FlushMoveBatches();
+
   if (m_moveCoalescer)
     m_moveCoalescer->PlaybackMoves();
 
@@ -2456,6 +2466,9 @@ nsresult nsParseNewMailState::AppendMsgFromStream(nsIInputStream *fileStream,
 
 /*
  * Moves message pointed to by mailHdr into folder destIFolder.
+ * The message is taken out of the download folder right away, but only
+ * written to destIFolder together with the other messages moved there, by
+ * FlushMoveBatches().
  * After successful move mailHdr is no longer usable by the caller.
  */
 nsresult nsParseNewMailState::MoveIncorporatedMessage(nsIMsgDBHdr *mailHdr,
@@ -2488,135 +2501,270 @@ nsresult nsParseNewMailState::MoveIncorporatedMessage(nsIMsgDBHdr *mailHdr,
     return NS_MSG_NOT_A_MAIL_FOLDER;
   }
 
-  uint32_t messageLength;
-  mailHdr->GetMessageSize(&messageLength);
-
   nsCOMPtr<nsIMsgLocalMailFolder> localFolder = do_QueryInterface(destIFolder);
-  if (localFolder) {
-    bool destFolderTooBig = true;
-    rv = localFolder->WarnIfLocalFileTooBig(msgWindow, messageLength,
-                                            &destFolderTooBig);
-    if (NS_FAILED(rv) || destFolderTooBig)
-      return NS_MSG_ERROR_WRITING_MAIL_FOLDER;
+  if (!localFolder)
+    return NS_MSG_POP_FILTER_TARGET_ERROR;
+
+  // Leave the message alone if someone else is writing into the folder. The
+  // folder is only locked by us while FlushMoveBatch() writes to it.
+  bool isLocked = false;
+  destIFolder->GetLocked(&isLocked);
+  if (isLocked)
+  {
+    destIFolder->ThrowAlertMsg("filterFolderDeniedLocked", msgWindow);
+    return NS_MSG_FOLDER_BUSY;
   }
 
-  nsCOMPtr<nsISupports> myISupports =
-    do_QueryInterface(static_cast<nsIMsgParseMailMsgState*>(this));
+  nsFilterMoveBatch *batch = nullptr;
+  for (uint32_t i = 0; i < m_moveBatches.Length(); i++)
+  {
+    if (m_moveBatches[i]->folder == destIFolder)
+    {
+      batch = m_moveBatches[i].get();
+      break;
+    }
+  }
+
+  uint32_t messageLength;
+  mailHdr->GetMessageSize(&messageLength);
+
+  // what is waiting to be written counts as well
+  bool destFolderTooBig = true;
+  rv = localFolder->WarnIfLocalFileTooBig(msgWindow,
+                                          messageLength + (batch ? batch->data.Length() : 0),
+                                          &destFolderTooBig);
+  if (NS_FAILED(rv) || destFolderTooBig)
+    return NS_MSG_ERROR_WRITING_MAIL_FOLDER;
 
-  // Make sure no one else is writing into this folder
-  if (NS_FAILED(rv = destIFolder->AcquireSemaphore (myISupports)))
+  if (!batch)
   {
-    destIFolder->ThrowAlertMsg("filterFolderDeniedLocked", msgWindow);
-    return rv;
+    nsCOMPtr<nsISupports> myISupports =
+      do_QueryInterface(static_cast<nsIMsgParseMailMsgState*>(this));
+
+    // don't force upgrade in place - open the db here before we start writing to the
+    // destination file because XP_Stat can return file size including bytes written...
+    nsCOMPtr<nsIMsgDatabase> destMailDB;
+    rv = localFolder->GetDatabaseWOReparse(getter_AddRefs(destMailDB));
+    NS_WARNING_ASSERTION(destMailDB && NS_SUCCEEDED(rv),
+                         "failed to open mail db parsing folder");
+    if (!destMailDB)
+    {
+      destIFolder->ThrowAlertMsg("filterFolderHdrAddFailed", msgWindow);
+      return NS_MSG_ERROR_WRITING_MAIL_FOLDER;
+    }
+
+    m_moveBatches.AppendElement(mozilla::MakeUnique<nsFilterMoveBatch>());
+    batch = m_moveBatches.LastElement().get();
+    batch->folder = destIFolder;
+    batch->db = destMailDB;
+    batch->semaphoreHolder = myISupports;
   }
+
   nsCOMPtr<nsIInputStream> inputStream;
   bool reusable;
   rv = m_downloadFolder->GetMsgInputStream(mailHdr, &reusable, getter_AddRefs(inputStream));
   if (!inputStream)
   {
     NS_ERROR("couldn't get source msg input stream in move filter");
-    destIFolder->ReleaseSemaphore (myISupports);
     return NS_MSG_FOLDER_UNREADABLE;  // ### dmb
   }
 
-  nsCOMPtr<nsIMsgDatabase> destMailDB;
-
-  if (!localFolder)
-    return NS_MSG_POP_FILTER_TARGET_ERROR;
+  // Keep a copy of the message, as it's about to be cut off the download
+  // folder.
+  uint32_t batchLength = batch->data.Length();
+  if (!batch->data.SetLength(batchLength + messageLength, mozilla::fallible))
+    return NS_ERROR_OUT_OF_MEMORY;
+  char *buffer = batch->data.BeginWriting() + batchLength;
+  uint32_t length = messageLength;
+  while (length > 0)
+  {
+    uint32_t nRead;
+    rv = inputStream->Read(buffer, length, &nRead);
+    if (NS_FAILED(rv) || nRead == 0)
+      break;
+    buffer += nRead;
+    length -= nRead;
+  }
 
-  // don't force upgrade in place - open the db here before we start writing to the
-  // destination file because XP_Stat can return file size including bytes written...
-  rv = localFolder->GetDatabaseWOReparse(getter_AddRefs(destMailDB));
-  NS_WARNING_ASSERTION(destMailDB && NS_SUCCEEDED(rv),
-                       "failed to open mail db parsing folder");
   nsCOMPtr<nsIMsgDBHdr> newHdr;
-
-  if (destMailDB)
-    rv = destMailDB->CopyHdrFromExistingHdr(m_new_key, mailHdr, true,
-                                            getter_AddRefs(newHdr));
-  if (NS_SUCCEEDED(rv) && !newHdr)
-    rv = NS_ERROR_UNEXPECTED;
-
-  if (NS_FAILED(rv))
+  if (length == 0)
   {
-    destIFolder->ThrowAlertMsg("filterFolderHdrAddFailed", msgWindow);
-  } else {
-    rv = AppendMsgFromStream(inputStream, newHdr, messageLength, destIFolder);
+    rv = batch->db->CopyHdrFromExistingHdr(m_new_key, mailHdr, false,
+                                           getter_AddRefs(newHdr));
+    if (NS_SUCCEEDED(rv) && !newHdr)
+      rv = NS_ERROR_UNEXPECTED;
     if (NS_FAILED(rv))
-      destIFolder->ThrowAlertMsg("filterFolderWriteFailed", msgWindow);
+      destIFolder->ThrowAlertMsg("filterFolderHdrAddFailed", msgWindow);
+  }
+  else
+  {
+    NS_ERROR("didn't read all of original message in filter move");
+    destIFolder->ThrowAlertMsg("filterFolderWriteFailed", msgWindow);
+    rv = NS_MSG_ERROR_WRITING_MAIL_FOLDER;
   }
 
   if (NS_FAILED(rv))
   {
-    if (destMailDB)
-      destMailDB->Close(true);
-
-    destIFolder->ReleaseSemaphore(myISupports);
-
+    batch->data.SetLength(batchLength);
     return NS_MSG_ERROR_WRITING_MAIL_FOLDER;
   }
 
-  bool movedMsgIsNew = false;
-  // if we have made it this far then the message has successfully been written to the new folder
-  // now add the header to the destMailDB.
+  batch->hdrs.AppendObject(newHdr);
+  batch->lengths.AppendElement(messageLength);
+  m_moveBatchBytes += messageLength;
+  m_msgToForwardOrReply = newHdr;
 
-  uint32_t newFlags;
-  newHdr->GetFlags(&newFlags);
-  nsMsgKey msgKey;
-  newHdr->GetMessageKey(&msgKey);
-  if (!(newFlags & nsMsgMessageFlags::Read))
+  if (!m_filterTargetFolders.Contains(destIFolder))
+    m_filterTargetFolders.AppendObject(destIFolder);
+
+  nsCOMPtr<nsIMsgPluggableStore> store;
+  rv = m_downloadFolder->GetMsgStore(getter_AddRefs(store));
+  if (store)
+    store->DiscardNewMessage(m_outputStream, mailHdr);
+  if (sourceDB)
+    sourceDB->RemoveHeaderMdbRow(mailHdr);
+
+  if (m_moveBatchBytes >= FILTER_MOVE_BATCH_BYTES)
+    FlushMoveBatches();
+  return NS_OK;
+}
+
+nsresult nsParseNewMailState::FlushMoveBatches()
+{
+  nsresult rv = NS_OK;
+  nsTArray<mozilla::UniquePtr<nsFilterMoveBatch> > batches;
+  batches.SwapElements(m_moveBatches);
+  m_moveBatchBytes = 0;
+  for (uint32_t i = 0; i < batches.Length(); i++)
   {
-    nsCString junkScoreStr;
-    (void) newHdr->GetStringProperty("junkscore", getter_Copies(junkScoreStr));
-    if (atoi(junkScoreStr.get()) == nsIJunkMailPlugin::IS_HAM_SCORE)
-    {
-      newHdr->OrFlags(nsMsgMessageFlags::New, &newFlags);
-      destMailDB->AddToNewList(msgKey);
-      movedMsgIsNew = true;
-    }
+    nsresult rv2 = FlushMoveBatch(batches[i].get());
+    if (NS_FAILED(rv2))
+      rv = rv2;
   }
+  return rv;
+}
+
+/*
+ * Writes the messages of a batch to their folder through one output stream,
+ * and commits their headers to its database once. What can't be written is
+ * put back into the download folder, so that no message gets lost.
+ */
+nsresult nsParseNewMailState::FlushMoveBatch(nsFilterMoveBatch *aBatch)
+{
+  nsIMsgFolder *destIFolder = aBatch->folder;
+  nsIMsgDatabase *destMailDB = aBatch->db;
+  nsCOMPtr<nsIMsgLocalMailFolder> localFolder = do_QueryInterface(destIFolder);
   nsCOMPtr<nsIMsgFolderNotificationService> notifier(do_GetService(NS_MSGNOTIFICATIONSERVICE_CONTRACTID));
-  if (notifier)
-    notifier->NotifyMsgAdded(newHdr);
-  // mark the header as not yet reported classified
-  destIFolder->OrProcessingFlags(
-    msgKey, nsMsgProcessingFlags::NotReportedClassified);
-  m_msgToForwardOrReply = newHdr;
 
-  if (movedMsgIsNew)
-    destIFolder->SetHasNewMessages(true);
-  if (!m_filterTargetFolders.Contains(destIFolder))
-    m_filterTargetFolders.AppendObject(destIFolder);
+  // Make sure no one else is writing into this folder while the batch is
+  // written.
+  nsresult rv = destIFolder->AcquireSemaphore(aBatch->semaphoreHolder);
+  bool denied = NS_FAILED(rv);
+  if (denied)
+    destIFolder->ThrowAlertMsg("filterFolderDeniedLocked", m_msgWindow);
 
-  destIFolder->ReleaseSemaphore (myISupports);
+  nsCOMPtr<nsIMsgPluggableStore> store;
+  if (NS_SUCCEEDED(rv))
+    rv = destIFolder->GetMsgStore(getter_AddRefs(store));
+  nsCOMPtr<nsIOutputStream> destOutputStream;
+  bool reusable = false;
+  bool movedMsgIsNew = false;
+  uint32_t count = aBatch->hdrs.Count();
+  uint32_t offset = 0;
+  uint32_t written = 0;
+  for (; NS_SUCCEEDED(rv) && written < count; written++)
+  {
+    nsIMsgDBHdr *newHdr = aBatch->hdrs[written];
+    uint32_t length = aBatch->lengths[written];
+    // The store hands out the same stream again, moved to the end.
+    rv = store->GetNewMsgOutputStream(destIFolder, &newHdr, &reusable,
+                                      getter_AddRefs(destOutputStream));
+    if (NS_FAILED(rv))
+      break;
+    uint32_t bytesWritten;
+    rv = destOutputStream->Write(aBatch->data.get() + offset, length,
+                                 &bytesWritten);
+    if (NS_SUCCEEDED(rv) && bytesWritten != length)
+      rv = NS_MSG_ERROR_WRITING_MAIL_FOLDER;
+    if (NS_FAILED(rv))
+    {
+      store->DiscardNewMessage(destOutputStream, newHdr);
+      destOutputStream = nullptr;
+      break;
+    }
+    store->FinishNewMessage(destOutputStream, newHdr);
+    offset += length;
 
-  (void) localFolder->RefreshSizeOnDisk();
+    nsresult rv2 = destMailDB->AddNewHdrToDB(newHdr, true);
+    NS_WARNING_ASSERTION(NS_SUCCEEDED(rv2), "couldn't add moved msg hdr");
 
-  // Notify the message was moved.
-  if (notifier) {
-    nsCOMPtr<nsIMsgFolder> folder;
-    nsresult rv = mailHdr->GetFolder(getter_AddRefs(folder));
-    if (NS_SUCCEEDED(rv)) {
-      notifier->NotifyItemEvent(folder,
+    uint32_t newFlags;
+    newHdr->GetFlags(&newFlags);
+    nsMsgKey msgKey;
+    newHdr->GetMessageKey(&msgKey);
+    if (!(newFlags & nsMsgMessageFlags::Read))
+    {
+      nsCString junkScoreStr;
+      (void) newHdr->GetStringProperty("junkscore", getter_Copies(junkScoreStr));
+      if (atoi(junkScoreStr.get()) == nsIJunkMailPlugin::IS_HAM_SCORE)
+      {
+        newHdr->OrFlags(nsMsgMessageFlags::New, &newFlags);
+        destMailDB->AddToNewList(msgKey);
+        movedMsgIsNew = true;
+      }
+    }
+    if (notifier)
+      notifier->NotifyMsgAdded(newHdr);
+    // mark the header as not yet reported classified
+    destIFolder->OrProcessingFlags(
+      msgKey, nsMsgProcessingFlags::NotReportedClassified);
+
+    // Notify the message was moved.
+    if (notifier)
+      notifier->NotifyItemEvent(m_downloadFolder,
                                 NS_LITERAL_CSTRING("UnincorporatedMessageMoved"),
                                 newHdr,
                                 EmptyCString());
-    } else {
-      NS_WARNING("Can't get folder for message that was moved.");
+  }
+  // non-reusable streams get closed by the store.
+  if (destOutputStream && reusable)
+    destOutputStream->Close();
+  if (!denied)
+    destIFolder->ReleaseSemaphore(aBatch->semaphoreHolder);
+
+  if (written < count)
+  {
+    if (!denied)
+      destIFolder->ThrowAlertMsg("filterFolderWriteFailed", m_msgWindow);
+    // Append what's left to the download folder instead.
+    for (uint32_t i = written; i < count && m_mailDB; i++)
+    {
+      uint32_t length = aBatch->lengths[i];
+      nsCOMPtr<nsIInputStream> msgStream;
+      nsCOMPtr<nsIMsgDBHdr> inboxHdr;
+      if (NS_SUCCEEDED(NS_NewByteInputStream(getter_AddRefs(msgStream),
+                                             aBatch->data.get() + offset,
+                                             length, NS_ASSIGNMENT_DEPEND)) &&
+          NS_SUCCEEDED(m_mailDB->CopyHdrFromExistingHdr(nsMsgKey_None,
+                                                        aBatch->hdrs[i], false,
+                                                        getter_AddRefs(inboxHdr))) &&
+          NS_SUCCEEDED(AppendMsgFromStream(msgStream, inboxHdr, length,
+                                           m_downloadFolder)))
+        m_mailDB->AddNewHdrToDB(inboxHdr, true);
+      offset += length;
     }
   }
 
-  nsCOMPtr<nsIMsgPluggableStore> store;
-  rv = m_downloadFolder->GetMsgStore(getter_AddRefs(store));
-  if (store)
-    store->DiscardNewMessage(m_outputStream, mailHdr);
-  if (sourceDB)
-    sourceDB->RemoveHeaderMdbRow(mailHdr);
+  if (movedMsgIsNew)
+    destIFolder->SetHasNewMessages(true);
+
+  if (localFolder)
+    (void) localFolder->RefreshSizeOnDisk();
 
   // update the folder size so we won't reparse.
   UpdateDBFolderInfo(destMailDB);
   destIFolder->UpdateSummaryTotals(true);
 
   destMailDB->Commit(nsMsgDBCommitType::kLargeCommit);
-  return rv;
+  return written < count ? NS_MSG_ERROR_WRITING_MAIL_FOLDER : NS_OK;
 }
@@ -7,6 +7,7 @@
 #define nsParseMailbox_H
 
 #include "mozilla/Attributes.h"
+#include "mozilla/UniquePtr.h"
 #include "nsIURI.h"
 #include "nsIMsgParseMailMsgState.h"
 #include "nsIStreamListener.h"
@@ -185,6 +186,23 @@ private:
 
 };
 
+// how much of the messages moved by filters is held before writing them out
+#define FILTER_MOVE_BATCH_BYTES (4 * 1024 * 1024)
+
+// Messages moved into one folder by filters, waiting to be written there
+// together.
+struct nsFilterMoveBatch
+{
+  nsCOMPtr<nsIMsgFolder> folder;
+  nsCOMPtr<nsIMsgDatabase> db;
+  // what the folder's semaphore is acquired with while writing, not AddRef'ed
+  nsISupports *semaphoreHolder;
+  // headers in db, but not added to it yet
+  nsCOMArray<nsIMsgDBHdr> hdrs;
+  nsTArray<uint32_t> lengths;
+  nsCString data;
+};
+
 class nsParseNewMailState : public nsMsgMailboxParser
 , public nsIMsgFilterHitNotify
 {
@@ -208,6 +226,7 @@ public:
   virtual int32_t PublishMsgHeader(nsIMsgWindow *msgWindow) override;
   void            GetMsgWindow(nsIMsgWindow **aMsgWindow);
   nsresult EndMsgDownload();
+  nsresult FlushMoveBatches();
 
   nsresult AppendMsgFromStream(nsIInputStream *fileStream, nsIMsgDBHdr *aHdr,
                                uint32_t length, nsIMsgFolder *destFolder);
@@ -228,6 +247,7 @@ protected:
                                           nsIMsgFolder *destIFolder,
                                           nsIMsgFilter *filter,
                                           nsIMsgWindow *msgWindow);
+  nsresult         FlushMoveBatch(nsFilterMoveBatch *aBatch);
   virtual void     MarkFilteredMessageRead(nsIMsgDBHdr *msgHdr);
   virtual void     MarkFilteredMessageUnread(nsIMsgDBHdr *msgHdr);
 
@@ -240,6 +260,8 @@ protected:
   nsCOMArray <nsIMsgFolder> m_filterTargetFolders;
 
   RefPtr<nsImapMoveCoalescer> m_moveCoalescer;
+  nsTArray<mozilla::UniquePtr<nsFilterMoveBatch> > m_moveBatches;
+  uint32_t      m_moveBatchBytes;
 
   bool          m_msgMovedByFilter;
   bool          m_msgCopiedByFilter;
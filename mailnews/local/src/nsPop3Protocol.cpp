@@ -48,6 +48,10 @@
 #include "mozilla/Logging.h"
 #include "mozilla/Attributes.h"
 #include "mozilla/Preferences.h"
+#include "mozilla/EndianUtils.h"
+#include "nsClassHashtable.h"
+#include "nsDataHashtable.h"
+#include "nsHashKeys.h"
 
 using namespace mozilla;
 
@@ -69,26 +73,35 @@ uint32_t TimeInSecondsFromPRTime(PRTime prTime)
   return (uint32_t)(prTime / PR_USEC_PER_SEC);
 }
 
-static void
-put_hash(PLHashTable* table, const char* key, char value, uint32_t dateReceived)
+static Pop3UidlEntry*
+put_hash_entry(PLHashTable* table, const char* key, uint32_t keyLength,
+               char value, uint32_t dateReceived)
 {
   // don't put not used slots or empty uid into hash
-  if (key && *key)
+  if (!key || !keyLength || !*key)
+    return nullptr;
+
+  Pop3UidlEntry* tmp = PR_NEWZAP(Pop3UidlEntry);
+  if (tmp)
   {
-    Pop3UidlEntry* tmp = PR_NEWZAP(Pop3UidlEntry);
-    if (tmp)
+    tmp->uidl = PL_strndup(key, keyLength);
+    if (tmp->uidl)
     {
-      tmp->uidl = PL_strdup(key);
-      if (tmp->uidl)
-      {
-        tmp->dateReceived = dateReceived;
-        tmp->status = value;
-        PL_HashTableAdd(table, (const void *)tmp->uidl, (void*) tmp);
-      }
-      else
-        PR_Free(tmp);
+      tmp->dateReceived = dateReceived;
+      tmp->status = value;
+      PL_HashTableAdd(table, (const void *)tmp->uidl, (void*) tmp);
+      return tmp;
     }
+    PR_Free(tmp);
   }
+  return nullptr;
+}
+
+static void
+put_hash(PLHashTable* table, const char* key, char value, uint32_t dateReceived)
+{
+  if (key)
+    put_hash_entry(table, key, strlen(key), value, dateReceived);
 }
 
 static int
@@ -137,50 +150,417 @@ static PLHashAllocOps gHashAllocOps = {
     AllocUidlInfo, FreeUidlInfo
 };
 
+#define POPSTATE_FILE_NAME "popstate.dat"
+#define POPSTATE_STORE_FILE_NAME "popstate.bin"
+#define POPSTATE_JOURNAL_FILE_NAME "popstate.journal"
 
-static Pop3UidlHost*
-net_pop3_load_state(const char* searchhost,
-                    const char* searchuser,
-                    nsIFile *mailDirectory)
+/*
+ * popstate.dat had a line for every UIDL, so all of it was parsed when a
+ * session started and written again when it ended. It is converted once to
+ * popstate.bin, which has for every host and user: the host, the user and
+ * the number of UIDLs, and then each UIDL with its status and the date it was
+ * received. Strings have their length before them in 16 bits, and numbers
+ * are little endian. popstate.dat is kept for older versions, and only read
+ * again if one of them wrote it after popstate.bin.
+ *
+ * The changes made since then are appended to popstate.journal:
+ *   'p', host hash, status, date received, UIDL     for an added or changed UIDL
+ *   'r', host hash, UIDL hash                       for a removed one
+ * The hashes are 64 bit FNV-1a hashes of "host user" and the UIDL. Once the
+ * journal has grown to half the size of popstate.bin, popstate.bin is
+ * written again.
+ */
+static const char kPopStateStoreMagic[] = "POPSTAT1";
+static const char kPopStateJournalMagic[] = "POPJRNL1";
+#define POPSTATE_MAGIC_LEN 8
+#define POPSTATE_PUT 'p'
+#define POPSTATE_REMOVE 'r'
+// what is written to popstate.bin at once
+#define POPSTATE_WRITE_BUFFER_SIZE 65536
+
+static uint64_t
+net_pop3_hash(const char* str, uint32_t length,
+              uint64_t hash = UINT64_C(0xcbf29ce484222325))
 {
-  Pop3UidlHost* result = nullptr;
-  Pop3UidlHost* current = nullptr;
-  Pop3UidlHost* tmp;
+  for (uint32_t i = 0; i < length; i++)
+  {
+    hash ^= (uint8_t) str[i];
+    hash *= UINT64_C(0x100000001b3);
+  }
+  return hash;
+}
 
-  result = PR_NEWZAP(Pop3UidlHost);
-  if (!result)
-    return nullptr;
-  result->host = PL_strdup(searchhost);
-  result->user = PL_strdup(searchuser);
-  result->hash = PL_NewHashTable(20, PL_HashString, PL_CompareStrings, PL_CompareValues, &gHashAllocOps, nullptr);
+static uint64_t
+net_pop3_host_hash(Pop3UidlHost* host)
+{
+  uint64_t hash = net_pop3_hash(host->host, strlen(host->host));
+  hash = net_pop3_hash(" ", 1, hash);
+  return net_pop3_hash(host->user, strlen(host->user), hash);
+}
+
+static void
+net_pop3_append_uint32(nsACString &aData, uint32_t aValue)
+{
+  char buffer[4];
+  LittleEndian::writeUint32(buffer, aValue);
+  aData.Append(buffer, 4);
+}
+
+static void
+net_pop3_append_uint64(nsACString &aData, uint64_t aValue)
+{
+  char buffer[8];
+  LittleEndian::writeUint64(buffer, aValue);
+  aData.Append(buffer, 8);
+}
+
+static void
+net_pop3_append_string(nsACString &aData, const char* aStr)
+{
+  uint32_t length = strlen(aStr);
+  NS_ASSERTION(length <= UINT16_MAX, "string too long for popstate.bin");
+  if (length > UINT16_MAX)
+    length = UINT16_MAX;
+  char buffer[2];
+  LittleEndian::writeUint16(buffer, length);
+  aData.Append(buffer, 2);
+  aData.Append(aStr, length);
+}
+
+/**
+ * Reads the numbers and strings of popstate.bin and popstate.journal. Has()
+ * is false when a record was cut short.
+ */
+class PopStateReader
+{
+public:
+  explicit PopStateReader(const nsCString &aData)
+    : mCur(aData.get()), mEnd(aData.get() + aData.Length())
+  {
+  }
+
+  bool AtEnd() const { return mCur == mEnd; }
+  bool Has(uint32_t aLength) const { return uint32_t(mEnd - mCur) >= aLength; }
+
+  bool Magic(const char* aMagic)
+  {
+    if (!Has(POPSTATE_MAGIC_LEN) || memcmp(mCur, aMagic, POPSTATE_MAGIC_LEN))
+      return false;
+    mCur += POPSTATE_MAGIC_LEN;
+    return true;
+  }
+
+  uint8_t Uint8() { return (uint8_t) *mCur++; }
+
+  uint32_t Uint32()
+  {
+    uint32_t value = LittleEndian::readUint32(mCur);
+    mCur += 4;
+    return value;
+  }
 
+  uint64_t Uint64()
+  {
+    uint64_t value = LittleEndian::readUint64(mCur);
+    mCur += 8;
+    return value;
+  }
+
+  bool String(const char** aStr, uint32_t* aLength)
+  {
+    if (!Has(2))
+      return false;
+    *aLength = LittleEndian::readUint16(mCur);
+    mCur += 2;
+    if (!Has(*aLength))
+      return false;
+    *aStr = mCur;
+    mCur += *aLength;
+    return true;
+  }
+
+private:
+  const char* mCur;
+  const char* mEnd;
+};
+
+static void
+net_pop3_free_host(Pop3UidlHost* host)
+{
+  PR_Free(host->host);
+  PR_Free(host->user);
+  if (host->hash)
+    PL_HashTableDestroy(host->hash);
+  delete host;
+}
+
+static Pop3UidlHost*
+net_pop3_new_host(const char* host, uint32_t hostLength,
+                  const char* user, uint32_t userLength)
+{
+  Pop3UidlHost* result = new Pop3UidlHost();
+  result->host = PL_strndup(host, hostLength);
+  result->user = PL_strndup(user, userLength);
+  result->hash = PL_NewHashTable(20, PL_HashString, PL_CompareStrings, PL_CompareValues, &gHashAllocOps, nullptr);
   if (!result->host || !result->user || !result->hash)
   {
-    PR_Free(result->host);
-    PR_Free(result->user);
-    if (result->hash)
-      PL_HashTableDestroy(result->hash);
-    PR_Free(result);
+    net_pop3_free_host(result);
     return nullptr;
   }
+  return result;
+}
 
-  nsCOMPtr<nsIFile> popState;
-  mailDirectory->Clone(getter_AddRefs(popState));
-  if (!popState)
-    return nullptr;
-  popState->AppendNative(NS_LITERAL_CSTRING("popstate.dat"));
+// Finds the host and user in the list, or adds them after its first host.
+static Pop3UidlHost*
+net_pop3_find_host(Pop3UidlHost* hosts, const char* host, uint32_t hostLength,
+                   const char* user, uint32_t userLength)
+{
+  for (Pop3UidlHost* tmp = hosts; tmp; tmp = tmp->next)
+  {
+    if (!strncmp(host, tmp->host, hostLength) && !tmp->host[hostLength] &&
+        !strncmp(user, tmp->user, userLength) && !tmp->user[userLength])
+      return tmp;
+  }
+
+  Pop3UidlHost* current = net_pop3_new_host(host, hostLength, user, userLength);
+  if (current)
+  {
+    current->next = hosts->next;
+    hosts->next = current;
+  }
+  return current;
+}
+
+static already_AddRefed<nsIFile>
+net_pop3_state_file(nsIFile* mailDirectory, const char* name)
+{
+  nsCOMPtr<nsIFile> file;
+  mailDirectory->Clone(getter_AddRefs(file));
+  if (file)
+    file->AppendNative(nsDependentCString(name));
+  return file.forget();
+}
+
+static nsresult
+net_pop3_read_file(nsIFile* aFile, nsCString &aData)
+{
+  int64_t fileSize;
+  nsresult rv = aFile->GetFileSize(&fileSize);
+  if (NS_FAILED(rv))
+    return rv;
+
+  nsCOMPtr<nsIInputStream> fileStream;
+  rv = NS_NewLocalFileInputStream(getter_AddRefs(fileStream), aFile);
+  if (NS_FAILED(rv))
+    return rv;
+  rv = NS_ReadInputStreamToString(fileStream, aData, fileSize);
+  fileStream->Close();
+  return rv;
+}
+
+static int
+net_pop3_stored_state_mapper(PLHashEntry* he, int msgindex, void* arg)
+{
+  nsTArray<Pop3UidlState>* state = (nsTArray<Pop3UidlState>*) arg;
+  Pop3UidlEntry *uidlEntry = (Pop3UidlEntry *) he->value;
+  Pop3UidlState* uidlState = state->AppendElement();
+  uidlState->fingerprint = net_pop3_hash(uidlEntry->uidl, strlen(uidlEntry->uidl));
+  uidlState->dateReceived = uidlEntry->dateReceived;
+  uidlState->status = uidlEntry->status;
+  return HT_ENUMERATE_NEXT;
+}
+
+class Pop3UidlStateComparator
+{
+public:
+  bool Equals(const Pop3UidlState &a, const Pop3UidlState &b) const
+  {
+    return a.fingerprint == b.fingerprint;
+  }
+
+  bool LessThan(const Pop3UidlState &a, const Pop3UidlState &b) const
+  {
+    return a.fingerprint < b.fingerprint;
+  }
+};
+
+// Remembers the UIDLs of the host as they are in the store now.
+static void
+net_pop3_set_stored_state(Pop3UidlHost* host)
+{
+  host->storedState.Clear();
+  host->storedState.SetCapacity(host->hash->nentries);
+  PL_HashTableEnumerateEntries(host->hash, net_pop3_stored_state_mapper,
+                               (void *)&host->storedState);
+  host->storedState.Sort(Pop3UidlStateComparator());
+}
+
+// Reads popstate.bin into the hosts. Returns false if it can't be read.
+static bool
+net_pop3_load_store(Pop3UidlHost* hosts, nsIFile* storeFile)
+{
+  nsCString data;
+  if (NS_FAILED(net_pop3_read_file(storeFile, data)))
+    return false;
+
+  PopStateReader reader(data);
+  if (!reader.Magic(kPopStateStoreMagic))
+  {
+    NS_WARNING("popstate.bin is damaged, reading popstate.dat");
+    return false;
+  }
+
+  while (!reader.AtEnd())
+  {
+    const char *host, *user;
+    uint32_t hostLength, userLength;
+    if (!reader.String(&host, &hostLength) ||
+        !reader.String(&user, &userLength) || !reader.Has(4))
+      break;
+    uint32_t count = reader.Uint32();
+
+    Pop3UidlHost* current = net_pop3_find_host(hosts, host, hostLength,
+                                               user, userLength);
+    if (!current)
+      break;
+    current->inStore = true;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+      const char* uidl;
+      uint32_t uidlLength;
+      if (!reader.Has(5))
+        return true;
+      char status = reader.Uint8();
+      uint32_t dateReceived = reader.Uint32();
+      if (!reader.String(&uidl, &uidlLength))
+        return true;
+      put_hash_entry(current->hash, uidl, uidlLength, status, dateReceived);
+    }
+  }
+  return true;
+}
+
+static int
+net_pop3_hash_uidls_mapper(PLHashEntry* he, int msgindex, void* arg)
+{
+  nsDataHashtable<nsUint64HashKey, const char*>* uidls =
+    (nsDataHashtable<nsUint64HashKey, const char*>*) arg;
+  Pop3UidlEntry *uidlEntry = (Pop3UidlEntry *) he->value;
+  uidls->Put(net_pop3_hash(uidlEntry->uidl, strlen(uidlEntry->uidl)),
+             uidlEntry->uidl);
+  return HT_ENUMERATE_NEXT;
+}
+
+// Applies the changes in popstate.journal. Returns false if it is damaged,
+// e.g. the last change was cut short by a crash.
+static bool
+net_pop3_replay_journal(Pop3UidlHost* hosts, nsIFile* journalFile)
+{
+  bool exists;
+  if (NS_FAILED(journalFile->Exists(&exists)) || !exists)
+    return true;
+
+  nsCString data;
+  if (NS_FAILED(net_pop3_read_file(journalFile, data)))
+    return false;
+
+  PopStateReader reader(data);
+  if (!reader.Magic(kPopStateJournalMagic))
+    return false;
+
+  AutoTArray<uint64_t, 4> hostHashes;
+  for (Pop3UidlHost* host = hosts; host; host = host->next)
+    hostHashes.AppendElement(net_pop3_host_hash(host));
+  // the UIDLs of a host by their hash, made for the first one removed
+  nsClassHashtable<nsUint64HashKey,
+                   nsDataHashtable<nsUint64HashKey, const char*> > uidlsByHash;
+
+  while (!reader.AtEnd())
+  {
+    if (!reader.Has(1 + 8))
+      return false;
+    char type = reader.Uint8();
+    uint64_t hostHash = reader.Uint64();
+    Pop3UidlHost* host = hosts;
+    for (uint32_t i = 0; host && hostHashes[i] != hostHash; i++)
+      host = host->next;
+
+    if (type == POPSTATE_PUT)
+    {
+      const char* uidl;
+      uint32_t uidlLength;
+      if (!reader.Has(5))
+        return false;
+      char status = reader.Uint8();
+      uint32_t dateReceived = reader.Uint32();
+      if (!reader.String(&uidl, &uidlLength))
+        return false;
+      if (!host)
+        continue;
+
+      nsAutoCString key(uidl, uidlLength);
+      Pop3UidlEntry* uidlEntry =
+        (Pop3UidlEntry *) PL_HashTableLookup(host->hash, key.get());
+      if (uidlEntry)
+      {
+        uidlEntry->status = status;
+        uidlEntry->dateReceived = dateReceived;
+        continue;
+      }
+      uidlEntry = put_hash_entry(host->hash, uidl, uidlLength, status,
+                                 dateReceived);
+      nsDataHashtable<nsUint64HashKey, const char*>* uidls =
+        uidlsByHash.Get(hostHash);
+      if (uidlEntry && uidls)
+        uidls->Put(net_pop3_hash(uidl, uidlLength), uidlEntry->uidl);
+    }
+    else if (type == POPSTATE_REMOVE)
+    {
+      if (!reader.Has(8))
+        return false;
+      uint64_t uidlHash = reader.Uint64();
+      if (!host)
+        continue;
+
+      nsDataHashtable<nsUint64HashKey, const char*>* uidls =
+        uidlsByHash.Get(hostHash);
+      if (!uidls)
+      {
+        uidls = uidlsByHash.LookupOrAdd(hostHash);
+        PL_HashTableEnumerateEntries(host->hash, net_pop3_hash_uidls_mapper,
+                                     (void *)uidls);
+      }
+      const char* key;
+      if (uidls->Get(uidlHash, &key))
+      {
+        uidls->Remove(uidlHash);
+        PL_HashTableRemove(host->hash, key);
+      }
+    }
+    else
+      return false;
+  }
+  return true;
+}
+
+// Reads the old popstate.dat into the hosts.
+static void
+net_pop3_load_text_state(Pop3UidlHost* result, nsIFile* popState)
+{
+  Pop3UidlHost* current = nullptr;
 
   nsCOMPtr<nsIInputStream> fileStream;
   nsresult rv = NS_NewLocalFileInputStream(getter_AddRefs(fileStream), popState);
   // It is OK if the file doesn't exist. No state is stored yet.
   // Return empty list without warning.
   if (rv == NS_ERROR_FILE_NOT_FOUND)
-    return result;
+    return;
   // Warn for other errors.
-  NS_ENSURE_SUCCESS(rv, result);
+  NS_ENSURE_SUCCESS_VOID(rv);
 
   nsCOMPtr<nsILineInputStream> lineInputStream(do_QueryInterface(fileStream, &rv));
-  NS_ENSURE_SUCCESS(rv, result);
+  NS_ENSURE_SUCCESS_VOID(rv);
 
   bool more = true;
   nsCString line;
@@ -202,37 +582,8 @@ net_pop3_load_state(const char* searchhost,
       char *user = NS_strtok("\t\r\n", &lineBuf);
       if (!host || !user)
         continue;
-      for (tmp = result ; tmp ; tmp = tmp->next)
-      {
-        if (!strcmp(host, tmp->host) && !strcmp(user, tmp->user))
-        {
-          current = tmp;
-          break;
-        }
-      }
-      if (!current)
-      {
-        current = PR_NEWZAP(Pop3UidlHost);
-        if (current)
-        {
-          current->host = strdup(host);
-          current->user = strdup(user);
-          current->hash = PL_NewHashTable(20, PL_HashString, PL_CompareStrings, PL_CompareValues, &gHashAllocOps, nullptr);
-          if (!current->host || !current->user || !current->hash)
-          {
-            PR_Free(current->host);
-            PR_Free(current->user);
-            if (current->hash)
-              PL_HashTableDestroy(current->hash);
-            PR_Free(current);
-          }
-          else
-          {
-            current->next = result->next;
-            result->next = current;
-          }
-        }
-      }
+      current = net_pop3_find_host(result, host, strlen(host),
+                                   user, strlen(user));
     }
     else
     {
@@ -268,7 +619,61 @@ net_pop3_load_state(const char* searchhost,
     }
   }
   fileStream->Close();
+}
 
+static Pop3UidlHost*
+net_pop3_load_state(const char* searchhost,
+                    const char* searchuser,
+                    nsIFile *mailDirectory)
+{
+  Pop3UidlHost* result = net_pop3_new_host(searchhost, strlen(searchhost),
+                                           searchuser, strlen(searchuser));
+  if (!result)
+    return nullptr;
+
+  nsCOMPtr<nsIFile> storeFile =
+    net_pop3_state_file(mailDirectory, POPSTATE_STORE_FILE_NAME);
+  nsCOMPtr<nsIFile> journalFile =
+    net_pop3_state_file(mailDirectory, POPSTATE_JOURNAL_FILE_NAME);
+  nsCOMPtr<nsIFile> popState =
+    net_pop3_state_file(mailDirectory, POPSTATE_FILE_NAME);
+  if (!storeFile || !journalFile || !popState)
+    return result;
+
+  // popstate.dat is only newer than the store if an older version wrote it.
+  bool useStore = false;
+  bool exists;
+  if (NS_SUCCEEDED(storeFile->Exists(&exists)) && exists)
+  {
+    useStore = true;
+    PRTime textTime, storeTime, journalTime = 0;
+    if (NS_SUCCEEDED(popState->Exists(&exists)) && exists &&
+        NS_SUCCEEDED(popState->GetLastModifiedTime(&textTime)) &&
+        NS_SUCCEEDED(storeFile->GetLastModifiedTime(&storeTime)))
+    {
+      if (NS_FAILED(journalFile->GetLastModifiedTime(&journalTime)))
+        journalTime = 0;
+      useStore = textTime <= storeTime || textTime <= journalTime;
+    }
+  }
+
+  if (useStore && net_pop3_load_store(result, storeFile))
+  {
+    // Without all changes the store has to be written again, and the journal
+    // started over.
+    bool replayed = net_pop3_replay_journal(result, journalFile);
+    for (Pop3UidlHost* host = result; host; host = host->next)
+    {
+      if (!replayed)
+        host->inStore = false;
+      else if (host->inStore)
+        net_pop3_set_stored_state(host);
+    }
+    return result;
+  }
+
+  // The hosts aren't in the store yet, so it is written when the state is.
+  net_pop3_load_text_state(result, popState);
   return result;
 }
 
@@ -283,37 +688,41 @@ hash_clear_mapper(PLHashEntry* he, int msgindex, void* arg)
   return HT_ENUMERATE_REMOVE;
 }
 
-static int
-hash_empty_mapper(PLHashEntry* he, int msgindex, void* arg)
-{
-  *((bool*) arg) = false;
-  return HT_ENUMERATE_STOP;
-}
+typedef struct Pop3StoreWriter {
+  nsIOutputStream* stream;
+  nsCString buffer;
+  nsresult rv;
+} Pop3StoreWriter;
 
-static bool
-hash_empty(PLHashTable* hash)
+static void
+net_pop3_flush_store(Pop3StoreWriter* writer)
 {
-  bool result = true;
-  PL_HashTableEnumerateEntries(hash, hash_empty_mapper, (void *)&result);
-  return result;
+  if (NS_SUCCEEDED(writer->rv) && !writer->buffer.IsEmpty())
+  {
+    uint32_t numBytesWritten;
+    writer->rv = writer->stream->Write(writer->buffer.get(),
+                                       writer->buffer.Length(),
+                                       &numBytesWritten);
+    if (NS_SUCCEEDED(writer->rv) && numBytesWritten != writer->buffer.Length())
+      writer->rv = NS_ERROR_FAILURE;
+  }
+  writer->buffer.Truncate();
 }
 
-
 static int
 net_pop3_write_mapper(PLHashEntry* he, int msgindex, void* arg)
 {
-  nsIOutputStream* file = (nsIOutputStream*) arg;
+  Pop3StoreWriter* writer = (Pop3StoreWriter*) arg;
   Pop3UidlEntry *uidlEntry = (Pop3UidlEntry *) he->value;
   NS_ASSERTION((uidlEntry->status == KEEP) ||
     (uidlEntry->status == DELETE_CHAR) ||
     (uidlEntry->status == FETCH_BODY) ||
     (uidlEntry->status == TOO_BIG), "invalid status");
-  char* tmpBuffer = PR_smprintf("%c %s %d" MSG_LINEBREAK, uidlEntry->status, (char*)
-    uidlEntry->uidl, uidlEntry->dateReceived);
-  PR_ASSERT(tmpBuffer);
-  uint32_t numBytesWritten;
-  file->Write(tmpBuffer, strlen(tmpBuffer), &numBytesWritten);
-  PR_Free(tmpBuffer);
+  writer->buffer.Append(uidlEntry->status);
+  net_pop3_append_uint32(writer->buffer, uidlEntry->dateReceived);
+  net_pop3_append_string(writer->buffer, uidlEntry->uidl);
+  if (writer->buffer.Length() >= POPSTATE_WRITE_BUFFER_SIZE)
+    net_pop3_flush_store(writer);
   return HT_ENUMERATE_NEXT;
 }
 
@@ -327,42 +736,33 @@ net_pop3_delete_old_msgs_mapper(PLHashEntry* he, int msgindex, void* arg)
   return HT_ENUMERATE_NEXT;
 }
 
-static void
-net_pop3_write_state(Pop3UidlHost* host, nsIFile *mailDirectory)
+// Writes all hosts to popstate.bin, which then has everything the journal
+// and popstate.dat had.
+static nsresult
+net_pop3_write_store(Pop3UidlHost* host, nsIFile* storeFile)
 {
-  int32_t len = 0;
-  nsCOMPtr <nsIFile> popState;
-
-  mailDirectory->Clone(getter_AddRefs(popState));
-  if (!popState)
-    return;
-  popState->AppendNative(NS_LITERAL_CSTRING("popstate.dat"));
-
   nsCOMPtr<nsIOutputStream> fileOutputStream;
-  nsresult rv = MsgNewSafeBufferedFileOutputStream(getter_AddRefs(fileOutputStream), popState, -1, 00600);
-  if (NS_FAILED(rv))
-    return;
-
-  const char tmpBuffer[] =
-    "# POP3 State File" MSG_LINEBREAK
-    "# This is a generated file!  Do not edit." MSG_LINEBREAK
-    MSG_LINEBREAK;
+  nsresult rv = MsgNewSafeBufferedFileOutputStream(getter_AddRefs(fileOutputStream), storeFile, -1, 00600);
+  NS_ENSURE_SUCCESS(rv, rv);
 
-  uint32_t numBytesWritten;
-  fileOutputStream->Write(tmpBuffer, strlen(tmpBuffer), &numBytesWritten);
+  Pop3StoreWriter writer;
+  writer.stream = fileOutputStream;
+  writer.rv = NS_OK;
+  writer.buffer.Append(kPopStateStoreMagic, POPSTATE_MAGIC_LEN);
 
-  for (; host && (len >= 0); host = host->next)
+  for (; host && NS_SUCCEEDED(writer.rv); host = host->next)
   {
-    if (!hash_empty(host->hash))
+    if (host->hash->nentries)
     {
-      fileOutputStream->Write("*", 1, &numBytesWritten);
-      fileOutputStream->Write(host->host, strlen(host->host), &numBytesWritten);
-      fileOutputStream->Write(" ", 1, &numBytesWritten);
-      fileOutputStream->Write(host->user, strlen(host->user), &numBytesWritten);
-      fileOutputStream->Write(MSG_LINEBREAK, MSG_LINEBREAK_LEN, &numBytesWritten);
-      PL_HashTableEnumerateEntries(host->hash, net_pop3_write_mapper, (void *)fileOutputStream);
+      net_pop3_append_string(writer.buffer, host->host);
+      net_pop3_append_string(writer.buffer, host->user);
+      net_pop3_append_uint32(writer.buffer, host->hash->nentries);
+      PL_HashTableEnumerateEntries(host->hash, net_pop3_write_mapper, (void *)&writer);
     }
   }
+  net_pop3_flush_store(&writer);
+  NS_ENSURE_SUCCESS(writer.rv, writer.rv);
+
   nsCOMPtr<nsISafeOutputStream> safeStream = do_QueryInterface(fileOutputStream);
   NS_ASSERTION(safeStream, "expected a safe output stream!");
   if (safeStream) {
@@ -371,6 +771,165 @@ net_pop3_write_state(Pop3UidlHost* host, nsIFile *mailDirectory)
       NS_WARNING("failed to save pop state! possible data loss");
     }
   }
+  return rv;
+}
+
+typedef struct Pop3JournalDiff {
+  Pop3UidlHost* host;
+  uint64_t hostHash;
+  nsTArray<bool> seen; // the stored UIDLs still there
+  nsCString* journal;
+} Pop3JournalDiff;
+
+static int
+net_pop3_diff_mapper(PLHashEntry* he, int msgindex, void* arg)
+{
+  Pop3JournalDiff* diff = (Pop3JournalDiff*) arg;
+  Pop3UidlEntry *uidlEntry = (Pop3UidlEntry *) he->value;
+
+  Pop3UidlState state = {
+    net_pop3_hash(uidlEntry->uidl, strlen(uidlEntry->uidl)), 0, 0 };
+  size_t index = diff->host->storedState.BinaryIndexOf(state,
+                                                       Pop3UidlStateComparator());
+  if (index != diff->host->storedState.NoIndex)
+  {
+    diff->seen[index] = true;
+    const Pop3UidlState &stored = diff->host->storedState[index];
+    if (stored.status == uidlEntry->status &&
+        stored.dateReceived == uidlEntry->dateReceived)
+      return HT_ENUMERATE_NEXT;
+  }
+
+  diff->journal->Append(POPSTATE_PUT);
+  net_pop3_append_uint64(*diff->journal, diff->hostHash);
+  diff->journal->Append(uidlEntry->status);
+  net_pop3_append_uint32(*diff->journal, uidlEntry->dateReceived);
+  net_pop3_append_string(*diff->journal, uidlEntry->uidl);
+  return HT_ENUMERATE_NEXT;
+}
+
+// Adds what changed in a host since it was read from the store, or last
+// written, to the journal.
+static void
+net_pop3_diff_host(Pop3UidlHost* host, nsCString &aJournal)
+{
+  Pop3JournalDiff diff;
+  diff.host = host;
+  diff.hostHash = net_pop3_host_hash(host);
+  diff.seen.InsertElementsAt(0, host->storedState.Length(), false);
+  diff.journal = &aJournal;
+  PL_HashTableEnumerateEntries(host->hash, net_pop3_diff_mapper, (void *)&diff);
+
+  for (uint32_t i = 0; i < diff.seen.Length(); i++)
+  {
+    if (!diff.seen[i])
+    {
+      aJournal.Append(POPSTATE_REMOVE);
+      net_pop3_append_uint64(aJournal, diff.hostHash);
+      net_pop3_append_uint64(aJournal, host->storedState[i].fingerprint);
+    }
+  }
+}
+
+static nsresult
+net_pop3_append_journal(nsIFile* journalFile, const nsCString &aJournal,
+                        int64_t* aJournalSize)
+{
+  int64_t fileSize = 0;
+  bool exists;
+  if (NS_FAILED(journalFile->Exists(&exists)) || !exists ||
+      NS_FAILED(journalFile->GetFileSize(&fileSize)))
+    fileSize = 0;
+
+  // start over if there isn't a journal yet
+  nsAutoCString magic;
+  int32_t ioFlags = PR_WRONLY | PR_CREATE_FILE | PR_APPEND;
+  if (fileSize < POPSTATE_MAGIC_LEN)
+  {
+    magic.Assign(kPopStateJournalMagic, POPSTATE_MAGIC_LEN);
+    ioFlags = PR_WRONLY | PR_CREATE_FILE | PR_TRUNCATE;
+    fileSize = 0;
+  }
+
+  nsCOMPtr<nsIOutputStream> stream;
+  nsresult rv = NS_NewLocalFileOutputStream(getter_AddRefs(stream),
+                                            journalFile, ioFlags, 00600);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  uint32_t numBytesWritten;
+  if (!magic.IsEmpty())
+  {
+    rv = stream->Write(magic.get(), magic.Length(), &numBytesWritten);
+    if (NS_SUCCEEDED(rv) && numBytesWritten != magic.Length())
+      rv = NS_ERROR_FAILURE;
+  }
+  if (NS_SUCCEEDED(rv))
+  {
+    rv = stream->Write(aJournal.get(), aJournal.Length(), &numBytesWritten);
+    if (NS_SUCCEEDED(rv) && numBytesWritten != aJournal.Length())
+      rv = NS_ERROR_FAILURE;
+  }
+  nsresult closeRv = stream->Close();
+  NS_ENSURE_SUCCESS(rv, rv);
+  NS_ENSURE_SUCCESS(closeRv, closeRv);
+
+  *aJournalSize = fileSize + magic.Length() + aJournal.Length();
+  return NS_OK;
+}
+
+static void
+net_pop3_write_state(Pop3UidlHost* hosts, nsIFile *mailDirectory)
+{
+  nsCOMPtr<nsIFile> storeFile =
+    net_pop3_state_file(mailDirectory, POPSTATE_STORE_FILE_NAME);
+  nsCOMPtr<nsIFile> journalFile =
+    net_pop3_state_file(mailDirectory, POPSTATE_JOURNAL_FILE_NAME);
+  if (!storeFile || !journalFile)
+    return;
+
+  int64_t storeSize = 0;
+  bool exists;
+  bool writeStore = NS_FAILED(storeFile->Exists(&exists)) || !exists ||
+                    NS_FAILED(storeFile->GetFileSize(&storeSize));
+
+  // Only what changed goes to the journal. A host which isn't in the store
+  // yet, e.g. from popstate.dat, has the whole store written.
+  nsCString journal;
+  for (Pop3UidlHost* host = hosts; host && !writeStore; host = host->next)
+  {
+    if (host->inStore)
+      net_pop3_diff_host(host, journal);
+    else if (host->hash->nentries)
+      writeStore = true;
+  }
+
+  if (!writeStore)
+  {
+    if (journal.IsEmpty())
+      return;
+    int64_t journalSize;
+    nsresult rv = net_pop3_append_journal(journalFile, journal, &journalSize);
+    writeStore = NS_FAILED(rv) || journalSize > storeSize / 2;
+  }
+
+  if (writeStore)
+  {
+    if (NS_FAILED(net_pop3_write_store(hosts, storeFile)))
+      return;
+    // popstate.dat is left alone, so an older version going back to it
+    // doesn't download all messages again.
+    journalFile->Remove(false);
+  }
+
+  for (Pop3UidlHost* host = hosts; host; host = host->next)
+  {
+    if (writeStore)
+      host->inStore = host->hash->nentries != 0;
+    if (host->inStore)
+      net_pop3_set_stored_state(host);
+    else
+      host->storedState.Clear();
+  }
 }
 
 static void
@@ -380,10 +939,7 @@ net_pop3_free_state(Pop3UidlHost* host)
   while (host)
   {
     h = host->next;
-    PR_Free(host->host);
-    PR_Free(host->user);
-    PL_HashTableDestroy(host->hash);
-    PR_Free(host);
+    net_pop3_free_host(host);
     host = h;
   }
 }
@@ -483,6 +1039,13 @@ nsresult nsPop3Protocol::Initialize(nsIURI * aURL)
   m_password_already_sent = false;
   m_currentAuthMethod = POP3_AUTH_MECH_UNDEFINED;
   m_needToRerunUrl = false;
+  m_pipelining = false;
+  m_pipelineBytes = 0;
+  m_pipelineNextMsg = 0;
+  m_pipelineSerialState = POP3_GET_MSG;
+  m_pipelineSerialTruncating = false;
+  m_pipelinePaused = false;
+  m_pipelineResponseState = POP3_RETR_RESPONSE;
 
   m_url = aURL;
 
@@ -1510,6 +2073,9 @@ int32_t nsPop3Protocol::SendCapa()
     if(!m_pop3ConData->command_succeeded)
         return Error("pop3ServerError");
 
+    // only what this server says now
+    ClearCapFlag(POP3_HAS_PIPELINING);
+
     nsAutoCString command("CAPA" CRLF);
 
     m_pop3ConData->next_state_after_response = POP3_CAPA_RESPONSE;
@@ -1580,6 +2146,13 @@ int32_t nsPop3Protocol::CapaResponse(nsIInputStream* inputStream,
       m_pop3Server->SetPop3CapabilityFlags(m_pop3ConData->capability_flags);
     }
     else
+    // see RFC 2449, chapter 6.6
+    if (!PL_strcasecmp(line, "PIPELINING"))
+    {
+      SetCapFlag(POP3_HAS_PIPELINING);
+      m_pop3Server->SetPop3CapabilityFlags(m_pop3ConData->capability_flags);
+    }
+    else
     // see RFC 2449, chapter 6.3
     if (!PL_strncasecmp(line, "SASL", 4) && strlen(line) > 6)
     {
@@ -2913,7 +3486,8 @@ int32_t nsPop3Protocol::GetMsg()
 {
   int32_t popstateTimestamp = TimeInSecondsFromPRTime(PR_Now());
 
-  if (m_pop3ConData->last_accessed_msg >= m_pop3ConData->number_of_messages)
+  if (m_pop3ConData->last_accessed_msg >= m_pop3ConData->number_of_messages &&
+      m_pipeline.IsEmpty())
   {
     /* Oh, gee, we're all done. */
     if(m_pop3ConData->msg_del_started)
@@ -3054,8 +3628,24 @@ int32_t nsPop3Protocol::GetMsg()
       // the pop3 sink know.
       rv = m_nsIPop3Sink->SetMsgsToDownload(m_pop3ConData->really_new_messages);
     }
+
+    // Pipeline the RETR and DELE commands if the server supports it. XSENDER
+    // has to be answered before each RETR, so then they go one by one.
+    m_pipelining = TestCapFlag(POP3_HAS_PIPELINING) &&
+                   m_pop3ConData->msg_info && !m_pop3ConData->only_uidl &&
+                   !(m_prefAuthMethods != POP3_HAS_AUTH_USER &&
+                     TestCapFlag(POP3_HAS_XSENDER));
+    m_pipeline.Clear();
+    m_pipelineCommands.Truncate();
+    m_pipelineBytes = 0;
+    m_pipelineNextMsg = m_pop3ConData->last_accessed_msg;
+    m_pipelineSerialState = POP3_GET_MSG;
+    m_pipelinePaused = false;
   }
 
+  if (m_pipelining)
+    return GetMsgPipelined();
+
   /* Look at this message, and decide whether to ignore it, get it, just get
   the TOP of it, or delete it. */
 
@@ -3080,85 +3670,10 @@ int32_t nsPop3Protocol::GetMsg()
     }
     else
     {
-      char c = 0;
-      if (!m_pop3ConData->newuidl)
-      {
-        m_pop3ConData->newuidl = PL_NewHashTable(20, PL_HashString, PL_CompareStrings, PL_CompareValues, &gHashAllocOps, nullptr);
-        if (!m_pop3ConData->newuidl)
-          return MK_OUT_OF_MEMORY;
-      }
-      if (info->uidl)
-      {
-        Pop3UidlEntry *uidlEntry = (Pop3UidlEntry *) PL_HashTableLookup(m_pop3ConData->uidlinfo->hash, info->uidl);
-        if (uidlEntry)
-        {
-          c = uidlEntry->status;
-          popstateTimestamp = uidlEntry->dateReceived;
-        }
-      }
-      if (c == DELETE_CHAR)
-      {
-        m_pop3ConData->next_state = POP3_SEND_DELE;
-      }
-      else if (c == KEEP)
-      {
-        // this is a message we've already downloaded and left on server;
-        // Advance to next message.
-        m_pop3ConData->next_state = POP3_GET_MSG;
-      }
-      else if (c == FETCH_BODY)
-      {
-        m_pop3ConData->next_state = POP3_SEND_RETR;
-        PL_HashTableRemove (m_pop3ConData->uidlinfo->hash, (void*)info->uidl);
-      }
-      else if ((c != TOO_BIG) &&
-        (TestCapFlag(POP3_TOP_UNDEFINED | POP3_HAS_TOP)) &&
-        (m_pop3ConData->headers_only ||
-         ((m_pop3ConData->size_limit > 0) &&
-          (info->size > m_pop3ConData->size_limit) &&
-          !m_pop3ConData->only_uidl)) &&
-        info->uidl && *info->uidl)
-      {
-        // message is too big
-        m_pop3ConData->truncating_cur_msg = true;
-        m_pop3ConData->next_state = POP3_SEND_TOP;
-        put_hash(m_pop3ConData->newuidl, info->uidl, TOO_BIG, popstateTimestamp);
-      }
-      else if (c == TOO_BIG)
-      {
-        /* message previously left on server, see if the max download size
-        has changed, because we may want to download the message this time
-        around. Otherwise ignore the message, we have the header. */
-        if ((m_pop3ConData->size_limit > 0) && (info->size <=
-          m_pop3ConData->size_limit))
-          PL_HashTableRemove (m_pop3ConData->uidlinfo->hash, (void*)info->uidl);
-        // remove from our table, and download
-        else
-        {
-          m_pop3ConData->truncating_cur_msg = true;
-          m_pop3ConData->next_state = POP3_GET_MSG;
-          // ignore this message and get next one
-          put_hash(m_pop3ConData->newuidl, info->uidl, TOO_BIG, popstateTimestamp);
-        }
-      }
-
-      if (m_pop3ConData->next_state != POP3_SEND_DELE &&
-          info->uidl)
-      {
-        /* This is a message we have decided to keep on the server. Notate
-            that now for the future. (Don't change the popstate file at all
-            if only_uidl is set; in that case, there might be brand new messages
-            on the server that we *don't* want to mark KEEP; we just want to
-            leave them around until the user next does a GetNewMail.) */
-
-        /* If this is a message we already know about (i.e., it was
-            in popstate.dat already), we need to maintain the original
-            date the message was downloaded. */
-        if (m_pop3ConData->truncating_cur_msg)
-          put_hash(m_pop3ConData->newuidl, info->uidl, TOO_BIG, popstateTimestamp);
-        else
-          put_hash(m_pop3ConData->newuidl, info->uidl, KEEP, popstateTimestamp);
-      }
+      int32_t status = ChooseMsgAction(info, &m_pop3ConData->next_state,
+                                       &m_pop3ConData->truncating_cur_msg);
+      if (status < 0)
+        return status;
     }
     if (m_pop3ConData->next_state == POP3_GET_MSG)
       m_pop3ConData->last_accessed_msg++;
@@ -3167,6 +3682,218 @@ int32_t nsPop3Protocol::GetMsg()
   return 0;
 }
 
+/* Decide whether to get the message, just the TOP of it, skip it or delete
+   it, and note in newuidl what becomes of it. aAction comes in with the state
+   to get it. */
+int32_t nsPop3Protocol::ChooseMsgAction(Pop3MsgInfo* info,
+                                        Pop3StatesEnum* aAction,
+                                        bool* aTruncating)
+{
+  int32_t popstateTimestamp = TimeInSecondsFromPRTime(PR_Now());
+  char c = 0;
+  if (!m_pop3ConData->newuidl)
+  {
+    m_pop3ConData->newuidl = PL_NewHashTable(20, PL_HashString, PL_CompareStrings, PL_CompareValues, &gHashAllocOps, nullptr);
+    if (!m_pop3ConData->newuidl)
+      return MK_OUT_OF_MEMORY;
+  }
+  if (info->uidl)
+  {
+    Pop3UidlEntry *uidlEntry = (Pop3UidlEntry *) PL_HashTableLookup(m_pop3ConData->uidlinfo->hash, info->uidl);
+    if (uidlEntry)
+    {
+      c = uidlEntry->status;
+      popstateTimestamp = uidlEntry->dateReceived;
+    }
+  }
+  if (c == DELETE_CHAR)
+  {
+    *aAction = POP3_SEND_DELE;
+  }
+  else if (c == KEEP)
+  {
+    // this is a message we've already downloaded and left on server;
+    // Advance to next message.
+    *aAction = POP3_GET_MSG;
+  }
+  else if (c == FETCH_BODY)
+  {
+    *aAction = POP3_SEND_RETR;
+    PL_HashTableRemove (m_pop3ConData->uidlinfo->hash, (void*)info->uidl);
+  }
+  else if ((c != TOO_BIG) &&
+    (TestCapFlag(POP3_TOP_UNDEFINED | POP3_HAS_TOP)) &&
+    (m_pop3ConData->headers_only ||
+     ((m_pop3ConData->size_limit > 0) &&
+      (info->size > m_pop3ConData->size_limit) &&
+      !m_pop3ConData->only_uidl)) &&
+    info->uidl && *info->uidl)
+  {
+    // message is too big
+    *aTruncating = true;
+    *aAction = POP3_SEND_TOP;
+    put_hash(m_pop3ConData->newuidl, info->uidl, TOO_BIG, popstateTimestamp);
+  }
+  else if (c == TOO_BIG)
+  {
+    /* message previously left on server, see if the max download size
+    has changed, because we may want to download the message this time
+    around. Otherwise ignore the message, we have the header. */
+    if ((m_pop3ConData->size_limit > 0) && (info->size <=
+      m_pop3ConData->size_limit))
+      PL_HashTableRemove (m_pop3ConData->uidlinfo->hash, (void*)info->uidl);
+    // remove from our table, and download
+    else
+    {
+      *aTruncating = true;
+      *aAction = POP3_GET_MSG;
+      // ignore this message and get next one
+      put_hash(m_pop3ConData->newuidl, info->uidl, TOO_BIG, popstateTimestamp);
+    }
+  }
+
+  if (*aAction != POP3_SEND_DELE &&
+      info->uidl)
+  {
+    /* This is a message we have decided to keep on the server. Notate
+        that now for the future. (Don't change the popstate file at all
+        if only_uidl is set; in that case, there might be brand new messages
+        on the server that we *don't* want to mark KEEP; we just want to
+        leave them around until the user next does a GetNewMail.) */
+
+    /* If this is a message we already know about (i.e., it was
+        in popstate.dat already), we need to maintain the original
+        date the message was downloaded. */
+    if (*aTruncating)
+      put_hash(m_pop3ConData->newuidl, info->uidl, TOO_BIG, popstateTimestamp);
+    else
+      put_hash(m_pop3ConData->newuidl, info->uidl, KEEP, popstateTimestamp);
+  }
+  return 0;
+}
+
+/* With PIPELINING, the messages ahead are decided on, and their RETR and
+   DELE commands sent in one go, up to POP3_PIPELINE_WINDOW_BYTES of messages
+   still to come. The responses are then read in the order the commands were
+   sent. A message which needs TOP is only started once all of them are in. */
+int32_t nsPop3Protocol::GetMsgPipelined()
+{
+  if (m_pipelinePaused)
+  {
+    // done with that message, unless a filter wants all of it now
+    m_pipelinePaused = false;
+    m_pipelineNextMsg = m_pop3ConData->last_accessed_msg;
+  }
+
+  while (m_pipelineSerialState == POP3_GET_MSG &&
+         m_pipelineNextMsg < m_pop3ConData->number_of_messages &&
+         (m_pipeline.IsEmpty() ||
+          (m_pipeline.Length() < POP3_PIPELINE_MAX_COMMANDS &&
+           m_pipelineBytes < POP3_PIPELINE_WINDOW_BYTES)))
+  {
+    Pop3MsgInfo* info = m_pop3ConData->msg_info + m_pipelineNextMsg;
+    Pop3StatesEnum action = POP3_SEND_RETR;
+    bool truncating = false;
+    int32_t status = ChooseMsgAction(info, &action, &truncating);
+    if (status < 0)
+      return status;
+
+    if (action == POP3_SEND_RETR)
+      QueuePipelinedCommand("RETR", m_pipelineNextMsg, POP3_RETR_RESPONSE,
+                            info->size);
+    else if (action == POP3_SEND_DELE)
+      QueuePipelinedCommand("DELE", m_pipelineNextMsg, POP3_DELE_RESPONSE, 0);
+    else if (action != POP3_GET_MSG)
+    {
+      m_pipelineSerialState = action;
+      m_pipelineSerialTruncating = truncating;
+      break;
+    }
+    m_pipelineNextMsg++;
+  }
+
+  int32_t status = SendPipelinedCommands();
+  if (status < 0)
+    return status;
+
+  m_pop3ConData->pause_for_read = false;
+  if (!m_pipeline.IsEmpty())
+  {
+    // Read the response to the oldest command. It may be buffered already.
+    Pop3PipelinedCommand command = m_pipeline[0];
+    m_pipeline.RemoveElementAt(0);
+    m_pipelineBytes -= command.size;
+    m_pipelineResponseState = command.responseState;
+    m_pop3ConData->truncating_cur_msg = false;
+    if (command.responseState == POP3_RETR_RESPONSE)
+    {
+      m_pop3ConData->last_accessed_msg = command.msgIndex;
+      PrepareRetr();
+    }
+    else
+    {
+      // SendDele() already went on to the next message
+      m_pop3ConData->last_accessed_msg = command.msgIndex + 1;
+    }
+    m_pop3ConData->next_state_after_response = command.responseState;
+    m_pop3ConData->next_state = POP3_WAIT_FOR_RESPONSE;
+    return 0;
+  }
+
+  if (m_pipelineSerialState != POP3_GET_MSG)
+  {
+    m_pop3ConData->last_accessed_msg = m_pipelineNextMsg;
+    m_pop3ConData->truncating_cur_msg = m_pipelineSerialTruncating;
+    m_pop3ConData->next_state = m_pipelineSerialState;
+    m_pipelineSerialState = POP3_GET_MSG;
+    m_pipelineResponseState = POP3_RETR_RESPONSE;
+    m_pipelinePaused = true;
+    return 0;
+  }
+
+  // all messages are done
+  m_pop3ConData->last_accessed_msg = m_pop3ConData->number_of_messages;
+  m_pop3ConData->next_state = POP3_GET_MSG;
+  return 0;
+}
+
+void nsPop3Protocol::QueuePipelinedCommand(const char* aCommand,
+                                           int32_t aMsgIndex,
+                                           Pop3StatesEnum aResponseState,
+                                           int32_t aSize)
+{
+  m_pipelineCommands.Append(aCommand);
+  m_pipelineCommands.Append(' ');
+  m_pipelineCommands.AppendInt(m_pop3ConData->msg_info[aMsgIndex].msgnum);
+  m_pipelineCommands.AppendLiteral(CRLF);
+
+  Pop3PipelinedCommand* command = m_pipeline.AppendElement();
+  command->msgIndex = aMsgIndex;
+  command->responseState = aResponseState;
+  command->size = std::max(aSize, 0);
+  m_pipelineBytes += command->size;
+}
+
+int32_t nsPop3Protocol::SendPipelinedCommands()
+{
+  if (m_pipelineCommands.IsEmpty())
+    return 0;
+
+  // Unlike Pop3SendData(), this keeps what is buffered of the responses to
+  // the commands sent before.
+  nsresult rv = nsMsgProtocol::SendData(m_pipelineCommands.get());
+  MOZ_LOG(POP3LOGMODULE, LogLevel::Info,
+          (POP3LOG("SEND: %s"), m_pipelineCommands.get()));
+  m_pipelineCommands.Truncate();
+  if (NS_FAILED(rv))
+  {
+    m_pop3ConData->next_state = POP3_ERROR_DONE;
+    MOZ_LOG(POP3LOGMODULE, LogLevel::Info, (POP3LOG("SendPipelinedCommands failed: %" PRIx32), static_cast<uint32_t>(rv)));
+    return -1;
+  }
+  return 0;
+}
+
 
 /* start retrieving just the first 20 lines
  */
@@ -3227,6 +3954,43 @@ int32_t nsPop3Protocol::XsenderResponse()
     return 0;
 }
 
+/* get ready for the response to RETR
+ */
+void
+nsPop3Protocol::PrepareRetr()
+{
+  m_pop3ConData->cur_msg_size = -1;
+
+
+  /* zero the bytes received in message in preparation for
+  * the next
+  */
+  m_bytesInMsgReceived = 0;
+
+  if (m_pop3ConData->only_uidl)
+  {
+    /* Display bytes if we're only downloading one message. */
+    PR_ASSERT(!m_pop3ConData->graph_progress_bytes_p);
+    UpdateProgressPercent(0, m_totalDownloadSize);
+    m_pop3ConData->graph_progress_bytes_p = true;
+  }
+  else
+  {
+    nsString finalString;
+    mozilla::DebugOnly<nsresult> rv =
+      FormatCounterString(NS_LITERAL_STRING("receivingMessages"),
+                          m_pop3ConData->real_new_counter,
+                          m_pop3ConData->really_new_messages,
+                          finalString);
+    NS_ASSERTION(NS_SUCCEEDED(rv), "couldn't format string");
+    if (mProgressEventSink) {
+      rv = mProgressEventSink->OnStatus(this, m_channelContext, NS_OK,
+                                        finalString.get());
+      NS_ASSERTION(NS_SUCCEEDED(rv), "dropping error result");
+    }
+  }
+}
+
 /* retrieve the whole message
  */
 int32_t
@@ -3238,37 +4002,7 @@ nsPop3Protocol::SendRetr()
   if (cmd)
   {
     m_pop3ConData->next_state_after_response = POP3_RETR_RESPONSE;
-    m_pop3ConData->cur_msg_size = -1;
-
-
-    /* zero the bytes received in message in preparation for
-    * the next
-    */
-    m_bytesInMsgReceived = 0;
-
-    if (m_pop3ConData->only_uidl)
-    {
-      /* Display bytes if we're only downloading one message. */
-      PR_ASSERT(!m_pop3ConData->graph_progress_bytes_p);
-      UpdateProgressPercent(0, m_totalDownloadSize);
-      m_pop3ConData->graph_progress_bytes_p = true;
-    }
-    else
-    {
-      nsString finalString;
-      mozilla::DebugOnly<nsresult> rv =
-        FormatCounterString(NS_LITERAL_STRING("receivingMessages"),
-                            m_pop3ConData->real_new_counter,
-                            m_pop3ConData->really_new_messages,
-                            finalString);
-      NS_ASSERTION(NS_SUCCEEDED(rv), "couldn't format string");
-      if (mProgressEventSink) {
-        rv = mProgressEventSink->OnStatus(this, m_channelContext, NS_OK,
-                                          finalString.get());
-        NS_ASSERTION(NS_SUCCEEDED(rv), "dropping error result");
-      }
-    }
-
+    PrepareRetr();
     status = Pop3SendData(cmd);
   } // if cmd
   PR_Free(cmd);
@@ -3333,6 +4067,10 @@ nsPop3Protocol::RetrResponse(nsIInputStream* inputStream,
         m_pop3ConData->assumed_end = false;
 
         m_pop3Server->GetDotFix(&m_pop3ConData->dot_fix);
+        // The responses to pipelined commands follow right after the end of
+        // the message, so a wrong size can't be made up for.
+        if (m_pipelining && !m_pipelinePaused)
+          m_pop3ConData->dot_fix = false;
 
         MOZ_LOG(POP3LOGMODULE,LogLevel::Info,
                 (POP3LOG("Opening message stream: MSG_IncorporateBegin")));
@@ -3383,6 +4121,10 @@ nsPop3Protocol::RetrResponse(nsIInputStream* inputStream,
           m_pop3ConData->parsed_bytes += buffer_size - MSG_LINEBREAK_LEN + 2;
         }
 
+        // Leave what follows the end of the message for the next response.
+        if (!m_pop3ConData->msg_closure)
+          break;
+
         // now read in the next line
         PR_Free(line);
         line = m_lineStreamBuffer->ReadNextLine(inputStream, buffer_size,
@@ -3621,6 +4363,16 @@ nsPop3Protocol::HandleLine(char *line, uint32_t line_length)
 
 int32_t nsPop3Protocol::SendDele()
 {
+    if (m_pipelining && !m_pipelinePaused)
+    {
+      // after the commands already sent; GetMsgPipelined() sends it
+      QueuePipelinedCommand("DELE", m_pop3ConData->last_accessed_msg,
+                            POP3_DELE_RESPONSE, 0);
+      m_pop3ConData->next_state = POP3_GET_MSG;
+      m_pop3ConData->pause_for_read = false;
+      return 0;
+    }
+
     /* increment the last accessed message since we have now read it
      */
     char * cmd = PR_smprintf("DELE %ld" CRLF, m_pop3ConData->msg_info[m_pop3ConData->last_accessed_msg].msgnum);
@@ -3706,8 +4458,24 @@ nsPop3Protocol::CommitState(bool remove_last_entry)
         uidl from the hash, because it might have been put in there before
         we got it into the database.
       */
+      // With pipelining, the messages asked for ahead were noted in newuidl
+      // as well, but haven't come in.
+      for (uint32_t i = 0; i < m_pipeline.Length(); i++)
+      {
+        Pop3MsgInfo* info = m_pop3ConData->msg_info + m_pipeline[i].msgIndex;
+        if (m_pipeline[i].responseState == POP3_RETR_RESPONSE && info->uidl)
+          PL_HashTableRemove(m_pop3ConData->newuidl, info->uidl);
+      }
+      if (m_pipelineSerialState != POP3_GET_MSG)
+      {
+        Pop3MsgInfo* info = m_pop3ConData->msg_info + m_pipelineNextMsg;
+        if (info->uidl)
+          PL_HashTableRemove(m_pop3ConData->newuidl, info->uidl);
+      }
+
       if (remove_last_entry && m_pop3ConData->msg_info &&
-          !m_pop3ConData->only_uidl && m_pop3ConData->newuidl->nentries > 0)
+          !m_pop3ConData->only_uidl && m_pop3ConData->newuidl->nentries > 0 &&
+          !(m_pipelining && m_pipelineResponseState == POP3_DELE_RESPONSE))
       {
         Pop3MsgInfo* info = m_pop3ConData->msg_info + m_pop3ConData->last_accessed_msg;
         if (info && info->uidl)
@@ -20,6 +20,7 @@
 
 #include "prerror.h"
 #include "plhash.h"
+#include "nsTArray.h"
 #include "nsCOMPtr.h"
 
 /* A more guaranteed way of making sure that we never get duplicate messages
@@ -48,6 +49,11 @@ and change the POP3_QUIT_RESPONSE state to flush the newly committed deletes. */
 
 #define OUTPUT_BUFFER_SIZE 8192 // maximum size of command string
 
+// With PIPELINING, RETR and DELE are sent ahead until the messages still to
+// come add up to this many bytes, or there are this many commands.
+#define POP3_PIPELINE_WINDOW_BYTES (256 * 1024)
+#define POP3_PIPELINE_MAX_COMMANDS 64
+
 /* structure to hold data pertaining to the active state of
  * a transfer in progress.
  *
@@ -75,7 +81,8 @@ enum Pop3CapabilityEnum {
     POP3_HAS_RESP_CODES         = 0x00020000,
     POP3_HAS_AUTH_RESP_CODE     = 0x00040000,
     POP3_HAS_STLS               = 0x00080000,
-    POP3_HAS_AUTH_GSSAPI        = 0x00100000
+    POP3_HAS_AUTH_GSSAPI        = 0x00100000,
+    POP3_HAS_PIPELINING         = 0x00200000
 };
 
 // TODO use value > 0?
@@ -163,12 +170,24 @@ typedef struct Pop3UidlEntry { /* information about this message */
     uint32_t dateReceived; // time message received, used for aging
 } Pop3UidlEntry;
 
+// A UIDL the way the popstate store has it, found by a 64 bit hash of the
+// UIDL.
+typedef struct Pop3UidlState {
+    uint64_t fingerprint;
+    uint32_t dateReceived;
+    char  status;
+} Pop3UidlState;
+
 typedef struct Pop3UidlHost {
     char* host;
     char* user;
     PLHashTable * hash;
     Pop3UidlEntry* uidlEntries;
     struct Pop3UidlHost* next;
+    // What the store has for this host, sorted by fingerprint, so only the
+    // changes have to be added to its journal. Only valid if inStore.
+    nsTArray<Pop3UidlState> storedState;
+    bool inStore;
 } Pop3UidlHost;
 
 typedef struct Pop3MsgInfo {
@@ -177,6 +196,14 @@ typedef struct Pop3MsgInfo {
     char* uidl;
 } Pop3MsgInfo;
 
+// With PIPELINING (RFC 2449), a RETR or DELE sent before the responses to
+// the commands ahead of it have come in.
+typedef struct Pop3PipelinedCommand {
+    int32_t msgIndex;               // into msg_info
+    Pop3StatesEnum responseState;   // POP3_RETR_RESPONSE or POP3_DELE_RESPONSE
+    int32_t size;                   // of the message to come for a RETR
+} Pop3PipelinedCommand;
+
 typedef struct _Pop3ConData {
     bool leave_on_server;     /* Whether we're supposed to leave messages
                                    on server. */
@@ -342,6 +369,19 @@ private:
 
   int32_t m_listpos;
 
+  // RETR and DELE are pipelined if the server supports it.
+  bool m_pipelining;
+  nsTArray<Pop3PipelinedCommand> m_pipeline; // responses still to come
+  nsCString m_pipelineCommands;   // queued in m_pipeline, but not sent yet
+  int64_t m_pipelineBytes;        // of the messages in m_pipeline
+  int32_t m_pipelineNextMsg;      // the first message not decided on yet
+  // The message which needs its responses before the next commands are sent,
+  // e.g. for TOP, and what to do with it; POP3_GET_MSG if none.
+  Pop3StatesEnum m_pipelineSerialState;
+  bool m_pipelineSerialTruncating;
+  bool m_pipelinePaused;          // that message is being handled
+  Pop3StatesEnum m_pipelineResponseState; // of the response being read
+
   nsresult HandleLine(char *line, uint32_t line_length);
 
   nsresult GetApopTimestamp();
@@ -383,9 +423,16 @@ private:
   int32_t SendUidlList();
   int32_t GetUidlList(nsIInputStream* inputStream, uint32_t length);
   int32_t GetMsg();
+  int32_t ChooseMsgAction(Pop3MsgInfo* info, Pop3StatesEnum* aAction,
+                          bool* aTruncating);
+  int32_t GetMsgPipelined();
+  void QueuePipelinedCommand(const char* aCommand, int32_t aMsgIndex,
+                             Pop3StatesEnum aResponseState, int32_t aSize);
+  int32_t SendPipelinedCommands();
   int32_t SendTop();
   int32_t SendXsender();
   int32_t XsenderResponse();
+  void PrepareRetr();
   int32_t SendRetr();
 
   int32_t RetrResponse(nsIInputStream* inputStream, uint32_t length);
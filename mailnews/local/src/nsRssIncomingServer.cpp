@@ -83,6 +83,11 @@ NS_IMETHODIMP nsRssIncomingServer::GetFeedItemsDataSourcePath(nsIFile ** aLocati
   return FillInDataSourcePath(NS_LITERAL_STRING("feeditems.rdf"), aLocation);
 }
 
+NS_IMETHODIMP nsRssIncomingServer::GetFeedItemsStorePath(nsIFile ** aLocation)
+{
+  return FillInDataSourcePath(NS_LITERAL_STRING("feeditems.dat"), aLocation);
+}
+
 NS_IMETHODIMP nsRssIncomingServer::CreateDefaultMailboxes()
 {
   // For Feeds, all we have is Trash.
@@ -0,0 +1,164 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+ * Tests the journal backed store of seen feed items which replaced
+ * feeditems.rdf, and measures loading and looking up a large store.
+ */
+
+const {FeedItemStore} = ChromeUtils.import("resource:///modules/FeedItemStore.jsm");
+const {FileUtils} = ChromeUtils.import("resource://gre/modules/FileUtils.jsm");
+
+var kFeed = "http://example.com/feed.xml";
+var kOtherFeed = "http://example.org/atom";
+
+function storeFile(aName) {
+  let file = do_get_profile().clone();
+  file.append(aName);
+  if (file.exists()) {
+    file.remove(false);
+  }
+  return file;
+}
+
+function test_items() {
+  let file = storeFile("feeditems-items.dat");
+  let store = new FeedItemStore(file);
+  Assert.equal(store.count, 0);
+
+  store.markStored("urn:feeditem:1", kFeed);
+  store.markValid("urn:feeditem:1", kFeed, 1000);
+  store.markValid("urn:feeditem:2", kFeed, 1000);
+  store.markValid("urn:feeditem:2", kOtherFeed, 2000);
+  // Non-ASCII in urls and item ids survives the round trip.
+  store.markStored("urn:feeditem:%C3%A9t%C3%A9", "http://example.com/été");
+  store.flush();
+
+  Assert.ok(store.isStored("urn:feeditem:1"));
+  Assert.ok(!store.isStored("urn:feeditem:2"));
+  Assert.ok(!store.isStored("urn:feeditem:3"));
+  Assert.deepEqual(store.getFeedItems(kFeed).sort(),
+                   ["urn:feeditem:1", "urn:feeditem:2"]);
+
+  store = new FeedItemStore(file);
+  Assert.equal(store.count, 3);
+  Assert.deepEqual(store.getItem("urn:feeditem:2"),
+                   { stored: false, valid: true, lastSeen: 2000,
+                     feeds: [kFeed, kOtherFeed] });
+  Assert.ok(store.isStored("urn:feeditem:%C3%A9t%C3%A9"));
+  Assert.deepEqual(store.getFeedItems("http://example.com/été"),
+                   ["urn:feeditem:%C3%A9t%C3%A9"]);
+
+  // Items not in the feed document any more are kept until they have not
+  // been seen for a while.
+  store.invalidateFeedItems(kFeed);
+  store.markValid("urn:feeditem:1", kFeed, 5000);
+  Assert.equal(store.removeInvalidFeedItems(kFeed, 500), 0);
+  Assert.equal(store.removeInvalidFeedItems(kFeed, 2000), 1);
+  // Item 2 is still in the other feed.
+  Assert.deepEqual(store.getItem("urn:feeditem:2").feeds, [kOtherFeed]);
+  store.invalidateFeedItems(kOtherFeed);
+  Assert.equal(store.removeInvalidFeedItems(kOtherFeed, Infinity), 1);
+  Assert.equal(store.getItem("urn:feeditem:2"), null);
+  Assert.deepEqual(store.getFeedItems(kOtherFeed), []);
+  store.flush();
+
+  store = new FeedItemStore(file);
+  Assert.equal(store.count, 2);
+  Assert.equal(store.getItem("urn:feeditem:1").lastSeen, 5000);
+  Assert.equal(store.getItem("urn:feeditem:2"), null);
+}
+
+function test_journal() {
+  let file = storeFile("feeditems-journal.dat");
+  let store = new FeedItemStore(file);
+  for (let i = 0; i < 100; i++) {
+    store.markValid("urn:feeditem:" + i, kFeed, i);
+  }
+  store.flush();
+  let size = file.fileSize;
+
+  // Changing one item appends one line.
+  store.markStored("urn:feeditem:7", kFeed);
+  store.flush();
+  Assert.ok(file.fileSize > size);
+  Assert.ok(file.fileSize < size + 100);
+  // Nothing to write.
+  size = file.fileSize;
+  store.flush();
+  Assert.equal(file.fileSize, size);
+
+  // A line cut short by a crash is skipped, and the journal rewritten.
+  let fos = FileUtils.openFileOutputStream(file,
+    FileUtils.MODE_WRONLY | FileUtils.MODE_APPEND);
+  let partial = "[\"urn:feeditem:100\",1,1,";
+  fos.write(partial, partial.length);
+  fos.close();
+  store = new FeedItemStore(file);
+  Assert.equal(store.count, 100);
+  Assert.ok(store.isStored("urn:feeditem:7"));
+  store.flush();
+  Assert.ok(file.fileSize < size);
+  Assert.equal(new FeedItemStore(file).count, 100);
+
+  // Once the journal has plenty of superseded records it is rewritten.
+  for (let round = 0; round < 30; round++) {
+    store.invalidateFeedItems(kFeed);
+    for (let i = 0; i < 100; i++) {
+      store.markValid("urn:feeditem:" + i, kFeed, round);
+    }
+    store.flush();
+  }
+  Assert.ok(store.mJournalRecords <= 2 * 100 + store.kCompactionSlack);
+  store = new FeedItemStore(file);
+  Assert.equal(store.count, 100);
+  Assert.equal(store.getItem("urn:feeditem:99").lastSeen, 29);
+}
+
+function test_large() {
+  const kItems = 200000;
+  const kFeeds = 2000;
+  let file = storeFile("feeditems-large.dat");
+  let store = new FeedItemStore(file);
+  let start = Date.now();
+  for (let i = 0; i < kItems; i++) {
+    let uri = "urn:feeditem:http%3A%2f%2fexample.com%2fpost%2f" + i;
+    store.markStored(uri, "http://example.com/feed" + (i % kFeeds));
+    store.markValid(uri, "http://example.com/feed" + (i % kFeeds), i);
+  }
+  store.flush();
+  info("Added " + kItems + " items in " + (Date.now() - start) + "ms, " +
+       file.fileSize + " bytes");
+
+  start = Date.now();
+  store = new FeedItemStore(file);
+  info("Loaded " + store.count + " items in " + (Date.now() - start) + "ms");
+  Assert.equal(store.count, kItems);
+
+  start = Date.now();
+  let found = 0;
+  for (let i = 0; i < kItems * 2; i++) {
+    found += store.isStored("urn:feeditem:http%3A%2f%2fexample.com%2fpost%2f" + i);
+  }
+  info("Looked up " + kItems * 2 + " items in " + (Date.now() - start) + "ms");
+  Assert.equal(found, kItems);
+
+  // Checking one feed only writes the records of its items.
+  let size = file.fileSize;
+  start = Date.now();
+  store.invalidateFeedItems("http://example.com/feed5");
+  for (let uri of store.getFeedItems("http://example.com/feed5")) {
+    store.markValid(uri, "http://example.com/feed5", kItems);
+  }
+  store.flush();
+  info("Updated one feed in " + (Date.now() - start) + "ms, appending " +
+       (file.fileSize - size) + " bytes");
+  Assert.ok(file.fileSize - size < size / 100);
+}
+
+function run_test() {
+  test_items();
+  test_journal();
+  test_large();
+}
@@ -0,0 +1,143 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+ * Tests that messages which pop3 move filters send to several folders all
+ * end up whole in their folders when they are written out together, and
+ * that the others stay in the inbox.
+ */
+
+/* import-globals-from ../../../test/resources/POP3pump.js */
+load("../../../resources/POP3pump.js");
+
+var gFiles = [];
+for (let i = 1; i <= 30; i++) {
+  let name = ["plaintext", "plaintext+attachment", "HTML", "HTML+attachment",
+              "HTML+embedded-image", "plaintext+HMTL",
+              "plaintext+(HTML+embedded-image)",
+              "plaintext+HTML+attachment",
+              "(HTML+embedded-image)+attachment",
+              "plaintext+(HTML+embedded-image)+attachment"][(i - 1) % 10];
+  gFiles.push("../../../data/" + (i < 10 ? "0" : "") + i + "-" + name + ".eml");
+}
+
+Services.prefs.setBoolPref("mail.server.default.leave_on_server", true);
+
+// Currently we have two mailbox storage formats.
+var gPluggableStores = [
+  "@mozilla.org/msgstore/berkeleystore;1",
+  "@mozilla.org/msgstore/maildirstore;1",
+];
+
+// the first filter which matches the subject moves the message
+var gMoves = [
+  { subject: "attachment", folder: "Attachments", count: 15 },
+  { subject: "embedded image", folder: "Images", count: 6 },
+  { subject: "HTML", folder: "Html", count: 3 },
+];
+
+var gTestArray = [
+  function createFilters() {
+    let filterList = gPOP3Pump.fakeServer.getFilterList(null);
+    gMoves.forEach((move, i) => {
+      let filter = filterList.createFilter("Move" + move.folder);
+      let searchTerm = filter.createTerm();
+      searchTerm.attrib = Ci.nsMsgSearchAttrib.Subject;
+      searchTerm.op = Ci.nsMsgSearchOp.Contains;
+      let value = searchTerm.value;
+      value.attrib = Ci.nsMsgSearchAttrib.Subject;
+      value.str = move.subject;
+      searchTerm.value = value;
+      filter.appendTerm(searchTerm);
+      let moveAction = filter.createAction();
+      moveAction.type = Ci.nsMsgFilterAction.MoveToFolder;
+      moveAction.targetFolderUri = move.destFolder.URI;
+      filter.appendAction(moveAction);
+      filter.enabled = true;
+      filter.filterType = Ci.nsMsgFilterType.InboxRule;
+      filterList.insertFilterAt(i, filter);
+    });
+  },
+  async function getLocalMessages() {
+    gPOP3Pump.files = gFiles;
+    await gPOP3Pump.run();
+  },
+  function verifyFolders() {
+    let subjects = [];
+    for (let move of gMoves) {
+      // only locked while a batch is written
+      Assert.ok(!move.destFolder.locked);
+      let hdrs = folderHdrs(move.destFolder);
+      Assert.equal(hdrs.length, move.count);
+      for (let hdr of hdrs) {
+        Assert.equal(gMoves.find(m => hdr.subject.includes(m.subject)), move);
+        subjects.push(hdr.subject);
+      }
+      checkMessagesWhole(move.destFolder, hdrs);
+    }
+
+    let inboxHdrs = folderHdrs(localAccountUtils.inboxFolder);
+    Assert.equal(inboxHdrs.length, 6);
+    for (let hdr of inboxHdrs) {
+      Assert.ok(!gMoves.some(m => hdr.subject.includes(m.subject)));
+      subjects.push(hdr.subject);
+    }
+    Assert.equal(new Set(subjects).size, gFiles.length);
+  },
+];
+
+function folderHdrs(folder) {
+  let hdrs = [];
+  let enumerator = folder.msgDatabase.EnumerateMessages();
+  while (enumerator.hasMoreElements())
+    hdrs.push(enumerator.getNext().QueryInterface(Ci.nsIMsgDBHdr));
+  return hdrs;
+}
+
+// In an mbox, the messages follow each other without a gap, up to the end.
+function checkMessagesWhole(folder, hdrs) {
+  if (folder.msgStore.storeType != "mbox")
+    return;
+  hdrs.sort((a, b) => a.messageOffset - b.messageOffset);
+  let end = 0;
+  for (let hdr of hdrs) {
+    Assert.equal(hdr.messageOffset, end);
+    end = hdr.messageOffset + hdr.messageSize;
+  }
+  Assert.equal(folder.filePath.fileSize, end);
+}
+
+function setup_store(storeID) {
+  return function _setup_store() {
+    // Reset pop3Pump with correct mailbox format.
+    gPOP3Pump.resetPluggableStore(storeID);
+
+    // Make sure we're not quarantining messages
+    Services.prefs.setBoolPref("mailnews.downloadToTempFile", false);
+
+    if (!localAccountUtils.inboxFolder)
+      localAccountUtils.loadLocalMailAccount();
+
+    for (let move of gMoves) {
+      move.destFolder = localAccountUtils.rootFolder
+                                         .createLocalSubfolder(move.folder);
+    }
+  };
+}
+
+function run_test() {
+  for (let store of gPluggableStores) {
+    add_task(setup_store(store));
+    gTestArray.forEach(x => add_task(x));
+  }
+
+  add_task(exitTest);
+  run_next_test();
+}
+
+function exitTest() {
+  // Cleanup and exit the test.
+  info("Exiting mail tests\n");
+  gPOP3Pump = null;
+}
@@ -0,0 +1,170 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+ * Tests that RETR and DELE are pipelined when the server advertises
+ * PIPELINING, and are sent one by one when it doesn't. The server takes a
+ * while to answer, so that the commands sent ahead arrive before it does.
+ */
+
+var server;
+var daemon;
+var extraProps;
+var incomingServer;
+var thisTest;
+var test;
+
+var kLatency = 100;
+var kMessages = ["message1.eml", "message2.eml", "message3.eml",
+                 "message1.eml", "message2.eml", "message3.eml",
+                 "message1.eml", "message2.eml", "message3.eml"];
+
+function commands(aCommand) {
+  return kMessages.map((message, i) => aCommand + " " + (i + 1));
+}
+
+var tests = [{
+  title: "Pipelined",
+  capabilities: ["UIDL", "PIPELINING"],
+  pipelined: true,
+  transaction: ["AUTH", "CAPA", "AUTH PLAIN", "STAT", "LIST", "UIDL",
+                ...commands("RETR"), ...commands("DELE")],
+}, {
+  title: "Serial",
+  capabilities: ["UIDL"],
+  pipelined: false,
+  transaction: ["CAPA", "AUTH PLAIN", "STAT", "LIST", "UIDL",
+                ...[].concat(...kMessages.map((message, i) =>
+                  ["RETR " + (i + 1), "DELE " + (i + 1)]))],
+}];
+
+// Checks whether the RETR and DELE commands were sent without waiting for
+// the answers to the commands before them.
+function checkAnswered(aTransaction) {
+  // as in do_check_transaction, the last reader is the one of this test
+  if (aTransaction instanceof Array)
+    aTransaction = aTransaction[aTransaction.length - 1];
+  let {them, answered} = aTransaction;
+  let firstRetr = them.indexOf("RETR 1");
+  let firstDele = them.indexOf("DELE 1");
+  Assert.ok(firstRetr > 0);
+  Assert.ok(firstDele > 0);
+
+  if (!thisTest.pipelined) {
+    for (let i = firstRetr; i < them.length; i++)
+      Assert.equal(answered[i], i, them[i] + " was sent after all answers");
+    return;
+  }
+
+  // All RETR commands went out in one batch, before the first was answered.
+  for (let i = firstRetr; i < firstRetr + kMessages.length; i++)
+    Assert.equal(answered[i], firstRetr, them[i] + " was sent in the batch");
+  // Each DELE went out as its message came in, before the DELE before it
+  // was answered.
+  for (let i = firstDele + 1; i < firstDele + kMessages.length; i++)
+    Assert.ok(answered[i] < i, them[i] + " was sent ahead");
+}
+
+var urlListener = {
+  OnStartRunningUrl(url) {
+  },
+  OnStopRunningUrl(url, result) {
+    try {
+      let transaction = server.playTransaction();
+      do_check_transaction(transaction, thisTest.transaction);
+      checkAnswered(transaction);
+      Assert.equal(result, 0);
+    } catch (e) {
+      // If we have an error, clean up nicely before we throw it.
+      server.stop();
+
+      var thread = gThreadManager.currentThread;
+      while (thread.hasPendingEvents())
+        thread.processNextEvent(true);
+
+      do_throw(e);
+    }
+
+    // Let OnStopRunningUrl return cleanly before doing anything else.
+    do_timeout(0, checkBusy);
+  },
+};
+
+function checkBusy() {
+  if (tests.length == 0) {
+    incomingServer.closeCachedConnections();
+
+    // No more tests, let everything finish
+    server.stop();
+
+    var thread = gThreadManager.currentThread;
+    while (thread.hasPendingEvents())
+      thread.processNextEvent(true);
+
+    // Every message came in both times.
+    Assert.equal(localAccountUtils.inboxFolder.getTotalMessages(false),
+                 2 * kMessages.length);
+
+    do_test_finished();
+    return;
+  }
+
+  // If the server hasn't quite finished, just delay a little longer.
+  if (incomingServer.serverBusy ||
+      (incomingServer instanceof Ci.nsIPop3IncomingServer &&
+       incomingServer.runningProtocol)) {
+    do_timeout(20, checkBusy);
+    return;
+  }
+
+  testNext();
+}
+
+function testNext() {
+  thisTest = tests.shift();
+
+  // Handle the server in a try/catch/finally loop so that we always will stop
+  // the server if something fails.
+  try {
+    server.resetTest();
+
+    // Set up the test
+    test = thisTest.title;
+    extraProps.kCapabilities = thisTest.capabilities;
+    daemon.setMessages(kMessages);
+
+    // Now get the mail
+    MailServices.pop3.GetNewMail(null, urlListener, localAccountUtils.inboxFolder,
+                                 incomingServer);
+
+    server.performTest();
+  } catch (e) {
+    server.stop();
+
+    do_throw(e);
+  } finally {
+    var thread = gThreadManager.currentThread;
+    while (thread.hasPendingEvents())
+      thread.processNextEvent(true);
+  }
+}
+
+function run_test() {
+  // Disable new mail notifications
+  Services.prefs.setBoolPref("mail.biff.play_sound", false);
+  Services.prefs.setBoolPref("mail.biff.show_alert", false);
+  Services.prefs.setBoolPref("mail.biff.show_tray_icon", false);
+  Services.prefs.setBoolPref("mail.biff.animate_dock_icon", false);
+
+  [daemon, server, extraProps] = setupServerDaemon();
+  server.setLatency(kLatency);
+  server.start();
+
+  // Set up the basic accounts and folders
+  incomingServer = createPop3ServerAndLocalFolders(server.port);
+
+  do_test_pending();
+
+  testNext();
+}
@@ -0,0 +1,146 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+ * Tests that a popstate.dat with a million UIDLs is converted to the binary
+ * popstate.bin once, that marking messages after that only appends the
+ * changes to popstate.journal, and that the journal is read back, or thrown
+ * away with the store written again when a crash left it damaged.
+ */
+
+var {IOUtils} = ChromeUtils.import("resource:///modules/IOUtils.js");
+
+var kUidls = 1000000;
+var kDateReceived = 1500000000;
+var kPOP3_PORT = 1024 + 110;
+// the marks of nsIMsgLocalMailFolder.idl
+var kKeep = 0;
+var kDelete = 1;
+var kFetchBody = 2;
+
+function localFile(aServer, aName) {
+  let file = aServer.localPath;
+  file.append(aName);
+  return file;
+}
+
+function readFile(aFile) {
+  let stream = Cc["@mozilla.org/network/file-input-stream;1"]
+                 .createInstance(Ci.nsIFileInputStream);
+  stream.init(aFile, -1, 0, 0);
+  let binaryStream = Cc["@mozilla.org/binaryinputstream;1"]
+                       .createInstance(Ci.nsIBinaryInputStream);
+  binaryStream.setInputStream(stream);
+  let length = binaryStream.available();
+  let buffer = new ArrayBuffer(length);
+  binaryStream.readArrayBuffer(length, buffer);
+  binaryStream.close();
+  return buffer;
+}
+
+function readString(aView, aPos) {
+  let length = aView.getUint16(aPos, true);
+  let bytes = new Uint8Array(aView.buffer, aPos + 2, length);
+  return [String.fromCharCode(...bytes), aPos + 2 + length];
+}
+
+// Returns the status of every UIDL of fred@localhost in popstate.bin.
+function readStore(aFile) {
+  let view = new DataView(readFile(aFile));
+  Assert.equal(String.fromCharCode(...new Uint8Array(view.buffer, 0, 8)),
+               "POPSTAT1");
+  let statuses = new Map();
+  let pos = 8;
+  while (pos < view.byteLength) {
+    let host, user;
+    [host, pos] = readString(view, pos);
+    [user, pos] = readString(view, pos);
+    let count = view.getUint32(pos, true);
+    pos += 4;
+    for (let i = 0; i < count; i++) {
+      let status = String.fromCharCode(view.getUint8(pos));
+      Assert.equal(view.getUint32(pos + 1, true), kDateReceived);
+      let uidl;
+      [uidl, pos] = readString(view, pos + 5);
+      if (host == "localhost" && user == "fred")
+        statuses.set(uidl, status);
+    }
+  }
+  Assert.equal(pos, view.byteLength);
+  return statuses;
+}
+
+function appendToFile(aFile, aData) {
+  let stream = Cc["@mozilla.org/network/file-output-stream;1"]
+                 .createInstance(Ci.nsIFileOutputStream);
+  // PR_WRONLY | PR_APPEND
+  stream.init(aFile, 0x02 | 0x10, -1, 0);
+  stream.write(aData, aData.length);
+  stream.close();
+}
+
+function mark(aServer, aUidl, aMark) {
+  aServer.addUidlToMark(aUidl, aMark);
+  aServer.markMessages();
+}
+
+function run_test() {
+  let server = localAccountUtils.create_incoming_server("pop3", kPOP3_PORT,
+                                                        "fred", "wilma")
+                                .QueryInterface(Ci.nsIPop3IncomingServer);
+  let popState = localFile(server, "popstate.dat");
+  let store = localFile(server, "popstate.bin");
+  let journal = localFile(server, "popstate.journal");
+
+  let lines = ["# POP3 State File", "", "*localhost fred"];
+  for (let i = 0; i < kUidls; i++)
+    lines.push("k UIDL" + i + " " + kDateReceived);
+  lines.push("*otherhost fred", "k OTHER1 " + kDateReceived, "");
+  IOUtils.saveStringToFile(popState, lines.join("\n"));
+
+  // The first change converts popstate.dat.
+  let start = Date.now();
+  mark(server, "UIDL5", kDelete);
+  info("Converted " + kUidls + " UIDLs in " + (Date.now() - start) + "ms");
+  Assert.ok(store.exists());
+  // popstate.dat is left for older versions.
+  Assert.ok(popState.exists());
+  Assert.ok(!journal.exists());
+  let statuses = readStore(store);
+  Assert.equal(statuses.size, kUidls);
+  Assert.equal(statuses.get("UIDL5"), "d");
+  Assert.equal(statuses.get("UIDL6"), "k");
+  Assert.equal(statuses.get("UIDL" + (kUidls - 1)), "k");
+
+  // After that, only the change is journaled.
+  let storeSize = store.fileSize;
+  start = Date.now();
+  mark(server, "UIDL7", kFetchBody);
+  info("Journaled a change in " + (Date.now() - start) + "ms");
+  Assert.ok(journal.exists());
+  Assert.equal(store.fileSize, storeSize);
+  let journalSize = journal.fileSize;
+  // the magic, then 'p', host hash, status, date and "UIDL7"
+  Assert.equal(journalSize, 8 + 1 + 8 + 1 + 4 + 2 + 5);
+
+  mark(server, "UIDL5", kKeep);
+  Assert.ok(journal.fileSize > journalSize);
+  journalSize = journal.fileSize;
+
+  // The journal was read back, so this is no change, and nothing is written.
+  mark(server, "UIDL5", kKeep);
+  mark(server, "UIDL7", kFetchBody);
+  Assert.equal(journal.fileSize, journalSize);
+  Assert.equal(store.fileSize, storeSize);
+
+  // A record cut short by a crash has the whole store written again.
+  appendToFile(journal, "p");
+  mark(server, "UIDL8", kDelete);
+  Assert.ok(!journal.exists());
+  statuses = readStore(store);
+  Assert.equal(statuses.size, kUidls);
+  Assert.equal(statuses.get("UIDL5"), "k");
+  Assert.equal(statuses.get("UIDL7"), "f");
+  Assert.equal(statuses.get("UIDL8"), "d");
+}
@@ -551,6 +551,9 @@ pref("mail.server.default.offline_download",true);
 // -1 means no limit, no purging of offline stores.
 pref("mail.server.default.autosync_max_age_days", -1);
 
+// Maximum rate in KB/s at which auto-sync downloads messages, 0 means no limit.
+pref("mail.imap.autosync.max_download_rate", 0);
+
 // Can we change the store type without conversion? (=has the store been used)
 pref("mail.server.default.canChangeStoreType", false);
 
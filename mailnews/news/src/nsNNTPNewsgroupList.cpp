@@ -78,6 +78,8 @@ nsNNTPNewsgroupList::nsNNTPNewsgroupList()
   m_lastMsgNumber(0),
   m_firstMsgToDownload(0),
   m_lastMsgToDownload(0),
+  m_knownRunStart(0),
+  m_knownRunEnd(0),
   m_set(nullptr)
 {
   memset(&m_knownArts, 0, sizeof(m_knownArts));
@@ -138,6 +140,7 @@ nsNNTPNewsgroupList::CleanUp()
   // db, then we should mark it read in the unread set.
   if (m_newsDB)
   {
+    FlushKnownRun();
     if (m_knownArts.set && m_knownArts.set->getLength() && m_set->getLength())
     {
       nsCOMPtr <nsIDBFolderInfo> folderInfo;
@@ -480,6 +483,9 @@ nsNNTPNewsgroupList::InitXOVER(int32_t first_msg, int32_t last_msg)
    probably handle it OK...) */
   NS_ASSERTION(first_msg <= last_msg, "first > last");
 
+  nsresult rv = FlushKnownRun();
+  NS_ENSURE_SUCCESS(rv, rv);
+
   /* If any XOVER lines from the last time failed to come in, mark those
      messages as read. */
   if (m_lastProcessedNumber < m_lastMsgNumber)
@@ -508,17 +514,30 @@ nsNNTPNewsgroupList::ParseLine(char *line, uint32_t * message_number)
     return NS_ERROR_NULL_POINTER;
   }
 
-  char *next = line;
-
-#define GET_TOKEN()                           \
-  line = next;                                \
-  next = (line ? PL_strchr (line, '\t') : 0); \
-  if (next) *next++ = 0
-
-  GET_TOKEN (); /* message number */
-  *message_number = atol(line);
+  // Split the line at its tabs in place, in one pass. Fields missing at the
+  // end of the line stay null.
+  enum { kNumber, kSubject, kAuthor, kDate, kMessageId, kReferences, kBytes,
+         kLines, kNumFields };
+  char *fields[kNumFields] = { nullptr };
+  uint32_t lengths[kNumFields] = { 0 };
+  uint32_t numFields = 0;
+  char *fieldStart = line;
+  for (char *p = line; numFields < kNumFields; p++)
+  {
+    if (*p != '\t' && *p)
+      continue;
+    bool atEnd = !*p;
+    *p = '\0';
+    fields[numFields] = fieldStart;
+    lengths[numFields++] = p - fieldStart;
+    if (atEnd)
+      break;
+    fieldStart = p + 1;
+  }
 
-  if (atol(line) == 0) /* bogus xover data */
+  /* message number */
+  *message_number = atol(fields[kNumber]);
+  if (*message_number == 0) /* bogus xover data */
     return NS_ERROR_UNEXPECTED;
 
   m_newsDB->CreateNewHdr(*message_number, getter_AddRefs(newMsgHdr));
@@ -527,15 +546,15 @@ nsNNTPNewsgroupList::ParseLine(char *line, uint32_t * message_number)
   if (!newMsgHdr)
     return NS_ERROR_NULL_POINTER;
 
-  GET_TOKEN (); /* subject */
-  if (line) {
-    const char *subject = line;  /* #### const evilness */
+  if (fields[kSubject]) {
+    const char *subject = fields[kSubject];
 
     uint32_t flags = 0;
     // ### should call IsHeaderRead here...
     /* strip "Re: " */
     nsCString modifiedSubject;
-    bool strippedRE = NS_MsgStripRE(nsDependentCString(subject), modifiedSubject);
+    bool strippedRE = NS_MsgStripRE(nsDependentCString(subject, lengths[kSubject]),
+                                    modifiedSubject);
     if (strippedRE)
       (void) newMsgHdr->OrFlags(nsMsgMessageFlags::HasRe, &flags);
 
@@ -549,17 +568,15 @@ nsNNTPNewsgroupList::ParseLine(char *line, uint32_t * message_number)
       return rv;
   }
 
-  GET_TOKEN (); /* author */
-  if (line) {
-    rv = newMsgHdr->SetAuthor(line);
+  if (fields[kAuthor]) {
+    rv = newMsgHdr->SetAuthor(fields[kAuthor]);
     if (NS_FAILED(rv))
       return rv;
   }
 
-  GET_TOKEN ();
-  if (line) {
+  if (fields[kDate]) {
     PRTime date;
-    PRStatus status = PR_ParseTimeString (line, false, &date);
+    PRStatus status = PR_ParseTimeString(fields[kDate], false, &date);
     if (PR_SUCCESS == status) {
       rv = newMsgHdr->SetDate(date); /* date */
       if (NS_FAILED(rv))
@@ -567,46 +584,38 @@ nsNNTPNewsgroupList::ParseLine(char *line, uint32_t * message_number)
     }
   }
 
-  GET_TOKEN (); /* message id */
-  if (line) {
-    char *strippedId = line;
-    if (strippedId[0] == '<')
+  if (fields[kMessageId]) {
+    char *strippedId = fields[kMessageId];
+    uint32_t idLength = lengths[kMessageId];
+    if (idLength && strippedId[0] == '<') {
       strippedId++;
-    char * lastChar = strippedId + PL_strlen(strippedId) -1;
-
-    if (*lastChar == '>')
-      *lastChar = '\0';
+      idLength--;
+    }
+    if (idLength && strippedId[idLength - 1] == '>')
+      strippedId[idLength - 1] = '\0';
 
     rv = newMsgHdr->SetMessageId(strippedId);
     if (NS_FAILED(rv))
       return rv;
   }
 
-  GET_TOKEN (); /* references */
-  if (line) {
-    rv = newMsgHdr->SetReferences(line);
+  if (fields[kReferences]) {
+    rv = newMsgHdr->SetReferences(fields[kReferences]);
     if (NS_FAILED(rv))
       return rv;
   }
 
-  GET_TOKEN (); /* bytes */
-  if (line) {
-    uint32_t msgSize = 0;
-    msgSize = (line) ? atol (line) : 0;
-
-    rv = newMsgHdr->SetMessageSize(msgSize);
+  if (fields[kBytes]) {
+    rv = newMsgHdr->SetMessageSize(atol(fields[kBytes]));
     if (NS_FAILED(rv)) return rv;
   }
 
-  GET_TOKEN (); /* lines */
-  if (line) {
-    uint32_t numLines = 0;
-    numLines = line ? atol (line) : 0;
-    rv = newMsgHdr->SetLineCount(numLines);
+  if (fields[kLines]) {
+    rv = newMsgHdr->SetLineCount(atol(fields[kLines]));
     if (NS_FAILED(rv)) return rv;
   }
 
-  GET_TOKEN (); /* xref */
+  /* xref isn't used */
 
   m_newHeaders.AppendObject(newMsgHdr);
   return NS_OK;
@@ -755,12 +764,10 @@ nsNNTPNewsgroupList::ProcessXOVERLINE(const char *line, uint32_t *status)
 
   if (m_newsDB)
   {
-    char *xoverline = PL_strdup(line);
-    if (!xoverline)
+    // ParseLine splits the line in place; reuse one buffer for all lines.
+    if (!m_xoverLine.Assign(line, mozilla::fallible))
       return NS_ERROR_OUT_OF_MEMORY;
-    rv = ParseLine(xoverline, &message_number);
-    PL_strfree(xoverline);
-    xoverline = nullptr;
+    rv = ParseLine(m_xoverLine.BeginWriting(), &message_number);
     if (NS_FAILED(rv))
       return rv;
   }
@@ -783,14 +790,20 @@ nsNNTPNewsgroupList::ProcessXOVERLINE(const char *line, uint32_t *status)
   }
 
   m_lastProcessedNumber = message_number;
-  if (m_knownArts.set)
+  // XOVER lines mostly come in runs of consecutive articles; add each run to
+  // the known articles at once.
+  if (m_knownRunStart && message_number == m_knownRunEnd + 1)
+    m_knownRunEnd = message_number;
+  else
   {
-    int result = m_knownArts.set->Add(message_number);
-    if (result < 0) {
+    rv = FlushKnownRun();
+    if (NS_FAILED(rv))
+    {
       if (status)
-        *status = result;
-      return NS_ERROR_NOT_INITIALIZED;
+        *status = -1;
+      return rv;
     }
+    m_knownRunStart = m_knownRunEnd = message_number;
   }
 
   if (message_number > m_lastMsgNumber)
@@ -798,10 +811,6 @@ nsNNTPNewsgroupList::ProcessXOVERLINE(const char *line, uint32_t *status)
   else if (message_number < m_firstMsgNumber)
     m_firstMsgNumber = message_number;
 
-  if (m_set) {
-    (void) m_set->IsMember(message_number);
-  }
-
   /* Update the progress meter with a percentage of articles retrieved */
   if (m_lastMsgNumber > m_firstMsgNumber)
   {
@@ -818,6 +827,18 @@ nsNNTPNewsgroupList::ProcessXOVERLINE(const char *line, uint32_t *status)
   return NS_OK;
 }
 
+nsresult
+nsNNTPNewsgroupList::FlushKnownRun()
+{
+  if (!m_knownRunStart)
+    return NS_OK;
+  int result = 0;
+  if (m_knownArts.set)
+    result = m_knownArts.set->AddRange(m_knownRunStart, m_knownRunEnd);
+  m_knownRunStart = m_knownRunEnd = 0;
+  return result < 0 ? NS_ERROR_NOT_INITIALIZED : NS_OK;
+}
+
 nsresult
 nsNNTPNewsgroupList::ResetXOVER()
 {
@@ -839,6 +860,7 @@ nsNNTPNewsgroupList::FinishXOVERLINE(int status, int *newstatus)
     m_set->AddRange(m_lastProcessedNumber + 1, m_lastMsgNumber);
   }
 
+  FlushKnownRun();
   if (m_lastProcessedNumber)
     AddToKnownArticles(m_firstMsgNumber, m_lastProcessedNumber);
 
@@ -1116,23 +1138,31 @@ nsNNTPNewsgroupList::CallFilters()
   // Notify MsgFolderListeners of message adds
   nsCOMPtr<nsIMsgFolderNotificationService> notifier(do_GetService(NS_MSGNOTIFICATIONSERVICE_CONTRACTID));
 
-  for (uint32_t i = 0; i < count; i++)
+  if (!filterCount && !serverFilterCount)
   {
-    m_newMsgHdr = m_newHeaders[i];
-    if (!filterCount && !serverFilterCount)
-    {
-      m_newsDB->AddNewHdrToDB(m_newMsgHdr, true);
+    // Without filters to run the headers can go into the database in one
+    // batch, which writes the folder counts once instead of per header.
+    nsCOMPtr<nsINewsDatabase> newsDB = do_QueryInterface(m_newsDB, &rv);
+    NS_ENSURE_SUCCESS(rv, rv);
+    newsDB->AddNewHdrsToDB(m_newHeaders, true);
 
+    for (uint32_t i = 0; i < count; i++)
+    {
       if (notifier)
-        notifier->NotifyMsgAdded(m_newMsgHdr);
+        notifier->NotifyMsgAdded(m_newHeaders[i]);
       // mark the header as not yet reported classified
       nsMsgKey msgKey;
-      m_newMsgHdr->GetMessageKey(&msgKey);
+      m_newHeaders[i]->GetMessageKey(&msgKey);
       folder->OrProcessingFlags(msgKey,
                                 nsMsgProcessingFlags::NotReportedClassified);
-
-      continue;
     }
+    m_newHeaders.Clear();
+    return NS_OK;
+  }
+
+  for (uint32_t i = 0; i < count; i++)
+  {
+    m_newMsgHdr = m_newHeaders[i];
     m_addHdrToDB = true;
 
     // build up a "headers" for filter code
@@ -69,6 +69,7 @@ private:
   virtual void OnAnnouncerGoingAway (ChangeAnnouncer *instigator);
 #endif
   nsresult ParseLine(char *line, uint32_t *message_number);
+  nsresult FlushKnownRun();
   nsresult GetDatabase(const char *uri, nsIMsgDatabase **db);
   void SetProgressBarPercent(int32_t percent);
   void SetProgressStatus(const char16_t *aMessage);
@@ -102,12 +103,20 @@ protected:
   int32_t m_firstMsgToDownload, m_lastMsgToDownload;
 
   struct MSG_NewsKnown m_knownArts;
+  /**
+   * Articles processed since the last FlushKnownRun, which have yet to be
+   * added to m_knownArts.set in one range. m_knownRunStart is 0 when there
+   * are none.
+   */
+  nsMsgKey m_knownRunStart, m_knownRunEnd;
   nsMsgKeySet *m_set;
 
   nsTArray<nsCString> m_filterHeaders;
   uint32_t m_currentXHDRIndex;
   nsCString m_lastHeader;
   nsCString m_thisLine;
+  // the XOVER line being parsed; its buffer is reused for every line
+  nsCString m_xoverLine;
 
 private:
   nsCOMPtr <nsIMsgWindow> m_msgWindow;
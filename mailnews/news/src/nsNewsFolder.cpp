@@ -121,6 +121,10 @@ nsMsgNewsFolder::CreateSubFolders(nsIFile *path)
     NS_ENSURE_SUCCESS(rv, rv);
 
     rv = LoadNewsrcFileAndCreateNewsgroups();
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    // apply the changes the newsrc is missing if we weren't shut down cleanly
+    rv = nntpServer->ReplayJournal();
   }
   else // is not a host, so it has no newsgroups.  (what about categories??)
     rv = NS_OK;
@@ -1396,6 +1400,7 @@ NS_IMETHODIMP nsMsgNewsFolder::SetReadSetFromStr(const nsACString& newsrcLine)
   delete mReadSet;
   mReadSet = nsMsgKeySet::Create(nsCString(newsrcLine).get());
   NS_ENSURE_TRUE(mReadSet, NS_ERROR_OUT_OF_MEMORY);
+  mReadSet->SetListener(this);
 
   // Now that mReadSet is recreated, make sure it's stored in the db as well.
   nsCOMPtr<nsINewsDatabase> db = do_QueryInterface(mDatabase);
@@ -1421,7 +1426,28 @@ nsMsgNewsFolder::GetOptionLines(nsACString& optionLines)
 NS_IMETHODIMP
 nsMsgNewsFolder::OnReadChanged(nsIDBChangeListener * aInstigator)
 {
-  return SetNewsrcHasChanged(true);
+  // The read set tells us about the changes in OnKeySetChanged, so they go
+  // to the journal instead of making the whole newsrc be written.
+  return NS_OK;
+}
+
+void
+nsMsgNewsFolder::OnKeySetChanged(nsMsgKeySet *aSet, int32_t aFirst,
+                                 int32_t aLast, bool aAdded)
+{
+  nsCOMPtr<nsINntpIncomingServer> nntpServer;
+  nsresult rv = GetNntpServer(getter_AddRefs(nntpServer));
+  if (NS_FAILED(rv))
+    return;
+
+  nsString name;
+  rv = GetName(name);
+  if (NS_FAILED(rv))
+    return;
+
+  // if the journal can't be written, the server writes the whole newsrc
+  nntpServer->JournalReadChange(NS_ConvertUTF16toUTF8(name), aFirst, aLast,
+                                aAdded);
 }
 
 NS_IMETHODIMP
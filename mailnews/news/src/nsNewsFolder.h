@@ -20,7 +20,8 @@
 #include "nsIMsgFilterList.h"
 #include "nsIArray.h"
 
-class nsMsgNewsFolder : public nsMsgDBFolder, public nsIMsgNewsFolder
+class nsMsgNewsFolder : public nsMsgDBFolder, public nsIMsgNewsFolder,
+                        public nsMsgKeySetListener
 {
 public:
   nsMsgNewsFolder(void);
@@ -71,6 +72,10 @@ public:
   NS_IMETHOD GetCanCompact(bool *aResult) override;
   NS_IMETHOD OnReadChanged(nsIDBChangeListener * aInstigator) override;
 
+  // nsMsgKeySetListener method, journals the changes to the read set
+  virtual void OnKeySetChanged(nsMsgKeySet *aSet, int32_t aFirst,
+                               int32_t aLast, bool aAdded) override;
+
   NS_IMETHOD DownloadMessagesForOffline(nsIArray *messages,
                                         nsIMsgWindow *window) override;
   NS_IMETHOD Compact(nsIUrlListener *aListener,
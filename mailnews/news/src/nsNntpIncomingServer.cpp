@@ -28,6 +28,10 @@
 #include "nsNetUtil.h"
 #include "nsISimpleEnumerator.h"
 #include "nsMsgUtils.h"
+#include "nsMsgKeySet.h"
+#include "nsISafeOutputStream.h"
+#include "nsTHashtable.h"
+#include "nsThreadUtils.h"
 #include "mozilla/Services.h"
 #include "mozilla/dom/Element.h"
 #include "mozilla/ErrorResult.h"
@@ -41,6 +45,8 @@
 #define PREF_MAIL_NEWSRC_ROOT_REL "mail.newsrc_root-rel"
 #define PREF_MAILNEWS_VIEW_DEFAULT_CHARSET "mailnews.view_default_charset"
 #define HOSTINFO_FILE_NAME      "hostinfo.dat"
+#define JOURNAL_FILE_NAME       "journal.dat"
+#define OLD_JOURNAL_FILE_NAME   "journal.old"
 
 #define NEWS_DELIMITER          '.'
 
@@ -78,6 +84,41 @@ public:
   }
 };
 
+/**
+ * Sorts the indexes of groups by their names like the comparator above.
+ */
+class nsGroupIndexComparator
+{
+public:
+  explicit nsGroupIndexComparator(const nsTArray<nsCString> &aGroups)
+    : mGroups(aGroups)
+  {
+  }
+
+  bool Equals(uint32_t a, uint32_t b) const
+  {
+    return mComparator.Equals(mGroups[a], mGroups[b]);
+  }
+
+  bool LessThan(uint32_t a, uint32_t b) const
+  {
+    return mComparator.LessThan(mGroups[a], mGroups[b]);
+  }
+
+private:
+  const nsTArray<nsCString> &mGroups;
+  nsCStringLowerCaseComparator mComparator;
+};
+
+// The key for three characters of a lower case string in the group index.
+static inline uint32_t
+TrigramAt(const nsCString &aLowerCase, uint32_t aIndex)
+{
+  const uint8_t *chars =
+    reinterpret_cast<const uint8_t*>(aLowerCase.get()) + aIndex;
+  return (chars[0] << 16) | (chars[1] << 8) | chars[2];
+}
+
 static NS_DEFINE_CID(kSubscribableServerCID, NS_SUBSCRIBABLESERVER_CID);
 
 NS_IMPL_ADDREF_INHERITED(nsNntpIncomingServer, nsMsgIncomingServer)
@@ -105,6 +146,8 @@ nsNntpIncomingServer::nsNntpIncomingServer()
   mHasSeenBeginGroups = false;
   mPostingAllowed = false;
   mLastUpdatedTime = 0;
+  mJournalHasReadChanges = false;
+  mCompactAgain = false;
 
   // we have server wide and per group filters
   m_canHaveFilters = true;
@@ -120,6 +163,7 @@ nsNntpIncomingServer::~nsNntpIncomingServer()
         mNewsrcSaveTimer->Cancel();
         mNewsrcSaveTimer = nullptr;
     }
+    CloseJournal();
     rv = ClearInner();
     NS_ASSERTION(NS_SUCCEEDED(rv), "ClearInner failed");
 
@@ -297,105 +341,534 @@ nsNntpIncomingServer::GetCharset(nsACString & aCharset)
   return NS_OK;
 }
 
+/**
+ * Writes the files when the journal is compacted: the newsrc, hostinfo.dat
+ * with all groups after they were listed, or hostinfo.dat with the new groups
+ * merged in. Then removes the journals, whose changes are in the files now.
+ * When compacting in the background, it runs on a thread of its own and then
+ * on the main thread again to tell the server.
+ */
+class nsNewsJournalCompactor : public mozilla::Runnable
+{
+public:
+  nsNewsJournalCompactor() :
+    mozilla::Runnable("nsNewsJournalCompactor"),
+    mLastUpdatedTime(0),
+    mStatus(NS_OK)
+  {
+  }
+
+  NS_IMETHOD Run() override;
+  nsresult Compact();
+
+  nsCOMPtr<nsIFile> mNewsrcFile;
+  nsCString mNewsrcData;
+  nsCOMPtr<nsIFile> mHostInfoFile;
+  // all of hostinfo.dat, or empty to merge the new groups into it
+  nsCString mHostInfoData;
+  nsTArray<nsCString> mNewGroups;
+  uint32_t mLastUpdatedTime;
+  nsCOMArray<nsIFile> mJournals;
+  nsresult mStatus;
+  // Keeps the server alive while compacting in the background. Only used on
+  // the main thread.
+  RefPtr<nsNntpIncomingServer> mServer;
+
+protected:
+  nsresult WriteFile(nsIFile *aFile, const nsACString &aData);
+  nsresult MergeNewGroups();
+};
+
+NS_IMETHODIMP
+nsNewsJournalCompactor::Run()
+{
+  if (!NS_IsMainThread())
+  {
+    mStatus = Compact();
+    return NS_DispatchToMainThread(this);
+  }
+
+  RefPtr<nsNntpIncomingServer> server = mServer.forget();
+  server->OnJournalCompacted(this);
+  return NS_OK;
+}
+
+nsresult
+nsNewsJournalCompactor::Compact()
+{
+  nsresult rv;
+  if (mNewsrcFile)
+  {
+    rv = WriteFile(mNewsrcFile, mNewsrcData);
+    NS_ENSURE_SUCCESS(rv, rv);
+  }
+
+  if (mHostInfoFile)
+  {
+    rv = mHostInfoData.IsEmpty() ? MergeNewGroups()
+                                 : WriteFile(mHostInfoFile, mHostInfoData);
+    NS_ENSURE_SUCCESS(rv, rv);
+  }
+
+  for (int32_t i = 0; i < mJournals.Count(); i++)
+  {
+    bool exists;
+    rv = mJournals[i]->Exists(&exists);
+    if (NS_SUCCEEDED(rv) && exists)
+      rv = mJournals[i]->Remove(false);
+    NS_ENSURE_SUCCESS(rv, rv);
+  }
+  return NS_OK;
+}
+
+// Replaces the file, so it is either all old or all new after a crash.
+nsresult
+nsNewsJournalCompactor::WriteFile(nsIFile *aFile, const nsACString &aData)
+{
+  nsCOMPtr<nsIOutputStream> stream;
+  nsresult rv = MsgNewSafeBufferedFileOutputStream(getter_AddRefs(stream),
+                                                   aFile, -1, 00600);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  uint32_t bytesWritten;
+  rv = stream->Write(aData.BeginReading(), aData.Length(), &bytesWritten);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  nsCOMPtr<nsISafeOutputStream> safeStream = do_QueryInterface(stream, &rv);
+  NS_ENSURE_SUCCESS(rv, rv);
+  return safeStream->Finish();
+}
+
+// Copies hostinfo.dat with the new last group date, without the new groups it
+// already has, and adds the new groups to the end of the group list.
+nsresult
+nsNewsJournalCompactor::MergeNewGroups()
+{
+  bool exists;
+  nsresult rv = mHostInfoFile->Exists(&exists);
+  NS_ENSURE_SUCCESS(rv, rv);
+  // Without the list of all groups there is nothing to add the new ones to.
+  if (!exists)
+    return NS_OK;
+
+  nsTHashtable<nsCStringHashKey> newGroups(mNewGroups.Length());
+  for (uint32_t i = 0; i < mNewGroups.Length(); i++)
+    newGroups.PutEntry(mNewGroups[i]);
+
+  nsCOMPtr<nsIInputStream> fileStream;
+  rv = NS_NewLocalFileInputStream(getter_AddRefs(fileStream), mHostInfoFile);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  nsCOMPtr<nsILineInputStream> lineInputStream(do_QueryInterface(fileStream, &rv));
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  nsCString data;
+  nsCString line;
+  bool hasSeenBeginGroups = false;
+  bool more = true;
+  while (more)
+  {
+    rv = lineInputStream->ReadLine(line, &more);
+    NS_ENSURE_SUCCESS(rv, rv);
+    if (!more && line.IsEmpty())
+      break;
+
+    if (!hasSeenBeginGroups)
+    {
+      if (StringBeginsWith(line, NS_LITERAL_CSTRING("lastgroupdate=")))
+      {
+        line.AssignLiteral("lastgroupdate=");
+        line.AppendInt(mLastUpdatedTime);
+      }
+      else if (StringBeginsWith(line, NS_LITERAL_CSTRING("begingroups")))
+        hasSeenBeginGroups = true;
+    }
+    else if (newGroups.Contains(line))
+      continue;
+
+    data.Append(line);
+    data.AppendLiteral(MSG_LINEBREAK);
+  }
+  fileStream->Close();
+
+  if (!hasSeenBeginGroups)
+    return NS_OK;
+
+  for (uint32_t i = 0; i < mNewGroups.Length(); i++)
+  {
+    data.Append(mNewGroups[i]);
+    data.AppendLiteral(MSG_LINEBREAK);
+  }
+  return WriteFile(mHostInfoFile, data);
+}
+
 NS_IMETHODIMP
 nsNntpIncomingServer::WriteNewsrcFile()
 {
-    nsresult rv;
+  return CompactJournal(true);
+}
 
-    bool newsrcHasChanged;
-    rv = GetNewsrcHasChanged(&newsrcHasChanged);
-    if (NS_FAILED(rv)) return rv;
+nsresult
+nsNntpIncomingServer::GetNewsrcData(nsACString &aData)
+{
+  nsCOMPtr<nsIMsgFolder> rootFolder;
+  nsresult rv = GetRootFolder(getter_AddRefs(rootFolder));
+  NS_ENSURE_SUCCESS(rv, rv);
 
-#ifdef DEBUG_NEWS
-  nsCString hostname;
-  rv = GetHostName(hostname);
-  if (NS_FAILED(rv)) return rv;
-#endif /* DEBUG_NEWS */
+  nsCOMPtr<nsIMsgNewsFolder> newsFolder = do_QueryInterface(rootFolder, &rv);
+  NS_ENSURE_SUCCESS(rv, rv);
 
-    if (newsrcHasChanged) {
-#ifdef DEBUG_NEWS
-        printf("write newsrc file for %s\n", hostname.get());
-#endif
-        nsCOMPtr <nsIFile> newsrcFile;
-        rv = GetNewsrcFilePath(getter_AddRefs(newsrcFile));
-        if (NS_FAILED(rv)) return rv;
+  nsCString optionLines;
+  rv = newsFolder->GetOptionLines(optionLines);
+  if (NS_SUCCEEDED(rv))
+    aData.Append(optionLines);
 
-        nsCOMPtr<nsIOutputStream> newsrcStream;
-        nsresult rv = MsgNewBufferedFileOutputStream(getter_AddRefs(newsrcStream), newsrcFile, -1, 00600);
-        if (NS_FAILED(rv))
-          return rv;
+  nsCString unsubscribedLines;
+  rv = newsFolder->GetUnsubscribedNewsgroupLines(unsubscribedLines);
+  if (NS_SUCCEEDED(rv))
+    aData.Append(unsubscribedLines);
+
+  nsCOMPtr<nsISimpleEnumerator> subFolders;
+  rv = rootFolder->GetSubFolders(getter_AddRefs(subFolders));
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  bool moreFolders;
+  while (NS_SUCCEEDED(subFolders->HasMoreElements(&moreFolders)) &&
+         moreFolders)
+  {
+    nsCOMPtr<nsISupports> child;
+    rv = subFolders->GetNext(getter_AddRefs(child));
+    if (NS_SUCCEEDED(rv) && child)
+    {
+      newsFolder = do_QueryInterface(child, &rv);
+      if (NS_SUCCEEDED(rv) && newsFolder)
+      {
+        nsCString newsrcLine;
+        rv = newsFolder->GetNewsrcLine(newsrcLine);
+        if (NS_SUCCEEDED(rv))
+          aData.Append(newsrcLine);
+      }
+    }
+  }
+  return NS_OK;
+}
 
-        nsCOMPtr<nsISimpleEnumerator> subFolders;
-        nsCOMPtr<nsIMsgFolder> rootFolder;
-        rv = GetRootFolder(getter_AddRefs(rootFolder));
-        if (NS_FAILED(rv)) return rv;
+nsresult
+nsNntpIncomingServer::GetLocalFile(const char *aName, nsIFile **aFile)
+{
+  nsresult rv = GetLocalPath(aFile);
+  NS_ENSURE_SUCCESS(rv, rv);
+  if (!*aFile)
+    return NS_ERROR_FAILURE;
+  return (*aFile)->AppendNative(nsDependentCString(aName));
+}
 
-        nsCOMPtr <nsIMsgNewsFolder> newsFolder = do_QueryInterface(rootFolder, &rv);
-        if (NS_FAILED(rv)) return rv;
+nsresult
+nsNntpIncomingServer::AppendToJournal(const nsACString &aRecord)
+{
+  nsresult rv;
+  if (!mJournalStream)
+  {
+    nsCOMPtr<nsIFile> journal;
+    rv = GetLocalFile(JOURNAL_FILE_NAME, getter_AddRefs(journal));
+    NS_ENSURE_SUCCESS(rv, rv);
+    rv = NS_NewLocalFileOutputStream(getter_AddRefs(mJournalStream), journal,
+                                     PR_WRONLY | PR_CREATE_FILE | PR_APPEND,
+                                     00600);
+    NS_ENSURE_SUCCESS(rv, rv);
+  }
 
-        uint32_t bytesWritten;
-        nsCString optionLines;
-        rv = newsFolder->GetOptionLines(optionLines);
-        if (NS_SUCCEEDED(rv) && !optionLines.IsEmpty()) {
-          newsrcStream->Write(optionLines.get(), optionLines.Length(), &bytesWritten);
-#ifdef DEBUG_NEWS
-               printf("option lines:\n%s", optionLines.get());
-#endif /* DEBUG_NEWS */
-        }
-#ifdef DEBUG_NEWS
-        else {
-            printf("no option lines to write out\n");
-        }
-#endif /* DEBUG_NEWS */
-
-        nsCString unsubscribedLines;
-        rv = newsFolder->GetUnsubscribedNewsgroupLines(unsubscribedLines);
-        if (NS_SUCCEEDED(rv) && !unsubscribedLines.IsEmpty()) {
-          newsrcStream->Write(unsubscribedLines.get(), unsubscribedLines.Length(), &bytesWritten);
-#ifdef DEBUG_NEWS
-               printf("unsubscribedLines:\n%s", unsubscribedLines.get());
-#endif /* DEBUG_NEWS */
-        }
-#ifdef DEBUG_NEWS
-        else {
-            printf("no unsubscribed lines to write out\n");
-        }
-#endif /* DEBUG_NEWS */
-
-        rv = rootFolder->GetSubFolders(getter_AddRefs(subFolders));
-        if (NS_FAILED(rv)) return rv;
-
-        bool moreFolders;
-
-        while (NS_SUCCEEDED(subFolders->HasMoreElements(&moreFolders)) &&
-               moreFolders) {
-            nsCOMPtr<nsISupports> child;
-            rv = subFolders->GetNext(getter_AddRefs(child));
-            if (NS_SUCCEEDED(rv) && child) {
-                newsFolder = do_QueryInterface(child, &rv);
-                if (NS_SUCCEEDED(rv) && newsFolder) {
-                    nsCString newsrcLine;
-                    rv = newsFolder->GetNewsrcLine(newsrcLine);
-                    if (NS_SUCCEEDED(rv) && !newsrcLine.IsEmpty()) {
-                        // write the line to the newsrc file
-                        newsrcStream->Write(newsrcLine.get(), newsrcLine.Length(), &bytesWritten);
-                    }
-                }
-            }
-        }
-
-        newsrcStream->Close();
-
-        rv = SetNewsrcHasChanged(false);
-        if (NS_FAILED(rv)) return rv;
+  // The stream isn't buffered, so each record is handed to the OS with one
+  // write, and a crash can at most cut off the last one.
+  nsAutoCString line(aRecord);
+  line.AppendLiteral(MSG_LINEBREAK);
+  uint32_t bytesWritten;
+  rv = mJournalStream->Write(line.get(), line.Length(), &bytesWritten);
+  if (NS_SUCCEEDED(rv) && bytesWritten != line.Length())
+    rv = NS_ERROR_FAILURE;
+  if (NS_FAILED(rv))
+    CloseJournal();
+  return rv;
+}
+
+nsresult
+nsNntpIncomingServer::CloseJournal()
+{
+  if (!mJournalStream)
+    return NS_OK;
+  nsresult rv = mJournalStream->Close();
+  mJournalStream = nullptr;
+  return rv;
+}
+
+NS_IMETHODIMP
+nsNntpIncomingServer::JournalReadChange(const nsACString &aName,
+                                        int32_t aFirst, int32_t aLast,
+                                        bool aRead)
+{
+  // "+group: 1-10" when the articles were marked read, "-group: 5" when one
+  // was marked unread.
+  nsAutoCString record(aRead ? "+" : "-");
+  record.Append(aName);
+  record.AppendLiteral(": ");
+  record.AppendInt(aFirst);
+  if (aLast != aFirst)
+  {
+    record.Append('-');
+    record.AppendInt(aLast);
+  }
+
+  nsresult rv = AppendToJournal(record);
+  if (NS_FAILED(rv))
+  {
+    // Without the journal the whole newsrc has to be written instead.
+    mNewsrcHasChanged = true;
+    return rv;
+  }
+  mJournalHasReadChanges = true;
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+nsNntpIncomingServer::ReplayJournal()
+{
+  nsCOMPtr<nsIFile> oldJournal;
+  nsresult rv = GetLocalFile(OLD_JOURNAL_FILE_NAME, getter_AddRefs(oldJournal));
+  NS_ENSURE_SUCCESS(rv, rv);
+  nsCOMPtr<nsIFile> journal;
+  rv = GetLocalFile(JOURNAL_FILE_NAME, getter_AddRefs(journal));
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  // The old journal is left from a compaction which didn't finish, and the
+  // journal has the changes made after that one started.
+  nsClassHashtable<nsCStringHashKey, nsMsgKeySet> readSets;
+  rv = ReplayJournalFile(oldJournal, readSets);
+  NS_ENSURE_SUCCESS(rv, rv);
+  rv = ReplayJournalFile(journal, readSets);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  for (auto iter = readSets.Iter(); !iter.Done(); iter.Next())
+  {
+    nsCOMPtr<nsIMsgNewsFolder> newsFolder;
+    rv = FindGroup(iter.Key(), getter_AddRefs(newsFolder));
+    if (NS_FAILED(rv))
+      continue;
+
+    nsCString setStr;
+    iter.UserData()->Output(getter_Copies(setStr));
+    rv = newsFolder->SetReadSetFromStr(setStr);
+    if (NS_SUCCEEDED(rv))
+      mJournalHasReadChanges = true;
+  }
+
+  // Write out the files right away, so the journals don't have to be
+  // replayed again.
+  return CompactJournal(false);
+}
+
+nsresult
+nsNntpIncomingServer::ReplayJournalFile(nsIFile *aJournal,
+                                        nsClassHashtable<nsCStringHashKey, nsMsgKeySet> &aReadSets)
+{
+  bool exists;
+  nsresult rv = aJournal->Exists(&exists);
+  if (NS_FAILED(rv) || !exists)
+    return rv;
+
+  nsCOMPtr<nsIInputStream> fileStream;
+  rv = NS_NewLocalFileInputStream(getter_AddRefs(fileStream), aJournal);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  nsCOMPtr<nsILineInputStream> lineInputStream(do_QueryInterface(fileStream, &rv));
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  bool more = true;
+  nsCString line;
+  while (more && NS_SUCCEEDED(rv))
+  {
+    rv = lineInputStream->ReadLine(line, &more);
+    if (line.Length() < 2)
+      continue;
+
+    if (line[0] == '*')
+    {
+      nsDependentCSubstring name(line, 1);
+      if (!mJournaledGroups.Contains(name))
+        mJournaledGroups.AppendElement(name);
+      continue;
     }
-#ifdef DEBUG_NEWS
-    else {
-        printf("no need to write newsrc file for %s, it was not dirty\n", (hostname.get()));
+
+    // Skip unknown records, and the groups unsubscribed from since.
+    int32_t colon = line.FindChar(':');
+    if ((line[0] != '+' && line[0] != '-') || colon < 2)
+      continue;
+    nsAutoCString name(Substring(line, 1, colon - 1));
+    if (!mSubscribedNewsgroups.Contains(name))
+      continue;
+
+    int32_t first = 0, last = 0;
+    int32_t numbers = PR_sscanf(line.get() + colon + 1, "%d-%d", &first, &last);
+    if (numbers < 1)
+      continue;
+    if (numbers == 1)
+      last = first;
+    if (first > last)
+      continue;
+
+    nsMsgKeySet *set = aReadSets.Get(name);
+    if (!set)
+    {
+      nsCOMPtr<nsIMsgNewsFolder> newsFolder;
+      if (NS_FAILED(FindGroup(name, getter_AddRefs(newsFolder))))
+        continue;
+      // "group: 1-10" followed by a line break
+      nsCString newsrcLine;
+      newsFolder->GetNewsrcLine(newsrcLine);
+      newsrcLine.Cut(0, name.Length() + 1);
+      set = nsMsgKeySet::Create(newsrcLine.get());
+      if (!set)
+        return NS_ERROR_OUT_OF_MEMORY;
+      aReadSets.Put(name, set);
     }
-#endif /* DEBUG_NEWS */
 
+    if (line[0] == '+')
+      set->AddRange(first, last);
+    else
+      set->RemoveRange(first, last);
+  }
+
+  fileStream->Close();
+  return rv;
+}
+
+nsresult
+nsNntpIncomingServer::CompactJournal(bool aInBackground)
+{
+  if (mCompactThread)
+  {
+    if (aInBackground)
+    {
+      mCompactAgain = true;
+      return NS_OK;
+    }
+    // Let the compaction writing older data finish first.
+    mCompactAgain = false;
+    nsCOMPtr<nsIThread> thread = mCompactThread.forget();
+    thread->Shutdown();
+  }
+
+  bool writeNewsrc = mNewsrcHasChanged || mJournalHasReadChanges;
+  // Only a full listing replaces hostinfo.dat. After NEWGROUPS, the groups on
+  // the server are just the new ones, which are added to it from the journal.
+  bool writeAllGroups = mHostInfoHasChanged && !mGetOnlyNew && !mHostInfoLoaded;
+  bool writeHostInfo = writeAllGroups || !mJournaledGroups.IsEmpty();
+  if (!writeNewsrc && !writeHostInfo)
     return NS_OK;
+
+  RefPtr<nsNewsJournalCompactor> compactor = new nsNewsJournalCompactor();
+  nsresult rv;
+  if (writeNewsrc)
+  {
+    rv = GetNewsrcFilePath(getter_AddRefs(compactor->mNewsrcFile));
+    NS_ENSURE_SUCCESS(rv, rv);
+    rv = GetNewsrcData(compactor->mNewsrcData);
+    NS_ENSURE_SUCCESS(rv, rv);
+  }
+  if (writeHostInfo)
+  {
+    rv = GetLocalFile(HOSTINFO_FILE_NAME, getter_AddRefs(compactor->mHostInfoFile));
+    NS_ENSURE_SUCCESS(rv, rv);
+    mLastUpdatedTime = uint32_t(PR_Now() / PR_USEC_PER_SEC);
+    compactor->mLastUpdatedTime = mLastUpdatedTime;
+    // All groups have been listed, so the new ones are among them.
+    if (writeAllGroups)
+      GetHostInfoData(compactor->mHostInfoData);
+    else
+      compactor->mNewGroups = mJournaledGroups;
+  }
+
+  nsCOMPtr<nsIFile> journal;
+  rv = GetLocalFile(JOURNAL_FILE_NAME, getter_AddRefs(journal));
+  NS_ENSURE_SUCCESS(rv, rv);
+  nsCOMPtr<nsIFile> oldJournal;
+  rv = GetLocalFile(OLD_JOURNAL_FILE_NAME, getter_AddRefs(oldJournal));
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  // In the background, the journal is set aside for the compaction, and the
+  // changes made while it runs go to a new one. If there is an old journal
+  // already, the last compaction failed, and it has to be done right here.
+  CloseJournal();
+  bool exists;
+  rv = oldJournal->Exists(&exists);
+  NS_ENSURE_SUCCESS(rv, rv);
+  if (exists)
+    aInBackground = false;
+  if (aInBackground)
+  {
+    rv = journal->Exists(&exists);
+    if (NS_SUCCEEDED(rv) && exists)
+      rv = journal->MoveToNative(nullptr, NS_LITERAL_CSTRING(OLD_JOURNAL_FILE_NAME));
+    if (NS_FAILED(rv))
+      aInBackground = false;
+  }
+  compactor->mJournals.AppendObject(oldJournal);
+  if (!aInBackground)
+    compactor->mJournals.AppendObject(journal);
+
+  mNewsrcHasChanged = false;
+  mJournalHasReadChanges = false;
+  mHostInfoHasChanged = false;
+  mJournaledGroups.Clear();
+
+  if (aInBackground)
+  {
+    compactor->mServer = this;
+    rv = NS_NewThread(getter_AddRefs(mCompactThread));
+    if (NS_SUCCEEDED(rv))
+      rv = mCompactThread->Dispatch(compactor, NS_DISPATCH_NORMAL);
+    if (NS_SUCCEEDED(rv))
+      return NS_OK;
+    if (mCompactThread)
+    {
+      mCompactThread->Shutdown();
+      mCompactThread = nullptr;
+    }
+    compactor->mServer = nullptr;
+  }
+
+  compactor->mStatus = compactor->Compact();
+  OnJournalCompacted(compactor);
+  return compactor->mStatus;
+}
+
+void
+nsNntpIncomingServer::OnJournalCompacted(nsNewsJournalCompactor *aCompactor)
+{
+  if (mCompactThread)
+  {
+    nsCOMPtr<nsIThread> thread = mCompactThread.forget();
+    thread->Shutdown();
+  }
+
+  if (NS_FAILED(aCompactor->mStatus))
+  {
+    // Try again next time. The journals are kept until then.
+    NS_WARNING("failed to write the newsrc or hostinfo.dat");
+    if (aCompactor->mNewsrcFile)
+      mNewsrcHasChanged = true;
+    if (!aCompactor->mHostInfoData.IsEmpty())
+      mHostInfoHasChanged = true;
+    for (uint32_t i = 0; i < aCompactor->mNewGroups.Length(); i++)
+    {
+      if (!mJournaledGroups.Contains(aCompactor->mNewGroups[i]))
+        mJournaledGroups.AppendElement(aCompactor->mNewGroups[i]);
+    }
+  }
+  else if (mCompactAgain)
+  {
+    mCompactAgain = false;
+    CompactJournal(true);
+  }
 }
 
 NS_IMETHODIMP
@@ -436,16 +909,9 @@ nsNntpIncomingServer::CloseCachedConnections()
     }
   }
 
-  rv = WriteNewsrcFile();
-  if (NS_FAILED(rv)) return rv;
-
-  if (!mGetOnlyNew && !mHostInfoLoaded)
-  {
-    rv = WriteHostInfoFile();
-    NS_ENSURE_SUCCESS(rv,rv);
-  }
-
-  return NS_OK;
+  // Write the files now rather than in the background, as this is also
+  // how the server is shut down.
+  return CompactJournal(false);
 }
 
 NS_IMETHODIMP
@@ -789,65 +1255,44 @@ writeGroupToHostInfoFile(nsCString &aElement, void *aData)
     return true;
 }
 
-void nsNntpIncomingServer::WriteLine(nsIOutputStream *stream, nsCString &str)
-{
-  uint32_t bytesWritten;
-  str.Append(MSG_LINEBREAK);
-  stream->Write(str.get(), str.Length(), &bytesWritten);
-}
 nsresult
 nsNntpIncomingServer::WriteHostInfoFile()
 {
   if (!mHostInfoHasChanged)
     return NS_OK;
+  return CompactJournal(true);
+}
 
-  mLastUpdatedTime = uint32_t(PR_Now() / PR_USEC_PER_SEC);
-
+void
+nsNntpIncomingServer::GetHostInfoData(nsACString &aData)
+{
   nsCString hostname;
-  nsresult rv = GetHostName(hostname);
-  NS_ENSURE_SUCCESS(rv,rv);
-
-  if (!mHostInfoFile)
-    return NS_ERROR_UNEXPECTED;
-  nsCOMPtr<nsIOutputStream> hostInfoStream;
-  rv = MsgNewBufferedFileOutputStream(getter_AddRefs(hostInfoStream), mHostInfoFile, -1, 00600);
-  NS_ENSURE_SUCCESS(rv, rv);
+  GetHostName(hostname);
 
   // XXX TODO: missing some formatting, see the 4.x code
-  nsAutoCString header("# News host information file.");
-  WriteLine(hostInfoStream, header);
-  header.AssignLiteral("# This is a generated file!  Do not edit.");
-  WriteLine(hostInfoStream, header);
-  header.Truncate();
-  WriteLine(hostInfoStream, header);
-  nsAutoCString version("version=");
-  version.AppendInt(VALID_VERSION);
-  WriteLine(hostInfoStream, version);
-  nsAutoCString newsrcname("newsrcname=");
-  newsrcname.Append(hostname);
-  WriteLine(hostInfoStream, hostname);
-  nsAutoCString dateStr("lastgroupdate=");
-  dateStr.AppendInt(mLastUpdatedTime);
-  WriteLine(hostInfoStream, dateStr);
-  dateStr = "uniqueid=";
-  dateStr.AppendInt(mUniqueId);
-  WriteLine(hostInfoStream, dateStr);
-  header.Assign(MSG_LINEBREAK"begingroups");
-  WriteLine(hostInfoStream, header);
+  aData.AssignLiteral("# News host information file." MSG_LINEBREAK);
+  aData.AppendLiteral("# This is a generated file!  Do not edit." MSG_LINEBREAK);
+  aData.AppendLiteral(MSG_LINEBREAK);
+  aData.AppendLiteral("version=");
+  aData.AppendInt(VALID_VERSION);
+  aData.AppendLiteral(MSG_LINEBREAK);
+  aData.Append(hostname);
+  aData.AppendLiteral(MSG_LINEBREAK);
+  aData.AppendLiteral("lastgroupdate=");
+  aData.AppendInt(mLastUpdatedTime);
+  aData.AppendLiteral(MSG_LINEBREAK);
+  aData.AppendLiteral("uniqueid=");
+  aData.AppendInt(mUniqueId);
+  aData.AppendLiteral(MSG_LINEBREAK);
+  aData.AppendLiteral(MSG_LINEBREAK "begingroups" MSG_LINEBREAK);
 
   // XXX TODO: sort groups first?
   uint32_t length = mGroupsOnServer.Length();
   for (uint32_t i = 0; i < length; ++i)
   {
-    uint32_t bytesWritten;
-    hostInfoStream->Write(mGroupsOnServer[i].get(), mGroupsOnServer[i].Length(),
-                          &bytesWritten);
-    hostInfoStream->Write(MSG_LINEBREAK, MSG_LINEBREAK_LEN, &bytesWritten);
+    aData.Append(mGroupsOnServer[i]);
+    aData.AppendLiteral(MSG_LINEBREAK);
   }
-
-  hostInfoStream->Close();
-  mHostInfoHasChanged = false;
-  return NS_OK;
 }
 
 nsresult
@@ -943,7 +1388,7 @@ nsNntpIncomingServer::StartPopulating(nsIMsgWindow *aMsgWindow, bool aForceToSer
 
   mHostInfoLoaded = false;
   mVersion = INVALID_VERSION;
-  mGroupsOnServer.Clear();
+  ClearGroupsOnServer();
   mGetOnlyNew = aGetOnlyNew;
 
   if (!aForceToServer) {
@@ -958,7 +1403,7 @@ nsNntpIncomingServer::StartPopulating(nsIMsgWindow *aMsgWindow, bool aForceToSer
     mHostInfoHasChanged = true;
     mVersion = VALID_VERSION;
 
-    mGroupsOnServer.Clear();
+    ClearGroupsOnServer();
     rv = nntpService->GetListOfGroupsOnServer(this, aMsgWindow, aGetOnlyNew);
     if (NS_FAILED(rv)) return rv;
   }
@@ -996,9 +1441,18 @@ nsNntpIncomingServer::AddNewsgroupToList(const char *aName)
         CopyASCIItoUTF16(nsDependentCString(aName), newsgroupName);
     }
 
-    rv = AddTo(NS_ConvertUTF16toUTF8(newsgroupName),
-               false, true, true);
+    NS_ConvertUTF16toUTF8 name(newsgroupName);
+    rv = AddTo(name, false, true, true);
     if (NS_FAILED(rv)) return rv;
+
+    // When only the groups created since the last update are listed, they
+    // are kept in the journal until they are merged into hostinfo.dat.
+    if (mGetOnlyNew && mLastUpdatedTime && !mJournaledGroups.Contains(name)) {
+      nsAutoCString record("*");
+      record.Append(name);
+      (void) AppendToJournal(record);
+      mJournaledGroups.AppendElement(name);
+    }
     return NS_OK;
 }
 
@@ -1243,9 +1697,68 @@ nsresult
 nsNntpIncomingServer::AddGroupOnServer(const nsACString &aName)
 {
   mGroupsOnServer.AppendElement(aName);
+
+  // The index is made again by the next search, which can't just search the
+  // last results since they don't have the new group.
+  if (!mSortedGroups.IsEmpty())
+  {
+    mSortedGroups.Clear();
+    mGroupTrigrams.Clear();
+  }
+  mSearchValue.Truncate();
   return NS_OK;
 }
 
+void
+nsNntpIncomingServer::ClearGroupsOnServer()
+{
+  // the search results are indexes of the groups
+  if (mTree && !mSubscribeSearchResult.IsEmpty())
+    mTree->RowCountChanged(0, -static_cast<int32_t>(mSubscribeSearchResult.Length()));
+  mSubscribeSearchResult.Clear();
+  mSearchValue.Truncate();
+
+  mGroupsOnServer.Clear();
+  mSortedGroups.Clear();
+  mGroupTrigrams.Clear();
+}
+
+void
+nsNntpIncomingServer::BuildGroupIndex()
+{
+  uint32_t length = mGroupsOnServer.Length();
+  mSortedGroups.Clear();
+  mSortedGroups.SetCapacity(length);
+  for (uint32_t i = 0; i < length; i++)
+    mSortedGroups.AppendElement(i);
+  mSortedGroups.Sort(nsGroupIndexComparator(mGroupsOnServer));
+
+  // Going through the groups in order keeps the lists of groups in order,
+  // and a group is only added once to each list.
+  mGroupTrigrams.Clear();
+  nsAutoCString name;
+  for (uint32_t i = 0; i < length; i++)
+  {
+    uint32_t group = mSortedGroups[i];
+    ToLowerCase(mGroupsOnServer[group], name);
+    for (uint32_t j = 0; j + 3 <= name.Length(); j++)
+    {
+      nsTArray<uint32_t> *groups =
+        mGroupTrigrams.LookupOrAdd(TrigramAt(name, j));
+      if (groups->IsEmpty() || groups->LastElement() != group)
+        groups->AppendElement(group);
+    }
+  }
+}
+
+const nsCString &
+nsNntpIncomingServer::GetSearchResult(int32_t row)
+{
+  if (mSearchResultSortDescending)
+    row = mSubscribeSearchResult.Length() - 1 - row;
+  return mGroupsOnServer[mSubscribeSearchResult[row]];
+}
+
 NS_IMETHODIMP
 nsNntpIncomingServer::AddNewsgroup(const nsAString &aName)
 {
@@ -1641,25 +2154,56 @@ nsNntpIncomingServer::SetSearchValue(const nsAString &aSearchValue)
   if (!searchValue.IsEmpty())
     ParseString(searchValue, ' ', searchStringParts);
 
+  if (mSortedGroups.Length() != mGroupsOnServer.Length())
+    BuildGroupIndex();
+
+  // The groups which can have all parts of the search string: the results of
+  // the last search if this one only has more characters, else the groups
+  // with the rarest three characters of the search string, or all of them.
+  nsTArray<uint32_t> candidates;
+  const nsTArray<uint32_t> *groups = &mSortedGroups;
+  if (!mSearchValue.IsEmpty() && StringBeginsWith(searchValue, mSearchValue))
+  {
+    candidates.SwapElements(mSubscribeSearchResult);
+    groups = &candidates;
+  }
+  else
+  {
+    for (uint32_t i = 0; i < searchStringParts.Length(); i++)
+    {
+      nsAutoCString part;
+      ToLowerCase(searchStringParts[i], part);
+      for (uint32_t j = 0; j + 3 <= part.Length(); j++)
+      {
+        nsTArray<uint32_t> *trigramGroups =
+          mGroupTrigrams.Get(TrigramAt(part, j));
+        if (!trigramGroups)
+          groups = &candidates;  // nothing has all of the search string
+        else if (trigramGroups->Length() < groups->Length())
+          groups = trigramGroups;
+      }
+    }
+  }
+
+  // These are in order already, so the results don't have to be sorted.
   mSubscribeSearchResult.Clear();
-  uint32_t length = mGroupsOnServer.Length();
+  uint32_t length = groups->Length();
   for (uint32_t i = 0; i < length; i++)
   {
+    uint32_t group = groups->ElementAt(i);
     // check that all parts of the search string occur
     bool found = true;
     for (uint32_t j = 0; j < searchStringParts.Length(); ++j) {
-      if (MsgFind(mGroupsOnServer[i], searchStringParts[j], true, 0) == kNotFound) {
+      if (MsgFind(mGroupsOnServer[group], searchStringParts[j], true, 0) == kNotFound) {
         found = false;
         break;
       }
     }
 
     if (found)
-      mSubscribeSearchResult.AppendElement(mGroupsOnServer[i]);
+      mSubscribeSearchResult.AppendElement(group);
   }
-
-  nsCStringLowerCaseComparator comparator;
-  mSubscribeSearchResult.Sort(comparator);
+  mSearchValue = searchValue;
 
   if (mTree)
   {
@@ -1728,9 +2272,7 @@ nsNntpIncomingServer::GetCellProperties(int32_t row, nsTreeColumn* col, nsAStrin
     // if <name> is in our temporary list of subscribed groups
     // add the "subscribed-true" property so the check mark shows up
     // in the "subscribedColumn2"
-    if (mSearchResultSortDescending)
-      row = mSubscribeSearchResult.Length() - 1 - row;
-    if (mTempSubscribed.Contains(mSubscribeSearchResult.ElementAt(row))) {
+    if (mTempSubscribed.Contains(GetSearchResult(row))) {
       properties.AssignLiteral("subscribed-true");
     }
   }
@@ -1839,10 +2381,7 @@ nsNntpIncomingServer::GetCellValue(int32_t row, nsTreeColumn* col, nsAString& _r
   const nsAString& colID = col->GetId();
   nsresult rv = NS_OK;
   if (!colID.IsEmpty() && colID.First() == 'n') {
-    nsAutoCString str;
-    if (mSearchResultSortDescending)
-      row = mSubscribeSearchResult.Length() - 1 - row;
-    _retval.Assign(NS_ConvertASCIItoUTF16(mSubscribeSearchResult.ElementAt(row)));
+    _retval.Assign(NS_ConvertASCIItoUTF16(GetSearchResult(row)));
   }
   return rv;
 }
@@ -1858,12 +2397,9 @@ nsNntpIncomingServer::GetCellText(int32_t row, nsTreeColumn* col, nsAString& _re
   const nsAString& colID = col->GetId();
   nsresult rv = NS_OK;
   if (!colID.IsEmpty() && colID.First() == 'n') {
-    nsAutoCString str;
-    if (mSearchResultSortDescending)
-      row = mSubscribeSearchResult.Length() - 1 - row;
     // some servers have newsgroup names that are non ASCII.  we store
     // those as escaped. unescape here so the UI is consistent
-    rv = NS_MsgDecodeUnescapeURLPath(mSubscribeSearchResult.ElementAt(row), _retval);
+    rv = NS_MsgDecodeUnescapeURLPath(GetSearchResult(row), _retval);
   }
   return rv;
 }
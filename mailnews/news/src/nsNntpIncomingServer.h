@@ -19,15 +19,22 @@
 #include "nsIMsgWindow.h"
 #include "nsISubscribableServer.h"
 #include "nsITimer.h"
+#include "nsIThread.h"
+#include "nsIOutputStream.h"
 #include "nsIFile.h"
 #include "nsITreeView.h"
 #include "nsITreeSelection.h"
 #include "nsCOMArray.h"
 #include "nsTArray.h"
+#include "nsClassHashtable.h"
+#include "nsHashKeys.h"
 
 #include "nsNntpMockChannel.h"
 #include "nsAutoPtr.h"
 
+class nsMsgKeySet;
+class nsNewsJournalCompactor;
+
 /* get some implementation from nsMsgIncomingServer */
 class nsNntpIncomingServer : public nsMsgIncomingServer,
                              public nsINntpIncomingServer,
@@ -91,13 +98,36 @@ protected:
     NS_IMETHOD GetServerRequiresPasswordForBiff(bool *aServerRequiresPasswordForBiff) override;
     nsresult SetupNewsrcSaveTimer();
     static void OnNewsrcSaveTimer(nsITimer *timer, void *voidIncomingServer);
-    void WriteLine(nsIOutputStream *stream, nsCString &str);
+
+public:
+    // Called on the main thread when a compaction of the journal finished.
+    void OnJournalCompacted(nsNewsJournalCompactor *aCompactor);
+
+protected:
+    // a file in the local path of the server
+    nsresult GetLocalFile(const char *aName, nsIFile **aFile);
+    nsresult AppendToJournal(const nsACString &aRecord);
+    nsresult CloseJournal();
+    nsresult ReplayJournalFile(nsIFile *aJournal,
+                               nsClassHashtable<nsCStringHashKey, nsMsgKeySet> &aReadSets);
+    nsresult GetNewsrcData(nsACString &aData);
+    void GetHostInfoData(nsACString &aData);
+    nsresult CompactJournal(bool aInBackground);
 
 private:
     nsTArray<nsCString> mSubscribedNewsgroups;
     nsTArray<nsCString> mGroupsOnServer;
-    nsTArray<nsCString> mSubscribeSearchResult;
+    // the indexes in mGroupsOnServer of the groups found, sorted by name
+    nsTArray<uint32_t> mSubscribeSearchResult;
     bool mSearchResultSortDescending;
+    // The index for searching mGroupsOnServer, made by the first search after
+    // the groups changed: the groups in the order of their case insensitive
+    // names, and for every three lower case characters the groups with them
+    // in their names, in that order.
+    nsTArray<uint32_t> mSortedGroups;
+    nsClassHashtable<nsUint32HashKey, nsTArray<uint32_t> > mGroupTrigrams;
+    // the last search value, so typing more only searches its results
+    nsCString mSearchValue;
     // the list of of subscribed newsgroups within a given
     // subscribed dialog session.
     // we need to keep track of them so we know what to show as "checked"
@@ -112,6 +142,9 @@ private:
     nsresult WriteHostInfoFile();
     nsresult LoadHostInfoFile();
     nsresult AddGroupOnServer(const nsACString &name);
+    void ClearGroupsOnServer();
+    void BuildGroupIndex();
+    const nsCString &GetSearchResult(int32_t row);
 
     bool mNewsrcHasChanged;
     bool mHostInfoLoaded;
@@ -125,6 +158,18 @@ private:
     bool mPostingAllowed;
 
     nsCOMPtr<nsITimer> mNewsrcSaveTimer;
+
+    // The journal records the read state changes and the new groups on the
+    // server since the newsrc and hostinfo.dat were last written. Compacting
+    // it writes these files and starts a new journal.
+    nsCOMPtr<nsIOutputStream> mJournalStream;
+    bool mJournalHasReadChanges;
+    nsTArray<nsCString> mJournaledGroups;
+    // the thread writing the files while compacting in the background
+    nsCOMPtr<nsIThread> mCompactThread;
+    // whether to compact again when the running compaction is done
+    bool mCompactAgain;
+
     nsCOMPtr <nsIMsgWindow> mMsgWindow;
 
     nsCOMPtr <nsISubscribableServer> mInner;
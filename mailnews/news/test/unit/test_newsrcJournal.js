@@ -0,0 +1,84 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+ * Tests that the read changes and new groups left in the journal by a crash
+ * are replayed when the groups are loaded, that the newsrc and hostinfo.dat
+ * are written out then, and that marking articles read only appends to the
+ * journal until the server is shut down.
+ */
+
+var {IOUtils} = ChromeUtils.import("resource:///modules/IOUtils.js");
+
+function localFile(aServer, aName) {
+  let file = aServer.localPath;
+  file.append(aName);
+  return file;
+}
+
+function run_test() {
+  let server = localAccountUtils.create_incoming_server("nntp", NNTP_PORT,
+                                                        null, null)
+                                .QueryInterface(Ci.nsINntpIncomingServer);
+  let newsrcFile = server.newsrcFilePath;
+  let journal = localFile(server, "journal.dat");
+  let oldJournal = localFile(server, "journal.old");
+  let hostInfo = localFile(server, "hostinfo.dat");
+
+  IOUtils.saveStringToFile(newsrcFile,
+                           "test.journal: 1-10\nother.group: 1-3\n");
+  // Left by a compaction which didn't finish; journal.dat has what came after.
+  IOUtils.saveStringToFile(oldJournal,
+                           "+test.journal: 12\n-test.journal: 15\n");
+  IOUtils.saveStringToFile(journal,
+                           "+test.journal: 15\n-test.journal: 3-4\n" +
+                           "+test.journal: 20-22\n+not.subscribed: 1-5\n" +
+                           "*brand.new.group\n");
+  IOUtils.saveStringToFile(hostInfo,
+                           "# News host information file.\n" +
+                           "# This is a generated file!  Do not edit.\n" +
+                           "\n" +
+                           "version=2\n" +
+                           "newsrcname=localhost\n" +
+                           "lastgroupdate=1000\n" +
+                           "uniqueid=0\n" +
+                           "\n" +
+                           "begingroups\n" +
+                           "test.journal\n" +
+                           "other.group\n");
+
+  let folder = server.rootFolder.getChildNamed("test.journal")
+                     .QueryInterface(Ci.nsIMsgNewsFolder);
+  Assert.equal(folder.newsrcLine.trim(),
+               "test.journal: 1-2,5-10,12,15,20-22");
+  Assert.ok(!server.rootFolder.containsChildNamed("not.subscribed"));
+
+  // Replaying wrote everything out and removed the journals.
+  Assert.ok(!journal.exists());
+  Assert.ok(!oldJournal.exists());
+  let newsrc = IOUtils.loadFileToString(newsrcFile);
+  Assert.ok(newsrc.includes("test.journal: 1-2,5-10,12,15,20-22"));
+  Assert.ok(newsrc.includes("other.group: 1-3"));
+  let groups = IOUtils.loadFileToString(hostInfo).split(/\r?\n/);
+  Assert.deepEqual(groups.slice(groups.indexOf("begingroups") + 1)
+                         .filter(line => line),
+                   ["test.journal", "other.group", "brand.new.group"]);
+  Assert.ok(!groups.includes("lastgroupdate=1000"));
+
+  // Marking an article read goes to the journal only.
+  let db = folder.QueryInterface(Ci.nsIMsgFolder).msgDatabase;
+  let hdr = db.CreateNewHdr(30);
+  db.AddNewHdrToDB(hdr, true);
+  db.MarkRead(30, true, null);
+  Assert.ok(journal.exists());
+  Assert.ok(IOUtils.loadFileToString(journal).split(/\r?\n/)
+                   .includes("+test.journal: 30"));
+  Assert.equal(IOUtils.loadFileToString(newsrcFile), newsrc);
+
+  // Shutting down compacts the journal into the newsrc.
+  server.closeCachedConnections();
+  Assert.ok(!journal.exists());
+  Assert.ok(IOUtils.loadFileToString(newsrcFile)
+                   .includes("test.journal: 1-2,5-10,12,15,20-22,30"));
+}
@@ -0,0 +1,86 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+ * Fills the subscribe list of a news server with a lot of groups, and checks
+ * that searching it finds the same groups as looking at each of them, also
+ * while more is typed into the search box, and that the hierarchy lists the
+ * groups in order.
+ */
+
+var kHierarchies = ["alt", "comp", "de", "microsoft.public", "Rec", "sci"];
+var kGroups = 60000;
+
+var gGroups = [];
+
+function makeGroups() {
+  for (let i = 0; i < kGroups; i++) {
+    // not in order, the way some servers list them
+    let n = (i * 7919) % kGroups;
+    let hierarchy = kHierarchies[n % kHierarchies.length];
+    gGroups.push(hierarchy + ".topic" + (n % 101) + ".group" + n +
+                 (n % 3 ? ".binaries" : ".Discussion"));
+  }
+}
+
+function expectedCount(aSearchValue) {
+  let parts = aSearchValue.toLowerCase().split(" ").filter(part => part);
+  return gGroups.filter(name => parts.every(
+    part => name.toLowerCase().includes(part))).length;
+}
+
+function checkSearch(aServer, aSearchValue) {
+  aServer.setSearchValue(aSearchValue);
+  let view = aServer.QueryInterface(Ci.nsITreeView);
+  Assert.equal(view.rowCount, expectedCount(aSearchValue),
+               "results for '" + aSearchValue + "'");
+}
+
+function run_test() {
+  makeGroups();
+  let server = localAccountUtils.create_incoming_server("nntp", NNTP_PORT,
+                                                        null, null)
+                                .QueryInterface(Ci.nsISubscribableServer);
+  let start = Date.now();
+  for (let name of gGroups) {
+    server.addTo(name, false, true, true);
+  }
+  info("Added " + kGroups + " groups in " + (Date.now() - start) + "ms");
+
+  start = Date.now();
+  checkSearch(server, "");
+  info("Indexed and listed all groups in " + (Date.now() - start) + "ms");
+
+  // Typing one character after another only searches the last results.
+  start = Date.now();
+  let typed = "";
+  for (let c of "topic42 BIN") {
+    typed += c;
+    checkSearch(server, typed);
+  }
+  info("Searched while typing in " + (Date.now() - start) + "ms");
+
+  for (let searchValue of ["rec.", "group1234", "DISCUSSION group5",
+                           "public 7", "nothing.like.this", "s", "e.t",
+                           "  comp   topic9  "]) {
+    checkSearch(server, searchValue);
+  }
+
+  // Groups added after a search are found by the next one.
+  checkSearch(server, "topic1");
+  gGroups.push("alt.topic1.late");
+  server.addTo("alt.topic1.late", false, true, true);
+  checkSearch(server, "topic1.");
+
+  // The children of a hierarchy come out sorted, with their full names.
+  let children = [...server.getChildURIs("microsoft.public.topic7")];
+  let expected = gGroups.filter(
+    name => name.startsWith("microsoft.public.topic7."))
+    .map(name => name.split(".").slice(0, 4).join("."));
+  expected = [...new Set(expected)].sort();
+  Assert.deepEqual(children, expected);
+  Assert.equal(server.getFirstChildURI("microsoft"), "microsoft.public");
+  Assert.ok(server.isSubscribable(children[0] + ".binaries") ||
+            server.isSubscribable(children[0] + ".Discussion"));
+}
@@ -0,0 +1,135 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+ * Downloads the headers of a large newsgroup from a server which replays
+ * recorded XOVER output, checks what ends up in the database and the newsrc,
+ * and measures how many XOVER lines per second are processed.
+ */
+
+var kGroup = "test.xover";
+var kArticles = 20000;
+
+// Articles which have expired on the server.
+function isExpired(aKey) {
+  return aKey % 97 == 0 || (aKey > 5000 && aKey <= 5010);
+}
+
+var gKeys = [];
+var gLines = new Map();
+
+/**
+ * Build the XOVER output as a server would send it: number, subject, from,
+ * date, message id, references, bytes, lines and xref.
+ */
+function recordXover() {
+  for (let key = 1; key <= kArticles; key++) {
+    if (isExpired(key)) {
+      continue;
+    }
+    gKeys.push(key);
+    let thread = Math.floor(key / 10);
+    let isReply = key % 10 != 0;
+    let date = new Date(Date.UTC(2019, 0, 1, 0, 0, key)).toUTCString();
+    gLines.set(key, [
+      key,
+      (isReply ? "Re: " : "") + "Thread " + thread + " about tabs and spaces",
+      "Poster " + (key % 37) + " <poster" + (key % 37) + "@example.com>",
+      date,
+      "<" + key + "@xover.invalid>",
+      isReply ? "<" + thread * 10 + "@xover.invalid>" : "",
+      1000 + key,
+      10 + key % 50,
+      "Xref: news.example.com " + kGroup + ":" + key,
+    ].join("\t"));
+  }
+}
+
+function NNTP_Replay_handler(daemon) {
+  NNTP_RFC2980_handler.call(this, daemon);
+}
+NNTP_Replay_handler.prototype = Object.create(NNTP_RFC2980_handler.prototype);
+NNTP_Replay_handler.prototype.XOVER = function(args) {
+  if (!this.group)
+    return "412 No group selected";
+
+  let lines = ["224 List of articles"];
+  for (let key of this._filterRange(args.split(/ +/, 3)[0], this.group.keys)) {
+    lines.push(gLines.get(key));
+  }
+  lines.push(".\n");
+  return lines.join("\n");
+};
+
+function run_test() {
+  recordXover();
+  groups.push([kGroup, true]);
+
+  let daemon = setupNNTPDaemon();
+  daemon.addGroup(kGroup);
+  daemon.getGroup(kGroup).keys = gKeys;
+
+  let server = makeServer(NNTP_Replay_handler, daemon);
+  server.start();
+  let localserver = setupLocalServer(server.port);
+  // Don't ask before downloading this many headers.
+  localserver.QueryInterface(Ci.nsINntpIncomingServer).notifyOn = false;
+
+  let folder = localserver.rootFolder.getChildNamed(kGroup);
+  let start = Date.now();
+  folder.getNewMessages(null, {
+    OnStopRunningUrl() { localserver.closeCachedConnections(); },
+  });
+  server.performTest();
+  let elapsed = Math.max(Date.now() - start, 1);
+  server.stop();
+  info("Processed " + gKeys.length + " XOVER lines in " + elapsed + "ms, " +
+       Math.round(gKeys.length * 1000 / elapsed) + " lines/s");
+
+  let db = folder.msgDatabase;
+  let count = 0;
+  let enumerator = db.EnumerateMessages();
+  while (enumerator.hasMoreElements()) {
+    enumerator.getNext();
+    count++;
+  }
+  Assert.equal(count, gKeys.length);
+  Assert.ok(!db.ContainsKey(97));
+
+  let reply = db.GetMsgHdrForKey(4321);
+  Assert.equal(reply.subject, "Thread 432 about tabs and spaces");
+  Assert.ok(reply.flags & Ci.nsMsgMessageFlags.HasRe);
+  Assert.equal(reply.author, "Poster 29 <poster29@example.com>");
+  Assert.equal(reply.messageId, "4321@xover.invalid");
+  Assert.equal(reply.getStringReference(0), "4320@xover.invalid");
+  Assert.equal(reply.messageSize, 5321);
+  Assert.equal(reply.lineCount, 31);
+  Assert.equal(reply.date, Date.UTC(2019, 0, 1, 0, 0, 4321) * 1000);
+  Assert.equal(reply.threadParent, 4320);
+  let first = db.GetMsgHdrForKey(4320);
+  Assert.ok(!(first.flags & Ci.nsMsgMessageFlags.HasRe));
+  Assert.equal(first.numReferences, 0);
+
+  // The folder counts and high water mark were written for the batch.
+  folder.msgDatabase = null;
+  let folderInfo = folder.msgDatabase.dBFolderInfo;
+  Assert.equal(folderInfo.numMessages, gKeys.length);
+  Assert.equal(folderInfo.numUnreadMessages, gKeys.length);
+  Assert.equal(folderInfo.highWater, kArticles);
+  Assert.equal(folderInfo.knownArtsSet, "1-" + kArticles);
+
+  // The expired articles are marked read in the newsrc.
+  let newsrcLine = folder.QueryInterface(Ci.nsIMsgNewsFolder).newsrcLine;
+  let readSet = newsrcLine.substring(newsrcLine.indexOf(":") + 1).trim();
+  let expired = [];
+  for (let range of readSet.split(",")) {
+    let [low, high] = range.split("-").map(Number);
+    for (let key = low; key <= (high || low); key++) {
+      expired.push(key);
+    }
+  }
+  Assert.deepEqual(expired,
+                   Array.from({ length: kArticles }, (v, i) => i + 1)
+                        .filter(isExpired));
+}
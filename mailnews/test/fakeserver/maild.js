@@ -107,6 +107,12 @@ function nsMailServer(handlerCreator, daemon) {
    */
   this._logTransactions = true;
 
+  /**
+   * Milliseconds to wait before handling what the client sent, so that every
+   * round trip takes at least that long, like on a slow network.
+   */
+  this._latency = 0;
+
   this._handlerCreator = handlerCreator;
   this._daemon = daemon;
   this._readers = [];
@@ -161,6 +167,10 @@ nsMailServer.prototype = {
       this._readers[i].setDebugLevel(debug);
   },
 
+  setLatency : function (latency) {
+    this._latency = latency;
+  },
+
   start : function (port=-1) {
     if (this._socket)
       throw Cr.NS_ERROR_ALREADY_INITIALIZED;
@@ -247,7 +257,9 @@ nsMailServer.prototype = {
   /**
    * Returns the commands run between the server and client.
    * The return is an object with two variables (us and them), both of which
-   * are arrays returning the commands given by each server.
+   * are arrays returning the commands given by each server. A third array,
+   * answered, has for each command in them how many of the commands before it
+   * had been answered when it arrived, so that pipelining can be checked.
    */
   playTransaction : function() {
     if (this._readers.some(function (e) { return e.observer.forced; }))
@@ -307,6 +319,9 @@ function nsMailReader(server, handler, transport, debug, logTransaction) {
   this._server = server;
   this._buffer = [];
   this._lines = [];
+  // for each line in _lines, the commands answered when it arrived
+  this._linesAnswered = [];
+  this._answered = 0;
   this._handler = handler;
   this._transport = transport;
   // We don't seem to properly handle large streams when the buffer gets
@@ -315,7 +330,7 @@ function nsMailReader(server, handler, transport, debug, logTransaction) {
   var output = transport.openOutputStream(Ci.nsITransport.OPEN_BLOCKING, 1024, 4096);
   this._output = output;
   if (logTransaction)
-    this.transaction = { us : [], them : [] };
+    this.transaction = { us : [], them : [], answered : [] };
   else
     this.transaction = null;
 
@@ -332,6 +347,7 @@ function nsMailReader(server, handler, transport, debug, logTransaction) {
   this._multiline = false;
 
   this._isRunning = true;
+  this._latencyTimers = [];
 
   this.observer = {
     server : server,
@@ -363,6 +379,7 @@ nsMailReader.prototype = {
     var line = String.fromCharCode.apply(null, buf.slice(0, crlfLoc));
     this._buffer = buf.slice(crlfLoc + 2);
     this._lines.push(line);
+    this._linesAnswered.push(this._answered);
     this._findLines();
   },
 
@@ -382,8 +399,30 @@ nsMailReader.prototype = {
     readTo(stream, bytes, this._buffer);
     this._findLines();
 
+    if (this._server._latency > 0) {
+      let timer = Cc["@mozilla.org/timer;1"].createInstance(Ci.nsITimer);
+      this._latencyTimers.push(timer);
+      timer.initWithCallback(() => {
+        this._latencyTimers.splice(this._latencyTimers.indexOf(timer), 1);
+        if (this._isRunning && !this.observer.forced)
+          this._processLines();
+      }, this._server._latency, Ci.nsITimer.TYPE_ONE_SHOT);
+    } else {
+      this._processLines();
+    }
+
+    if (this._isRunning) {
+      stream.asyncWait(this, 0, 0, Services.tm.currentThread);
+      this.timer.initWithCallback(this.observer, TIMEOUT,
+                                  Ci.nsITimer.TYPE_ONE_SHOT);
+    }
+  },
+
+  _processLines : function () {
     while (this._lines.length > 0) {
       var line = this._lines.shift();
+      var answered = this._linesAnswered.shift();
+      var isCommand = false;
 
       if (this._debug != fsDebugNone)
         dump("RECV: " + line + '\n');
@@ -397,8 +436,11 @@ nsMailReader.prototype = {
             continue;
         } else {
           // Record the transaction
-          if (this.transaction)
+          isCommand = true;
+          if (this.transaction) {
             this.transaction.them.push(line);
+            this.transaction.answered.push(answered);
+          }
 
           // Find the command and splice it out...
           var splitter = line.indexOf(" ");
@@ -449,6 +491,8 @@ nsMailReader.prototype = {
 
       if (this.transaction)
         this.transaction.us.push(response);
+      if (isCommand)
+        this._answered++;
 
       try {
         this._output.write(response, response.length);
@@ -470,12 +514,6 @@ nsMailReader.prototype = {
         this._signalStop = false;
       }
     }
-
-    if (this._isRunning) {
-      stream.asyncWait(this, 0, 0, Services.tm.currentThread);
-      this.timer.initWithCallback(this.observer, TIMEOUT,
-                                  Ci.nsITimer.TYPE_ONE_SHOT);
-    }
   },
 
   closeSocket : function () {
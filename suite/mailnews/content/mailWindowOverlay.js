@@ -3182,7 +3182,7 @@ function FeedSetContentView(val)
         }
         else
           // Do not have this item's feed anymore in feeds.rdf though its
-          // message folder remains and its items exist in feeditems.rdf
+          // message folder remains and its items exist in the feed items store
           // (Bug 309449), or the item has been moved to another folder,
           // or some error on the file. Default to show summary.
           quickMode = true;